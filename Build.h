@@ -1,7 +1,15 @@
 #pragma once
 
-// `thread_local` keyword, for thread-local storage.
-#define thread_local __thread
+// Storage class for thread-local variables, such as `BStatusCode`.
+#if defined(__cplusplus)
+#define BUILD_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define BUILD_THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#define BUILD_THREAD_LOCAL __declspec(thread)
+#else
+#define BUILD_THREAD_LOCAL __thread
+#endif
 
 #if defined(__WIN32) && !defined(WINDOWS)
 #define WINDOWS
@@ -25,6 +33,12 @@ int vasprintf(char **out, const char *fmt, va_list);
 
 #if defined(__cplusplus)
 #include <string>
+#include <vector>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <cstdarg>
 #else
 #include <stdbool.h>
@@ -34,6 +48,11 @@ int vasprintf(char **out, const char *fmt, va_list);
 #if !defined(__cplusplus)
 typedef enum BStatusCode_ BStatusCode_;
 typedef struct BuildConfig BuildConfig;
+typedef struct BuildJob BuildJob;
+typedef struct BuildJobStatus BuildJobStatus;
+typedef struct BuildToolchainInfo BuildToolchainInfo;
+typedef struct BuildPlanEstimate BuildPlanEstimate;
+typedef struct BuildStats BuildStats;
 #endif
 
 
@@ -55,10 +74,88 @@ enum BStatusCode_ {
 	B_ChDirFailed,
 	B_CurrentWorkingDirFailed,
 	B_MissingExecutableFilePath,
+	B_InvalidGlobPattern,
+	B_CommandFailed,
+	B_ReadFailed,
+	B_WriteFailed,
+	B_ToolchainProbeFailed,
+	B_WorkerFailed,
+	B_RemoteCacheFailed,
+	B_ModuleScanFailed,
+	B_ObjectPathConflict,
 };
-extern thread_local enum BStatusCode_ BStatusCode;
+// Status code of the last failed call made by the calling thread.
+extern BUILD_THREAD_LOCAL enum BStatusCode_ BStatusCode;
 
 struct BuildConfig;
+struct BuildJob;
+
+// What `Build_ProbeCC()` / `Build_ProbeCXX()` found out about a compiler.
+// The lists are NULL-terminated.
+struct BuildToolchainInfo {
+	// Resolved path of the compiler executable.
+	char *Path;
+	// `gcc`, `clang`, or `unknown`.
+	char *Family;
+	// e.g. `12.2.0`.
+	char *Version;
+	// e.g. `x86_64-linux-gnu`.
+	char *Target;
+	// Accepted `-std=` values, e.g. `c++17`.
+	char **Standards;
+	// Supported features: `lto`, `lto-incremental` (GCC), `modules`, `p1689`, `thread-sanitizer`,
+	// `address-sanitizer`, `split-dwarf`, `color-diagnostics`, `file-prefix-map`.
+	char **Features;
+	char **SystemIncludeDirs;
+};
+
+// Outcome of an asynchronous job.
+struct BuildJobStatus {
+	// `B_OK` if the command ran and exited with 0, `B_CommandFailed` if it exited with another code,
+	// or the reason it could not be run.
+	enum BStatusCode_ Code;
+	int ExitCode;
+	// Whether the outputs were restored from the cache instead of running the command.
+	bool Cached;
+	// Whether the step was up to date, and did not run; see `Build_SetSkipUpToDate()`.
+	bool Skipped;
+	// User and system CPU time of the processes of the job, in seconds, and the peak resident set size
+	// of the largest one, in KiB.
+	double CPUSeconds;
+	unsigned long long MaxRSSKiB;
+};
+
+// What the planning mode found would run; see `Build_SetPlan()`.
+struct BuildPlanEstimate {
+	// Steps that would run, and steps that are up to date.
+	unsigned Steps;
+	unsigned UpToDate;
+	// Steps that would run but have no recorded duration; they count as the average of the others.
+	unsigned Unrecorded;
+	// Sum of the durations of the steps that would run, and the estimated wall time, in seconds.
+	double SerialSeconds;
+	double Seconds;
+};
+
+// Counters of the work done by the Builders of the process; see `Build_GetStats()`.
+struct BuildStats {
+	// Child processes started, and the time spent starting them and blocked waiting for jobs, in seconds.
+	unsigned long long ProcessesSpawned;
+	double SpawnSeconds;
+	double WaitSeconds;
+	// Files and directories stat'ed, and directory listings reused from the glob cache.
+	unsigned long long StatCalls;
+	unsigned long long StatCacheHits;
+	// Compile and link steps restored from the output cache, and steps not found there.
+	unsigned long long CacheHits;
+	unsigned long long CacheMisses;
+	// Bytes of the files copied by `Build_Copy()`.
+	unsigned long long BytesCopied;
+	// Jobs skipped as up to date; see `Build_SetSkipUpToDate()`.
+	unsigned long long JobsSkipped;
+	// Steps whose output came out unchanged, so that the steps using it were not rerun.
+	unsigned long long JobsCutOff;
+};
 
 const char * Build_StatusCodeMessage(enum BStatusCode_ code);
 
@@ -74,6 +171,10 @@ char * Build_DirName(const char *path);
 
 int Build_ChDir(const char *dirPath);
 int Build_ChDirToProgramDir(int argc, char *argv[]);
+// Recompiles the running build program from the NULL-terminated list `sources` with `flags`, and re-executes it with
+// `argv`, if one of them is newer than its executable `argv[0]`; see `Builder::RebuildSelfIfStale()`. Returns 0
+// if the program is up to date, and does not return if it was rebuilt.
+int Build_RebuildSelfIfStale(BuildConfig *cfg, int argc, char *argv[], char **sources, const char *flags);
 
 // Caller owns the memory pointed by `out`, and will be responsible for freeing it.
 char * Build_GetCurrentWorkingDir();
@@ -85,6 +186,9 @@ int Build_SetDryRun(BuildConfig *cfg, bool dryRun);
 bool Build_GetDryRun(BuildConfig *cfg);
 int Build_SetPrintCommandToStdout(BuildConfig *cfg, bool printCommandToStdout);
 bool Build_GetPrintCommandToStdout(BuildConfig *cfg);
+// Returns the last command executed with `cfg` by the calling thread.
+// Like the other string getters, the returned string stays valid until the same function
+// is called again by the same thread, even if other threads use `cfg` concurrently.
 const char * Build_GetLastExecCommand(BuildConfig *cfg);
 int Build_SetCCCommand(BuildConfig *cfg, const char *cmd);
 const char * Build_GetCCCommand(BuildConfig *cfg);
@@ -116,8 +220,183 @@ int Build_Remove(BuildConfig *cfg, const char *path);
 
 // Caller owns the memory pointed by `out`, and will be responsible for freeing it.
 char * Build_ExecutableFileName(const char *exeName);
+// Paths of build outputs in the output directory of `cfg`, whose parent directories are created unless
+// in dry run mode: `Build_ObjectPath(cfg, "src/a/b.c")` is `<output dir>/a/b.o` when the source directory
+// is `src`. Fails with `B_ObjectPathConflict` for a source whose object an earlier call returned for another
+// one, e.g. `a.cc` after `a.c`. Caller owns the returned path, and will be responsible for freeing it.
+char * Build_ObjectPath(BuildConfig *cfg, const char *source);
+char * Build_ArchivePath(BuildConfig *cfg, const char *libName);
+char * Build_SharedLibraryPath(BuildConfig *cfg, const char *libName);
+char * Build_ExecutablePath(BuildConfig *cfg, const char *exeName);
 
 bool Build_FileExists(const char *path);
+
+// Returns the paths matching `pattern` (e.g. `src/**/*.cc`), sorted, as a NULL-terminated list.
+// Caller owns the list, and will be responsible for freeing it with `Build_FreeStringList()`.
+char ** Build_Glob(BuildConfig *cfg, const char *pattern);
+// Returns the headers `source` includes, directly or not, found next to the including files or in the
+// NULL-terminated list `includeDirs`; see `Builder::ScanIncludes()`. Free the list with `Build_FreeStringList()`.
+char ** Build_ScanIncludes(BuildConfig *cfg, const char *source, char **includeDirs);
+int Build_AddGlobIgnorePattern(BuildConfig *cfg, const char *pattern);
+int Build_ClearGlobIgnorePatterns(BuildConfig *cfg);
+int Build_SetCacheDir(BuildConfig *cfg, const char *dir);
+const char * Build_GetCacheDir(BuildConfig *cfg);
+void Build_FreeStringList(char **list);
+
+// Creates or updates the static library `archivePath` from the NULL-terminated list `members`.
+// Returns 1 if the archive was written, 0 if no member changed since the last call, or -1 on error.
+int Build_Archive(BuildConfig *cfg, const char *archivePath, char **members);
+int Build_SetThinArchives(BuildConfig *cfg, bool thinArchives);
+bool Build_GetThinArchives(BuildConfig *cfg);
+
+// Probes the compiler of `Build_GetCCCommand()` / `Build_GetCXXCommand()`. Results are cached in
+// the cache directory until the compiler executable changes, so that usually no process is spawned.
+// Caller owns the returned info, and will be responsible for freeing it with `Build_FreeToolchainInfo()`.
+BuildToolchainInfo * Build_ProbeCC(BuildConfig *cfg);
+BuildToolchainInfo * Build_ProbeCXX(BuildConfig *cfg);
+void Build_FreeToolchainInfo(BuildToolchainInfo *info);
+
+// Maximum number of asynchronous jobs running at once. Defaults to the number of CPUs.
+int Build_SetJobs(BuildConfig *cfg, unsigned jobs);
+unsigned Build_GetJobs(BuildConfig *cfg);
+
+// Workers (`<host>:<port>` or `unix:<path>`) compiling the jobs of `Build_CompileAsync()`.
+int Build_AddRemoteWorker(BuildConfig *cfg, const char *address);
+int Build_ClearRemoteWorkers(BuildConfig *cfg);
+// Maximum number of compilations sent to workers at once. 0 (the default) means `Jobs` per worker.
+int Build_SetRemoteJobs(BuildConfig *cfg, unsigned remoteJobs);
+unsigned Build_GetRemoteJobs(BuildConfig *cfg);
+
+// Whether `Build_CompileAsync()` and `Build_LinkAsync()` reuse the outputs of identical earlier steps,
+// stored in the cache directory and the remote cache.
+int Build_SetCacheOutputs(BuildConfig *cfg, bool cacheOutputs);
+bool Build_GetCacheOutputs(BuildConfig *cfg);
+// Base URL of an HTTP cache with the bazel-remote layout, e.g. `http://cache.local:8080`. Empty disables it.
+int Build_SetRemoteCache(BuildConfig *cfg, const char *url);
+const char * Build_GetRemoteCache(BuildConfig *cfg);
+// Whether outputs built here are uploaded to the remote cache. Defaults to true.
+int Build_SetRemoteCacheUpload(BuildConfig *cfg, bool upload);
+bool Build_GetRemoteCacheUpload(BuildConfig *cfg);
+// Waits for the uploads to the remote cache queued so far.
+int Build_WaitForUploads(BuildConfig *cfg);
+// Maximum number of threads of an LTO link. 0 (the default) means the number of jobs.
+int Build_SetLTOJobs(BuildConfig *cfg, unsigned ltoJobs);
+unsigned Build_GetLTOJobs(BuildConfig *cfg);
+// Size limit, in bytes, of the LTO cache in the cache directory. Defaults to 1 GiB.
+int Build_SetLTOCacheSize(BuildConfig *cfg, unsigned long long size);
+unsigned long long Build_GetLTOCacheSize(BuildConfig *cfg);
+// Maximum number of sources `Build_CompileBatchedAsync()` passes to one compiler invocation. Defaults to 16.
+int Build_SetCompileBatchSize(BuildConfig *cfg, unsigned size);
+unsigned Build_GetCompileBatchSize(BuildConfig *cfg);
+
+// Whether `Build_TestAsync()` skips tests that passed before with the same program, arguments and data.
+// Defaults to false.
+int Build_SetCacheTestResults(BuildConfig *cfg, bool cacheTestResults);
+bool Build_GetCacheTestResults(BuildConfig *cfg);
+// Runs only the tests of shard `index` (from 0) of `count`; the default comes from the `TEST_SHARD_INDEX`
+// and `TEST_TOTAL_SHARDS` environment variables.
+int Build_SetTestShard(BuildConfig *cfg, unsigned index, unsigned count);
+unsigned Build_GetTestShardIndex(BuildConfig *cfg);
+unsigned Build_GetTestShardCount(BuildConfig *cfg);
+
+// Whether `Build_CompileAsync()` and `Build_LinkAsync()` skip steps whose output is newer than their inputs
+// and was built by the same command, as recorded in the cache directory. Defaults to false.
+int Build_SetSkipUpToDate(BuildConfig *cfg, bool skipUpToDate);
+bool Build_GetSkipUpToDate(BuildConfig *cfg);
+// Whether to plan instead of running anything: prints why each step would run, and accounts for its
+// recorded duration in `Build_GetPlanEstimate()`. Defaults to false.
+int Build_SetPlan(BuildConfig *cfg, bool plan);
+bool Build_GetPlan(BuildConfig *cfg);
+int Build_GetPlanEstimate(BuildConfig *cfg, BuildPlanEstimate *estimate);
+// Whether outputs are independent of where and when they are built: source paths are mapped to `.`, commands
+// run with a fixed locale, time zone and `SOURCE_DATE_EPOCH`, and archives hold no timestamps; see
+// `Builder::Deterministic`. Defaults to false.
+int Build_SetDeterministic(BuildConfig *cfg, bool deterministic);
+bool Build_GetDeterministic(BuildConfig *cfg);
+// Calls `build` twice with a copy of `cfg` building deterministic outputs, and returns the NULL-terminated list of
+// the files of the output directory that differ between the two builds; see `Builder::VerifyReproducible()`.
+// Caller owns the list, and will be responsible for freeing it with `Build_FreeStringList()`.
+char ** Build_VerifyReproducible(BuildConfig *cfg, void (*build)(BuildConfig *copy, void *arg), void *arg);
+// Ninja manifest to which the steps are written instead of being run, by `Build_WriteNinjaFile()`, with their
+// dependency files, pools and response files. Overrides dry runs and planning. Empty (the default) runs them.
+int Build_SetNinjaFile(BuildConfig *cfg, const char *path);
+const char * Build_GetNinjaFile(BuildConfig *cfg);
+// Writes the steps recorded so far to the Ninja manifest, unless it is unchanged.
+int Build_WriteNinjaFile(BuildConfig *cfg);
+// Whether to show the progress of the commands run on one status line instead of printing each command,
+// printing only failed commands. Falls back to a line per command if stdout is not a terminal. Defaults to false.
+int Build_SetShowProgress(BuildConfig *cfg, bool showProgress);
+bool Build_GetShowProgress(BuildConfig *cfg);
+// Fills `stats` with the counters of the work done so far. They are process-wide, and include the work of
+// all Builders.
+int Build_GetStats(BuildConfig *cfg, BuildStats *stats);
+// File to which the counters are written as JSON when the process exits, once a command ran. Empty (the
+// default) disables it.
+int Build_SetStatsFile(BuildConfig *cfg, const char *path);
+const char * Build_GetStatsFile(BuildConfig *cfg);
+// Prints the `n` steps of the build log that used the most memory, and the `n` that used the most CPU time,
+// the last time they ran.
+int Build_PrintResourceReport(BuildConfig *cfg, unsigned n);
+
+// Returns a copy of `cfg` for the variant `name` (e.g. `debug`), with its own commands, language standards
+// and output directory (`name` inside the output directory of `cfg`). The jobs of all variants share the
+// job scheduler of `cfg`. Caller owns the variant, and will be responsible for freeing it with
+// `Build_DeinitBuildConfig()`.
+BuildConfig * Build_InitVariant(BuildConfig *cfg, const char *name);
+const char * Build_GetVariantName(BuildConfig *cfg);
+// Directory for the outputs of `cfg`. Empty (the default) means the current directory.
+int Build_SetOutputDir(BuildConfig *cfg, const char *dir);
+const char * Build_GetOutputDir(BuildConfig *cfg);
+// Directory of the sources, whose layout `Build_ObjectPath()` mirrors in the output directory.
+int Build_SetSourceDir(BuildConfig *cfg, const char *dir);
+const char * Build_GetSourceDir(BuildConfig *cfg);
+
+// Asynchronous variants of `Build_CC()` and friends. They return a job handle right away,
+// while the command is queued on the job scheduler of `cfg`, or NULL on error.
+// Every job must be passed to one of the `Build_Wait*()` functions, which free it.
+BuildJob * Build_CCAsync(BuildConfig *cfg, const char *fmt, ...);
+BuildJob * Build_CXXAsync(BuildConfig *cfg, const char *fmt, ...);
+BuildJob * Build_ARAsync(BuildConfig *cfg, const char *fmt, ...);
+BuildJob * Build_LDAsync(BuildConfig *cfg, const char *fmt, ...);
+BuildJob * Build_ExecAsync(BuildConfig *cfg, const char *fmt, ...);
+// Queues the command once for `cfg` and all of its variants: later calls with the same command
+// return a new handle to the first job.
+BuildJob * Build_ExecOnceAsync(BuildConfig *cfg, const char *fmt, ...);
+// Compiles `source` into `object` with `flags`, using the C++ compiler if `cxx` is true,
+// on a remote worker when any are configured.
+BuildJob * Build_CompileAsync(BuildConfig *cfg, const char *source, const char *object, const char *flags, bool cxx);
+// Links the NULL-terminated list `inputs` into `output`, followed by `flags`, with the C++ compiler if `cxx` is true.
+BuildJob * Build_LinkAsync(BuildConfig *cfg, const char *output, char **inputs, const char *flags, bool cxx);
+// Like `Build_LinkAsync()`, for inputs compiled with `-flto`: the link-time code generation runs on as
+// many threads as there are free job slots, which stay reserved until the link finishes.
+BuildJob * Build_LTOLinkAsync(BuildConfig *cfg, const char *output, char **inputs, const char *flags, bool cxx);
+// Like `Build_LinkAsync()`, for a shared library of `-fPIC` inputs. With `version`, e.g. `1.2.3`, the library is
+// written to `<output>.1.2.3`, with the soname `<output>.1`, and `<output>.1` and `<output>` link to it.
+// `versionScript`, if not NULL, is passed with `-Wl,--version-script`; `splitDebugInfo` moves the debug
+// information to `<output>.debug`. See `Build::LinkStep`.
+BuildJob * Build_LinkSharedAsync(BuildConfig *cfg, const char *output, char **inputs, const char *flags,
+	const char *version, const char *versionScript, bool splitDebugInfo, bool cxx);
+// Compiles the C++20 module units and other sources of the NULL-terminated list `sources` into the objects at the
+// same index of `objects`, after the modules they import; see `Builder::CompileModulesAsync()`. Stores a job per
+// source in `jobs`, for `Build_WaitAll()`. Returns -1, with no jobs queued, if the modules could not be resolved.
+int Build_CompileModulesAsync(BuildConfig *cfg, char **sources, char **objects, const char *flags, BuildJob **jobs);
+// Compiles the NULL-terminated list `sources` into the objects at the same index of `objects`, passing several stale
+// sources to one compiler invocation; see `Builder::CompileBatchedAsync()`. Stores a job per source in `jobs`.
+int Build_CompileBatchedAsync(BuildConfig *cfg, char **sources, char **objects, const char *flags, bool cxx, BuildJob **jobs);
+// Runs the test `program` with `args`, killing it after `timeoutSeconds` unless 0, and skipping it if it belongs to
+// another shard or, with `Build_SetCacheTestResults()`, it passed before with the same program, arguments and the
+// files of the NULL-terminated list `data`; see `Builder::TestAsync()`.
+BuildJob * Build_TestAsync(BuildConfig *cfg, const char *program, const char *args, char **data, unsigned timeoutSeconds);
+// Waits for `job`, stores its outcome in `status` (if not NULL), and frees the job.
+// Returns 0 if the command ran and exited with 0; -1 otherwise.
+int Build_Wait(BuildJob *job, BuildJobStatus *status);
+// Waits for one of the `count` jobs to finish, stores its outcome in `status` (if not NULL),
+// frees it and sets its entry to NULL. NULL entries are skipped.
+// Returns the index of the finished job, or -1 if there are no jobs left.
+int Build_WaitAny(BuildJob **jobs, size_t count, BuildJobStatus *status);
+// Waits for all `count` jobs, stores their outcomes in `statuses` (if not NULL), frees them
+// and sets their entries to NULL. Returns 0 if all of them succeeded; -1 otherwise.
+int Build_WaitAll(BuildJob **jobs, size_t count, BuildJobStatus *statuses);
 #if defined(__cplusplus)
 }
 #endif
@@ -125,6 +404,202 @@ bool Build_FileExists(const char *path);
 
 #if defined(__cplusplus)
 namespace Build {
+	// Resources used by the processes of a command, as reported by `wait4()`.
+	struct ResourceUsage {
+		double UserSeconds = 0;
+		double SystemSeconds = 0;
+		// Peak resident set size of the largest process, in KiB.
+		long long MaxRSSKiB = 0;
+		long long MinorFaults = 0;
+		long long MajorFaults = 0;
+		// Context switches.
+		long long VoluntarySwitches = 0;
+		long long InvoluntarySwitches = 0;
+	};
+
+	// Result of a single command execution.
+	struct ExecResult {
+		// Command line, as invoked (or printed, for dry runs).
+		std::string Command;
+		// Exit code of the command, or 0 for dry runs.
+		int ExitCode = 0;
+		// Whether the outputs were restored from the cache instead of running the command.
+		bool Cached = false;
+		// Whether the step was up to date, and did not run; see `Builder::SkipUpToDate`.
+		bool Skipped = false;
+		// What the processes of the command used. Empty for cached and skipped steps, and on Windows.
+		ResourceUsage Usage;
+	};
+
+	// A step of the build log, with what it used when it last ran; see `Builder::HeaviestSteps()`.
+	struct StepUsage {
+		// Output of the step, or `#<hash>` for commands without declared outputs.
+		std::string Key;
+		// For commands without declared outputs: the command, cut to 200 characters.
+		std::string Command;
+		long long DurationMsec = 0;
+		ResourceUsage Usage;
+	};
+
+	// What `Builder::Plan` found would run, and how long it would take.
+	struct PlanEstimate {
+		// Steps that would run.
+		unsigned Steps = 0;
+		// Steps that are up to date, and would be skipped.
+		unsigned UpToDate = 0;
+		// Steps that would run but have no recorded duration; they count as the average of the others.
+		unsigned Unrecorded = 0;
+		// Sum of the durations of the steps that would run, in seconds.
+		double SerialSeconds = 0;
+		// Estimated wall time with `Builder::Jobs` steps running at once, in seconds.
+		double Seconds = 0;
+	};
+
+	// Counters of the work done by the Builders of the process, returned by `Builder::Stats()`.
+	struct Statistics {
+		// Child processes started.
+		unsigned long long ProcessesSpawned = 0;
+		// Time spent starting child processes, in seconds.
+		double SpawnSeconds = 0;
+		// Time spent blocked in `Job::Wait()` and `Builder::WaitAny()`, in seconds.
+		double WaitSeconds = 0;
+		// Files and directories stat'ed, by `Builder::FileExists()`, `Glob()` and the up-to-date checks.
+		unsigned long long StatCalls = 0;
+		// Directory listings `Glob()` and files `ScanIncludes()` reused from their caches instead of reading them again.
+		unsigned long long StatCacheHits = 0;
+		// Compile and link steps restored from the output cache, and tests skipped as passed before
+		// (see `Builder::CacheTestResults`), and those not found there.
+		unsigned long long CacheHits = 0;
+		unsigned long long CacheMisses = 0;
+		// Bytes of the files copied by `Builder::Copy()`.
+		unsigned long long BytesCopied = 0;
+		// Jobs skipped as up to date; see `Builder::SkipUpToDate`.
+		unsigned long long JobsSkipped = 0;
+		// Steps whose output came out byte for byte the same, and kept its modification time so that the steps
+		// using it were not rerun.
+		unsigned long long JobsCutOff = 0;
+	};
+
+	// What `Builder::ProbeCC()` / `Builder::ProbeCXX()` found out about a compiler.
+	struct ToolchainInfo {
+		// Resolved path of the compiler executable.
+		std::string Path;
+		// `gcc`, `clang`, or `unknown`.
+		std::string Family;
+		// e.g. `12.2.0`.
+		std::string Version;
+		// e.g. `x86_64-linux-gnu`.
+		std::string Target;
+		// Accepted `-std=` values, e.g. `c++17`.
+		std::vector<std::string> Standards;
+		// Supported features: `lto`, `lto-incremental` (GCC), `modules`, `p1689`, `thread-sanitizer`,
+		// `address-sanitizer`, `split-dwarf`, `color-diagnostics`, `file-prefix-map`.
+		std::vector<std::string> Features;
+		std::vector<std::string> SystemIncludeDirs;
+
+		// Returns whether `name` is one of `Standards` or `Features`.
+		bool Supports(const std::string &name) const;
+	};
+
+	// Compilation of one C or C++ source file into an object file.
+	struct CompileStep {
+		std::string Source;
+		std::string Object;
+		// Compiler flags, other than `-c`, `-o` and the source file.
+		std::string Flags;
+		// Whether to compile with `CXXCommand` instead of `CCCommand`.
+		bool CXX = false;
+	};
+
+	// Link of object files and static libraries into an executable or a shared library.
+	struct LinkStep {
+		// Object files and static libraries. Their contents are part of the cache key.
+		std::vector<std::string> Inputs;
+		std::string Output;
+		// Linker flags, placed after `Inputs`, e.g. `-lpthread`.
+		std::string Flags;
+		// Whether to link with `CXXCommand` instead of `CCCommand`.
+		bool CXX = false;
+		// Whether the inputs were compiled with `-flto`. The link-time code generation then runs on as
+		// many threads as there are free job slots, up to `Builder::LTOJobs`, which stay reserved until
+		// the link finishes, and reuses earlier results from the LTO cache in `Builder::CacheDir`.
+		bool LTO = false;
+		// Whether to link a shared library with `-shared`, instead of an executable. The inputs, including
+		// those of static libraries, must be compiled with `-fPIC`.
+		bool Shared = false;
+		// For `Shared`: the version of the library, e.g. `1.2.3`. The library is then written to `<Output>.1.2.3`,
+		// with `<Output>.1` and `<Output>` as symbolic links to it, except on Windows, and the soname defaults
+		// to the file name of `<Output>.1`, so that programs linked with it accept any `1.x` version.
+		std::string Version;
+		// For `Shared`: the soname recorded in the library (the install name on macOS). Empty means the default
+		// of `Version`, or none.
+		std::string SOName;
+		// Linker version script, passed with `-Wl,--version-script`, which picks the exported symbols and
+		// their versions. Its contents are part of the cache key.
+		std::string VersionScript;
+		// Whether to move the debug information of the output to `<output>.debug` with `objcopy`, leaving a
+		// `.gnu_debuglink` to it.
+		bool SplitDebugInfo = false;
+	};
+
+	// A test program run by `Builder::Test()`.
+	struct TestStep {
+		// Name of the test in failure reports, its log file and its shard assignment. Empty means `Program`.
+		std::string Name;
+		std::string Program;
+		// Arguments passed to `Program`.
+		std::string Args;
+		// Files the test reads. With `Builder::CacheTestResults`, the test runs again only when one of them
+		// or `Program` changed since it last passed.
+		std::vector<std::string> Data;
+		// Seconds after which the test is killed and fails with exit code 124. 0 means no limit.
+		unsigned TimeoutSeconds = 0;
+	};
+
+	struct JobState;
+	struct Scheduler;
+	struct OutputCache;
+	struct OnceJobs;
+	struct StepTarget;
+	struct PlanState;
+	struct NinjaState;
+
+	// Handle to a command queued or running on a Builder's job scheduler.
+	// Copies refer to the same job.
+	struct Job {
+		// Blocks until the command finishes, and returns its result.
+		// Throws if the command could not be invoked.
+		ExecResult Wait() const;
+		bool Done() const;
+		// Runs `fn` once the command finishes, on the thread that ran it,
+		// or right away if it has already finished.
+		void OnFinish(std::function<void()> fn) const;
+
+		std::shared_ptr<JobState> State;
+	};
+
+	struct EventLoopState;
+
+	// Runs callbacks posted from other threads on the thread that calls `Run()`.
+	// Coroutines awaiting jobs inside `SyncWait()` are resumed through it. Copies share the same loop.
+	struct EventLoop {
+		EventLoop();
+
+		void Post(std::function<void()> fn) const;
+		// Makes this the current loop of the calling thread, calls `start`, then runs posted callbacks
+		// until `done` returns true.
+		void Run(std::function<void()> start, std::function<bool()> done);
+		// The loop running on the calling thread, or NULL.
+		static EventLoop * Current();
+
+		std::shared_ptr<EventLoopState> State;
+	};
+
+	// One Builder may be shared between threads: `CC()`, `Exec()`, `Copy()` and the other
+	// execution functions may be called concurrently. Set the configuration members before sharing
+	// a Builder, or change them with `Configure()`. Executions read the configuration once, when they
+	// start, so a change does not affect those already running.
+	// `SetConsoleCodePage()` and `ChDir()` change process-wide state, and are not thread-safe.
 	struct Builder {
 		Builder(bool dryRun = true, bool printCommandToStdout = true);
 
@@ -138,28 +613,159 @@ namespace Build {
 		static std::string DirName(std::string path);
 		static void ChDir(std::string dirPath);
 		static void ChDirToProgramDir(int argc, char *argv[]);
+		// Recompiles the running build program from `sources` with `CXXCommand` and `flags` (e.g. `-I. -pthread`;
+		// `sources` may list libraries such as `libBuild.a`) if one of them, or a header listed by the dependency
+		// file left next to the executable by the last rebuild, is newer than the executable `argv[0]`, and
+		// re-executes it with `argv`. Rebuilds even in dry runs, as the stale program would show the old steps.
+		// Only stats the inputs when the program is up to date. Call it before changing the working directory,
+		// e.g. with `ChDirToProgramDir()`, when `argv[0]` is a relative path. Does nothing for programs found
+		// through `PATH`.
+		void RebuildSelfIfStale(int argc, char *argv[], const std::vector<std::string> &sources, const std::string &flags);
 		static std::string GetCurrentWorkingDir();
 
-		void ExecCommandFV(std::string cmd, std::string fmt, va_list args);
-		void CC(std::string fmt, ...);
-		void CCFV(std::string fmt, va_list args);
-		void CXX(std::string fmt, ...);
-		void CXXFV(std::string fmt, va_list args);
-		void AR(std::string fmt, ...);
-		void ARFV(std::string fmt, va_list args);
-		void LD(std::string fmt, ...);
-		void LDFV(std::string fmt, va_list args);
-		void ExecRaw(std::string cmdExpr);
-		void Exec(std::string fmt, ...);
-		void ExecFV(std::string fmt, va_list args);
-		void Move(std::string src, std::string dest);
-		void Copy(std::string src, std::string dest);
-		void Remove(std::string path);
+		static std::string FormatCommandFV(std::string cmd, std::string fmt, va_list args);
+		ExecResult ExecCommandFV(std::string cmd, std::string fmt, va_list args);
+		ExecResult CC(std::string fmt, ...);
+		ExecResult CCFV(std::string fmt, va_list args);
+		ExecResult CXX(std::string fmt, ...);
+		ExecResult CXXFV(std::string fmt, va_list args);
+		ExecResult AR(std::string fmt, ...);
+		ExecResult ARFV(std::string fmt, va_list args);
+		ExecResult LD(std::string fmt, ...);
+		ExecResult LDFV(std::string fmt, va_list args);
+		ExecResult ExecRaw(std::string cmdExpr);
+		ExecResult Exec(std::string fmt, ...);
+		ExecResult ExecFV(std::string fmt, va_list args);
+		ExecResult Move(std::string src, std::string dest);
+		ExecResult Copy(std::string src, std::string dest);
+		ExecResult Remove(std::string path);
+		Job ExecCommandAsyncFV(std::string cmd, std::string fmt, va_list args);
+		Job CCAsync(std::string fmt, ...);
+		Job CCAsyncFV(std::string fmt, va_list args);
+		Job CXXAsync(std::string fmt, ...);
+		Job CXXAsyncFV(std::string fmt, va_list args);
+		Job ARAsync(std::string fmt, ...);
+		Job ARAsyncFV(std::string fmt, va_list args);
+		Job LDAsync(std::string fmt, ...);
+		Job LDAsyncFV(std::string fmt, va_list args);
+		Job ExecRawAsync(std::string cmdExpr);
+		Job ExecAsync(std::string fmt, ...);
+		Job ExecAsyncFV(std::string fmt, va_list args);
+		// Returns a copy of this Builder for the variant `name` (e.g. `debug` or `asan`), after passing it
+		// to `configure` to set its own commands, flags and language standards. Its `OutputDir` is
+		// `name` inside this Builder's `OutputDir`. Variants share this Builder's job schedulers, so the
+		// jobs of all variants fill the same `Jobs` slots, and the steps started with `Once()`.
+		Builder Variant(std::string name, std::function<void(Builder &)> configure = std::function<void(Builder &)>());
+		// Calls `start` the first time `key` is passed by this Builder or any of its variants, and returns
+		// its job; later calls return the same job, or, while `start` runs, a job finishing with it. `start`
+		// may itself call `Once()`, e.g. for a step its own depends on. For variant-independent steps, such
+		// as code generation.
+		Job Once(std::string key, std::function<Job()> start);
+		// Queues the command once for this Builder and all of its variants; see `Once()`.
+		Job ExecOnceAsync(std::string fmt, ...);
+		Job ExecOnceAsyncFV(std::string fmt, va_list args);
+		// Waits for one of `jobs` to finish, and returns its index.
+		static size_t WaitAny(const std::vector<Job> &jobs);
+		// Waits for all of `jobs`, and returns their results in the same order.
+		// Throws the first error, after all jobs have finished.
+		static std::vector<ExecResult> WaitAll(const std::vector<Job> &jobs);
 		static std::string ExecutableFileName(std::string exeName);
+		// Paths of build outputs in `OutputDir`, whose parent directories are created unless `DryRun`.
+		// `ObjectPath("src/a/b.cc")` is `<OutputDir>/a/b.o` when `SourceDir` is `src`; `..` components
+		// become `__`, so that objects stay inside `OutputDir`. Throws for a source whose object an earlier
+		// call returned for another one, e.g. `a.cc` after `a.c`, rather than letting one overwrite the other.
+		std::string ObjectPath(std::string source);
+		// `<OutputDir>/lib<libName>.a`.
+		std::string ArchivePath(std::string libName);
+		// `<OutputDir>/lib<libName>.so`, or `.dylib` on macOS and `.dll` on Windows.
+		std::string SharedLibraryPath(std::string libName);
+		// `<OutputDir>/<ExecutableFileName(exeName)>`.
+		std::string ExecutablePath(std::string exeName);
 		static bool FileExists(std::string path);
+		std::vector<std::string> Glob(std::string pattern);
+		// Returns, for each of `sources`, the headers it includes, directly or not, without running the compiler,
+		// e.g. to plan a clean build before dependency files exist. Quoted names are looked up next to the
+		// including file, then in `includeDirs`; angled names in `includeDirs` only. Headers not found there, such
+		// as system headers, are left out. The result errs on the side of too many headers: directives in
+		// comments and in conditional blocks count, and only those naming a macro are missed. Files are scanned
+		// on several threads, and what they include is cached in `CacheDir` by size and modification time.
+		std::map<std::string, std::vector<std::string>> ScanIncludes(const std::vector<std::string> &sources,
+			const std::vector<std::string> &includeDirs);
+		// Creates or updates the static library `archivePath` from `members`. ELF objects are archived
+		// in process, and only the members that changed since the last call are read; if none did, the
+		// archive is left untouched. Otherwise, if the symbol index keeps its size, the members before the
+		// first change are kept in place and the rest rewritten. Returns whether the archive was written.
+		bool Archive(std::string archivePath, std::vector<std::string> members);
+		// Probes the compiler of `CCCommand` / `CXXCommand`. Results are cached in `CacheDir`, keyed by
+		// the path, size and modification time of the compiler executable, so that usually no process
+		// is spawned.
+		ToolchainInfo ProbeCC();
+		ToolchainInfo ProbeCXX();
+		// Compiles `step`. With `RemoteWorkers`, the source file is preprocessed here and compiled by
+		// a worker; if no worker can be reached, it is compiled here.
+		ExecResult Compile(const CompileStep &step);
+		Job CompileAsync(const CompileStep &step);
+		// Links `step` with the compiler driver. For a versioned shared library, the result and the job name
+		// the versioned file; see `LinkStep::Version`.
+		ExecResult Link(const LinkStep &step);
+		Job LinkAsync(const LinkStep &step);
+		// Compiles the C++20 module units and other sources of `steps` with `CXXCommand`, each once the BMIs of
+		// the modules it imports are built, and returns their jobs in the order of `steps`. What the units provide
+		// and import is read by the compiler's P1689 scan (`-fdeps-format=p1689r5`) when `ProbeCXX()` finds it,
+		// else from their module declarations. BMIs go to `bmi/` in `OutputDir`, and count as outputs of their
+		// step for `SkipUpToDate`. Throws if a module is missing or provided twice, or if imports form a cycle.
+		std::vector<Job> CompileModulesAsync(const std::vector<CompileStep> &steps);
+		std::vector<ExecResult> CompileModules(const std::vector<CompileStep> &steps);
+		// Compiles `steps`, passing the stale sources with the same compiler, flags and object directory to one
+		// compiler invocation, run in that directory, to save the start-up of the compiler, and returns their jobs in
+		// the order of `steps`. Batches hold up to `CompileBatchSize` sources, and fewer when there are not enough
+		// to give each of the `Jobs` slots one. With `SkipUpToDate`, each object is checked, and recorded in the build
+		// log, on its own, with the command compiling it alone, so that an edit recompiles only its source; a source
+		// that fails fails its own job only. Steps whose object is not named after their source (`a.c` to `a.o`) or
+		// that name an output in their flags (`-o`, `-MF`), and all steps in dry runs, when planning, with `NinjaFile`,
+		// `RemoteWorkers`, `CacheOutputs` or `Deterministic`, are compiled one by one, as by `CompileAsync()`.
+		std::vector<Job> CompileBatchedAsync(const std::vector<CompileStep> &steps);
+		std::vector<ExecResult> CompileBatched(const std::vector<CompileStep> &steps);
+		// Runs the test `step`, unless it belongs to another shard (see `TestShardCount`) or, with
+		// `CacheTestResults`, it passed before with the same program, arguments and data. Its output is written to
+		// `testlogs/<Name>.log` in `OutputDir`, and printed if it fails.
+		ExecResult Test(const TestStep &step);
+		Job TestAsync(const TestStep &step);
+		// Waits for the uploads to `RemoteCache` queued so far.
+		void WaitForUploads();
+		// Returns what the steps submitted so far with `Plan` set would take. Includes the steps of variants.
+		PlanEstimate GetPlanEstimate();
+		// Runs `build` twice on a copy of this Builder with `Deterministic` set, and neither `SkipUpToDate` nor
+		// `CacheOutputs`, a second apart, and returns the paths, relative to `OutputDir`, of the files there that
+		// differ between the two builds or exist after one only. Outputs outside `OutputDir` are not compared.
+		// Returns nothing in dry runs, when planning, or with `NinjaFile`.
+		std::vector<std::string> VerifyReproducible(std::function<void(Builder &)> build);
+		// Writes the steps recorded so far with `NinjaFile` set, including those of variants, to `NinjaFile`.
+		// The file is left untouched if it did not change. Does nothing if `NinjaFile` is empty.
+		void WriteNinjaFile();
+		// Returns the counters of the work done so far. They are process-wide, as Builders share their work
+		// with copies and variants.
+		static Statistics Stats();
+		// Returns the `n` steps of the build log that used the most memory, or, unless `byMemory` is set, the
+		// most CPU time, the last time they ran.
+		std::vector<StepUsage> HeaviestSteps(unsigned n, bool byMemory);
+		// Prints the `n` steps that used the most memory, and the `n` that used the most CPU time.
+		void PrintResourceReport(unsigned n);
+		// Serves compilations for Builders listing `address` (`<host>:<port>` or `unix:<path>`) in their
+		// `RemoteWorkers`, with this Builder's compilers, until `keepRunning` returns false.
+		// At most `Jobs` compilations run at once. Requests whose flags have characters the shell treats
+		// specially, e.g. quotes or `;`, are refused, and compiled by the client instead.
+		void ServeWorker(std::string address, std::function<bool()> keepRunning = std::function<bool()>());
+		// Runs `fn` with the configuration locked against concurrent `Configure()` calls and executions
+		// reading it as they start; executions already running keep the configuration they read. `fn` must
+		// only read or set members: calling Builder functions from it, e.g. `ObjectPath()`, deadlocks.
+		void Configure(std::function<void(Builder &)> fn);
+		// Returns the last command executed by the calling thread.
+		std::string GetLastExecCommand();
 
 		bool DryRun;
 		bool PrintCommandToStdout;
+		// Last command executed by any thread. Prefer `ExecResult` when sharing the Builder between threads.
 		std::string LastExecCommand;
 		std::string CCCommand;
 		std::string CLanguageStandard;
@@ -170,7 +776,386 @@ namespace Build {
 		std::string MoveCommand;
 		std::string CopyCommand;
 		std::string RemoveCommand;
+		// Paths or file names skipped by `Glob()`, e.g. `.git` or `third_party/**`.
+		std::vector<std::string> GlobIgnorePatterns;
+		// Directory for persistent caches. Empty disables them.
+		std::string CacheDir;
+		// Maximum number of asynchronous jobs running at once.
+		unsigned Jobs;
+		// Maximum number of sources `CompileBatchedAsync()` passes to one compiler invocation. 1 compiles each
+		// on its own.
+		unsigned CompileBatchSize;
+		// Whether `Archive()` creates thin archives, which refer to the member files instead of copying them.
+		bool ThinArchives;
+		// Addresses (`<host>:<port>` or `unix:<path>`) of workers serving `Compile()`, e.g. `build_worker`.
+		std::vector<std::string> RemoteWorkers;
+		// Maximum number of compilations sent to `RemoteWorkers` at once. 0 means `Jobs` per worker.
+		unsigned RemoteJobs;
+		// Whether `Compile()` and `Link()` reuse the outputs of identical earlier steps, stored in
+		// `CacheDir` and `RemoteCache`. Compilations are keyed by their preprocessed source.
+		bool CacheOutputs;
+		// Base URL of an HTTP cache with the bazel-remote layout (`/ac/` and `/cas/`), e.g.
+		// `http://cache.local:8080`, shared between machines. Empty disables it.
+		std::string RemoteCache;
+		// Whether outputs built here are uploaded to `RemoteCache`. Uploads run in the background.
+		bool RemoteCacheUpload;
+		// Maximum number of threads of an LTO link. 0 means `Jobs`.
+		unsigned LTOJobs;
+		// Size limit, in bytes, of the LTO cache in `CacheDir`. The least recently used entries are
+		// removed after each LTO link.
+		unsigned long long LTOCacheSize;
+		// Whether `Compile()` and `Link()` skip their step when the output is newer than its inputs
+		// (including the headers listed by a `-MMD` dependency file next to the object file) and was built
+		// by the same command, as recorded in the build log in `CacheDir`. `Archive()` always does. A step whose
+		// output comes out byte for byte the same as last time keeps its older modification time, so that the
+		// steps using it are skipped too (early cutoff).
+		bool SkipUpToDate;
+		// Whether to plan instead of running anything: for each step that would run, prints why (output
+		// missing, a newer input, a changed command, a cache miss), and adds its recorded duration to
+		// `GetPlanEstimate()`. Other commands have no declared outputs, and always count as running.
+		bool Plan;
+		// Whether outputs are independent of where and when they are built, so that checkouts at different paths
+		// share `CacheOutputs`: compilers map the absolute `SourceDir` to `.` with `-ffile-prefix-map` (or only
+		// `-fdebug-prefix-map` if that is all they have), and GCC gets a `-frandom-seed` per object; commands run
+		// with `LC_ALL=C`, `TZ=UTC` and `SOURCE_DATE_EPOCH` (0 unless set), process-wide once one did; archive
+		// members get zero timestamps, with `D` for `ARCommand`. See `VerifyReproducible()`.
+		bool Deterministic;
+		// Ninja manifest to write the steps to, instead of running them; see `WriteNinjaFile()`. Each step becomes
+		// a `build` statement, with its dependency file if built with `-MMD` or `-MD` (as `deps = gcc`), a pool
+		// for LTO links taking several job slots, and a response file for command lines too long for the shell.
+		// Steps are ordered by the files they declare, and after the synchronous commands before them; commands
+		// without declared outputs run on every Ninja build. Overrides `DryRun` and `Plan`. Empty runs the steps.
+		std::string NinjaFile;
+		// Whether to show the progress of the commands run on one status line, with the number of commands
+		// done, the running ones, the throughput and the ETA, instead of printing each command. Only failed
+		// commands are printed, with their output. Falls back to a line per command if stdout is not a terminal.
+		bool ShowProgress;
+		// File to which `Stats()` is written as JSON when the process exits, once a command ran. Empty disables it.
+		std::string StatsFile;
+		// Whether `Test()` skips tests that passed before with the same program, arguments and data, as recorded
+		// in `CacheDir`.
+		bool CacheTestResults;
+		// Number of invocations the tests are split between, and which of them this is, from 0. `Test()` skips
+		// the tests of other shards. Default to the `TEST_TOTAL_SHARDS` and `TEST_SHARD_INDEX` environment variables.
+		unsigned TestShardCount;
+		unsigned TestShardIndex;
+		// Name given to `Variant()`, or empty.
+		std::string VariantName;
+		// Directory for the outputs of this Builder, e.g. `build/debug`. Empty means the current directory.
+		std::string OutputDir;
+		// Directory of the sources, whose layout `ObjectPath()` mirrors in `OutputDir`. Empty means the
+		// current directory.
+		std::string SourceDir;
+
+	private:
+		// A mutex that does not prevent copying the Builder; copies get their own mutex.
+		struct CopyableMutex : std::mutex {
+			CopyableMutex() {}
+			CopyableMutex(const CopyableMutex &) {}
+			CopyableMutex & operator=(const CopyableMutex &) { return *this; }
+		};
+		// Keys the Builder's last command in each thread's `GetLastExecCommand()` results. Copies get their
+		// own key, and the calling thread's result is dropped with the key.
+		struct ExecCommandKey {
+			unsigned long long Value;
+
+			ExecCommandKey();
+			ExecCommandKey(const ExecCommandKey &) : ExecCommandKey() {}
+			ExecCommandKey & operator=(const ExecCommandKey &) { return *this; }
+			~ExecCommandKey();
+		};
+
+		std::string CCCommandLine();
+		std::string CXXCommandLine();
+		std::string ConfigValue(const std::string &value);
+		// `relativePath` in `OutputDir`, with its parent directories created unless `DryRun`.
+		std::string OutputPath(const std::string &relativePath);
+		void RecordCommand(const std::string &cmdExpr, bool &dryRun, bool &printCommand, bool &plan, bool &progress, bool &ninja);
+		std::shared_ptr<Scheduler> GetScheduler();
+		std::shared_ptr<Scheduler> GetRemoteScheduler();
+		std::shared_ptr<Scheduler> GetUploadScheduler();
+		std::shared_ptr<OnceJobs> GetOnceJobs();
+		std::shared_ptr<PlanState> GetPlanState();
+		std::shared_ptr<NinjaState> GetNinjaState();
+		// Path of the build log, or empty without `CacheDir`.
+		std::string BuildLogPath();
+		// For `Plan`: prints why `cmdExpr`, which builds `target` if not NULL, would run, and accounts for
+		// it. Returns false if it is up to date and would be skipped.
+		bool PlanStep(const std::string &cmdExpr, const StepTarget *target);
+		// For `NinjaFile`: records `cmdExpr`, which builds `target` if not NULL, takes `slots` job slots, and runs
+		// once the files `after` are built. The arguments after `program`, if not empty, may go in a response
+		// file. `sync` steps order the steps recorded after them. Returns the output naming the step.
+		std::string NinjaStep(const std::string &cmdExpr, const StepTarget *target, const std::string &program, unsigned slots,
+			const std::vector<std::string> &after, bool sync);
+		// Runs `program` with `args`, through a response file if the command line is too long.
+		ExecResult ExecTool(const std::string &program, const std::string &args);
+		// Directory of the response files of `ExecTool()`.
+		std::string ResponseFileDir();
+		// Fills `cache` from the cache configuration, for steps run with `CXXCommand` if `cxx` is true.
+		void SetUpOutputCache(OutputCache &cache, bool cxx);
+		// Queues `cmdExpr`, or `run` instead if given, which returns the exit code. The job may reserve up
+		// to `maxSlots` job slots; `commandForSlots` then builds the command for the slots it gets.
+		// `target`, if not NULL, declares the files of the step, for `SkipUpToDate` and `Plan`. The job is
+		// queued once the jobs `after` finish, or fails without running if one of them failed. Unless `logged`
+		// is false, e.g. for a job recording its outputs itself, the step goes in the build log when it succeeds.
+		Job SubmitJob(const std::string &cmdExpr, std::function<int(ExecResult &, unsigned)> run, bool remote,
+			unsigned maxSlots = 1, std::function<std::string(unsigned)> commandForSlots = std::function<std::string(unsigned)>(),
+			const StepTarget *target = NULL, const std::vector<Job> &after = std::vector<Job>(), bool logged = true);
+
+		CopyableMutex Mutex;
+		ExecCommandKey LastExecCommandKey;
+		// Sources of the objects `ObjectPath()` returned, by object.
+		std::map<std::string, std::string> ObjectSources;
+		// Shared by copies of the Builder.
+		std::shared_ptr<Scheduler> JobScheduler;
+		// Runs remote compilations, which do not count against `Jobs`.
+		std::shared_ptr<Scheduler> RemoteScheduler;
+		// Runs uploads to `RemoteCache`.
+		std::shared_ptr<Scheduler> UploadScheduler;
+		// Jobs started with `Once()`, by key.
+		std::shared_ptr<OnceJobs> SharedOnceJobs;
+		// What `Plan` found so far, shared with variants.
+		std::shared_ptr<PlanState> SharedPlanState;
+		// Steps recorded for `NinjaFile`, shared with variants.
+		std::shared_ptr<NinjaState> SharedNinjaState;
 	};
 }
 #endif
 
+#if defined(__cplusplus) && defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define BUILD_HAS_COROUTINES 1
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+// Coroutine tasks for composing build steps, available when compiling with C++20:
+//
+//	Build::Task<void> Compile(Builder &b) {
+//		std::vector<Build::Job> objects;
+//		objects.push_back(b.CXXAsync("-c a.cc"));
+//		objects.push_back(b.CXXAsync("-c b.cc"));
+//		co_await Build::WhenAll(objects);
+//		co_await b.CXXAsync("-o app a.o b.o");
+//	}
+//
+//	Build::SyncWait(Compile(b));
+//
+// Commands run on the Builder's job scheduler, and coroutines are resumed on the thread calling `SyncWait()`.
+namespace Build {
+	template <typename T> struct Task;
+
+	struct TaskPromiseBase {
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+			template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+				if (h.promise().Continuation) return h.promise().Continuation;
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() { Exception = std::current_exception(); }
+
+		std::coroutine_handle<> Continuation;
+		// Claimed by the first task to fail; tasks may finish on different threads.
+		std::atomic<bool> Failed{ false };
+		std::exception_ptr Exception;
+	};
+
+	template <typename T> struct TaskPromise : TaskPromiseBase {
+		Task<T> get_return_object();
+		void return_value(T value) { Value = std::move(value); }
+
+		T Result() {
+			if (Exception) std::rethrow_exception(Exception);
+			return std::move(*Value);
+		}
+
+		std::optional<T> Value;
+	};
+
+	template <> struct TaskPromise<void> : TaskPromiseBase {
+		Task<void> get_return_object();
+		void return_void() {}
+
+		void Result() {
+			if (Exception) std::rethrow_exception(Exception);
+		}
+	};
+
+	// A lazily started coroutine, which runs when awaited or passed to `SyncWait()`.
+	template <typename T> struct Task {
+		typedef TaskPromise<T> promise_type;
+
+		explicit Task(std::coroutine_handle<promise_type> handle) : Handle(handle) {}
+		Task(Task &&other) noexcept : Handle(std::exchange(other.Handle, nullptr)) {}
+		Task & operator=(Task &&other) noexcept {
+			if (this != &other) {
+				if (Handle) Handle.destroy();
+				Handle = std::exchange(other.Handle, nullptr);
+			}
+			return *this;
+		}
+		Task(const Task &) = delete;
+		Task & operator=(const Task &) = delete;
+		~Task() { if (Handle) Handle.destroy(); }
+
+		bool await_ready() const noexcept { return !Handle || Handle.done(); }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+			Handle.promise().Continuation = continuation;
+			return Handle;
+		}
+		T await_resume() { return Handle.promise().Result(); }
+
+		// Awaits the task without taking its result, which `Handle.promise().Result()` still returns.
+		struct CompletionAwaiter {
+			bool await_ready() const noexcept { return !Handle || Handle.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+				Handle.promise().Continuation = continuation;
+				return Handle;
+			}
+			void await_resume() noexcept {}
+
+			std::coroutine_handle<promise_type> Handle;
+		};
+
+		CompletionAwaiter Completion() { return CompletionAwaiter{ Handle }; }
+
+		std::coroutine_handle<promise_type> Handle;
+	};
+
+	template <typename T> Task<T> TaskPromise<T>::get_return_object() {
+		return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+	}
+
+	inline Task<void> TaskPromise<void>::get_return_object() {
+		return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+	}
+
+	// A coroutine that starts right away and frees itself when it finishes.
+	struct DetachedTask {
+		struct promise_type {
+			DetachedTask get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	// Awaiting a Job suspends the coroutine until the command finishes, and yields its `ExecResult`.
+	struct JobAwaiter {
+		bool await_ready() const { return AwaitedJob.Done(); }
+		void await_suspend(std::coroutine_handle<> handle) {
+			EventLoop *current = EventLoop::Current();
+
+			if (!current) {
+				AwaitedJob.OnFinish([handle] { handle.resume(); });
+				return;
+			}
+			// The copy shares the loop's state, keeping it alive while the job's thread posts to it.
+			EventLoop loop = *current;
+			AwaitedJob.OnFinish([loop, handle] { loop.Post([handle] { handle.resume(); }); });
+		}
+		ExecResult await_resume() { return AwaitedJob.Wait(); }
+
+		Job AwaitedJob;
+	};
+
+	inline JobAwaiter operator co_await(Job job) {
+		return JobAwaiter{ job };
+	}
+
+	template <typename T> struct WhenAllState {
+		std::atomic<size_t> Remaining;
+		std::coroutine_handle<> Continuation;
+		// Claimed by the first task to fail; tasks may finish on different threads.
+		std::atomic<bool> Failed{ false };
+		std::exception_ptr Exception;
+		std::vector<std::optional<T>> Values;
+	};
+
+	template <> struct WhenAllState<void> {
+		std::atomic<size_t> Remaining;
+		std::coroutine_handle<> Continuation;
+		std::atomic<bool> Failed{ false };
+		std::exception_ptr Exception;
+	};
+
+	template <typename T> DetachedTask WhenAllDriver(Task<T> &task, WhenAllState<T> &state, size_t index) {
+		try {
+			if constexpr (std::is_void_v<T>) {
+				co_await task;
+			} else {
+				state.Values[index] = co_await task;
+			}
+		} catch (...) {
+			if (!state.Failed.exchange(true)) state.Exception = std::current_exception();
+		}
+		if (--state.Remaining == 0) state.Continuation.resume();
+	}
+
+	template <typename T> struct WhenAllAwaiter {
+		bool await_ready() const { return Tasks.empty(); }
+		bool await_suspend(std::coroutine_handle<> continuation) {
+			State.Continuation = continuation;
+			for (size_t i = 0; i < Tasks.size(); ++i) WhenAllDriver(Tasks[i], State, i);
+			// Holding one count until every task is started avoids resuming twice, if they all finish right away.
+			return --State.Remaining > 0;
+		}
+		void await_resume() {}
+
+		std::vector<Task<T>> &Tasks;
+		WhenAllState<T> &State;
+	};
+
+	// Runs all `tasks` concurrently, and yields their results in the same order once all of them finish.
+	// Rethrows the first exception, after all tasks have finished.
+	template <typename T> Task<std::vector<T>> WhenAll(std::vector<Task<T>> tasks) {
+		WhenAllState<T> state;
+		std::vector<T> values;
+
+		state.Remaining = tasks.size() + 1;
+		state.Values.resize(tasks.size());
+		co_await WhenAllAwaiter<T>{ tasks, state };
+		if (state.Exception) std::rethrow_exception(state.Exception);
+		for (std::optional<T> &value : state.Values) values.push_back(std::move(*value));
+		co_return values;
+	}
+
+	inline Task<void> WhenAll(std::vector<Task<void>> tasks) {
+		WhenAllState<void> state;
+
+		state.Remaining = tasks.size() + 1;
+		co_await WhenAllAwaiter<void>{ tasks, state };
+		if (state.Exception) std::rethrow_exception(state.Exception);
+	}
+
+	// Waits for all `jobs`, which already run concurrently, and yields their results in the same order.
+	inline Task<std::vector<ExecResult>> WhenAll(std::vector<Job> jobs) {
+		std::vector<ExecResult> results;
+
+		for (Job &job : jobs) results.push_back(co_await job);
+		co_return results;
+	}
+
+	template <typename T> DetachedTask SyncWaitDriver(Task<T> &task, bool &done) {
+		co_await task.Completion();
+		done = true;
+	}
+
+	// Runs `task` to completion on the calling thread, and returns its result.
+	template <typename T> T SyncWait(Task<T> task) {
+		EventLoop loop;
+		bool done = false;
+
+		loop.Run([&] { SyncWaitDriver(task, done); }, [&] { return done; });
+		return task.Handle.promise().Result();
+	}
+}
+#endif
@@ -0,0 +1,518 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::FileStamp;
+
+static const char *archiveManifestHeader = "libBuild-archive 1";
+
+// What `Archive()` recorded about a member, to tell whether it changed since.
+struct ArchiveMember {
+	string Path;
+	FileStamp Stamp;
+	vector<string> Symbols;
+};
+
+// Kept in `<CacheDir>/archives/`, one per archive.
+struct ArchiveManifest {
+	FileStamp ArchiveStamp;
+	bool Thin = false;
+	// Whether the archive was written by `ARCommand`, so the member symbols are unknown.
+	bool External = false;
+	vector<ArchiveMember> Members;
+};
+
+// Reads integers from an ELF file, clearing `Ok` instead of reading past its end.
+struct ELFReader {
+	const string &Data;
+	bool BigEndian = false;
+	bool Ok = true;
+
+	explicit ELFReader(const string &data) : Data(data) {}
+
+	unsigned long long Read(unsigned long long offset, unsigned size) {
+		unsigned long long value = 0;
+
+		if (offset > Data.size() || size > Data.size() - offset) {
+			Ok = false;
+			return 0;
+		}
+		for (unsigned i = 0; i < size; ++i) {
+			value = (value << 8) | (unsigned char) Data[offset + (BigEndian ? i : size - 1 - i)];
+		}
+
+		return value;
+	}
+};
+
+// Appends the global symbols defined by the ELF relocatable object `data` to `symbols`.
+// Returns false if `data` is not one, or if its symbols are only known to the compiler's LTO plugin.
+static bool ReadELFSymbols(const string &data, vector<string> &symbols) {
+	ELFReader r(data);
+	bool is64 = false;
+	unsigned long long shoff = 0, shentsize = 0, shnum = 0;
+	size_t first = symbols.size();
+
+	if (data.size() < 52 || memcmp(data.data(), "\x7f" "ELF", 4)) return false;
+	if (data[4] != 1 && data[4] != 2) return false;
+	is64 = data[4] == 2;
+	r.BigEndian = data[5] == 2;
+	// ET_REL
+	if (r.Read(16, 2) != 1) return false;
+
+	shoff = r.Read(is64 ? 40 : 32, is64 ? 8 : 4);
+	shentsize = r.Read(is64 ? 58 : 46, 2);
+	shnum = r.Read(is64 ? 60 : 48, 2);
+	// With many sections, the count is in the size field of section 0.
+	if (!shnum && shoff) shnum = r.Read(shoff + (is64 ? 32 : 20), is64 ? 8 : 4);
+	if (!r.Ok || !shentsize) return false;
+
+	for (unsigned long long i = 0; i < shnum && r.Ok; ++i) {
+		unsigned long long sh = shoff + i * shentsize, strSh = 0;
+		unsigned long long offset = 0, size = 0, link = 0, entsize = 0, strOffset = 0, strSize = 0;
+
+		// SHT_SYMTAB
+		if (r.Read(sh + 4, 4) != 2) continue;
+		offset = r.Read(sh + (is64 ? 24 : 16), is64 ? 8 : 4);
+		size = r.Read(sh + (is64 ? 32 : 20), is64 ? 8 : 4);
+		link = r.Read(sh + (is64 ? 40 : 24), 4);
+		entsize = r.Read(sh + (is64 ? 56 : 36), is64 ? 8 : 4);
+		strSh = shoff + link * shentsize;
+		strOffset = r.Read(strSh + (is64 ? 24 : 16), is64 ? 8 : 4);
+		strSize = r.Read(strSh + (is64 ? 32 : 20), is64 ? 8 : 4);
+		if (!r.Ok || !entsize || strOffset > data.size() || strSize > data.size() - strOffset) return false;
+
+		for (unsigned long long j = 1; j < size / entsize && r.Ok; ++j) {
+			unsigned long long sym = offset + j * entsize;
+			unsigned long long name = r.Read(sym, 4);
+			unsigned info = (unsigned) r.Read(sym + (is64 ? 4 : 12), 1);
+			unsigned shndx = (unsigned) r.Read(sym + (is64 ? 6 : 14), 2);
+			unsigned bind = info >> 4, type = info & 0xf;
+			const char *str = NULL;
+
+			// Skip undefined, section and file symbols, and keep global, weak and unique ones.
+			if (!shndx || type == 3 || type == 4) continue;
+			if (bind != 1 && bind != 2 && bind != 10) continue;
+			if (name >= strSize) return false;
+			str = data.data() + strOffset + name;
+			symbols.push_back(string(str, strnlen(str, strSize - name)));
+		}
+	}
+	if (!r.Ok) return false;
+
+	for (size_t i = first; i < symbols.size(); ++i) {
+		if (symbols[i] == "__gnu_lto_slim") return false;
+	}
+
+	return true;
+}
+
+static bool LoadArchiveManifest(const string &path, ArchiveManifest &manifest) {
+	FILE *in = fopen(path.c_str(), "rb");
+	char line[8192];
+	bool ok = false;
+
+	if (!in) return false;
+	ok = fgets(line, sizeof(line), in) && string(line) == string(archiveManifestHeader) + "\n";
+	while (ok && fgets(line, sizeof(line), in)) {
+		size_t len = strlen(line);
+		long long size = 0, mtime = 0;
+		int thin = 0, external = 0, pathOffset = 0;
+
+		if (!len || line[len - 1] != '\n') {
+			ok = false;
+			break;
+		}
+		line[len - 1] = '\0';
+		if (sscanf(line, "A %lld %lld %d %d", &size, &mtime, &thin, &external) == 4) {
+			manifest.ArchiveStamp.Size = size;
+			manifest.ArchiveStamp.MTimeNsec = mtime;
+			manifest.Thin = thin;
+			manifest.External = external;
+		} else if (sscanf(line, "M %lld %lld %n", &size, &mtime, &pathOffset) == 2 && pathOffset) {
+			ArchiveMember member;
+			member.Path = line + pathOffset;
+			member.Stamp.Size = size;
+			member.Stamp.MTimeNsec = mtime;
+			manifest.Members.push_back(member);
+		} else if (line[0] == 'S' && line[1] == ' ' && !manifest.Members.empty()) {
+			manifest.Members.back().Symbols.push_back(line + 2);
+		} else {
+			ok = false;
+		}
+	}
+	fclose(in);
+
+	return ok;
+}
+
+static void SaveArchiveManifest(const string &path, const ArchiveManifest &manifest) {
+	string content = string(archiveManifestHeader) + "\n";
+	size_t slash = path.find_last_of('/');
+
+	content += "A " + std::to_string(manifest.ArchiveStamp.Size) + " " + std::to_string(manifest.ArchiveStamp.MTimeNsec)
+		+ " " + (manifest.Thin ? "1" : "0") + " " + (manifest.External ? "1" : "0") + "\n";
+	for (const ArchiveMember &member : manifest.Members) {
+		content += "M " + std::to_string(member.Stamp.Size) + " " + std::to_string(member.Stamp.MTimeNsec) + " " + member.Path + "\n";
+		for (const string &symbol : member.Symbols) content += "S " + symbol + "\n";
+	}
+
+	if (slash != string::npos) Build::MakeDirs(path.substr(0, slash));
+	Build::WriteFileAtomic(path, content);
+}
+
+static string ArchiveMemberHeader(const string &name, long long mtime, const char *mode, long long size) {
+	char header[61];
+
+	snprintf(header, sizeof(header), "%-16s%-12lld%-6d%-6d%-8s%-10lld`\n", name.c_str(), mtime, 0, 0, mode, size);
+	return string(header, 60);
+}
+
+static void WriteAll(int fd, const char *data, size_t size, const string &path) {
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) throw runtime_error(string("unable to write file: ") + path);
+		data += n;
+		size -= (size_t) n;
+	}
+}
+
+// Appends the content of `srcPath` to `fd`, which must be `size` bytes long.
+static void AppendFile(int fd, const string &srcPath, long long size, const string &path) {
+	int in = open(srcPath.c_str(), O_RDONLY);
+	char buf[1 << 16];
+
+	if (in < 0) throw runtime_error(string("unable to read file: ") + srcPath);
+#if defined(LINUX)
+	// Let the kernel copy the data, or share the blocks on file systems that support reflinks.
+	while (size > 0) {
+		ssize_t n = copy_file_range(in, NULL, fd, NULL, (size_t) size, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		size -= n;
+	}
+#endif
+	while (size > 0) {
+		ssize_t n = read(in, buf, size < (long long) sizeof(buf) ? (size_t) size : sizeof(buf));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			close(in);
+			throw runtime_error(string("unable to read file: ") + srcPath);
+		}
+		try {
+			WriteAll(fd, buf, (size_t) n, path);
+		} catch (std::exception &e) {
+			close(in);
+			throw;
+		}
+		size -= n;
+	}
+	close(in);
+}
+
+// Where `WriteArchive()` puts each part of an archive.
+struct ArchiveLayout {
+	// The magic string, the symbol index and the table of long member names.
+	string Head;
+	vector<string> Names;
+	vector<long long> Offsets;
+	long long Size = 0;
+};
+
+// Lays out a GNU archive of `members` at `path`: a symbol index, a table of long member names, then the
+// members, whose data is left out of thin archives.
+static ArchiveLayout LayOutArchive(const string &path, const vector<ArchiveMember> &members, bool thin) {
+	ArchiveLayout layout;
+	string longNames, symbolNames;
+	size_t symbolCount = 0;
+	long long offset = 0, symbolTableSize = 0;
+	bool sym64 = false;
+	string archiveDir = Build::Builder::DirName(path);
+
+	layout.Names.resize(members.size());
+	layout.Offsets.resize(members.size());
+	for (size_t i = 0; i < members.size(); ++i) {
+		string name = members[i].Path;
+		if (thin) {
+			name = Build::RelativePath(name, archiveDir);
+		} else {
+			size_t slash = name.find_last_of("/\\");
+			if (slash != string::npos) name = name.substr(slash + 1);
+		}
+		if (!thin && name.size() < 16) {
+			layout.Names[i] = name + "/";
+		} else {
+			layout.Names[i] = "/" + std::to_string(longNames.size());
+			longNames += name + "/\n";
+		}
+		for (const string &symbol : members[i].Symbols) symbolNames += symbol + '\0';
+		symbolCount += members[i].Symbols.size();
+	}
+	if (longNames.size() % 2) longNames += "\n";
+	if (symbolNames.size() % 2) symbolNames += '\0';
+
+	// Member offsets depend on the size of the symbol index, which depends on the width of the offsets.
+	for (int pass = 0; pass < 2; ++pass) {
+		unsigned width = sym64 ? 8 : 4;
+		symbolTableSize = symbolCount ? (long long) (width + symbolCount * width + symbolNames.size()) : 0;
+		offset = 8;
+		if (symbolCount) offset += 60 + symbolTableSize;
+		if (!longNames.empty()) offset += 60 + (long long) longNames.size();
+		for (size_t i = 0; i < members.size(); ++i) {
+			layout.Offsets[i] = offset;
+			offset += 60;
+			if (!thin) offset += members[i].Stamp.Size + members[i].Stamp.Size % 2;
+		}
+		if (sym64 || offset <= 0xffffffffLL) break;
+		sym64 = true;
+	}
+	layout.Size = offset;
+
+	layout.Head = thin ? "!<thin>\n" : "!<arch>\n";
+	if (symbolCount) {
+		unsigned width = sym64 ? 8 : 4;
+		string index;
+		auto appendBigEndian = [&index, width](unsigned long long value) {
+			for (unsigned i = 0; i < width; ++i) index += (char) (value >> (8 * (width - 1 - i)));
+		};
+
+		appendBigEndian(symbolCount);
+		for (size_t i = 0; i < members.size(); ++i) {
+			for (size_t j = 0; j < members[i].Symbols.size(); ++j) appendBigEndian((unsigned long long) layout.Offsets[i]);
+		}
+		layout.Head += ArchiveMemberHeader(sym64 ? "/SYM64/" : "/", 0, "0", symbolTableSize);
+		layout.Head += index + symbolNames;
+	}
+	if (!longNames.empty()) {
+		layout.Head += ArchiveMemberHeader("//", 0, "0", (long long) longNames.size());
+		layout.Head += longNames;
+	}
+
+	return layout;
+}
+
+// Writes the members of `layout` from the `first` one onward, at the current position of `fd`.
+static void WriteArchiveMembers(int fd, const string &path, const vector<ArchiveMember> &members, const ArchiveLayout &layout,
+	size_t first, bool thin, bool deterministic) {
+	for (size_t i = first; i < members.size(); ++i) {
+		const ArchiveMember &member = members[i];
+		string header = ArchiveMemberHeader(layout.Names[i], deterministic ? 0 : member.Stamp.MTimeNsec / 1000000000LL, "100644", member.Stamp.Size);
+
+		WriteAll(fd, header.data(), header.size(), path);
+		if (thin) continue;
+		AppendFile(fd, member.Path, member.Stamp.Size, path);
+		if (member.Stamp.Size % 2) WriteAll(fd, "\n", 1, path);
+	}
+}
+
+// Updates the archive at `path`, which holds `previous` as `WriteArchive()` wrote it, to hold `members`,
+// keeping the leading members that did not change. That needs the head to keep its size, so that they stay
+// where they are; returns false, leaving the archive untouched, if it does not or no member would be kept.
+static bool UpdateArchive(const string &path, const vector<ArchiveMember> &members, const ArchiveLayout &layout,
+	const vector<ArchiveMember> &previous, bool thin, bool deterministic) {
+	size_t keep = 0;
+	struct stat st;
+	int fd = -1;
+
+	while (keep < members.size() && keep < previous.size() && members[keep].Path == previous[keep].Path
+		&& members[keep].Stamp == previous[keep].Stamp) {
+		++keep;
+	}
+	if (keep == 0 || LayOutArchive(path, previous, thin).Head.size() != layout.Head.size()) return false;
+
+	fd = open(path.c_str(), O_WRONLY);
+	if (fd < 0) return false;
+	// Another link to the archive must keep the old content.
+	if (fstat(fd, &st) || st.st_nlink != 1) {
+		close(fd);
+		return false;
+	}
+	try {
+		WriteAll(fd, layout.Head.data(), layout.Head.size(), path);
+		if (lseek(fd, (off_t) (keep < members.size() ? layout.Offsets[keep] : layout.Size), SEEK_SET) < 0) {
+			throw runtime_error(string("unable to write file: ") + path);
+		}
+		WriteArchiveMembers(fd, path, members, layout, keep, thin, deterministic);
+		if (ftruncate(fd, (off_t) layout.Size)) throw runtime_error(string("unable to write file: ") + path);
+		if (close(fd)) {
+			fd = -1;
+			throw runtime_error(string("unable to write file: ") + path);
+		}
+	} catch (std::exception &e) {
+		// Half updated, so the next build writes it from scratch.
+		if (fd >= 0) close(fd);
+		remove(path.c_str());
+		throw;
+	}
+
+	return true;
+}
+
+// Writes a GNU archive of `members` to `path`. Members get zero timestamps if `deterministic`. If the
+// archive holds `previous`, the members it shares with them up to the first change are kept in place;
+// otherwise, and on Windows, the whole archive is written to a new file.
+static void WriteArchive(const string &path, const vector<ArchiveMember> &members, const vector<ArchiveMember> &previous,
+	bool thin, bool deterministic) {
+	ArchiveLayout layout = LayOutArchive(path, members, thin);
+	string tmpPath = path + ".tmp." + std::to_string((long) getpid());
+	int fd = -1;
+
+#if !defined(WINDOWS)
+	if (!previous.empty() && UpdateArchive(path, members, layout, previous, thin, deterministic)) return;
+#endif
+
+	fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) throw runtime_error(string("unable to write file: ") + path);
+	try {
+		WriteAll(fd, layout.Head.data(), layout.Head.size(), path);
+		WriteArchiveMembers(fd, path, members, layout, 0, thin, deterministic);
+		if (close(fd)) {
+			fd = -1;
+			throw runtime_error(string("unable to write file: ") + path);
+		}
+		fd = -1;
+#if defined(WINDOWS)
+		remove(path.c_str());
+#endif
+		if (rename(tmpPath.c_str(), path.c_str())) throw runtime_error(string("unable to write file: ") + path);
+	} catch (std::exception &e) {
+		if (fd >= 0) close(fd);
+		remove(tmpPath.c_str());
+		throw;
+	}
+}
+
+bool Build::Builder::Archive(string archivePath, std::vector<string> members) {
+	bool dryRun = true, printCommand = true, thin = false, upToDate = false, external = false, plan = false, ninja = false;
+	bool deterministic = false;
+	string cacheDir, arCommand, arModifiers, removeCommand, manifestPath, changedList, memberList, command, logPath;
+	ArchiveManifest manifest, previous;
+	bool havePrevious = false;
+	FileStamp archiveStamp;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	Configure([&](Builder &b) {
+		dryRun = b.DryRun;
+		printCommand = b.PrintCommandToStdout && (b.DryRun || !b.ShowProgress);
+		plan = b.Plan;
+		thin = b.ThinArchives;
+		cacheDir = b.CacheDir;
+		arCommand = b.ARCommand;
+		removeCommand = b.RemoveCommand;
+		ninja = !b.NinjaFile.empty();
+		if (ninja) printCommand = b.PrintCommandToStdout;
+		deterministic = b.Deterministic;
+	});
+	arModifiers = string(thin ? "rcsT" : "rcs") + (deterministic ? "D" : "");
+	for (const string &member : members) memberList += " " + member;
+	// Identifies the archive's contents in the build log.
+	command = string(thin ? "archive thin" : "archive") + memberList;
+	if (ninja) {
+		StepTarget target;
+
+		// Ninja cannot run the in-process archiver, so `ARCommand` writes the whole archive.
+		target.Output = archivePath;
+		target.Inputs = members;
+		target.Program = removeCommand + " " + archivePath + " && " + arCommand + " " + arModifiers + " " + archivePath;
+		target.Command = target.Program + memberList;
+		if (printCommand) PrintCommand("NINJA", target.Command);
+		NinjaStep(target.Command, &target, target.Program, 1, vector<string>(), false);
+		return true;
+	}
+	if (plan) {
+		StepTarget target;
+
+		target.Output = archivePath;
+		target.Inputs = members;
+		target.Command = command;
+		target.SkipsItself = true;
+		return PlanStep("archive " + archivePath + memberList, &target);
+	}
+	if (dryRun) {
+		if (printCommand) PrintCommand("DRYRUN", "archive " + archivePath + memberList);
+		return true;
+	}
+
+	if (!cacheDir.empty()) {
+		logPath = BuildLogPath();
+		// Separate for deterministic archives, so that switching rewrites the archive.
+		manifestPath = JoinPath(JoinPath(cacheDir, "archives"), HashHex(AbsolutePath(archivePath) + (deterministic ? " D" : "")));
+		havePrevious = StatFile(archivePath, archiveStamp) && LoadArchiveManifest(manifestPath, previous)
+			&& previous.ArchiveStamp == archiveStamp && previous.Thin == thin;
+	}
+
+	manifest.Thin = thin;
+	upToDate = havePrevious && previous.Members.size() == members.size();
+	for (size_t i = 0; i < members.size(); ++i) {
+		ArchiveMember member;
+		bool changed = true;
+
+		member.Path = members[i];
+		if (!StatFile(member.Path, member.Stamp)) throw runtime_error(string("unable to stat file: ") + member.Path);
+		if (havePrevious) {
+			// Most builds keep the order of members, so look there first.
+			const ArchiveMember *old = i < previous.Members.size() && previous.Members[i].Path == member.Path ? &previous.Members[i] : NULL;
+			for (size_t j = 0; !old && j < previous.Members.size(); ++j) {
+				if (previous.Members[j].Path == member.Path) old = &previous.Members[j];
+			}
+			if (old && old->Stamp == member.Stamp) {
+				member.Symbols = old->Symbols;
+				changed = false;
+			}
+			if (i >= previous.Members.size() || old != &previous.Members[i]) upToDate = false;
+		}
+		if (changed) {
+			upToDate = false;
+			changedList += " " + member.Path;
+		}
+		if ((changed || previous.External) && !external) {
+			// Only the members that changed are read, unless `ARCommand` wrote the archive last time.
+			external = !ReadELFSymbols(ReadFile(member.Path), member.Symbols);
+		}
+		manifest.Members.push_back(member);
+	}
+	if (upToDate) {
+		if (!logPath.empty()) RecordBuildLog(logPath, archivePath, HashHex(command), -1);
+		return false;
+	}
+
+	if (external) {
+		// Not ELF, or LTO objects: let `ARCommand` (and its plugins) build the symbol index.
+		string arArgs = arModifiers + " " + archivePath + memberList;
+
+		remove(archivePath.c_str());
+		if (ExecTool(arCommand, arArgs).ExitCode) throw runtime_error("command failed: " + arCommand + " " + arArgs);
+		for (ArchiveMember &member : manifest.Members) member.Symbols.clear();
+	} else {
+		if (printCommand) PrintCommand("ARCHIVE", archivePath + (changedList.empty() ? memberList : changedList));
+		WriteArchive(archivePath, manifest.Members, havePrevious && !previous.External ? previous.Members : vector<ArchiveMember>(),
+			thin, deterministic);
+	}
+
+	if (!logPath.empty()) {
+		RecordBuildLog(logPath, archivePath, HashHex(command),
+			(long long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+	manifest.External = external;
+	if (!manifestPath.empty() && StatFile(archivePath, manifest.ArchiveStamp)) {
+		SaveArchiveManifest(manifestPath, manifest);
+	}
+
+	return true;
+}
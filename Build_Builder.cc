@@ -1,24 +1,47 @@
+#include <atomic>
+#include <chrono>
 #include <cstdarg>
 #include <cstdlib>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
+#include <dirent.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "Build.h"
+#include "Build_Internal.h"
 #include "EnsureOSMacro.h"
 
 #if defined(WINDOWS)
+#include <process.h>
 #include <windows.h>
 #elif defined(MACOS) || defined(LINUX) || defined(UNIX)
 #include <locale.h>
+#include <sys/wait.h>
 #endif
 
 using std::cout;
 using std::string;
 using std::runtime_error;
+using Build::ExecResult;
+
+// The last command each Builder executed on this thread, by `Builder::ExecCommandKey`.
+struct ThreadExecCommands : std::map<unsigned long long, string> {
+	~ThreadExecCommands();
+};
+static thread_local bool threadExecCommandsDestroyed = false;
+static thread_local ThreadExecCommands threadExecCommands;
+
+ThreadExecCommands::~ThreadExecCommands() {
+	// Builders destroyed later, e.g. static ones, must not touch it.
+	threadExecCommandsDestroyed = true;
+}
 
 #if defined(WINDOWS)
 int vasprintf(char **out, const char *fmt, va_list args) {
@@ -77,6 +100,13 @@ cleanUp:
 }
 #endif
 
+// Returns the value of the environment variable `name`, or 0 if it is not set or not a number.
+static unsigned EnvUnsigned(const char *name) {
+	const char *value = getenv(name);
+
+	return value ? (unsigned) strtoul(value, NULL, 10) : 0;
+}
+
 Build::Builder::Builder(bool dryRun, bool printCommandToStdout) :
 DryRun(dryRun),
 PrintCommandToStdout(printCommandToStdout) {
@@ -84,6 +114,24 @@ PrintCommandToStdout(printCommandToStdout) {
 	CXXCommand = "g++";
 	ARCommand = "ar";
 	LDCommand = "ld";
+	Jobs = std::thread::hardware_concurrency();
+	if (Jobs < 1) Jobs = 1;
+	CompileBatchSize = 16;
+	GlobIgnorePatterns.push_back(".git");
+	CacheDir = ".libBuild";
+	ThinArchives = false;
+	RemoteJobs = 0;
+	CacheOutputs = false;
+	RemoteCacheUpload = true;
+	LTOJobs = 0;
+	LTOCacheSize = 1ULL << 30;
+	SkipUpToDate = false;
+	Plan = false;
+	Deterministic = false;
+	ShowProgress = false;
+	CacheTestResults = false;
+	TestShardCount = EnvUnsigned("TEST_TOTAL_SHARDS");
+	TestShardIndex = EnvUnsigned("TEST_SHARD_INDEX");
 	if (IsWindows()) {
 		MoveCommand = "move";
 		CopyCommand = "copy";
@@ -120,6 +168,30 @@ enum BStatusCode_ Build::Builder::ExceptionToStatusCode(std::exception &e) {
 		return B_Mem;
 	} else if (msg.rfind("unable to stat file: ") == 0) {
 		return B_StatFailed;
+	} else if (msg.rfind("invalid glob pattern: ") == 0) {
+		return B_InvalidGlobPattern;
+	} else if (msg.rfind("command failed: ") == 0 || msg.rfind("dependency failed: ") == 0) {
+		return B_CommandFailed;
+	} else if (msg.rfind("unable to read file: ") == 0) {
+		return B_ReadFailed;
+	} else if (msg.rfind("unable to write file: ") == 0 || msg.rfind("unable to create directory: ") == 0) {
+		return B_WriteFailed;
+	} else if (msg.rfind("unable to probe toolchain: ") == 0) {
+		return B_ToolchainProbeFailed;
+	} else if (msg.rfind("unable to listen on: ") == 0 || msg.rfind("unable to connect to worker: ") == 0
+		|| msg.rfind("invalid worker address: ") == 0) {
+		return B_WorkerFailed;
+	} else if (msg.rfind("invalid remote cache URL: ") == 0) {
+		return B_RemoteCacheFailed;
+	} else if (msg.rfind("unable to rebuild build program: ") == 0) {
+		return B_CommandFailed;
+	} else if (msg.rfind("unable to re-execute build program: ") == 0) {
+		return B_InvokeFailed;
+	} else if (msg.rfind("unable to scan modules: ") == 0 || msg.rfind("missing module: ") == 0
+		|| msg.rfind("duplicate module: ") == 0 || msg.rfind("module cycle: ") == 0) {
+		return B_ModuleScanFailed;
+	} else if (msg.rfind("conflicting object path: ") == 0) {
+		return B_ObjectPathConflict;
 	} else {
 		return B_Unknown;
 	}
@@ -196,6 +268,142 @@ void Build::Builder::ChDirToProgramDir(int argc, char *argv[]) {
 	ChDir(exeDir);
 }
 
+// Set for the program re-executed by `RebuildSelfIfStale()`, so that it does not rebuild itself again, e.g. when
+// a source is dated in the future.
+static const char *rebuiltEnvName = "LIBBUILD_REBUILT_SELF";
+
+// Escapes `path` for a Make-style dependency file.
+static string EscapeDepFilePath(const string &path) {
+	string escaped;
+
+	for (char c : path) {
+		if (c == ' ' || c == '#') escaped += '\\';
+		if (c == '$') escaped += '$';
+		escaped += c;
+	}
+
+	return escaped;
+}
+
+// Rewrites the dependency file `path` of `target` with absolute paths, which stay valid from other working directories.
+static void WriteAbsoluteDepFile(const string &path, const string &target) {
+	string content = EscapeDepFilePath(target) + ":";
+
+	for (const string &input : Build::ReadDepFile(path)) content += " \\\n  " + EscapeDepFilePath(Build::AbsolutePath(input));
+	Build::WriteFileAtomic(path, content + "\n");
+}
+
+void Build::Builder::RebuildSelfIfStale(int argc, char *argv[], const std::vector<string> &sources, const string &flags) {
+	StepTarget target;
+	string exePath, newPath, reason, command;
+	bool printCommand = true;
+	int status = 0;
+
+	if (argc < 1) throw runtime_error("missing executable file path");
+	if (getenv(rebuiltEnvName)) return;
+	exePath = argv[0];
+	// Found through `PATH`, so where it is is unknown.
+	if (exePath.find_first_of("/\\") == string::npos) return;
+	if (IsWindows() && !FileExists(exePath)) exePath += ".exe";
+	newPath = exePath + ".new";
+
+	target.Output = exePath;
+	target.Inputs = sources;
+	target.DepFile = exePath + ".d";
+	command = CXXCommandLine() + (flags.empty() ? "" : " " + flags) + " -MMD -MF " + target.DepFile + " -o " + newPath;
+	for (const string &source : sources) command += " " + source;
+	target.Command = command;
+	reason = OutOfDateReason(target, string(), NULL);
+	if (reason.empty()) return;
+
+	Configure([&printCommand](Builder &b) { printCommand = b.PrintCommandToStdout; });
+	if (printCommand) PrintCommand("REBUILD", exePath + ": " + reason);
+	status = RunShell(command);
+#if defined(WINDOWS)
+	if (status) throw runtime_error("unable to rebuild build program: " + command);
+	// A running executable may be renamed, but not replaced.
+	remove((exePath + ".old").c_str());
+	if (rename(exePath.c_str(), (exePath + ".old").c_str()) || rename(newPath.c_str(), exePath.c_str())) {
+		throw runtime_error("unable to rebuild build program: " + exePath);
+	}
+	WriteAbsoluteDepFile(target.DepFile, exePath);
+	_putenv((string(rebuiltEnvName) + "=1").c_str());
+	fflush(stdout);
+	_execv(exePath.c_str(), argv);
+#else
+	if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) throw runtime_error("unable to rebuild build program: " + command);
+	WriteAbsoluteDepFile(target.DepFile, exePath);
+	if (rename(newPath.c_str(), exePath.c_str())) throw runtime_error("unable to rebuild build program: " + exePath);
+	setenv(rebuiltEnvName, "1", 1);
+	fflush(stdout);
+	execv(exePath.c_str(), argv);
+#endif
+	throw runtime_error("unable to re-execute build program: " + exePath);
+}
+
+// Adds the `Sha256Hex()` of the files under `dir`, by path relative to `root`, to `hashes`, skipping the
+// directory `skip` (absolute).
+static void HashFilesUnder(const string &root, const string &dir, const string &skip, std::map<string, string> &hashes) {
+	DIR *d = opendir(dir.c_str());
+	struct dirent *entry = NULL;
+	std::vector<string> names;
+
+	if (!d) throw runtime_error(string("unable to read file: ") + dir);
+	while ((entry = readdir(d))) {
+		string name = entry->d_name;
+
+		if (name != "." && name != "..") names.push_back(name);
+	}
+	closedir(d);
+
+	for (const string &name : names) {
+		string path = Build::JoinPath(dir, name);
+		struct stat sb;
+
+		if (stat(path.c_str(), &sb)) continue;
+		if (S_ISDIR(sb.st_mode)) {
+			if (Build::AbsolutePath(path) != skip) HashFilesUnder(root, path, skip, hashes);
+		} else {
+			hashes[Build::RelativePath(path, root)] = Build::Sha256Hex(Build::ReadFile(path));
+		}
+	}
+}
+
+std::vector<string> Build::Builder::VerifyReproducible(std::function<void(Builder &)> build) {
+	Builder copy;
+	std::map<string, string> first, second;
+	std::vector<string> differing;
+	string outputDir, cacheDir;
+
+	Configure([&copy](Builder &b) { copy = b; });
+	copy.LastExecCommand.clear();
+	copy.Deterministic = true;
+	// Both builds run every step.
+	copy.SkipUpToDate = false;
+	copy.CacheOutputs = false;
+	outputDir = copy.OutputDir.empty() ? "." : copy.OutputDir;
+	cacheDir = copy.CacheDir.empty() ? string() : AbsolutePath(copy.CacheDir);
+
+	build(copy);
+	if (copy.DryRun || copy.Plan || !copy.NinjaFile.empty()) return differing;
+	HashFilesUnder(outputDir, outputDir, cacheDir, first);
+	// So that outputs embedding the time differ.
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	build(copy);
+	HashFilesUnder(outputDir, outputDir, cacheDir, second);
+
+	for (const auto &kv : first) {
+		auto it = second.find(kv.first);
+
+		if (it == second.end() || it->second != kv.second) differing.push_back(kv.first);
+	}
+	for (const auto &kv : second) {
+		if (!first.count(kv.first)) differing.push_back(kv.first);
+	}
+
+	return differing;
+}
+
 string Build::Builder::GetCurrentWorkingDir() {
 	string cwd;
 	char *cCwd = NULL;
@@ -212,31 +420,83 @@ cleanUp:
 	return cwd;
 }
 
-void Build::Builder::ExecRaw(string cmdExpr) {
-	int ret = 0;
+void Build::Builder::RecordCommand(const string &cmdExpr, bool &dryRun, bool &printCommand, bool &plan, bool &progress, bool &ninja) {
+	std::lock_guard<std::mutex> lock(Mutex);
 
+	dryRun = DryRun;
+	printCommand = PrintCommandToStdout;
+	plan = Plan;
+	progress = ShowProgress;
+	ninja = !NinjaFile.empty();
+	if (Deterministic) UseDeterministicEnvironment();
+	if (!StatsFile.empty()) SetStatsFile(StatsFile);
 	LastExecCommand = cmdExpr;
-	if (PrintCommandToStdout) {
-		if (DryRun)
-			cout << "[DRYRUN] " << cmdExpr << "\n";
-		else
-			cout << "[INVOKE] " << cmdExpr << "\n";
-	}
-	if (!DryRun) {
-		ret = system(cmdExpr.c_str());
+	threadExecCommands[LastExecCommandKey.Value] = cmdExpr;
+}
+
+ExecResult Build::Builder::ExecRaw(string cmdExpr) {
+	return ExecTool(string(), cmdExpr);
+}
+
+ExecResult Build::Builder::ExecTool(const string &program, const string &args) {
+	string cmdExpr = program.empty() ? args : program + " " + args;
+	int ret = 0;
+	unsigned progressId = 0;
+	bool dryRun = true, printCommand = true, plan = false, progress = false, ninja = false;
+	ExecResult result;
+	string logPath, output;
+	std::chrono::steady_clock::time_point start;
+
+	RecordCommand(cmdExpr, dryRun, printCommand, plan, progress, ninja);
+	result.Command = cmdExpr;
+	if (ninja) {
+		if (printCommand) PrintCommand("NINJA", cmdExpr);
+		// Later steps ran after it, as it blocked until it finished.
+		NinjaStep(cmdExpr, NULL, program, 1, std::vector<string>(), true);
+		return result;
+	}
+	if (plan) {
+		PlanStep(cmdExpr, NULL);
+		return result;
+	}
+	if (printCommand && (dryRun || !progress)) {
+		PrintCommand(dryRun ? "DRYRUN" : "INVOKE", cmdExpr);
+	}
+	if (!dryRun) {
+		logPath = BuildLogPath();
+		start = std::chrono::steady_clock::now();
+		if (progress) {
+			ProgressQueued();
+			progressId = ProgressStarted(cmdExpr);
+			ret = RunShellCapture(ResponseFileCommand(program, args, ResponseFileDir()), output, &result.Usage);
+			ProgressFinished(progressId, ret == -1 || ret == 127 || ExitCodeOfStatus(ret), cmdExpr, output);
+		} else {
+			ret = RunShell(ResponseFileCommand(program, args, ResponseFileDir()), &result.Usage);
+		}
 		switch (ret) {
 		case -1:
 			throw runtime_error("invocation error");
 		case 127:
 			throw runtime_error("shell invocation error");
 		}
+#if defined(WINDOWS)
+		result.ExitCode = ret;
+#else
+		result.ExitCode = WIFEXITED(ret) ? WEXITSTATUS(ret) : -1;
+#endif
+		if (!result.ExitCode && !logPath.empty()) {
+			string hash = HashHex(cmdExpr);
+			RecordBuildLog(logPath, "#" + hash, hash, (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - start).count(), result.Usage, string(), 0, cmdExpr);
+		}
 	}
+
+	return result;
 }
 
-void Build::Builder::ExecCommandFV(string cmd, string fmt, va_list args) {
+string Build::Builder::FormatCommandFV(string cmd, string fmt, va_list args) {
 	char *parameters = NULL;
 	string params;
-	string fullCmd;
 
 	if (vasprintf(&parameters, fmt.c_str(), args) == -1) {
 		throw runtime_error("unable to allocate memory");
@@ -245,134 +505,230 @@ void Build::Builder::ExecCommandFV(string cmd, string fmt, va_list args) {
 	if (parameters) { free((void *) parameters); parameters = NULL; }
 
 	if (cmd == "") {
-		fullCmd = params;
+		return params;
 	} else {
-		fullCmd = cmd + " " + params;
+		return cmd + " " + params;
 	}
+}
+
+ExecResult Build::Builder::ExecCommandFV(string cmd, string fmt, va_list args) {
+	return ExecTool(cmd, FormatCommandFV(string(), fmt, args));
+}
+
+string Build::Builder::ResponseFileDir() {
+	string cacheDir = ConfigValue(CacheDir);
+	const char *tmpDir = getenv("TMPDIR");
 
-	ExecRaw(fullCmd);
+	if (!cacheDir.empty()) return JoinPath(cacheDir, "rsp");
+#if defined(WINDOWS)
+	if (!tmpDir) tmpDir = getenv("TEMP");
+	return tmpDir ? string(tmpDir) : string(".");
+#else
+	return tmpDir ? string(tmpDir) : string("/tmp");
+#endif
 }
 
-void Build::Builder::CC(string fmt, ...) {
+void Build::Builder::Configure(std::function<void(Builder &)> fn) {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	fn(*this);
+}
+
+string Build::Builder::ConfigValue(const string &value) {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	return value;
+}
+
+string Build::Builder::GetLastExecCommand() {
+	auto it = threadExecCommands.find(LastExecCommandKey.Value);
+
+	if (it == threadExecCommands.end()) return string();
+	return it->second;
+}
+
+Build::Builder::ExecCommandKey::ExecCommandKey() {
+	static std::atomic<unsigned long long> nextValue(1);
+
+	Value = nextValue++;
+}
+
+Build::Builder::ExecCommandKey::~ExecCommandKey() {
+	// Other threads drop theirs when they exit.
+	if (!threadExecCommandsDestroyed) threadExecCommands.erase(Value);
+}
+
+// Flags of `Builder::Deterministic` for `toolchain`, mapping `sourceDir` to `.`.
+static string DeterministicFlags(const Build::ToolchainInfo &toolchain, const string &sourceDir) {
+	string root = Build::AbsolutePath(sourceDir.empty() ? "." : sourceDir);
+
+	if (root.find_first_of(" \t\"'") != string::npos) root = "\"" + root + "\"";
+	// `-ffile-prefix-map` covers `__FILE__` too, not only the debug information.
+	if (toolchain.Supports("file-prefix-map")) return " -ffile-prefix-map=" + root + "=.";
+	return " -fdebug-prefix-map=" + root + "=.";
+}
+
+string Build::Builder::CCCommandLine() {
+	string commandLine, sourceDir;
+	bool deterministic = false;
+
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		commandLine = CLanguageStandard != string() ? CCCommand + string(" -std=") + CLanguageStandard : CCCommand;
+		sourceDir = SourceDir;
+		deterministic = Deterministic;
+	}
+	if (deterministic) commandLine += DeterministicFlags(ProbeCC(), sourceDir);
+	return commandLine;
+}
+
+string Build::Builder::CXXCommandLine() {
+	string commandLine, sourceDir;
+	bool deterministic = false;
+
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		commandLine = CXXLanguageStandard != string() ? CXXCommand + string(" -std=") + CXXLanguageStandard : CXXCommand;
+		sourceDir = SourceDir;
+		deterministic = Deterministic;
+	}
+	if (deterministic) commandLine += DeterministicFlags(ProbeCXX(), sourceDir);
+	return commandLine;
+}
+
+ExecResult Build::Builder::CC(string fmt, ...) {
 	va_list args;
+	ExecResult result;
 
 	try {
 		va_start(args, fmt);
-		CCFV(fmt, args);
+		result = CCFV(fmt, args);
 		va_end(args);
 	} catch (std::exception &e) {
 		// Make sure to end var args.
 		va_end(args);
 		throw;
 	}
-}
-
-void Build::Builder::CCFV(string fmt, va_list args) {
-	string cmd = CCCommand;
 
-	if (CLanguageStandard != string()) cmd = CCCommand + string(" -std=") + CLanguageStandard;
+	return result;
+}
 
-	ExecCommandFV(cmd, fmt, args);
+ExecResult Build::Builder::CCFV(string fmt, va_list args) {
+	return ExecCommandFV(CCCommandLine(), fmt, args);
 }
 
-void Build::Builder::CXX(string fmt, ...) {
+ExecResult Build::Builder::CXX(string fmt, ...) {
 	va_list args;
+	ExecResult result;
 
 	try {
 		va_start(args, fmt);
-		CXXFV(fmt, args);
+		result = CXXFV(fmt, args);
 		va_end(args);
 	} catch (std::exception &e) {
 		// Make sure to end var args.
 		va_end(args);
 		throw;
 	}
-}
-
-void Build::Builder::CXXFV(string fmt, va_list args) {
-	string cmd = CXXCommand;
 
-	if (CXXLanguageStandard != string()) cmd = CXXCommand + string(" -std=") + CXXLanguageStandard;
+	return result;
+}
 
-	ExecCommandFV(cmd, fmt, args);
+ExecResult Build::Builder::CXXFV(string fmt, va_list args) {
+	return ExecCommandFV(CXXCommandLine(), fmt, args);
 }
 
-void Build::Builder::AR(string fmt, ...) {
+ExecResult Build::Builder::AR(string fmt, ...) {
 	va_list args;
+	ExecResult result;
 
 	try {
 		va_start(args, fmt);
-		ARFV(fmt, args);
+		result = ARFV(fmt, args);
 		va_end(args);
 	} catch (std::exception &e) {
 		// Make sure to end var args.
 		va_end(args);
 		throw;
 	}
+
+	return result;
 }
 
-void Build::Builder::ARFV(string fmt, va_list args) {
-	ExecCommandFV(ARCommand, fmt, args);
+ExecResult Build::Builder::ARFV(string fmt, va_list args) {
+	return ExecCommandFV(ConfigValue(ARCommand), fmt, args);
 }
 
-void Build::Builder::LD(string fmt, ...) {
+ExecResult Build::Builder::LD(string fmt, ...) {
 	va_list args;
+	ExecResult result;
 
 	try {
 		va_start(args, fmt);
-		LDFV(fmt, args);
+		result = LDFV(fmt, args);
 		va_end(args);
 	} catch (std::exception &e) {
 		// Make sure to end var args.
 		va_end(args);
 		throw;
 	}
+
+	return result;
 }
 
-void Build::Builder::LDFV(string fmt, va_list args) {
-	ExecCommandFV(LDCommand, fmt, args);
+ExecResult Build::Builder::LDFV(string fmt, va_list args) {
+	return ExecCommandFV(ConfigValue(LDCommand), fmt, args);
 }
 
-void Build::Builder::Exec(string fmt, ...) {
+ExecResult Build::Builder::Exec(string fmt, ...) {
 	va_list args;
+	ExecResult result;
 
 	try {
 		va_start(args, fmt);
-		ExecFV(fmt, args);
+		result = ExecFV(fmt, args);
 		va_end(args);
 	} catch (std::exception &e) {
 		// Make sure to end var args.
 		va_end(args);
 		throw;
 	}
+
+	return result;
 }
 
-void Build::Builder::ExecFV(string fmt, va_list args) {
-	ExecCommandFV(string(), fmt, args);
+ExecResult Build::Builder::ExecFV(string fmt, va_list args) {
+	return ExecCommandFV(string(), fmt, args);
 }
 
-void Build::Builder::Move(string src, string dest) {
+ExecResult Build::Builder::Move(string src, string dest) {
 	string fullCmd =
-		MoveCommand +
+		ConfigValue(MoveCommand) +
 		string(" \"") + src + string("\" \"") + dest + string("\"");
 
-	ExecRaw(fullCmd);
+	return ExecRaw(fullCmd);
 }
 
-void Build::Builder::Copy(string src, string dest) {
+ExecResult Build::Builder::Copy(string src, string dest) {
 	string fullCmd =
-		CopyCommand +
+		ConfigValue(CopyCommand) +
 		string(" \"") + src + string("\" \"") + dest + string("\"");
+	ExecResult result = ExecRaw(fullCmd);
+	bool ran = false;
+	FileStamp stamp;
 
-	ExecRaw(fullCmd);
+	Configure([&ran](Builder &b) { ran = !b.DryRun && !b.Plan; });
+	if (ran && !result.ExitCode && FileExists(src) && StatFile(src, stamp)) Counters.BytesCopied += (unsigned long long) stamp.Size;
+
+	return result;
 }
 
-void Build::Builder::Remove(string path) {
+ExecResult Build::Builder::Remove(string path) {
 	string fullCmd =
-		RemoveCommand +
+		ConfigValue(RemoveCommand) +
 		string(" \"") + path + string("\"");
 
-	ExecRaw(fullCmd);
+	return ExecRaw(fullCmd);
 }
 
 string Build::Builder::ExecutableFileName(string exeName) {
@@ -385,9 +741,82 @@ string Build::Builder::ExecutableFileName(string exeName) {
 	return outName;
 }
 
+// Maps `path` to a path relative to `sourceDir`, that stays inside the output directory when joined to it.
+static string OutputRelativePath(string path, const string &sourceDir) {
+	string relative, component;
+	size_t start = 0;
+
+	for (char &c : path) {
+		if (c == '\\') c = '/';
+	}
+	if (!sourceDir.empty() && sourceDir != ".") {
+		string dir = sourceDir[sourceDir.size() - 1] == '/' ? sourceDir : sourceDir + "/";
+		if (path.rfind(dir, 0) == 0) path = path.substr(dir.size());
+	}
+
+	while (start <= path.size()) {
+		size_t slash = path.find('/', start);
+		if (slash == string::npos) slash = path.size();
+		component = path.substr(start, slash - start);
+		start = slash + 1;
+		if (component.empty() || component == ".") continue;
+		if (component == "..") component = "__";
+		// Drive letters of absolute Windows paths.
+		if (component.size() == 2 && component[1] == ':') component = component.substr(0, 1);
+		relative += (relative.empty() ? "" : "/") + component;
+	}
+
+	return relative;
+}
+
+string Build::Builder::OutputPath(const string &relativePath) {
+	string outputDir, path;
+	bool dryRun = true;
+
+	Configure([&outputDir, &dryRun](Builder &b) {
+		outputDir = b.OutputDir;
+		dryRun = b.DryRun;
+	});
+	path = JoinPath(outputDir, relativePath);
+	if (!dryRun) MakeDirs(DirName(path));
+
+	return path;
+}
+
+string Build::Builder::ObjectPath(string source) {
+	string relative = OutputRelativePath(source, ConfigValue(SourceDir)), object = relative;
+	size_t dot = relative.rfind('.');
+
+	if (dot != string::npos && relative.find('/', dot) == string::npos) object.resize(dot);
+	object = OutputPath(object + ".o");
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		const string &previous = ObjectSources.insert(std::make_pair(object, relative)).first->second;
+
+		if (previous != relative) throw runtime_error("conflicting object path: " + object + " for " + previous + " and " + relative);
+	}
+
+	return object;
+}
+
+string Build::Builder::ArchivePath(string libName) {
+	return OutputPath("lib" + libName + ".a");
+}
+
+string Build::Builder::SharedLibraryPath(string libName) {
+	if (IsWindows()) return OutputPath("lib" + libName + ".dll");
+	if (IsMacOS()) return OutputPath("lib" + libName + ".dylib");
+	return OutputPath("lib" + libName + ".so");
+}
+
+string Build::Builder::ExecutablePath(string exeName) {
+	return OutputPath(ExecutableFileName(exeName));
+}
+
 bool Build::Builder::FileExists(string path) {
 	struct stat sb = { 0 };
 
+	++Counters.StatCalls;
 	if (stat(path.c_str(), &sb)) {
 		if (errno == ENOENT) {
 			return false;
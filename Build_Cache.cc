@@ -0,0 +1,628 @@
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::ExecResult;
+using Build::OutputCache;
+
+// Action keys change whenever the way they are computed does.
+static const char compileKeyVersion[] = "libBuild-compile 1";
+static const char linkKeyVersion[] = "libBuild-link 2";
+// Seconds the remote cache is left alone after it could not be reached, so that a cache that is
+// down costs one timeout rather than one per step.
+static const int remoteCacheRetryDelay = 30;
+static const int remoteCacheTimeout = 10;
+
+static std::atomic<long long> remoteCacheRetryAt(0);
+
+// One output file of a cached action.
+struct CachedOutput {
+	string Path;
+	string Content;
+	bool Executable = false;
+};
+
+// Contents of an `/ac/` entry: the fields of a Remote Execution API `ActionResult` that we use.
+struct CachedAction {
+	struct Output {
+		string Path;
+		string Hash;
+		long long Size = 0;
+		bool Executable = false;
+	};
+
+	vector<Output> Outputs;
+	int ExitCode = 0;
+	string Diagnostics;
+};
+
+static void AppendVarint(string &message, unsigned long long value) {
+	while (value >= 0x80) {
+		message += (char) (value | 0x80);
+		value >>= 7;
+	}
+	message += (char) value;
+}
+
+static void AppendBytesField(string &message, int field, const string &bytes) {
+	AppendVarint(message, (unsigned long long) field << 3 | 2);
+	AppendVarint(message, bytes.size());
+	message += bytes;
+}
+
+static void AppendVarintField(string &message, int field, unsigned long long value) {
+	AppendVarint(message, (unsigned long long) field << 3);
+	AppendVarint(message, value);
+}
+
+// Reads the next field of the protobuf `message` at `pos`. Varint fields are stored in `value`,
+// length-delimited ones in `bytes`; others are skipped. Returns false at the end or on malformed input.
+static bool ReadProtoField(const string &message, size_t &pos, int &field, unsigned long long &value, string &bytes) {
+	auto readVarint = [&message, &pos](unsigned long long &out) {
+		out = 0;
+		for (int shift = 0; pos < message.size() && shift < 64; shift += 7) {
+			unsigned char byte = (unsigned char) message[pos++];
+			out |= (unsigned long long) (byte & 0x7f) << shift;
+			if (!(byte & 0x80)) return true;
+		}
+		return false;
+	};
+	unsigned long long key = 0;
+
+	if (pos >= message.size() || !readVarint(key)) return false;
+	field = (int) (key >> 3);
+	switch (key & 7) {
+	case 0:
+		return readVarint(value);
+	case 1:
+		pos += 8;
+		return pos <= message.size();
+	case 2:
+		if (!readVarint(value) || value > message.size() - pos) return false;
+		bytes = message.substr(pos, value);
+		pos += value;
+		return true;
+	case 5:
+		pos += 4;
+		return pos <= message.size();
+	default:
+		return false;
+	}
+}
+
+// ActionResult { repeated OutputFile output_files = 2; int32 exit_code = 4; bytes stderr_raw = 7; }
+// OutputFile { string path = 1; Digest digest = 2; bool is_executable = 4; }
+// Digest { string hash = 1; int64 size_bytes = 2; }
+static string EncodeAction(const CachedAction &action) {
+	string message;
+
+	for (const CachedAction::Output &output : action.Outputs) {
+		string file, digest;
+
+		AppendBytesField(digest, 1, output.Hash);
+		AppendVarintField(digest, 2, (unsigned long long) output.Size);
+		AppendBytesField(file, 1, output.Path);
+		AppendBytesField(file, 2, digest);
+		if (output.Executable) AppendVarintField(file, 4, 1);
+		AppendBytesField(message, 2, file);
+	}
+	if (action.ExitCode) AppendVarintField(message, 4, (unsigned long long) (long long) action.ExitCode);
+	if (!action.Diagnostics.empty()) AppendBytesField(message, 7, action.Diagnostics);
+
+	return message;
+}
+
+static bool DecodeAction(const string &message, CachedAction &action) {
+	size_t pos = 0;
+	int field = 0;
+	unsigned long long value = 0;
+	string bytes;
+
+	action = CachedAction();
+	while (pos < message.size()) {
+		if (!ReadProtoField(message, pos, field, value, bytes)) return false;
+		if (field == 2) {
+			CachedAction::Output output;
+			size_t filePos = 0;
+			string file = bytes;
+
+			while (filePos < file.size()) {
+				if (!ReadProtoField(file, filePos, field, value, bytes)) return false;
+				if (field == 1) {
+					output.Path = bytes;
+				} else if (field == 2) {
+					size_t digestPos = 0;
+					string digest = bytes;
+
+					while (digestPos < digest.size()) {
+						if (!ReadProtoField(digest, digestPos, field, value, bytes)) return false;
+						if (field == 1) output.Hash = bytes;
+						else if (field == 2) output.Size = (long long) value;
+					}
+				} else if (field == 4) {
+					output.Executable = value != 0;
+				}
+			}
+			action.Outputs.push_back(output);
+		} else if (field == 4) {
+			action.ExitCode = (int) value;
+		} else if (field == 7) {
+			action.Diagnostics = bytes;
+		}
+	}
+
+	return true;
+}
+
+// Splits `url` (`http://<host>[:<port>][/<prefix>]`) into an address for `OpenSocket()` and a path prefix.
+static void ParseCacheURL(const string &url, string &host, string &address, string &prefix) {
+	string rest;
+	size_t slash = 0;
+
+	if (url.rfind("http://", 0) != 0 || url.size() == 7) throw runtime_error(string("invalid remote cache URL: ") + url);
+	rest = url.substr(7);
+	slash = rest.find('/');
+	host = rest.substr(0, slash);
+	prefix = slash == string::npos ? string() : rest.substr(slash);
+	while (!prefix.empty() && prefix[prefix.size() - 1] == '/') prefix.erase(prefix.size() - 1);
+	address = host;
+	if (host.empty() || host[host.size() - 1] == ']' || host.find(':') == string::npos) address += ":80";
+}
+
+static void CheckCacheURL(const string &url) {
+	string host, address, prefix;
+
+	if (!url.empty()) ParseCacheURL(url, host, address, prefix);
+}
+
+static long long SteadySeconds() {
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sends one request to the HTTP cache at `url`, and returns the status code with the body in
+// `response`, or 0 if the cache could not be reached.
+static int HttpRequest(const string &method, const string &url, const string &path, const string &body, string &response) {
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+	string host, address, prefix, request, reply, headers;
+	struct timeval timeout;
+	char buf[65536];
+	size_t headerEnd = 0, lineEnd = 0;
+	int fd = -1, status = 0;
+
+	ParseCacheURL(url, host, address, prefix);
+	if (SteadySeconds() < remoteCacheRetryAt) return 0;
+	try {
+		fd = Build::OpenSocket(address, false);
+	} catch (std::exception &e) {
+		remoteCacheRetryAt = SteadySeconds() + remoteCacheRetryDelay;
+		return 0;
+	}
+	timeout.tv_sec = remoteCacheTimeout;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	request = method + " " + prefix + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n";
+	if (method == "PUT") {
+		request += "Content-Type: application/octet-stream\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+	}
+	request += "\r\n";
+	try {
+		Build::SendAll(fd, request.data(), request.size());
+		Build::SendAll(fd, body.data(), body.size());
+	} catch (std::exception &e) {
+		close(fd);
+		remoteCacheRetryAt = SteadySeconds() + remoteCacheRetryDelay;
+		return 0;
+	}
+	for (;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			close(fd);
+			remoteCacheRetryAt = SteadySeconds() + remoteCacheRetryDelay;
+			return 0;
+		}
+		if (n == 0) break;
+		reply.append(buf, (size_t) n);
+	}
+	close(fd);
+
+	headerEnd = reply.find("\r\n\r\n");
+	if (headerEnd == string::npos || reply.rfind("HTTP/1.", 0) != 0) return 0;
+	status = atoi(reply.c_str() + reply.find(' ') + 1);
+	headers = reply.substr(0, headerEnd + 2);
+	response = reply.substr(headerEnd + 4);
+	for (size_t i = 0; i < headers.size(); ++i) headers[i] = (char) tolower((unsigned char) headers[i]);
+	if (headers.find("\r\ntransfer-encoding: chunked\r\n") != string::npos) {
+		string chunked = response;
+		size_t pos = 0;
+
+		response.clear();
+		while ((lineEnd = chunked.find("\r\n", pos)) != string::npos) {
+			unsigned long size = strtoul(chunked.c_str() + pos, NULL, 16);
+			if (size == 0 || lineEnd + 2 + size > chunked.size()) break;
+			response.append(chunked, lineEnd + 2, size);
+			pos = lineEnd + 2 + size + 2;
+		}
+	}
+
+	return status;
+#else
+	return 0;
+#endif
+}
+
+// Reads the blob `hash` of `kind` (`ac` or `cas`) from the local cache, or from the remote cache,
+// in which case it is kept locally. CAS blobs are checked against their hash.
+static bool FetchBlob(const OutputCache &cache, const string &kind, const string &hash, string &blob) {
+	string localPath = cache.Dir.empty() ? string() : Build::JoinPath(Build::JoinPath(cache.Dir, kind), hash);
+	Build::FileStamp stamp;
+
+	if (!localPath.empty() && Build::StatFile(localPath, stamp)) {
+		try {
+			blob = Build::ReadFile(localPath);
+			if (kind != "cas" || Build::Sha256Hex(blob) == hash) return true;
+		} catch (std::exception &e) {
+			// Fall back to the remote cache.
+		}
+	}
+	if (cache.RemoteURL.empty() || HttpRequest("GET", cache.RemoteURL, "/" + kind + "/" + hash, "", blob) != 200) return false;
+	if (kind == "cas" && Build::Sha256Hex(blob) != hash) return false;
+	if (!localPath.empty()) {
+		try {
+			Build::MakeDirs(Build::JoinPath(cache.Dir, kind));
+			Build::WriteFileAtomic(localPath, blob);
+		} catch (std::exception &e) {
+			// The local cache is best-effort.
+		}
+	}
+
+	return true;
+}
+
+// Restores the outputs of the action `key` to `paths`, and returns its diagnostics in `diagnostics`.
+// Returns false on a cache miss.
+static bool RestoreOutputs(const OutputCache &cache, const string &key, const vector<string> &paths, string &diagnostics) {
+	CachedAction action;
+	vector<string> contents;
+	string message;
+
+	if (!FetchBlob(cache, "ac", key, message) || !DecodeAction(message, action) || action.ExitCode
+		|| action.Outputs.size() != paths.size()) {
+		++Build::Counters.CacheMisses;
+		return false;
+	}
+	for (const CachedAction::Output &output : action.Outputs) {
+		string content;
+
+		if (!FetchBlob(cache, "cas", output.Hash, content) || (long long) content.size() != output.Size) {
+			++Build::Counters.CacheMisses;
+			return false;
+		}
+		contents.push_back(content);
+	}
+	++Build::Counters.CacheHits;
+
+	for (size_t i = 0; i < paths.size(); ++i) {
+		Build::WriteFileAtomic(paths[i], contents[i]);
+#if !defined(WINDOWS)
+		if (action.Outputs[i].Executable) chmod(paths[i].c_str(), 0755);
+#endif
+	}
+	diagnostics = action.Diagnostics;
+
+	return true;
+}
+
+// Stores the outputs of the successful action `key` locally, and queues their upload.
+static void StoreOutputs(const OutputCache &cache, const string &key, const vector<CachedOutput> &outputs, const string &diagnostics) {
+	CachedAction action;
+	vector<string> hashes;
+	string message;
+
+	for (const CachedOutput &output : outputs) {
+		CachedAction::Output entry;
+
+		entry.Path = output.Path;
+		entry.Hash = Build::Sha256Hex(output.Content);
+		entry.Size = (long long) output.Content.size();
+		entry.Executable = output.Executable;
+		action.Outputs.push_back(entry);
+		hashes.push_back(entry.Hash);
+	}
+	action.Diagnostics = diagnostics;
+	message = EncodeAction(action);
+
+	if (!cache.Dir.empty()) {
+		try {
+			Build::MakeDirs(Build::JoinPath(cache.Dir, "cas"));
+			Build::MakeDirs(Build::JoinPath(cache.Dir, "ac"));
+			// Blobs first, so that the action never refers to missing blobs.
+			for (size_t i = 0; i < outputs.size(); ++i) {
+				Build::WriteFileAtomic(Build::JoinPath(Build::JoinPath(cache.Dir, "cas"), hashes[i]), outputs[i].Content);
+			}
+			Build::WriteFileAtomic(Build::JoinPath(Build::JoinPath(cache.Dir, "ac"), key), message);
+		} catch (std::exception &e) {
+			// The local cache is best-effort.
+		}
+	}
+
+	if (cache.Upload) {
+		string url = cache.RemoteURL;
+
+		// bazel-remote rejects actions referring to blobs it does not have, so upload those first.
+		cache.Upload([url, key, outputs, hashes, message] {
+			string response;
+
+			for (size_t i = 0; i < outputs.size(); ++i) {
+				if (HttpRequest("PUT", url, "/cas/" + hashes[i], outputs[i].Content, response) / 100 != 2) return;
+			}
+			HttpRequest("PUT", url, "/ac/" + key, message, response);
+		});
+	}
+}
+
+static void PrintDiagnostics(const string &diagnostics) {
+	Build::PrintOutput(diagnostics, stderr);
+}
+
+// Returns `flags` without those mapping path prefixes, e.g. of `Builder::Deterministic`, which name the checkout
+// while the objects they give do not depend on where it is.
+static string KeyFlags(const string &flags) {
+	static const char *prefixMaps[] = { "-ffile-prefix-map=", "-fdebug-prefix-map=", "-fmacro-prefix-map=", NULL };
+	string result;
+	size_t start = flags.find_first_not_of(" \t");
+
+	while (start != string::npos) {
+		size_t end = start;
+		bool quoted = false, skip = false;
+
+		// A quoted path may have spaces.
+		while (end < flags.size() && (quoted || (flags[end] != ' ' && flags[end] != '\t'))) {
+			if (flags[end] == '"') quoted = !quoted;
+			++end;
+		}
+		for (int i = 0; prefixMaps[i]; ++i) {
+			if (flags.compare(start, strlen(prefixMaps[i]), prefixMaps[i]) == 0) skip = true;
+		}
+		if (!skip) result += (result.empty() ? "" : " ") + flags.substr(start, end - start);
+		start = flags.find_first_not_of(" \t", end);
+	}
+
+	return result;
+}
+
+int Build::RunCompile(const CompileRequest &request, ExecResult &result) {
+	const CompileStep &step = request.Step;
+	string preprocessedPath = step.Object + (step.CXX ? ".ii" : ".i");
+	string commandFlags, preprocessed, flags, key, diagnostics, object;
+	string preprocessCommand = request.CommandLine + (step.Flags.empty() ? "" : " " + step.Flags);
+	size_t space = request.CommandLine.find(' ');
+	int exitCode = 0;
+	bool compiled = false;
+
+	if (request.CacheOutputs) CheckCacheURL(request.Cache.RemoteURL);
+
+	// The dependency file is written here, as the object may come from the cache or a worker: where the local
+	// command writes it, rather than next to the preprocessed file, and for the object.
+	if (HasFlag(preprocessCommand, "-MD") || HasFlag(preprocessCommand, "-MMD")) {
+		if (preprocessCommand.find(" -MF") == string::npos) preprocessCommand += " -MF " + request.DepFile;
+		preprocessCommand += " -MT " + step.Object;
+	}
+	// Preprocess here, so that neither the workers nor the cache key depend on headers and include paths.
+	exitCode = ExitCodeOfStatus(RunShell(preprocessCommand + " -E -o " + preprocessedPath + " " + step.Source, &result.Usage));
+	if (exitCode) {
+		remove(preprocessedPath.c_str());
+		return exitCode;
+	}
+	preprocessed = ReadFile(preprocessedPath);
+	remove(preprocessedPath.c_str());
+
+	if (space != string::npos) commandFlags = request.CommandLine.substr(space + 1);
+	flags = CompileOnlyFlags(commandFlags + " " + step.Flags);
+	if (request.CacheOutputs) {
+		key = Sha256Hex(string(compileKeyVersion) + "\n" + request.Cache.Toolchain + "\n" + (step.CXX ? "c++" : "c")
+			+ "\n" + KeyFlags(flags) + "\n" + preprocessed);
+		if (RestoreOutputs(request.Cache, key, vector<string>(1, step.Object), diagnostics)) {
+			PrintDiagnostics(diagnostics);
+			result.Cached = true;
+			return 0;
+		}
+	}
+
+	if (!request.Workers.empty()) {
+		compiled = CompileOnWorker(request.Workers, step, flags, preprocessed, exitCode, diagnostics, object);
+		if (compiled && !exitCode) WriteFileAtomic(step.Object, object);
+		// No worker could be reached; compile here.
+		if (!compiled && request.PrintCommand) PrintCommand("INVOKE", request.LocalCommand);
+	}
+	if (!compiled) {
+		// The original source rather than the preprocessed one, so that diagnostics are the usual ones.
+		if (!request.CacheOutputs) return ExitCodeOfStatus(RunShell(request.LocalCommand, &result.Usage));
+		exitCode = ExitCodeOfStatus(RunShellCapture(request.LocalCommand, diagnostics, &result.Usage));
+		if (!exitCode) object = ReadFile(step.Object);
+	}
+	PrintDiagnostics(diagnostics);
+
+	if (!exitCode && request.CacheOutputs) {
+		CachedOutput output;
+
+		output.Path = step.Object;
+		output.Content = object;
+		StoreOutputs(request.Cache, key, vector<CachedOutput>(1, output), diagnostics);
+	}
+
+	return exitCode;
+}
+
+// Last component of `path`.
+static string LinkFileName(const string &path) {
+	size_t slash = path.find_last_of("/\\");
+
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// `SOName` of `step`, or by default that of its major version.
+static string LinkSOName(const Build::LinkStep &step) {
+	if (!step.SOName.empty() || step.Version.empty()) return step.SOName;
+	return LinkFileName(step.Output) + "." + step.Version.substr(0, step.Version.find('.'));
+}
+
+string Build::LinkOutput(const LinkStep &step) {
+	return step.Shared && !step.Version.empty() ? step.Output + "." + step.Version : step.Output;
+}
+
+vector<string> Build::LinkSymlinks(const LinkStep &step) {
+	vector<string> links;
+
+#if !defined(WINDOWS)
+	if (step.Shared && !step.Version.empty()) {
+		string major = step.Output + "." + step.Version.substr(0, step.Version.find('.'));
+
+		if (major != LinkOutput(step)) links.push_back(major);
+		links.push_back(step.Output);
+	}
+#endif
+
+	return links;
+}
+
+string Build::LinkFinishCommands(const LinkStep &step, bool restored) {
+	string output = LinkOutput(step), commands, target = output;
+
+	if (step.SplitDebugInfo && !restored) {
+		commands += " && objcopy --only-keep-debug " + output + " " + output + ".debug";
+		commands += " && objcopy --strip-debug --add-gnu-debuglink=" + output + ".debug " + output;
+	}
+	// Each link refers to the next more specific name, relative to its own directory.
+	for (const string &link : LinkSymlinks(step)) {
+		commands += " && ln -sf " + LinkFileName(target) + " " + link;
+		target = link;
+	}
+
+	return commands;
+}
+
+string Build::LinkArgs(const LinkRequest &request, unsigned threads) {
+	const LinkStep &step = request.Step;
+	string args = "-o " + LinkOutput(step), soname = LinkSOName(step);
+
+	for (const string &input : step.Inputs) args += " " + input;
+	if (step.Shared) args += " -shared";
+	if (step.Shared && !soname.empty()) {
+#if defined(MACOS)
+		args += " -Wl,-install_name,@rpath/" + soname;
+#else
+		args += " -Wl,-soname," + soname;
+#endif
+	}
+	if (!step.VersionScript.empty()) args += " -Wl,--version-script=" + step.VersionScript;
+	if (!step.Flags.empty()) args += " " + step.Flags;
+	if (step.LTO) args += LTOLinkFlags(request.Toolchain, step.Flags, threads, request.LTOCacheDir);
+
+	return args;
+}
+
+string Build::LinkCommand(const LinkRequest &request, unsigned threads) {
+	return request.CommandLine + " " + LinkArgs(request, threads) + LinkFinishCommands(request.Step, false);
+}
+
+static string LinkCacheKey(const Build::LinkRequest &request) {
+	const Build::LinkStep &step = request.Step;
+	string key;
+
+	// Inputs by content, so that the key does not change when they are rebuilt identically.
+	// The LTO threads and cache do not change the output, so they are not part of the key.
+	key = string(linkKeyVersion) + "\n" + request.Cache.Toolchain + "\n" + (step.CXX ? "c++" : "c")
+		+ (step.LTO ? " lto" : "") + "\n" + step.Flags + "\n";
+	for (const string &input : step.Inputs) key += input + " " + Build::Sha256Hex(Build::ReadFile(input)) + "\n";
+	key += string(step.Shared ? "shared " + LinkSOName(step) : "executable") + (step.SplitDebugInfo ? " split-debug" : "") + "\n";
+	if (!step.VersionScript.empty()) key += "version-script " + Build::Sha256Hex(Build::ReadFile(step.VersionScript)) + "\n";
+
+	return Build::Sha256Hex(key);
+}
+
+bool Build::LinkOutputsCached(const LinkRequest &request) {
+	FileStamp stamp;
+
+	if (!request.CacheOutputs || request.Cache.Dir.empty()) return false;
+	try {
+		return StatFile(JoinPath(JoinPath(request.Cache.Dir, "ac"), LinkCacheKey(request)), stamp);
+	} catch (std::exception &e) {
+		// Inputs that do not exist yet.
+		return false;
+	}
+}
+
+int Build::RunLink(const LinkRequest &request, ExecResult &result, unsigned threads) {
+	const LinkStep &step = request.Step;
+	string command = ResponseFileCommand(request.CommandLine, LinkArgs(request, threads), request.ResponseFileDir), key, diagnostics;
+	string linked = LinkOutput(step), finish;
+	vector<string> paths(1, linked);
+	vector<CachedOutput> outputs;
+	int exitCode = 0;
+
+	if (step.SplitDebugInfo) paths.push_back(linked + ".debug");
+	if (request.CacheOutputs) {
+		CheckCacheURL(request.Cache.RemoteURL);
+		key = LinkCacheKey(request);
+		if (RestoreOutputs(request.Cache, key, paths, diagnostics)) {
+			PrintDiagnostics(diagnostics);
+			result.Cached = true;
+			finish = LinkFinishCommands(step, true);
+			return finish.empty() ? 0 : ExitCodeOfStatus(RunShell(finish.substr(4)));
+		}
+	}
+
+	if (!request.LTOCacheDir.empty()) MakeDirs(request.LTOCacheDir);
+	if (request.CacheOutputs) {
+		exitCode = ExitCodeOfStatus(RunShellCapture(command, diagnostics, &result.Usage));
+		PrintDiagnostics(diagnostics);
+	} else {
+		exitCode = ExitCodeOfStatus(RunShell(command, &result.Usage));
+	}
+	if (!request.LTOCacheDir.empty()) PruneCacheDir(request.LTOCacheDir, request.LTOCacheSize);
+	finish = LinkFinishCommands(step, false);
+	if (!exitCode && !finish.empty()) exitCode = ExitCodeOfStatus(RunShell(finish.substr(4)));
+	if (exitCode || !request.CacheOutputs) return exitCode;
+
+	for (const string &path : paths) {
+		CachedOutput output;
+
+		output.Path = path;
+		output.Content = ReadFile(path);
+#if !defined(WINDOWS)
+		{
+			struct stat sb;
+			output.Executable = !stat(path.c_str(), &sb) && (sb.st_mode & S_IXUSR);
+		}
+#endif
+		outputs.push_back(output);
+	}
+	StoreOutputs(request.Cache, key, outputs, diagnostics);
+
+	return exitCode;
+}
@@ -10,7 +10,9 @@
 #include <unistd.h>
 #include <libgen.h>
 
-thread_local enum BStatusCode_ BStatusCode;
+#include <stdexcept>
+
+BUILD_THREAD_LOCAL enum BStatusCode_ BStatusCode;
 
 using std::string;
 using Build::Builder;
@@ -19,6 +21,10 @@ struct BuildConfig {
 	Build::Builder *Builder;
 };
 
+struct BuildJob {
+	Build::Job Job;
+};
+
 const char * Build_StatusCodeMessage(BStatusCode_ code) {
 	switch (code) {
 	case B_OK:
@@ -45,6 +51,24 @@ const char * Build_StatusCodeMessage(BStatusCode_ code) {
 		return "get current working directory failed";
 	case B_MissingExecutableFilePath:
 		return "missing executable path";
+	case B_InvalidGlobPattern:
+		return "invalid glob pattern";
+	case B_CommandFailed:
+		return "command failed";
+	case B_ReadFailed:
+		return "read failed";
+	case B_WriteFailed:
+		return "write failed";
+	case B_ToolchainProbeFailed:
+		return "toolchain probe failed";
+	case B_WorkerFailed:
+		return "worker failed";
+	case B_RemoteCacheFailed:
+		return "remote cache failed";
+	case B_ModuleScanFailed:
+		return "module scan failed";
+	case B_ObjectPathConflict:
+		return "object path conflict";
 	default:
 		return "unknown status code";
 	}
@@ -174,16 +198,19 @@ int Build_SetDryRun(BuildConfig *cfg, bool dryRun) {
 		return -1;
 	}
 
-	cfg->Builder->DryRun = dryRun;
+	cfg->Builder->Configure([&](Builder &b) { b.DryRun = dryRun; });
 	return 0;
 }
 
 bool Build_GetDryRun(BuildConfig *cfg) {
+	bool dryRun = false;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return false;
 	}
 
-	return cfg->Builder->DryRun;
+	cfg->Builder->Configure([&](Builder &b) { dryRun = b.DryRun; });
+	return dryRun;
 }
 
 int Build_SetPrintCommandToStdout(BuildConfig *cfg, bool printCommandToStdout) {
@@ -191,24 +218,30 @@ int Build_SetPrintCommandToStdout(BuildConfig *cfg, bool printCommandToStdout) {
 		return -1;
 	}
 
-	cfg->Builder->PrintCommandToStdout = printCommandToStdout;
+	cfg->Builder->Configure([&](Builder &b) { b.PrintCommandToStdout = printCommandToStdout; });
 	return 0;
 }
 
 bool Build_GetPrintCommandToStdout(BuildConfig *cfg) {
+	bool printCommandToStdout = false;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return false;
 	}
 
-	return cfg->Builder->PrintCommandToStdout;
+	cfg->Builder->Configure([&](Builder &b) { printCommandToStdout = b.PrintCommandToStdout; });
+	return printCommandToStdout;
 }
 
 const char * Build_GetLastExecCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->LastExecCommand.c_str();
+	value = cfg->Builder->GetLastExecCommand();
+	return value.c_str();
 }
 
 int Build_SetCCCommand(BuildConfig *cfg, const char *cmd) {
@@ -216,16 +249,19 @@ int Build_SetCCCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->CCCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.CCCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetCCCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->CCCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.CCCommand; });
+	return value.c_str();
 }
 
 int Build_SetCLanguageStandard(BuildConfig *cfg, const char *std) {
@@ -233,16 +269,19 @@ int Build_SetCLanguageStandard(BuildConfig *cfg, const char *std) {
 		return -1;
 	}
 
-	cfg->Builder->CLanguageStandard = std;
+	cfg->Builder->Configure([&](Builder &b) { b.CLanguageStandard = std; });
 	return 0;
 }
 
 const char * Build_GetCLanguageStandard(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->CLanguageStandard.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.CLanguageStandard; });
+	return value.c_str();
 }
 
 int Build_SetCXXCommand(BuildConfig *cfg, const char *cmd) {
@@ -250,16 +289,19 @@ int Build_SetCXXCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->CXXCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.CXXCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetCXXCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->CXXCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.CXXCommand; });
+	return value.c_str();
 }
 
 int Build_SetCXXLanguageStandard(BuildConfig *cfg, const char *std) {
@@ -267,16 +309,19 @@ int Build_SetCXXLanguageStandard(BuildConfig *cfg, const char *std) {
 		return -1;
 	}
 
-	cfg->Builder->CXXLanguageStandard = std;
+	cfg->Builder->Configure([&](Builder &b) { b.CXXLanguageStandard = std; });
 	return 0;
 }
 
 const char * Build_GetCXXLanguageStandard(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->CXXLanguageStandard.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.CXXLanguageStandard; });
+	return value.c_str();
 }
 
 int Build_SetARCommand(BuildConfig *cfg, const char *cmd) {
@@ -284,16 +329,19 @@ int Build_SetARCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->ARCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.ARCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetARCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->ARCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.ARCommand; });
+	return value.c_str();
 }
 
 int Build_SetLDCommand(BuildConfig *cfg, const char *cmd) {
@@ -301,16 +349,19 @@ int Build_SetLDCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->LDCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.LDCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetLDCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->LDCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.LDCommand; });
+	return value.c_str();
 }
 
 int Build_SetMoveCommand(BuildConfig *cfg, const char *cmd) {
@@ -318,16 +369,19 @@ int Build_SetMoveCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->MoveCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.MoveCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetMoveCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->MoveCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.MoveCommand; });
+	return value.c_str();
 }
 
 int Build_SetCopyCommand(BuildConfig *cfg, const char *cmd) {
@@ -335,16 +389,19 @@ int Build_SetCopyCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->CopyCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.CopyCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetCopyCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->CopyCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.CopyCommand; });
+	return value.c_str();
 }
 
 int Build_SetRemoveCommand(BuildConfig *cfg, const char *cmd) {
@@ -352,16 +409,19 @@ int Build_SetRemoveCommand(BuildConfig *cfg, const char *cmd) {
 		return -1;
 	}
 
-	cfg->Builder->RemoveCommand = cmd;
+	cfg->Builder->Configure([&](Builder &b) { b.RemoveCommand = cmd; });
 	return 0;
 }
 
 const char * Build_GetRemoveCommand(BuildConfig *cfg) {
+	static thread_local string value;
+
 	if (!EnsureObjectProvidedOrFlagError(cfg)) {
 		return NULL;
 	}
 
-	return cfg->Builder->RemoveCommand.c_str();
+	cfg->Builder->Configure([&](Builder &b) { value = b.RemoveCommand; });
+	return value.c_str();
 }
 
 int Build_CC(BuildConfig *cfg, const char *fmt, ...) {
@@ -512,6 +572,43 @@ char * Build_ExecutableFileName(const char *exeName) {
 	return outName;
 }
 
+// Returns a copy of the path `fn` builds with the Builder of `cfg`, owned by the caller.
+static char * NewOutputPath(BuildConfig *cfg, std::function<string(Builder &)> fn) {
+	char *path = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	try {
+		if (asprintf(&path, "%s", fn(*cfg->Builder).c_str()) == -1) {
+			BStatusCode = B_Mem;
+			return NULL;
+		}
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+
+	return path;
+}
+
+char * Build_ObjectPath(BuildConfig *cfg, const char *source) {
+	return NewOutputPath(cfg, [&](Builder &b) { return b.ObjectPath(source); });
+}
+
+char * Build_ArchivePath(BuildConfig *cfg, const char *libName) {
+	return NewOutputPath(cfg, [&](Builder &b) { return b.ArchivePath(libName); });
+}
+
+char * Build_SharedLibraryPath(BuildConfig *cfg, const char *libName) {
+	return NewOutputPath(cfg, [&](Builder &b) { return b.SharedLibraryPath(libName); });
+}
+
+char * Build_ExecutablePath(BuildConfig *cfg, const char *exeName) {
+	return NewOutputPath(cfg, [&](Builder &b) { return b.ExecutablePath(exeName); });
+}
+
 bool Build_FileExists(const char *path) {
 	try {
 		return Builder::FileExists(string(path));
@@ -520,3 +617,1135 @@ bool Build_FileExists(const char *path) {
 		return false;
 	}
 }
+
+// Returns a NULL-terminated copy of `strings`, to be freed with `Build_FreeStringList()`.
+static char ** NewStringList(const std::vector<string> &strings) {
+	char **list = (char **) calloc(strings.size() + 1, sizeof(char *));
+
+	if (!list) {
+		BStatusCode = B_Mem;
+		return NULL;
+	}
+	for (size_t i = 0; i < strings.size(); ++i) {
+		if (asprintf(&list[i], "%s", strings[i].c_str()) == -1) {
+			list[i] = NULL;
+			Build_FreeStringList(list);
+			BStatusCode = B_Mem;
+			return NULL;
+		}
+	}
+
+	return list;
+}
+
+int Build_RebuildSelfIfStale(BuildConfig *cfg, int argc, char *argv[], char **sources, const char *flags) {
+	std::vector<string> paths;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	for (size_t i = 0; sources && sources[i]; ++i) paths.push_back(sources[i]);
+	try {
+		cfg->Builder->RebuildSelfIfStale(argc, argv, paths, flags ? flags : "");
+		return 0;
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+}
+
+char ** Build_Glob(BuildConfig *cfg, const char *pattern) {
+	std::vector<string> paths;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	try {
+		paths = cfg->Builder->Glob(string(pattern));
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+
+	return NewStringList(paths);
+}
+
+char ** Build_ScanIncludes(BuildConfig *cfg, const char *source, char **includeDirs) {
+	std::vector<string> dirs;
+	std::vector<string> headers;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	for (size_t i = 0; includeDirs && includeDirs[i]; ++i) dirs.push_back(includeDirs[i]);
+	try {
+		headers = cfg->Builder->ScanIncludes(std::vector<string>(1, source), dirs)[source];
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+
+	return NewStringList(headers);
+}
+
+int Build_AddGlobIgnorePattern(BuildConfig *cfg, const char *pattern) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.GlobIgnorePatterns.push_back(pattern); });
+	return 0;
+}
+
+int Build_ClearGlobIgnorePatterns(BuildConfig *cfg) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.GlobIgnorePatterns.clear(); });
+	return 0;
+}
+
+int Build_SetCacheDir(BuildConfig *cfg, const char *dir) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.CacheDir = dir; });
+	return 0;
+}
+
+const char * Build_GetCacheDir(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.CacheDir; });
+	return value.c_str();
+}
+
+void Build_FreeStringList(char **list) {
+	if (!list) return;
+
+	for (size_t i = 0; list[i]; ++i) free((void *) list[i]);
+	free((void *) list);
+}
+
+int Build_Archive(BuildConfig *cfg, const char *archivePath, char **members) {
+	std::vector<string> memberList;
+	bool written = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	for (size_t i = 0; members && members[i]; ++i) memberList.push_back(members[i]);
+	try {
+		written = cfg->Builder->Archive(string(archivePath), memberList);
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+
+	return written ? 1 : 0;
+}
+
+int Build_SetThinArchives(BuildConfig *cfg, bool thinArchives) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.ThinArchives = thinArchives; });
+	return 0;
+}
+
+bool Build_GetThinArchives(BuildConfig *cfg) {
+	bool thinArchives = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { thinArchives = b.ThinArchives; });
+	return thinArchives;
+}
+
+static BuildToolchainInfo * NewToolchainInfo(const Build::ToolchainInfo &info) {
+	BuildToolchainInfo *out = (BuildToolchainInfo *) calloc(1, sizeof(BuildToolchainInfo));
+
+	if (!out) {
+		BStatusCode = B_Mem;
+		return NULL;
+	}
+	if (asprintf(&out->Path, "%s", info.Path.c_str()) == -1) out->Path = NULL;
+	if (asprintf(&out->Family, "%s", info.Family.c_str()) == -1) out->Family = NULL;
+	if (asprintf(&out->Version, "%s", info.Version.c_str()) == -1) out->Version = NULL;
+	if (asprintf(&out->Target, "%s", info.Target.c_str()) == -1) out->Target = NULL;
+	out->Standards = NewStringList(info.Standards);
+	out->Features = NewStringList(info.Features);
+	out->SystemIncludeDirs = NewStringList(info.SystemIncludeDirs);
+	if (!out->Path || !out->Family || !out->Version || !out->Target || !out->Standards || !out->Features || !out->SystemIncludeDirs) {
+		Build_FreeToolchainInfo(out);
+		BStatusCode = B_Mem;
+		return NULL;
+	}
+
+	return out;
+}
+
+BuildToolchainInfo * Build_ProbeCC(BuildConfig *cfg) {
+	Build::ToolchainInfo info;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	try {
+		info = cfg->Builder->ProbeCC();
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+
+	return NewToolchainInfo(info);
+}
+
+BuildToolchainInfo * Build_ProbeCXX(BuildConfig *cfg) {
+	Build::ToolchainInfo info;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	try {
+		info = cfg->Builder->ProbeCXX();
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+
+	return NewToolchainInfo(info);
+}
+
+void Build_FreeToolchainInfo(BuildToolchainInfo *info) {
+	if (!info) return;
+
+	free((void *) info->Path);
+	free((void *) info->Family);
+	free((void *) info->Version);
+	free((void *) info->Target);
+	Build_FreeStringList(info->Standards);
+	Build_FreeStringList(info->Features);
+	Build_FreeStringList(info->SystemIncludeDirs);
+	free((void *) info);
+}
+
+int Build_SetJobs(BuildConfig *cfg, unsigned jobs) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.Jobs = jobs; });
+	return 0;
+}
+
+unsigned Build_GetJobs(BuildConfig *cfg) {
+	unsigned jobs = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { jobs = b.Jobs; });
+	return jobs;
+}
+
+int Build_AddRemoteWorker(BuildConfig *cfg, const char *address) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.RemoteWorkers.push_back(address); });
+	return 0;
+}
+
+int Build_ClearRemoteWorkers(BuildConfig *cfg) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.RemoteWorkers.clear(); });
+	return 0;
+}
+
+int Build_SetRemoteJobs(BuildConfig *cfg, unsigned remoteJobs) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.RemoteJobs = remoteJobs; });
+	return 0;
+}
+
+unsigned Build_GetRemoteJobs(BuildConfig *cfg) {
+	unsigned remoteJobs = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { remoteJobs = b.RemoteJobs; });
+	return remoteJobs;
+}
+
+int Build_SetCacheOutputs(BuildConfig *cfg, bool cacheOutputs) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.CacheOutputs = cacheOutputs; });
+	return 0;
+}
+
+bool Build_GetCacheOutputs(BuildConfig *cfg) {
+	bool cacheOutputs = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { cacheOutputs = b.CacheOutputs; });
+	return cacheOutputs;
+}
+
+int Build_SetRemoteCache(BuildConfig *cfg, const char *url) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.RemoteCache = url; });
+	return 0;
+}
+
+const char * Build_GetRemoteCache(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.RemoteCache; });
+	return value.c_str();
+}
+
+int Build_SetRemoteCacheUpload(BuildConfig *cfg, bool upload) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.RemoteCacheUpload = upload; });
+	return 0;
+}
+
+bool Build_GetRemoteCacheUpload(BuildConfig *cfg) {
+	bool upload = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { upload = b.RemoteCacheUpload; });
+	return upload;
+}
+
+int Build_WaitForUploads(BuildConfig *cfg) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->WaitForUploads();
+	return 0;
+}
+
+int Build_SetLTOJobs(BuildConfig *cfg, unsigned ltoJobs) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.LTOJobs = ltoJobs; });
+	return 0;
+}
+
+unsigned Build_GetLTOJobs(BuildConfig *cfg) {
+	unsigned ltoJobs = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { ltoJobs = b.LTOJobs; });
+	return ltoJobs;
+}
+
+int Build_SetLTOCacheSize(BuildConfig *cfg, unsigned long long size) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.LTOCacheSize = size; });
+	return 0;
+}
+
+unsigned long long Build_GetLTOCacheSize(BuildConfig *cfg) {
+	unsigned long long size = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { size = b.LTOCacheSize; });
+	return size;
+}
+
+int Build_SetCompileBatchSize(BuildConfig *cfg, unsigned size) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.CompileBatchSize = size; });
+	return 0;
+}
+
+unsigned Build_GetCompileBatchSize(BuildConfig *cfg) {
+	unsigned size = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { size = b.CompileBatchSize; });
+	return size;
+}
+
+int Build_SetCacheTestResults(BuildConfig *cfg, bool cacheTestResults) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.CacheTestResults = cacheTestResults; });
+	return 0;
+}
+
+bool Build_GetCacheTestResults(BuildConfig *cfg) {
+	bool cacheTestResults = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { cacheTestResults = b.CacheTestResults; });
+	return cacheTestResults;
+}
+
+int Build_SetTestShard(BuildConfig *cfg, unsigned index, unsigned count) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) {
+		b.TestShardIndex = index;
+		b.TestShardCount = count;
+	});
+	return 0;
+}
+
+unsigned Build_GetTestShardIndex(BuildConfig *cfg) {
+	unsigned index = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { index = b.TestShardIndex; });
+	return index;
+}
+
+unsigned Build_GetTestShardCount(BuildConfig *cfg) {
+	unsigned count = 0;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return 0;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { count = b.TestShardCount; });
+	return count;
+}
+
+int Build_SetSkipUpToDate(BuildConfig *cfg, bool skipUpToDate) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.SkipUpToDate = skipUpToDate; });
+	return 0;
+}
+
+bool Build_GetSkipUpToDate(BuildConfig *cfg) {
+	bool skipUpToDate = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { skipUpToDate = b.SkipUpToDate; });
+	return skipUpToDate;
+}
+
+int Build_SetPlan(BuildConfig *cfg, bool plan) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.Plan = plan; });
+	return 0;
+}
+
+bool Build_GetPlan(BuildConfig *cfg) {
+	bool plan = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { plan = b.Plan; });
+	return plan;
+}
+
+int Build_GetPlanEstimate(BuildConfig *cfg, BuildPlanEstimate *estimate) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+	if (!estimate) {
+		BStatusCode = B_ObjectRequired;
+		return -1;
+	}
+
+	try {
+		Build::PlanEstimate plan = cfg->Builder->GetPlanEstimate();
+
+		estimate->Steps = plan.Steps;
+		estimate->UpToDate = plan.UpToDate;
+		estimate->Unrecorded = plan.Unrecorded;
+		estimate->SerialSeconds = plan.SerialSeconds;
+		estimate->Seconds = plan.Seconds;
+		return 0;
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+}
+
+int Build_SetDeterministic(BuildConfig *cfg, bool deterministic) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.Deterministic = deterministic; });
+	return 0;
+}
+
+bool Build_GetDeterministic(BuildConfig *cfg) {
+	bool deterministic = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { deterministic = b.Deterministic; });
+	return deterministic;
+}
+
+char ** Build_VerifyReproducible(BuildConfig *cfg, void (*build)(BuildConfig *copy, void *arg), void *arg) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+	if (!build) {
+		BStatusCode = B_ObjectRequired;
+		return NULL;
+	}
+
+	try {
+		return NewStringList(cfg->Builder->VerifyReproducible([build, arg](Builder &b) {
+			BuildConfig copy = { &b };
+
+			build(&copy, arg);
+		}));
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+int Build_SetNinjaFile(BuildConfig *cfg, const char *path) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.NinjaFile = path ? path : ""; });
+	return 0;
+}
+
+const char * Build_GetNinjaFile(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.NinjaFile; });
+	return value.c_str();
+}
+
+int Build_WriteNinjaFile(BuildConfig *cfg) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	try {
+		cfg->Builder->WriteNinjaFile();
+		return 0;
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+}
+
+int Build_SetShowProgress(BuildConfig *cfg, bool showProgress) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.ShowProgress = showProgress; });
+	return 0;
+}
+
+bool Build_GetShowProgress(BuildConfig *cfg) {
+	bool showProgress = false;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return false;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { showProgress = b.ShowProgress; });
+	return showProgress;
+}
+
+int Build_GetStats(BuildConfig *cfg, BuildStats *stats) {
+	Build::Statistics counters;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+	if (!stats) {
+		BStatusCode = B_ObjectRequired;
+		return -1;
+	}
+
+	counters = Builder::Stats();
+	stats->ProcessesSpawned = counters.ProcessesSpawned;
+	stats->SpawnSeconds = counters.SpawnSeconds;
+	stats->WaitSeconds = counters.WaitSeconds;
+	stats->StatCalls = counters.StatCalls;
+	stats->StatCacheHits = counters.StatCacheHits;
+	stats->CacheHits = counters.CacheHits;
+	stats->CacheMisses = counters.CacheMisses;
+	stats->BytesCopied = counters.BytesCopied;
+	stats->JobsSkipped = counters.JobsSkipped;
+	stats->JobsCutOff = counters.JobsCutOff;
+	return 0;
+}
+
+int Build_SetStatsFile(BuildConfig *cfg, const char *path) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.StatsFile = path; });
+	return 0;
+}
+
+const char * Build_GetStatsFile(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.StatsFile; });
+	return value.c_str();
+}
+
+int Build_PrintResourceReport(BuildConfig *cfg, unsigned n) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	try {
+		cfg->Builder->PrintResourceReport(n);
+		return 0;
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+}
+
+BuildConfig * Build_InitVariant(BuildConfig *cfg, const char *name) {
+	BuildConfig *variant = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	variant = (BuildConfig *) calloc(1, sizeof(struct BuildConfig));
+	if (!variant) {
+		BStatusCode = B_Mem;
+		return NULL;
+	}
+
+	try {
+		variant->Builder = new Builder(cfg->Builder->Variant(name));
+		return variant;
+	} catch (std::exception &e) {
+		free((void *) variant);
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+const char * Build_GetVariantName(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.VariantName; });
+	return value.c_str();
+}
+
+int Build_SetOutputDir(BuildConfig *cfg, const char *dir) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.OutputDir = dir; });
+	return 0;
+}
+
+const char * Build_GetOutputDir(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.OutputDir; });
+	return value.c_str();
+}
+
+int Build_SetSourceDir(BuildConfig *cfg, const char *dir) {
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { b.SourceDir = dir; });
+	return 0;
+}
+
+const char * Build_GetSourceDir(BuildConfig *cfg) {
+	static thread_local string value;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	cfg->Builder->Configure([&](Builder &b) { value = b.SourceDir; });
+	return value.c_str();
+}
+
+BuildJob * Build_CCAsync(BuildConfig *cfg, const char *fmt, ...) {
+	va_list args;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->CCAsyncFV(fmt, args);
+		va_end(args);
+		return job;
+	} catch (std::exception &e) {
+		va_end(args);
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_CXXAsync(BuildConfig *cfg, const char *fmt, ...) {
+	va_list args;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->CXXAsyncFV(fmt, args);
+		va_end(args);
+		return job;
+	} catch (std::exception &e) {
+		va_end(args);
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_ARAsync(BuildConfig *cfg, const char *fmt, ...) {
+	va_list args;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->ARAsyncFV(fmt, args);
+		va_end(args);
+		return job;
+	} catch (std::exception &e) {
+		va_end(args);
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_LDAsync(BuildConfig *cfg, const char *fmt, ...) {
+	va_list args;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->LDAsyncFV(fmt, args);
+		va_end(args);
+		return job;
+	} catch (std::exception &e) {
+		va_end(args);
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_ExecAsync(BuildConfig *cfg, const char *fmt, ...) {
+	va_list args;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->ExecAsyncFV(fmt, args);
+		va_end(args);
+		return job;
+	} catch (std::exception &e) {
+		va_end(args);
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_ExecOnceAsync(BuildConfig *cfg, const char *fmt, ...) {
+	va_list args;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	va_start(args, fmt);
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->ExecOnceAsyncFV(fmt, args);
+		va_end(args);
+		return job;
+	} catch (std::exception &e) {
+		va_end(args);
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_CompileAsync(BuildConfig *cfg, const char *source, const char *object, const char *flags, bool cxx) {
+	Build::CompileStep step;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	step.Source = source;
+	step.Object = object;
+	step.Flags = flags ? flags : "";
+	step.CXX = cxx;
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->CompileAsync(step);
+		return job;
+	} catch (std::exception &e) {
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+int Build_CompileModulesAsync(BuildConfig *cfg, char **sources, char **objects, const char *flags, BuildJob **jobs) {
+	std::vector<Build::CompileStep> steps;
+	std::vector<Build::Job> queued;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	try {
+		for (size_t i = 0; sources && sources[i]; ++i) {
+			Build::CompileStep step;
+
+			if (!objects || !objects[i]) throw std::runtime_error(string("unable to scan modules: no object for ") + sources[i]);
+			step.Source = sources[i];
+			step.Object = objects[i];
+			step.Flags = flags ? flags : "";
+			step.CXX = true;
+			steps.push_back(step);
+		}
+		queued = cfg->Builder->CompileModulesAsync(steps);
+		for (size_t i = 0; i < queued.size(); ++i) {
+			jobs[i] = new BuildJob;
+			jobs[i]->Job = queued[i];
+		}
+		return 0;
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+}
+
+int Build_CompileBatchedAsync(BuildConfig *cfg, char **sources, char **objects, const char *flags, bool cxx, BuildJob **jobs) {
+	std::vector<Build::CompileStep> steps;
+	std::vector<Build::Job> queued;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return -1;
+	}
+
+	try {
+		for (size_t i = 0; sources && sources[i]; ++i) {
+			Build::CompileStep step;
+
+			if (!objects || !objects[i]) throw std::runtime_error(string("no object for ") + sources[i]);
+			step.Source = sources[i];
+			step.Object = objects[i];
+			step.Flags = flags ? flags : "";
+			step.CXX = cxx;
+			steps.push_back(step);
+		}
+		queued = cfg->Builder->CompileBatchedAsync(steps);
+		for (size_t i = 0; i < queued.size(); ++i) {
+			jobs[i] = new BuildJob;
+			jobs[i]->Job = queued[i];
+		}
+		return 0;
+	} catch (std::exception &e) {
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return -1;
+	}
+}
+
+// Queues the link of `inputs` into `output`, as an LTO link if `lto` is true.
+static BuildJob * QueueLink(BuildConfig *cfg, const char *output, char **inputs, const char *flags, bool cxx, bool lto) {
+	Build::LinkStep step;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	for (size_t i = 0; inputs && inputs[i]; ++i) step.Inputs.push_back(inputs[i]);
+	step.Output = output;
+	step.Flags = flags ? flags : "";
+	step.CXX = cxx;
+	step.LTO = lto;
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->LinkAsync(step);
+		return job;
+	} catch (std::exception &e) {
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_LinkAsync(BuildConfig *cfg, const char *output, char **inputs, const char *flags, bool cxx) {
+	return QueueLink(cfg, output, inputs, flags, cxx, false);
+}
+
+BuildJob * Build_LTOLinkAsync(BuildConfig *cfg, const char *output, char **inputs, const char *flags, bool cxx) {
+	return QueueLink(cfg, output, inputs, flags, cxx, true);
+}
+
+BuildJob * Build_LinkSharedAsync(BuildConfig *cfg, const char *output, char **inputs, const char *flags,
+	const char *version, const char *versionScript, bool splitDebugInfo, bool cxx) {
+	Build::LinkStep step;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	for (size_t i = 0; inputs && inputs[i]; ++i) step.Inputs.push_back(inputs[i]);
+	step.Output = output;
+	step.Flags = flags ? flags : "";
+	step.CXX = cxx;
+	step.Shared = true;
+	step.Version = version ? version : "";
+	step.VersionScript = versionScript ? versionScript : "";
+	step.SplitDebugInfo = splitDebugInfo;
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->LinkAsync(step);
+		return job;
+	} catch (std::exception &e) {
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+BuildJob * Build_TestAsync(BuildConfig *cfg, const char *program, const char *args, char **data, unsigned timeoutSeconds) {
+	Build::TestStep step;
+	BuildJob *job = NULL;
+
+	if (!EnsureObjectProvidedOrFlagError(cfg)) {
+		return NULL;
+	}
+
+	step.Program = program;
+	step.Args = args ? args : "";
+	for (size_t i = 0; data && data[i]; ++i) step.Data.push_back(data[i]);
+	step.TimeoutSeconds = timeoutSeconds;
+	try {
+		job = new BuildJob;
+		job->Job = cfg->Builder->TestAsync(step);
+		return job;
+	} catch (std::exception &e) {
+		if (job) delete job;
+		BStatusCode = Builder::ExceptionToStatusCode(e);
+		return NULL;
+	}
+}
+
+// Waits for `job` and frees it. Returns 0 if the command ran and exited with 0; -1 otherwise,
+// with the reason in `BStatusCode`.
+static int WaitAndFreeJob(BuildJob *job, BuildJobStatus *status) {
+	BuildJobStatus result = { B_OK, 0, false, false, 0, 0 };
+
+	try {
+		Build::ExecResult execResult = job->Job.Wait();
+
+		result.ExitCode = execResult.ExitCode;
+		result.Cached = execResult.Cached;
+		result.Skipped = execResult.Skipped;
+		result.CPUSeconds = execResult.Usage.UserSeconds + execResult.Usage.SystemSeconds;
+		result.MaxRSSKiB = (unsigned long long) execResult.Usage.MaxRSSKiB;
+		if (result.ExitCode) result.Code = B_CommandFailed;
+	} catch (std::exception &e) {
+		result.Code = Builder::ExceptionToStatusCode(e);
+		result.ExitCode = -1;
+	}
+	delete job;
+
+	if (status) *status = result;
+	if (result.Code != B_OK) {
+		BStatusCode = result.Code;
+		return -1;
+	}
+	return 0;
+}
+
+int Build_Wait(BuildJob *job, BuildJobStatus *status) {
+	if (!job) {
+		BStatusCode = B_ObjectRequired;
+		return -1;
+	}
+
+	return WaitAndFreeJob(job, status);
+}
+
+int Build_WaitAny(BuildJob **jobs, size_t count, BuildJobStatus *status) {
+	std::vector<Build::Job> pending;
+	std::vector<size_t> indices;
+	size_t index = 0;
+
+	for (size_t i = 0; jobs && i < count; ++i) {
+		if (!jobs[i]) continue;
+		pending.push_back(jobs[i]->Job);
+		indices.push_back(i);
+	}
+	if (pending.empty()) {
+		BStatusCode = B_ObjectRequired;
+		return -1;
+	}
+
+	index = indices[Builder::WaitAny(pending)];
+	WaitAndFreeJob(jobs[index], status);
+	jobs[index] = NULL;
+
+	return (int) index;
+}
+
+int Build_WaitAll(BuildJob **jobs, size_t count, BuildJobStatus *statuses) {
+	int ret = 0;
+
+	for (size_t i = 0; jobs && i < count; ++i) {
+		if (!jobs[i]) continue;
+		if (WaitAndFreeJob(jobs[i], statuses ? &statuses[i] : NULL)) ret = -1;
+		jobs[i] = NULL;
+	}
+
+	return ret;
+}
@@ -0,0 +1,559 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+#if defined(LINUX)
+#include <stdint.h>
+#include <sys/syscall.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+namespace {
+	struct DirEntry {
+		string Name;
+		// 'f' for regular files, 'd' for directories, 'l' for symbolic links.
+		char Type;
+	};
+
+	typedef std::shared_ptr<const vector<DirEntry>> DirEntries;
+
+	struct DirListing {
+		long long MTimeSec;
+		long MTimeNsec;
+		DirEntries Entries;
+	};
+
+	// Directory listings keyed by absolute directory path, persisted in `<CacheDir>/globcache`.
+	// A listing is reused as long as the directory's mtime is unchanged.
+	struct DirCache {
+		std::mutex Mutex;
+		string FilePath;
+		bool Loaded = false;
+		bool Dirty = false;
+		std::map<string, DirListing> Listings;
+	};
+
+#if defined(LINUX)
+	struct LinuxDirent64 {
+		uint64_t Ino;
+		int64_t Off;
+		unsigned short RecLen;
+		unsigned char Type;
+		char Name[256];
+	};
+#endif
+}
+
+static const char *dirCacheHeader = "libBuild-dircache 1";
+
+static std::mutex dirCachesMutex;
+static std::map<string, std::unique_ptr<DirCache>> dirCaches;
+
+static vector<string> SplitPath(const string &path) {
+	vector<string> segs;
+	size_t start = 0;
+
+	while (start <= path.size()) {
+		size_t end = path.find('/', start);
+		if (end == string::npos) end = path.size();
+		if (end > start) segs.push_back(path.substr(start, end - start));
+		start = end + 1;
+	}
+
+	return segs;
+}
+
+static string JoinGlobPath(const string &base, const string &sub) {
+	if (base.empty()) return sub.empty() ? string(".") : sub;
+	if (sub.empty()) return base;
+	if (base[base.size() - 1] == '/') return base + sub;
+	return base + "/" + sub;
+}
+
+static bool HasWildcard(const string &seg) {
+	return seg.find_first_of("*?[") != string::npos;
+}
+
+// Matches a single path segment against a pattern segment supporting `*`, `?`, `[...]` and `[!...]`.
+static bool MatchSegment(const string &pat, const string &name) {
+	size_t p = 0, n = 0;
+	size_t starP = string::npos, starN = 0;
+
+	while (n < name.size()) {
+		if (p < pat.size() && pat[p] == '*') {
+			starP = p++;
+			starN = n;
+			continue;
+		}
+		if (p < pat.size() && pat[p] == '[') {
+			size_t q = p + 1;
+			bool negate = false, matched = false;
+
+			if (q < pat.size() && (pat[q] == '!' || pat[q] == '^')) { negate = true; ++q; }
+			size_t first = q;
+			while (q < pat.size() && (pat[q] != ']' || q == first)) {
+				if (q + 2 < pat.size() && pat[q + 1] == '-' && pat[q + 2] != ']') {
+					if (name[n] >= pat[q] && name[n] <= pat[q + 2]) matched = true;
+					q += 3;
+				} else {
+					if (name[n] == pat[q]) matched = true;
+					++q;
+				}
+			}
+			if (q < pat.size() && matched != negate) {
+				p = q + 1;
+				++n;
+				continue;
+			}
+		} else if (p < pat.size() && pat[p] == '\\' && p + 1 < pat.size()) {
+			if (pat[p + 1] == name[n]) {
+				p += 2;
+				++n;
+				continue;
+			}
+		} else if (p < pat.size() && (pat[p] == '?' || pat[p] == name[n])) {
+			++p;
+			++n;
+			continue;
+		}
+		if (starP == string::npos) return false;
+		p = starP + 1;
+		n = ++starN;
+	}
+	while (p < pat.size() && pat[p] == '*') ++p;
+
+	return p == pat.size();
+}
+
+static bool MatchSegments(const vector<string> &pat, size_t pi, const vector<string> &path, size_t si) {
+	while (pi < pat.size()) {
+		if (pat[pi] == "**") {
+			while (pi + 1 < pat.size() && pat[pi + 1] == "**") ++pi;
+			if (pi + 1 == pat.size()) return si < path.size();
+			for (size_t k = si; k < path.size(); ++k) {
+				if (MatchSegments(pat, pi + 1, path, k)) return true;
+			}
+			return false;
+		}
+		if (si >= path.size() || !MatchSegment(pat[pi], path[si])) return false;
+		++pi;
+		++si;
+	}
+
+	return si == path.size();
+}
+
+// Adds the pattern positions reachable from `states` without consuming a segment, i.e. by `**` matching nothing.
+static void CloseGlobStates(const vector<string> &pat, vector<unsigned> &states) {
+	for (size_t i = 0; i < states.size(); ++i) {
+		unsigned next = states[i] + 1;
+		if (states[i] < pat.size() && pat[states[i]] == "**" && std::find(states.begin(), states.end(), next) == states.end()) {
+			states.push_back(next);
+		}
+	}
+}
+
+// Advances the set of pattern positions matched so far by one path segment.
+static void StepGlobStates(const vector<string> &pat, const vector<unsigned> &states, const string &name, vector<unsigned> &next) {
+	next.clear();
+	for (unsigned i : states) {
+		if (i >= pat.size()) continue;
+		if (pat[i] == "**") {
+			if (std::find(next.begin(), next.end(), i) == next.end()) next.push_back(i);
+		} else if (MatchSegment(pat[i], name)) {
+			if (std::find(next.begin(), next.end(), i + 1) == next.end()) next.push_back(i + 1);
+		}
+	}
+	CloseGlobStates(pat, next);
+}
+
+static void StatMTime(const struct stat &sb, long long &sec, long &nsec) {
+	sec = (long long) sb.st_mtime;
+#if defined(LINUX)
+	nsec = sb.st_mtim.tv_nsec;
+#elif defined(MACOS)
+	nsec = sb.st_mtimespec.tv_nsec;
+#else
+	nsec = 0;
+#endif
+}
+
+static char StatType(const struct stat &sb) {
+	if (S_ISDIR(sb.st_mode)) return 'd';
+	if (S_ISREG(sb.st_mode)) return 'f';
+#if !defined(WINDOWS)
+	if (S_ISLNK(sb.st_mode)) return 'l';
+#endif
+	return 0;
+}
+
+static bool ListDirectory(const string &dirPath, vector<DirEntry> &entries) {
+#if defined(LINUX)
+	char buf[32768];
+	long n = 0;
+	int fd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0) return false;
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (long pos = 0; pos < n;) {
+			LinuxDirent64 *d = (LinuxDirent64 *) (buf + pos);
+			const char *name = d->Name;
+			char type = 0;
+
+			pos += d->RecLen;
+			if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+			switch (d->Type) {
+			case DT_REG: type = 'f'; break;
+			case DT_DIR: type = 'd'; break;
+			case DT_LNK: type = 'l'; break;
+			case DT_UNKNOWN: {
+				struct stat sb;
+				if (!fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW)) type = StatType(sb);
+				break;
+			}
+			}
+			if (type) entries.push_back(DirEntry{ name, type });
+		}
+	}
+	close(fd);
+
+	return n == 0;
+#else
+	DIR *dir = opendir(dirPath.c_str());
+	struct dirent *d = NULL;
+
+	if (!dir) return false;
+	while ((d = readdir(dir))) {
+		string name = d->d_name;
+		char type = 0;
+
+		if (name == "." || name == "..") continue;
+	#if defined(DT_UNKNOWN)
+		switch (d->d_type) {
+		case DT_REG: type = 'f'; break;
+		case DT_DIR: type = 'd'; break;
+		case DT_LNK: type = 'l'; break;
+		}
+	#endif
+		if (!type) {
+			struct stat sb;
+			++Build::Counters.StatCalls;
+			if (!stat(JoinGlobPath(dirPath, name).c_str(), &sb)) type = StatType(sb);
+		}
+		if (type) entries.push_back(DirEntry{ name, type });
+	}
+	closedir(dir);
+
+	return true;
+#endif
+}
+
+static void LoadDirCache(DirCache &cache) {
+	std::ifstream in(cache.FilePath.c_str(), std::ios::binary);
+	string line;
+
+	cache.Loaded = true;
+	if (!in || !std::getline(in, line) || line != dirCacheHeader) return;
+
+	while (std::getline(in, line)) {
+		DirListing listing;
+		long long count = 0;
+		int offset = 0;
+		vector<DirEntry> *entries = new vector<DirEntry>;
+
+		listing.Entries.reset(entries);
+		if (sscanf(line.c_str(), "D %lld %ld %lld %n", &listing.MTimeSec, &listing.MTimeNsec, &count, &offset) != 3 || !offset) {
+			cache.Listings.clear();
+			return;
+		}
+		string dirPath = line.substr(offset);
+		entries->reserve(count);
+		for (long long i = 0; i < count; ++i) {
+			if (!std::getline(in, line) || line.empty()) {
+				cache.Listings.clear();
+				return;
+			}
+			entries->push_back(DirEntry{ line.substr(1), line[0] });
+		}
+		cache.Listings[dirPath] = listing;
+	}
+}
+
+// Caller must hold `cache.Mutex`.
+static void SaveDirCache(DirCache &cache, const string &cacheDir) {
+	string tmpPath = cache.FilePath + ".tmp." + std::to_string((long) getpid());
+	FILE *out = NULL;
+
+#if defined(WINDOWS)
+	mkdir(cacheDir.c_str());
+#else
+	mkdir(cacheDir.c_str(), 0777);
+#endif
+	out = fopen(tmpPath.c_str(), "wb");
+	if (!out) return;
+
+	fprintf(out, "%s\n", dirCacheHeader);
+	for (const auto &kv : cache.Listings) {
+		fprintf(out, "D %lld %ld %lld %s\n", kv.second.MTimeSec, kv.second.MTimeNsec, (long long) kv.second.Entries->size(), kv.first.c_str());
+		for (const DirEntry &e : *kv.second.Entries) {
+			fprintf(out, "%c%s\n", e.Type, e.Name.c_str());
+		}
+	}
+	if (fclose(out) || rename(tmpPath.c_str(), cache.FilePath.c_str())) {
+		remove(tmpPath.c_str());
+		return;
+	}
+	cache.Dirty = false;
+}
+
+static DirCache * GetDirCache(const string &cacheDir) {
+	string filePath;
+
+	if (cacheDir.empty()) return NULL;
+	filePath = JoinGlobPath(cacheDir, "globcache");
+	if (filePath[0] != '/') filePath = JoinGlobPath(Build::Builder::GetCurrentWorkingDir(), filePath);
+
+	std::lock_guard<std::mutex> lock(dirCachesMutex);
+	std::unique_ptr<DirCache> &cache = dirCaches[filePath];
+	if (!cache) {
+		cache.reset(new DirCache);
+		cache->FilePath = filePath;
+	}
+
+	return cache.get();
+}
+
+namespace {
+	// A directory walk shared by the worker threads of one `Glob()` call.
+	struct GlobWalk {
+		string Base;
+		string AbsBase;
+		vector<string> Pattern;
+		DirCache *Cache = NULL;
+		long long CacheableBefore = 0;
+
+		std::mutex Mutex;
+		std::condition_variable Cond;
+		// Directories still to visit, with the pattern positions matched by their path.
+		std::deque<std::pair<string, vector<unsigned>>> Queue;
+		int Busy = 0;
+		vector<string> Matches;
+
+		// Ignore patterns without a slash match file names, the others match whole paths.
+		vector<string> IgnoreNames;
+		vector<vector<string>> IgnorePaths;
+
+		bool IsIgnoredName(const string &name) const {
+			for (const string &ignore : IgnoreNames) {
+				if (MatchSegment(ignore, name)) return true;
+			}
+			return false;
+		}
+
+		bool IsIgnoredPath(const string &path) const {
+			if (IgnorePaths.empty()) return false;
+
+			vector<string> segs = SplitPath(path);
+			for (const vector<string> &ignore : IgnorePaths) {
+				if (MatchSegments(ignore, 0, segs, 0)) return true;
+			}
+			return false;
+		}
+
+		DirEntries List(const string &dirPath, const string &absPath) {
+			struct stat sb;
+			long long sec = 0;
+			long nsec = 0;
+			vector<DirEntry> *entries = NULL;
+			DirEntries listed;
+
+			++Build::Counters.StatCalls;
+			if (stat(dirPath.c_str(), &sb)) return DirEntries();
+			StatMTime(sb, sec, nsec);
+
+			if (Cache) {
+				std::lock_guard<std::mutex> lock(Cache->Mutex);
+				auto it = Cache->Listings.find(absPath);
+				if (it != Cache->Listings.end() && it->second.MTimeSec == sec && it->second.MTimeNsec == nsec) {
+					++Build::Counters.StatCacheHits;
+					return it->second.Entries;
+				}
+			}
+
+			entries = new vector<DirEntry>;
+			listed.reset(entries);
+			if (!ListDirectory(dirPath, *entries)) return DirEntries();
+
+			// A directory modified within the timestamp granularity of now might change again
+			// without its mtime changing, so only remember listings that are old enough.
+			if (Cache && sec < CacheableBefore) {
+				bool cacheable = true;
+				for (const DirEntry &e : *entries) {
+					if (e.Name.find('\n') != string::npos) { cacheable = false; break; }
+				}
+				if (cacheable) {
+					std::lock_guard<std::mutex> lock(Cache->Mutex);
+					Cache->Listings[absPath] = DirListing{ sec, nsec, listed };
+					Cache->Dirty = true;
+				}
+			}
+
+			return listed;
+		}
+
+		void Visit(const string &sub, const vector<unsigned> &states, vector<std::pair<string, vector<unsigned>>> &dirs, vector<string> &matches) {
+			string dirPath = JoinGlobPath(Base, sub);
+			string absPath = sub.empty() ? AbsBase : JoinGlobPath(AbsBase, sub);
+			DirEntries entries = List(dirPath, absPath);
+			unsigned accept = Pattern.size();
+			vector<unsigned> next;
+
+			if (!entries) return;
+			for (const DirEntry &e : *entries) {
+				char type = e.Type;
+				bool matched = false;
+				string path;
+
+				StepGlobStates(Pattern, states, e.Name, next);
+				if (next.empty() || IsIgnoredName(e.Name)) continue;
+				if (type == 'l' || type == 'f') {
+					matched = std::find(next.begin(), next.end(), accept) != next.end();
+					if (!matched) continue;
+				}
+				path = JoinGlobPath(dirPath == "." ? string() : dirPath, e.Name);
+				if (IsIgnoredPath(path)) continue;
+				if (type == 'l') {
+					// Symbolic links to files are matched, but linked directories are not walked.
+					struct stat sb;
+					++Build::Counters.StatCalls;
+					if (stat(path.c_str(), &sb) || !S_ISREG(sb.st_mode)) continue;
+					type = 'f';
+				}
+				if (type == 'd') {
+					for (unsigned i : next) {
+						if (i < accept) {
+							dirs.push_back(std::make_pair(sub.empty() ? e.Name : sub + "/" + e.Name, next));
+							break;
+						}
+					}
+				} else if (type == 'f' && matched) {
+					matches.push_back(path);
+				}
+			}
+		}
+
+		void Work() {
+			std::unique_lock<std::mutex> lock(Mutex);
+
+			for (;;) {
+				vector<std::pair<string, vector<unsigned>>> dirs;
+				vector<string> matches;
+				std::pair<string, vector<unsigned>> item;
+
+				Cond.wait(lock, [this] { return !Queue.empty() || Busy == 0; });
+				if (Queue.empty()) break;
+				item = Queue.front();
+				Queue.pop_front();
+				++Busy;
+				lock.unlock();
+
+				Visit(item.first, item.second, dirs, matches);
+
+				lock.lock();
+				Queue.insert(Queue.end(), dirs.begin(), dirs.end());
+				Matches.insert(Matches.end(), matches.begin(), matches.end());
+				--Busy;
+				Cond.notify_all();
+			}
+			Cond.notify_all();
+		}
+	};
+}
+
+vector<string> Build::Builder::Glob(string pattern) {
+	GlobWalk walk;
+	vector<string> segs = SplitPath(pattern);
+	vector<std::thread> threads;
+	bool absolute = !pattern.empty() && pattern[0] == '/';
+	size_t literal = 0;
+	unsigned threadCount = 0;
+
+	if (segs.empty()) throw runtime_error(string("invalid glob pattern: ") + pattern);
+
+	while (literal < segs.size() && !HasWildcard(segs[literal])) ++literal;
+	if (literal == segs.size()) {
+		if (FileExists(pattern)) return vector<string>{ pattern };
+		return vector<string>();
+	}
+
+	walk.Base = absolute ? "/" : "";
+	for (size_t i = 0; i < literal; ++i) walk.Base = i ? walk.Base + "/" + segs[i] : walk.Base + segs[i];
+	walk.AbsBase = absolute ? walk.Base : JoinGlobPath(GetCurrentWorkingDir(), walk.Base);
+	walk.Pattern.assign(segs.begin() + literal, segs.end());
+	vector<string> ignorePatterns;
+	string cacheDir;
+
+	Configure([&](Builder &b) {
+		ignorePatterns = b.GlobIgnorePatterns;
+		cacheDir = b.CacheDir;
+	});
+	for (string ignore : ignorePatterns) {
+		while (ignore.size() > 3 && ignore.compare(ignore.size() - 3, 3, "/**") == 0) ignore.resize(ignore.size() - 3);
+		while (ignore.size() > 1 && ignore[ignore.size() - 1] == '/') ignore.resize(ignore.size() - 1);
+		if (ignore.empty()) continue;
+		if (ignore.find('/') == string::npos) {
+			walk.IgnoreNames.push_back(ignore);
+		} else {
+			walk.IgnorePaths.push_back(SplitPath(ignore));
+		}
+	}
+	walk.Cache = GetDirCache(cacheDir);
+	walk.CacheableBefore = (long long) time(NULL) - 1;
+	walk.Queue.push_back(std::make_pair(string(), vector<unsigned>(1, 0)));
+	CloseGlobStates(walk.Pattern, walk.Queue.front().second);
+
+	if (walk.Cache) {
+		std::lock_guard<std::mutex> lock(walk.Cache->Mutex);
+		if (!walk.Cache->Loaded) LoadDirCache(*walk.Cache);
+	}
+
+	threadCount = std::thread::hardware_concurrency();
+	if (threadCount > 8) threadCount = 8;
+	for (unsigned i = 1; i < threadCount; ++i) {
+		threads.push_back(std::thread([&walk] { walk.Work(); }));
+	}
+	walk.Work();
+	for (std::thread &t : threads) t.join();
+
+	if (walk.Cache) {
+		std::lock_guard<std::mutex> lock(walk.Cache->Mutex);
+		if (walk.Cache->Dirty) SaveDirCache(*walk.Cache, cacheDir);
+	}
+
+	std::sort(walk.Matches.begin(), walk.Matches.end());
+	return walk.Matches;
+}
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::FileStamp;
+
+namespace {
+	// An `#include "Name"` directive, or `#include <Name>` if `Angled`.
+	struct IncludeDirective {
+		string Name;
+		bool Angled;
+	};
+
+	struct IncludeEntry {
+		FileStamp Stamp;
+		vector<IncludeDirective> Directives;
+	};
+
+	// Directives of scanned files keyed by absolute path, persisted in `<CacheDir>/includecache`.
+	// An entry is reused as long as the file's size and mtime are unchanged.
+	struct IncludeCache {
+		std::mutex Mutex;
+		string FilePath;
+		bool Loaded = false;
+		bool Dirty = false;
+		std::map<string, IncludeEntry> Files;
+	};
+}
+
+static const char *includeCacheHeader = "libBuild-includecache 1";
+
+static std::mutex includeCachesMutex;
+static std::map<string, std::unique_ptr<IncludeCache>> includeCaches;
+
+// Finds the `#include` and `#include_next` directives of `data`. Directives in comments and in conditional
+// blocks count too, so the result may list more headers than the compiler reads, never fewer, except for
+// those named by macros.
+static void LexIncludes(const char *data, size_t size, vector<IncludeDirective> &directives) {
+	const char *end = data + size, *p = data;
+
+	// memchr() is vectorized by the C library, so the bulk of the file is skipped many bytes at a time.
+	while ((p = (const char *) memchr(p, '#', end - p))) {
+		const char *q = p++;
+		char close = 0;
+
+		// Only spaces and tabs may precede the `#` on its line.
+		while (q > data && (q[-1] == ' ' || q[-1] == '\t')) --q;
+		if (q > data && q[-1] != '\n') continue;
+		while (p < end && (*p == ' ' || *p == '\t')) ++p;
+		if (end - p < 7 || memcmp(p, "include", 7)) continue;
+		p += 7;
+		if (end - p >= 5 && !memcmp(p, "_next", 5)) p += 5;
+		while (p < end && (*p == ' ' || *p == '\t')) ++p;
+		if (p == end) break;
+		if (*p == '"') close = '"';
+		else if (*p == '<') close = '>';
+		else continue;
+		q = ++p;
+		while (p < end && *p != close && *p != '\n') ++p;
+		if (p == end || *p != close || p == q) continue;
+		directives.push_back(IncludeDirective{ string(q, p - q), close == '>' });
+	}
+}
+
+static void LoadIncludeCache(IncludeCache &cache) {
+	std::ifstream in(cache.FilePath.c_str(), std::ios::binary);
+	string line;
+
+	cache.Loaded = true;
+	if (!in || !std::getline(in, line) || line != includeCacheHeader) return;
+
+	while (std::getline(in, line)) {
+		IncludeEntry entry;
+		long long count = 0;
+		int offset = 0;
+
+		if (sscanf(line.c_str(), "F %lld %lld %lld %n", &entry.Stamp.Size, &entry.Stamp.MTimeNsec, &count, &offset) != 3 || !offset) {
+			cache.Files.clear();
+			return;
+		}
+		string path = line.substr(offset);
+		for (long long i = 0; i < count; ++i) {
+			if (!std::getline(in, line) || line.size() < 2 || (line[0] != '<' && line[0] != '"')) {
+				cache.Files.clear();
+				return;
+			}
+			entry.Directives.push_back(IncludeDirective{ line.substr(1), line[0] == '<' });
+		}
+		cache.Files[path] = entry;
+	}
+}
+
+// Caller must hold `cache.Mutex`.
+static void SaveIncludeCache(IncludeCache &cache) {
+	string content = string(includeCacheHeader) + "\n";
+
+	for (const auto &kv : cache.Files) {
+		content += "F " + std::to_string(kv.second.Stamp.Size) + " " + std::to_string(kv.second.Stamp.MTimeNsec) + " "
+			+ std::to_string(kv.second.Directives.size()) + " " + kv.first + "\n";
+		for (const IncludeDirective &d : kv.second.Directives) content += (d.Angled ? "<" : "\"") + d.Name + "\n";
+	}
+	try {
+		Build::MakeDirs(Build::Builder::DirName(cache.FilePath));
+		Build::WriteFileAtomic(cache.FilePath, content);
+		cache.Dirty = false;
+	} catch (std::exception &e) {
+		// The cache only saves time.
+	}
+}
+
+static IncludeCache * GetIncludeCache(const string &cacheDir) {
+	string filePath;
+
+	if (cacheDir.empty()) return NULL;
+	filePath = Build::AbsolutePath(Build::JoinPath(cacheDir, "includecache"));
+
+	std::lock_guard<std::mutex> lock(includeCachesMutex);
+	std::unique_ptr<IncludeCache> &cache = includeCaches[filePath];
+	if (!cache) {
+		cache.reset(new IncludeCache);
+		cache->FilePath = filePath;
+	}
+
+	return cache.get();
+}
+
+namespace {
+	// A walk of the include graph shared by the worker threads of one `ScanIncludes()` call.
+	struct IncludeScan {
+		vector<string> IncludeDirs;
+		string WorkingDir;
+		IncludeCache *Cache = NULL;
+		long long CacheableBefore = 0;
+
+		std::mutex Mutex;
+		std::condition_variable Cond;
+		// Files still to scan.
+		std::deque<string> Queue;
+		int Busy = 0;
+		// Headers each visited file includes, resolved; also the set of files already queued.
+		std::map<string, vector<string>> Includes;
+		// Whether candidate paths of the resolution exist, so each is stat'ed once.
+		std::map<string, bool> Exists;
+		string Error;
+
+		bool FileExists(const string &path) {
+			FileStamp stamp;
+			bool exists = false;
+
+			{
+				std::lock_guard<std::mutex> lock(Mutex);
+				auto it = Exists.find(path);
+				if (it != Exists.end()) return it->second;
+			}
+			exists = Build::StatFile(path, stamp);
+			std::lock_guard<std::mutex> lock(Mutex);
+			Exists[path] = exists;
+
+			return exists;
+		}
+
+		// Returns the path of the header named by `directive` in `path`, or an empty string for headers that
+		// are not found, e.g. system headers outside `IncludeDirs`.
+		string Resolve(const string &path, const IncludeDirective &directive) {
+			size_t slash = path.find_last_of("/\\");
+
+			if (Build::IsAbsolutePath(directive.Name)) return FileExists(directive.Name) ? Build::NormalizePath(directive.Name) : string();
+			// Quoted names are looked up next to the including file first.
+			if (!directive.Angled) {
+				string candidate = Build::NormalizePath(Build::JoinPath(slash == string::npos ? string() : path.substr(0, slash), directive.Name));
+
+				if (FileExists(candidate)) return candidate;
+			}
+			for (const string &dir : IncludeDirs) {
+				string candidate = Build::NormalizePath(Build::JoinPath(dir, directive.Name));
+
+				if (FileExists(candidate)) return candidate;
+			}
+
+			return string();
+		}
+
+		vector<IncludeDirective> Lex(const string &path) {
+			string absPath = Build::IsAbsolutePath(path) ? path : Build::NormalizePath(WorkingDir + "/" + path);
+			IncludeEntry entry;
+			string content;
+
+			if (!Build::StatFile(path, entry.Stamp)) throw runtime_error(string("unable to read file: ") + path);
+			if (Cache) {
+				std::lock_guard<std::mutex> lock(Cache->Mutex);
+				auto it = Cache->Files.find(absPath);
+				if (it != Cache->Files.end() && it->second.Stamp == entry.Stamp) {
+					++Build::Counters.StatCacheHits;
+					return it->second.Directives;
+				}
+			}
+
+			content = Build::ReadFile(path);
+			LexIncludes(content.data(), content.size(), entry.Directives);
+			// A file modified within the timestamp granularity of now might change again without its
+			// mtime changing, so only remember files that are old enough.
+			if (Cache && entry.Stamp.MTimeNsec < CacheableBefore) {
+				std::lock_guard<std::mutex> lock(Cache->Mutex);
+				Cache->Files[absPath] = entry;
+				Cache->Dirty = true;
+			}
+
+			return entry.Directives;
+		}
+
+		void Visit(const string &path, vector<string> &includes) {
+			for (const IncludeDirective &directive : Lex(path)) {
+				string header = Resolve(path, directive);
+
+				if (!header.empty()) includes.push_back(header);
+			}
+		}
+
+		void Work() {
+			std::unique_lock<std::mutex> lock(Mutex);
+
+			for (;;) {
+				vector<string> includes;
+				string path;
+
+				Cond.wait(lock, [this] { return !Queue.empty() || Busy == 0; });
+				if (Queue.empty()) break;
+				path = Queue.front();
+				Queue.pop_front();
+				++Busy;
+				lock.unlock();
+
+				try {
+					Visit(path, includes);
+				} catch (std::exception &e) {
+					lock.lock();
+					if (Error.empty()) Error = e.what();
+					lock.unlock();
+				}
+
+				lock.lock();
+				for (const string &header : includes) {
+					if (Includes.count(header)) continue;
+					Includes[header];
+					Queue.push_back(header);
+				}
+				Includes[path] = includes;
+				--Busy;
+				Cond.notify_all();
+			}
+			Cond.notify_all();
+		}
+	};
+}
+
+std::map<string, vector<string>> Build::Builder::ScanIncludes(const vector<string> &sources, const vector<string> &includeDirs) {
+	IncludeScan scan;
+	std::map<string, vector<string>> headers;
+	vector<std::thread> threads;
+	unsigned threadCount = 0;
+	string cacheDir;
+
+	Configure([&cacheDir](Builder &b) {
+		cacheDir = b.CacheDir;
+	});
+	scan.IncludeDirs = includeDirs;
+	scan.WorkingDir = GetCurrentWorkingDir();
+	scan.Cache = GetIncludeCache(cacheDir);
+	scan.CacheableBefore = ((long long) time(NULL) - 1) * 1000000000LL;
+	for (const string &source : sources) {
+		string path = NormalizePath(source);
+
+		if (scan.Includes.count(path)) continue;
+		scan.Includes[path];
+		scan.Queue.push_back(path);
+	}
+
+	if (scan.Cache) {
+		std::lock_guard<std::mutex> lock(scan.Cache->Mutex);
+		if (!scan.Cache->Loaded) LoadIncludeCache(*scan.Cache);
+	}
+
+	threadCount = std::thread::hardware_concurrency();
+	if (threadCount > 8) threadCount = 8;
+	for (unsigned i = 1; i < threadCount; ++i) {
+		threads.push_back(std::thread([&scan] { scan.Work(); }));
+	}
+	scan.Work();
+	for (std::thread &t : threads) t.join();
+
+	if (scan.Cache) {
+		std::lock_guard<std::mutex> lock(scan.Cache->Mutex);
+		if (scan.Cache->Dirty) SaveIncludeCache(*scan.Cache);
+	}
+	if (!scan.Error.empty()) throw runtime_error(scan.Error);
+
+	// Each source depends on the headers reachable from it.
+	for (const string &source : sources) {
+		string path = NormalizePath(source);
+		std::set<string> reached;
+		vector<string> stack(1, path);
+
+		while (!stack.empty()) {
+			string file = stack.back();
+
+			stack.pop_back();
+			for (const string &header : scan.Includes[file]) {
+				if (header != path && reached.insert(header).second) stack.push_back(header);
+			}
+		}
+		headers[source].assign(reached.begin(), reached.end());
+	}
+
+	return headers;
+}
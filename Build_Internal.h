@@ -0,0 +1,242 @@
+#pragma once
+
+// Helpers shared between the library's source files. Not part of the public API.
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Build.h"
+
+namespace Build {
+	// Runs `cmd` with the system shell and returns its wait status, like `system()`, but without
+	// changing the signal dispositions of the whole process, so it may be called from any thread.
+	// Returns -1 if the shell could not be started.
+	// Adds the resources used by the shell and the commands it ran to `usage`, if not NULL.
+	int RunShell(const std::string &cmd, ResourceUsage *usage = NULL);
+	// Like `RunShell()`, but stores the standard output and error of `cmd` in `output`. With `timeoutSeconds`,
+	// kills `cmd` and the processes it started once that many seconds passed, and sets `timedOut` (not on Windows).
+	int RunShellCapture(const std::string &cmd, std::string &output, ResourceUsage *usage = NULL,
+		unsigned timeoutSeconds = 0, bool *timedOut = NULL);
+
+	// Returns a job, already finished, that skipped `command`.
+	Job SkippedJob(const std::string &command);
+
+	// Prints `[<tag>] <cmd>` as one line, so lines of concurrent commands do not interleave.
+	void PrintCommand(const std::string &tag, const std::string &cmd);
+	// Prints `text` to `stream` as whole lines, clearing the progress status line first if it is shown.
+	void PrintOutput(const std::string &text, FILE *stream = stdout);
+
+	// Progress of the jobs of Builders with `ShowProgress` set, process-wide. On a terminal, it is a status
+	// line redrawn at most every 100 ms; otherwise, one line per finished job.
+	void ProgressQueued();
+	// Returns the id of the job, shown as `name` while it runs.
+	unsigned ProgressStarted(const std::string &name);
+	// Prints `command` if the job failed, then `output`.
+	void ProgressFinished(unsigned id, bool failed, const std::string &command, const std::string &output);
+
+	// Backs `Builder::Stats()`.
+	struct StatCounters {
+		std::atomic<unsigned long long> ProcessesSpawned{0};
+		std::atomic<unsigned long long> SpawnNsec{0};
+		std::atomic<unsigned long long> WaitNsec{0};
+		std::atomic<unsigned long long> StatCalls{0};
+		std::atomic<unsigned long long> StatCacheHits{0};
+		std::atomic<unsigned long long> CacheHits{0};
+		std::atomic<unsigned long long> CacheMisses{0};
+		std::atomic<unsigned long long> BytesCopied{0};
+		std::atomic<unsigned long long> JobsSkipped{0};
+		std::atomic<unsigned long long> JobsCutOff{0};
+	};
+	extern StatCounters Counters;
+	// Writes `Builder::Stats()` to `path` as JSON when the process exits.
+	void SetStatsFile(const std::string &path);
+	std::string StatsJSON(const Statistics &stats);
+
+	// Size and modification time of a file.
+	struct FileStamp {
+		long long Size = 0;
+		long long MTimeNsec = 0;
+
+		bool operator==(const FileStamp &other) const { return Size == other.Size && MTimeNsec == other.MTimeNsec; }
+		bool operator!=(const FileStamp &other) const { return !(*this == other); }
+	};
+
+	// Returns false if `path` does not exist; throws if it cannot be stat'ed otherwise.
+	bool StatFile(const std::string &path, FileStamp &stamp);
+	// Sets the modification time of `path`, keeping its access time. Returns false on failure.
+	bool SetFileMTime(const std::string &path, long long mtimeNsec);
+	std::string ReadFile(const std::string &path);
+	// Writes `content` to a temporary file, then renames it to `path`.
+	void WriteFileAtomic(const std::string &path, const std::string &content);
+	// Creates `dirPath` and its missing parents.
+	void MakeDirs(const std::string &dirPath);
+
+	bool IsAbsolutePath(const std::string &path);
+	// Joins `path` to `dir`, unless `path` is absolute.
+	std::string JoinPath(const std::string &dir, const std::string &path);
+	// Removes `.` and `..` segments and duplicate separators.
+	std::string NormalizePath(const std::string &path);
+	std::string AbsolutePath(const std::string &path);
+	// Returns `path` relative to the directory `dir`.
+	std::string RelativePath(const std::string &path, const std::string &dir);
+
+	// Returns `program` followed by `args`, or, if that makes a command too long for the shell, by a
+	// response file in `dir` holding `args`. Arguments relying on the shell are left on the command line.
+	std::string ResponseFileCommand(const std::string &program, const std::string &args, const std::string &dir);
+	// Whether `command` is too long for the shell, so that its arguments go in a response file.
+	bool CommandTooLong(const std::string &command);
+
+	// Makes the commands run from now on see the environment of `Builder::Deterministic`: that of the process,
+	// with `LC_ALL=C`, `TZ=UTC` and `SOURCE_DATE_EPOCH`. Process-wide, like the environment itself.
+	void UseDeterministicEnvironment();
+
+	// Returns the exit code of a `RunShell()` wait status; throws if the shell could not be started.
+	int ExitCodeOfStatus(int status);
+
+	// Connects to, or listens on, `unix:<path>` or `<host>:<port>`, and returns the socket.
+	int OpenSocket(const std::string &address, bool listening);
+	void SendAll(int fd, const char *data, size_t size);
+
+	// Drops the flags that only matter when preprocessing, and may refer to files the workers do not have.
+	std::string CompileOnlyFlags(const std::string &flags);
+	// Whether `command` passes `flag` as an argument of its own, after the first word.
+	bool HasFlag(const std::string &command, const std::string &flag);
+	// Has one of `workers` compile the preprocessed source of `step`. Returns false if none could be reached.
+	bool CompileOnWorker(const std::vector<std::string> &workers, const CompileStep &step, const std::string &flags,
+		const std::string &preprocessed, int &exitCode, std::string &diagnostics, std::string &object);
+
+	// Where `Builder::Compile()` and `Builder::Link()` look up and store their outputs.
+	struct OutputCache {
+		// Local directory, or empty.
+		std::string Dir;
+		// Base URL of the HTTP cache, or empty.
+		std::string RemoteURL;
+		// Queues an upload to the HTTP cache; empty if uploads are disabled.
+		std::function<void(std::function<void()>)> Upload;
+		// Identifies the compiler, so that different compilers do not share entries.
+		std::string Toolchain;
+	};
+
+	struct CompileRequest {
+		std::vector<std::string> Workers;
+		// Compiler command line, e.g. `g++ -std=c++17`.
+		std::string CommandLine;
+		CompileStep Step;
+		// Command compiling `Step` here.
+		std::string LocalCommand;
+		// Where the local command writes the dependency file, if its flags ask for one.
+		std::string DepFile;
+		bool PrintCommand = false;
+		bool CacheOutputs = false;
+		OutputCache Cache;
+	};
+
+	// Restores the object file of `request.Step` from the cache, or compiles it on one of `request.Workers`
+	// or here, and returns the exit code. Sets `result.Cached` on cache hits.
+	int RunCompile(const CompileRequest &request, ExecResult &result);
+
+	struct LinkRequest {
+		LinkStep Step;
+		// Compiler command line, e.g. `g++ -std=c++17`.
+		std::string CommandLine;
+		bool CacheOutputs = false;
+		OutputCache Cache;
+		// For `Step.LTO`: the linking compiler, and the LTO cache directory (or empty) and its size limit.
+		ToolchainInfo Toolchain;
+		std::string LTOCacheDir;
+		unsigned long long LTOCacheSize = 0;
+		// Where long argument lists are spilled; see `ResponseFileCommand()`.
+		std::string ResponseFileDir;
+	};
+
+	// File `step` links: its `Output`, or `<Output>.<Version>` for a versioned shared library.
+	std::string LinkOutput(const LinkStep &step);
+	// Symbolic links to the versioned shared library of `step`, e.g. `<Output>.1` and `<Output>`; none for
+	// other steps, and on Windows.
+	std::vector<std::string> LinkSymlinks(const LinkStep &step);
+	// Shell commands run after linking `step`, each preceded by ` && `: splitting off the debug information,
+	// unless it was `restored` from the cache along with the output, and creating `LinkSymlinks()`.
+	std::string LinkFinishCommands(const LinkStep &step, bool restored);
+	// Arguments of `request.CommandLine` linking `request.Step`, with `threads` LTO threads.
+	std::string LinkArgs(const LinkRequest &request, unsigned threads);
+	// Command line linking `request.Step`, with `threads` LTO threads.
+	std::string LinkCommand(const LinkRequest &request, unsigned threads);
+	// Restores the output of `request.Step` from the cache, or links it here, and returns the exit code.
+	int RunLink(const LinkRequest &request, ExecResult &result, unsigned threads);
+
+	// Flags making `toolchain` link LTO objects on `threads` threads, caching in `cacheDir` if not empty.
+	std::string LTOLinkFlags(const ToolchainInfo &toolchain, const std::string &flags, unsigned threads, const std::string &cacheDir);
+	// Removes the least recently used files under `dirPath` until they take at most `maxSize` bytes.
+	void PruneCacheDir(const std::string &dirPath, unsigned long long maxSize);
+
+	// Whether the local cache has the output of `request.Step`, for `Builder::Plan`. The remote cache
+	// is not asked, so that planning stays fast.
+	bool LinkOutputsCached(const LinkRequest &request);
+
+	// Returns the prerequisites listed in the Make-style dependency file `path`, or none if it does not exist.
+	std::vector<std::string> ReadDepFile(const std::string &path);
+
+	// Files of a build step, for telling whether it is up to date.
+	struct StepTarget {
+		std::string Output;
+		// More files the step writes, e.g. the BMI of a module interface unit.
+		std::vector<std::string> OtherOutputs;
+		std::vector<std::string> Inputs;
+		// Make-style dependency file listing more inputs, e.g. written by `-MMD`. It need not exist.
+		std::string DepFile;
+		// Identifies the step's command: a different one means the output is out of date.
+		std::string Command;
+		// Whether the cache has the step's output, if the step is cached.
+		std::function<bool()> InCache;
+		// Whether the step skips itself when up to date, whatever `Builder::SkipUpToDate` is.
+		bool SkipsItself = false;
+		// Start of the command, after which the arguments may go in a response file if it is too long.
+		std::string Program;
+	};
+
+	// An output's entry in the build log, `<CacheDir>/log`.
+	struct BuildLogEntry {
+		// `HashHex()` of the command that last built the output.
+		std::string CommandHash;
+		// How long the command took, in milliseconds, or -1 if unknown.
+		long long DurationMsec = -1;
+		// What its processes used.
+		ResourceUsage Usage;
+		// `Sha256Hex()` of the output's content when it was last built, or empty if unknown.
+		std::string OutputHash;
+		// If the output was rebuilt unchanged and kept its older modification time, so that the steps using it
+		// are not rerun: the newest modification time of its inputs then, which the step itself compares
+		// its inputs against instead. Otherwise 0.
+		long long RestatMTimeNsec = 0;
+		// For steps without declared outputs, keyed by the hash of their command: the command, shortened.
+		std::string Command;
+	};
+
+	// Looks up `key` (an output path, or `#<HashHex(command)>` for commands without declared outputs) in
+	// the build log `logPath`. The log is read once per process.
+	bool LookUpBuildLog(const std::string &logPath, const std::string &key, BuildLogEntry &entry);
+	// Records that `key` was built by the command `commandHash` in `durationMsec` milliseconds using `usage`,
+	// or, if `durationMsec` is negative, as recorded before, with the content hash `outputHash` (kept as
+	// recorded if empty), `restatMTimeNsec` and `command` (see `BuildLogEntry`). Failures to write the log are ignored.
+	void RecordBuildLog(const std::string &logPath, const std::string &key, const std::string &commandHash, long long durationMsec,
+		const ResourceUsage &usage = ResourceUsage(), const std::string &outputHash = std::string(), long long restatMTimeNsec = 0,
+		const std::string &command = std::string());
+	// Returns the entries of the build log `logPath`, by key.
+	std::map<std::string, BuildLogEntry> ReadBuildLog(const std::string &logPath);
+	// Returns why `target` is out of date, e.g. `newer input: a.h`, or an empty string if it is up to
+	// date. Inputs in `rebuilt` count as changed. The command is only checked if `logPath` is not empty.
+	std::string OutOfDateReason(const StepTarget &target, const std::string &logPath, const std::set<std::string> *rebuilt);
+	// Returns the newest modification time of the inputs of `target`, including those of its dependency file,
+	// or 0 if it has none. Missing inputs are left out.
+	long long NewestInputMTime(const StepTarget &target);
+
+	// Short, non-cryptographic hash of `data`, as 16 hex digits. For cache keys and file names.
+	std::string HashHex(const std::string &data);
+	// SHA-256 of `data`, as 64 hex digits. For content-addressed storage.
+	std::string Sha256Hex(const std::string &data);
+}
@@ -0,0 +1,1165 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <errno.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char **environ;
+#endif
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::ExecResult;
+using Build::Job;
+using Build::JobState;
+using Build::EventLoop;
+using Build::EventLoopState;
+
+// Guards the completion state of all jobs, so that waiting for any one of several jobs is simple.
+static std::mutex jobsMutex;
+static std::condition_variable jobsDone;
+
+// Uploads to the remote cache running at once, per Builder.
+static const unsigned maxUploads = 4;
+
+struct Build::JobState {
+	string Command;
+	// Runs the job instead of `Command`, on `Slots` slots, and returns its exit code.
+	std::function<int(ExecResult &, unsigned)> Run;
+	// Builds `Command` once the number of slots is known, if set.
+	std::function<string(unsigned)> CommandForSlots;
+	// Job slots the job may use, e.g. for the threads of an LTO link. It gets as many as are free
+	// when it starts, and they stay reserved until it finishes.
+	unsigned MaxSlots = 1;
+	unsigned Slots = 1;
+	// Printed before `Command`.
+	string Tag = "INVOKE";
+	bool PrintCommand = false;
+	// Whether the job shows on the progress status line instead, with its output captured.
+	bool Progress = false;
+	// Files of the step, if declared. The step is skipped if `SkipUpToDate` is set and they are up to date.
+	std::shared_ptr<Build::StepTarget> Target;
+	bool SkipUpToDate = false;
+	// Build log recording the step's command and duration when it succeeds, or empty.
+	string LogPath;
+	bool Finished = false;
+	ExecResult Result;
+	// Message of the exception to throw from `Wait()`, if the command could not be invoked.
+	string Error;
+	vector<std::function<void()>> OnFinish;
+};
+
+struct Build::EventLoopState {
+	std::mutex Mutex;
+	std::condition_variable Cond;
+	std::deque<std::function<void()>> Ready;
+};
+
+static thread_local EventLoop *currentEventLoop = NULL;
+
+// Jobs started with `Builder::Once()`, shared by a Builder and its variants.
+struct Build::OnceJobs {
+	std::mutex Mutex;
+	std::map<string, Job> Jobs;
+};
+
+// Marks `job` finished, wakes up whoever waits for it, and runs its `OnFinish` callbacks.
+static void FinishJob(JobState &job, const string &error, int exitCode) {
+	vector<std::function<void()>> onFinish;
+
+	{
+		std::lock_guard<std::mutex> lock(jobsMutex);
+		job.Error = error;
+		job.Result.ExitCode = exitCode;
+		job.Finished = true;
+		onFinish.swap(job.OnFinish);
+		jobsDone.notify_all();
+	}
+	for (std::function<void()> &fn : onFinish) fn();
+}
+
+// Runs queued jobs on up to `Builder::Jobs` worker threads, each of which waits for one child
+// process at a time.
+struct Build::Scheduler {
+	std::mutex Mutex;
+	std::condition_variable Cond;
+	std::deque<std::shared_ptr<JobState>> Queue;
+	vector<std::thread> Workers;
+	unsigned Running = 0;
+	unsigned Limit = 1;
+	bool Stopping = false;
+
+	~Scheduler() {
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Stopping = true;
+		}
+		Cond.notify_all();
+		for (std::thread &worker : Workers) worker.join();
+	}
+
+	void Submit(std::shared_ptr<JobState> job, unsigned limit) {
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Limit = limit < 1 ? 1 : limit;
+			Queue.push_back(job);
+			if (Workers.size() < Limit && Workers.size() < Queue.size() + Running) {
+				Workers.push_back(std::thread([this] { Work(); }));
+			}
+		}
+		Cond.notify_all();
+	}
+
+	// Waits until the queue is empty and no job is running.
+	void WaitIdle() {
+		std::unique_lock<std::mutex> lock(Mutex);
+
+		Cond.wait(lock, [this] { return Queue.empty() && Running == 0; });
+	}
+
+	void Work() {
+		std::unique_lock<std::mutex> lock(Mutex);
+
+		for (;;) {
+			std::shared_ptr<JobState> job;
+			unsigned slots = 1;
+
+			Cond.wait(lock, [this] { return (!Queue.empty() && Running < Limit) || (Stopping && Queue.empty()); });
+			if (Queue.empty()) return;
+			job = Queue.front();
+			Queue.pop_front();
+			slots = std::min(job->MaxSlots, Limit - Running);
+			job->Slots = slots;
+			Running += slots;
+			lock.unlock();
+
+			Run(*job, [this, slots] {
+				std::lock_guard<std::mutex> lock(Mutex);
+				Running -= slots;
+				Cond.notify_all();
+			});
+
+			lock.lock();
+		}
+	}
+
+	// Runs `job`, then calls `release` before marking it finished, so that jobs queued by whoever
+	// waits for it see its slots free.
+	static void Run(JobState &job, std::function<void()> release) {
+		int ret = 0, exitCode = 0;
+		unsigned progressId = 0;
+		string error, output, outputHash;
+		Build::FileStamp previousStamp;
+		Build::BuildLogEntry previous;
+		long long newestInput = 0, restatMTime = 0;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		if (job.CommandForSlots) job.Command = job.Result.Command = job.CommandForSlots(job.Slots);
+		// Checked when the job starts rather than when it is queued, after the steps it waited for.
+		if (job.Target && job.SkipUpToDate) {
+			try {
+				job.Result.Skipped = Build::OutOfDateReason(*job.Target, job.LogPath, NULL).empty();
+			} catch (std::exception &e) {
+				// Run the step, which reports the problem.
+			}
+			// For the early cutoff below.
+			if (!job.Result.Skipped && !job.LogPath.empty()) {
+				try {
+					if (Build::StatFile(job.Target->Output, previousStamp) && Build::LookUpBuildLog(job.LogPath, job.Target->Output, previous)
+						&& !previous.OutputHash.empty()) {
+						newestInput = Build::NewestInputMTime(*job.Target);
+					}
+				} catch (std::exception &e) {
+					previous.OutputHash.clear();
+				}
+			}
+		}
+		if (job.Progress) progressId = Build::ProgressStarted(job.Target ? job.Target->Output : job.Command);
+		else if (job.PrintCommand && !job.Result.Skipped) Build::PrintCommand(job.Tag, job.Command);
+		if (job.Result.Skipped) {
+			// Up to date: nothing to run.
+			++Build::Counters.JobsSkipped;
+		} else if (job.Run) {
+			try {
+				exitCode = job.Run(job.Result, job.Slots);
+			} catch (std::exception &e) {
+				error = e.what();
+			}
+		} else {
+			ret = job.Progress ? Build::RunShellCapture(job.Command, output, &job.Result.Usage) : Build::RunShell(job.Command, &job.Result.Usage);
+			if (ret == -1) {
+				error = "invocation error";
+			} else {
+#if defined(WINDOWS)
+				exitCode = ret;
+#else
+				exitCode = WIFEXITED(ret) ? WEXITSTATUS(ret) : -1;
+#endif
+			}
+		}
+		if (!job.LogPath.empty() && !job.Result.Skipped && error.empty() && !exitCode) {
+			string hash = Build::HashHex(job.Target ? job.Target->Command : job.Command);
+			long long duration = (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - start).count();
+
+			// Early cutoff: an output rebuilt byte for byte, e.g. after an edit to a comment, gets its modification
+			// time back, so that the steps using it stay up to date.
+			if (job.Target && job.SkipUpToDate) {
+				try {
+					outputHash = Build::Sha256Hex(Build::ReadFile(job.Target->Output));
+					if (outputHash == previous.OutputHash && Build::SetFileMTime(job.Target->Output, previousStamp.MTimeNsec)) {
+						restatMTime = newestInput;
+						++Build::Counters.JobsCutOff;
+					}
+				} catch (std::exception &e) {
+					// The steps using it run.
+				}
+			}
+			// Restoring from the cache says nothing about how long the step takes.
+			Build::RecordBuildLog(job.LogPath, job.Target ? job.Target->Output : "#" + hash, hash, job.Result.Cached ? -1 : duration,
+				job.Result.Usage, outputHash, restatMTime, job.Target ? string() : job.Command);
+		}
+
+		if (job.Progress) Build::ProgressFinished(progressId, !error.empty() || exitCode, job.Command, output);
+
+		release();
+		FinishJob(job, error, exitCode);
+	}
+};
+
+// Counts a child process, started at `start`.
+static void CountSpawn(std::chrono::steady_clock::time_point start) {
+	++Build::Counters.ProcessesSpawned;
+	Build::Counters.SpawnNsec += (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+// Waits on `jobsDone` with `lock` held until `done` returns true, counting the time blocked.
+template <typename Predicate>
+static void WaitForJobs(std::unique_lock<std::mutex> &lock, Predicate done) {
+	std::chrono::steady_clock::time_point start;
+
+	if (done()) return;
+	start = std::chrono::steady_clock::now();
+	jobsDone.wait(lock, done);
+	Build::Counters.WaitNsec += (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+#if !defined(WINDOWS)
+// Adds the resources used by a child process, as reported by `wait4()`, to `usage`.
+static void AddRUsage(const struct rusage &ru, Build::ResourceUsage &usage) {
+	long long maxRSSKiB = (long long) ru.ru_maxrss;
+
+#if defined(MACOS)
+	// In bytes there.
+	maxRSSKiB /= 1024;
+#endif
+	usage.UserSeconds += (double) ru.ru_utime.tv_sec + (double) ru.ru_utime.tv_usec / 1e6;
+	usage.SystemSeconds += (double) ru.ru_stime.tv_sec + (double) ru.ru_stime.tv_usec / 1e6;
+	if (maxRSSKiB > usage.MaxRSSKiB) usage.MaxRSSKiB = maxRSSKiB;
+	usage.MinorFaults += (long long) ru.ru_minflt;
+	usage.MajorFaults += (long long) ru.ru_majflt;
+	usage.VoluntarySwitches += (long long) ru.ru_nvcsw;
+	usage.InvoluntarySwitches += (long long) ru.ru_nivcsw;
+}
+
+// Environment of the commands once `UseDeterministicEnvironment()` was called: the variables, and pointers to
+// them ending with NULL.
+static vector<string> deterministicVariables;
+static vector<char *> deterministicEnvironment;
+static std::atomic<bool> deterministicEnvironmentUsed(false);
+#endif
+
+static std::once_flag deterministicEnvironmentOnce;
+
+void Build::UseDeterministicEnvironment() {
+	std::call_once(deterministicEnvironmentOnce, [] {
+		bool haveEpoch = getenv("SOURCE_DATE_EPOCH") != NULL;
+
+#if defined(WINDOWS)
+		// `system()` passes on the environment of the process.
+		_putenv_s("LC_ALL", "C");
+		_putenv_s("TZ", "UTC");
+		if (!haveEpoch) _putenv_s("SOURCE_DATE_EPOCH", "0");
+#else
+		for (char **var = environ; *var; ++var) {
+			string entry = *var;
+
+			// The locale settings are replaced by `LC_ALL`.
+			if (entry.rfind("LC_", 0) == 0 || entry.rfind("LANG=", 0) == 0 || entry.rfind("LANGUAGE=", 0) == 0 || entry.rfind("TZ=", 0) == 0) continue;
+			deterministicVariables.push_back(entry);
+		}
+		deterministicVariables.push_back("LC_ALL=C");
+		deterministicVariables.push_back("TZ=UTC");
+		if (!haveEpoch) deterministicVariables.push_back("SOURCE_DATE_EPOCH=0");
+		for (string &entry : deterministicVariables) deterministicEnvironment.push_back(&entry[0]);
+		deterministicEnvironment.push_back(NULL);
+		deterministicEnvironmentUsed = true;
+#endif
+	});
+}
+
+#if !defined(WINDOWS)
+// Spawns `sh -c cmd` with `actions` and `attr`, calls `whileRunning` with its pid, waits for it, and adds
+// what it used to `usage`, if not NULL. The shell waits for the commands it runs, so they count too.
+static int SpawnShell(const string &cmd, const posix_spawn_file_actions_t *actions, const posix_spawnattr_t *attr,
+	Build::ResourceUsage *usage, std::function<void(pid_t)> whileRunning) {
+	char **env = deterministicEnvironmentUsed ? deterministicEnvironment.data() : environ;
+	pid_t pid = 0;
+	int status = 0;
+	const char *argv[] = { "sh", "-c", cmd.c_str(), NULL };
+	struct rusage ru;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if (posix_spawn(&pid, "/bin/sh", actions, attr, (char * const *) argv, env)) return -1;
+	CountSpawn(start);
+	if (whileRunning) whileRunning(pid);
+	while (wait4(pid, &status, 0, &ru) == -1) {
+		if (errno != EINTR) return -1;
+	}
+	if (usage) AddRUsage(ru, *usage);
+
+	return status;
+}
+#endif
+
+int Build::RunShell(const string &cmd, ResourceUsage *usage) {
+#if defined(WINDOWS)
+	++Counters.ProcessesSpawned;
+	return system(cmd.c_str());
+#else
+	return SpawnShell(cmd, NULL, NULL, usage, std::function<void(pid_t)>());
+#endif
+}
+
+int Build::RunShellCapture(const string &cmd, string &output, ResourceUsage *usage, unsigned timeoutSeconds, bool *timedOut) {
+	char buf[4096];
+
+	output.clear();
+	if (timedOut) *timedOut = false;
+#if defined(WINDOWS)
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	FILE *pipe = popen((cmd + " 2>&1").c_str(), "r");
+	size_t n = 0;
+
+	if (!pipe) return -1;
+	CountSpawn(start);
+	while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0) output.append(buf, n);
+
+	return pclose(pipe);
+#else
+	int fds[2] = { -1, -1 }, status = 0;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+
+	// Close-on-exec, so that the children of other threads do not hold the pipe open.
+#if defined(LINUX)
+	if (pipe2(fds, O_CLOEXEC)) return -1;
+#else
+	if (pipe(fds)) return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+	// With a timeout, the shell leads its own process group, so that the commands it started are killed with it.
+	posix_spawnattr_init(&attr);
+	if (timeoutSeconds) {
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+		posix_spawnattr_setpgroup(&attr, 0);
+	}
+	status = SpawnShell(cmd, &actions, &attr, usage, [&](pid_t pid) {
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+		ssize_t n = 0;
+
+		close(fds[1]);
+		fds[1] = -1;
+		for (;;) {
+			if (timeoutSeconds) {
+				struct pollfd pfd = { fds[0], POLLIN, 0 };
+				long long left = (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+				int ready = left > 0 ? poll(&pfd, 1, (int) std::min(left, 60000LL)) : 0;
+
+				if (ready < 0 && errno == EINTR) continue;
+				if (ready == 0 && left > 60000) continue;
+				if (ready == 0) {
+					kill(-pid, SIGKILL);
+					if (timedOut) *timedOut = true;
+					break;
+				}
+			}
+			n = read(fds[0], buf, sizeof(buf));
+			if (n == 0) break;
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) break;
+			output.append(buf, (size_t) n);
+		}
+	});
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (fds[1] >= 0) close(fds[1]);
+	close(fds[0]);
+
+	return status;
+#endif
+}
+
+void Build::PrintCommand(const string &tag, const string &cmd) {
+	PrintOutput("[" + tag + "] " + cmd + "\n");
+}
+
+ExecResult Build::Job::Wait() const {
+	std::unique_lock<std::mutex> lock(jobsMutex);
+
+	if (!State) throw runtime_error("invocation error");
+	WaitForJobs(lock, [this] { return State->Finished; });
+	if (!State->Error.empty()) throw runtime_error(State->Error);
+
+	return State->Result;
+}
+
+Job Build::SkippedJob(const string &command) {
+	Job job;
+
+	job.State = std::make_shared<JobState>();
+	job.State->Command = job.State->Result.Command = command;
+	job.State->Result.Skipped = true;
+	job.State->Finished = true;
+
+	return job;
+}
+
+bool Build::Job::Done() const {
+	std::lock_guard<std::mutex> lock(jobsMutex);
+
+	return !State || State->Finished;
+}
+
+void Build::Job::OnFinish(std::function<void()> fn) const {
+	{
+		std::lock_guard<std::mutex> lock(jobsMutex);
+		if (State && !State->Finished) {
+			State->OnFinish.push_back(fn);
+			return;
+		}
+	}
+	fn();
+}
+
+Build::EventLoop::EventLoop() : State(std::make_shared<EventLoopState>()) {
+}
+
+void Build::EventLoop::Post(std::function<void()> fn) const {
+	std::shared_ptr<EventLoopState> state = State;
+	std::lock_guard<std::mutex> lock(state->Mutex);
+
+	state->Ready.push_back(fn);
+	state->Cond.notify_all();
+}
+
+void Build::EventLoop::Run(std::function<void()> start, std::function<bool()> done) {
+	EventLoop *outer = currentEventLoop;
+
+	currentEventLoop = this;
+	try {
+		start();
+		while (!done()) {
+			std::function<void()> fn;
+			{
+				std::unique_lock<std::mutex> lock(State->Mutex);
+				State->Cond.wait(lock, [this] { return !State->Ready.empty(); });
+				fn = State->Ready.front();
+				State->Ready.pop_front();
+			}
+			fn();
+		}
+	} catch (std::exception &e) {
+		currentEventLoop = outer;
+		throw;
+	}
+	currentEventLoop = outer;
+}
+
+EventLoop * Build::EventLoop::Current() {
+	return currentEventLoop;
+}
+
+size_t Build::Builder::WaitAny(const vector<Job> &jobs) {
+	std::unique_lock<std::mutex> lock(jobsMutex);
+	size_t index = 0;
+
+	WaitForJobs(lock, [&] {
+		for (index = 0; index < jobs.size(); ++index) {
+			if (!jobs[index].State || jobs[index].State->Finished) return true;
+		}
+		return jobs.empty();
+	});
+
+	return index;
+}
+
+vector<ExecResult> Build::Builder::WaitAll(const vector<Job> &jobs) {
+	vector<ExecResult> results;
+	string error;
+
+	for (const Job &job : jobs) {
+		try {
+			results.push_back(job.Wait());
+		} catch (std::exception &e) {
+			if (error.empty()) error = e.what();
+			results.push_back(ExecResult());
+		}
+	}
+	if (!error.empty()) throw runtime_error(error);
+
+	return results;
+}
+
+std::shared_ptr<Build::Scheduler> Build::Builder::GetScheduler() {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	if (!JobScheduler) JobScheduler = std::make_shared<Scheduler>();
+	return JobScheduler;
+}
+
+std::shared_ptr<Build::Scheduler> Build::Builder::GetRemoteScheduler() {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	if (!RemoteScheduler) RemoteScheduler = std::make_shared<Scheduler>();
+	return RemoteScheduler;
+}
+
+std::shared_ptr<Build::Scheduler> Build::Builder::GetUploadScheduler() {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	if (!UploadScheduler) UploadScheduler = std::make_shared<Scheduler>();
+	return UploadScheduler;
+}
+
+std::shared_ptr<Build::OnceJobs> Build::Builder::GetOnceJobs() {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	if (!SharedOnceJobs) SharedOnceJobs = std::make_shared<OnceJobs>();
+	return SharedOnceJobs;
+}
+
+Job Build::Builder::SubmitJob(const string &cmdExpr, std::function<int(ExecResult &, unsigned)> run, bool remote,
+	unsigned maxSlots, std::function<string(unsigned)> commandForSlots, const StepTarget *target, const vector<Job> &after, bool logged) {
+	bool dryRun = true, printCommand = true, plan = false, progress = false, ninja = false;
+	unsigned limit = 1;
+	Job job;
+	std::shared_ptr<Scheduler> scheduler;
+	std::shared_ptr<JobState> state;
+	std::shared_ptr<std::atomic<size_t>> waiting;
+
+	RecordCommand(cmdExpr, dryRun, printCommand, plan, progress, ninja);
+	job.State = std::make_shared<JobState>();
+	job.State->Command = cmdExpr;
+	job.State->Run = run;
+	job.State->MaxSlots = maxSlots < 1 ? 1 : maxSlots;
+	job.State->CommandForSlots = commandForSlots;
+	job.State->Result.Command = cmdExpr;
+	job.State->PrintCommand = printCommand;
+	job.State->Progress = progress;
+	if (remote) job.State->Tag = "REMOTE";
+	if (ninja) {
+		vector<string> afterOutputs;
+
+		if (printCommand) PrintCommand("NINJA", cmdExpr);
+		for (const Job &dependency : after) {
+			if (dependency.State && dependency.State->Target) afterOutputs.push_back(dependency.State->Target->Output);
+		}
+		// Named by its output, so that the steps queued after it find it.
+		job.State->Target = std::make_shared<StepTarget>(target ? *target : StepTarget());
+		job.State->Target->Output = NinjaStep(cmdExpr, target, target ? target->Program : string(), maxSlots, afterOutputs, false);
+		job.State->Finished = true;
+		return job;
+	}
+	if (plan) {
+		job.State->Result.Skipped = !PlanStep(cmdExpr, target);
+		job.State->Finished = true;
+		return job;
+	}
+	if (dryRun) {
+		// Dry runs complete right away, so commands are printed in submission order.
+		if (printCommand) PrintCommand("DRYRUN", cmdExpr);
+		job.State->Finished = true;
+		return job;
+	}
+
+	if (target) job.State->Target = std::make_shared<StepTarget>(*target);
+	if (logged) job.State->LogPath = BuildLogPath();
+	Configure([&limit, &job, remote](Builder &b) {
+		limit = b.Jobs;
+		if (remote) limit = b.RemoteJobs ? b.RemoteJobs : b.Jobs * (unsigned) b.RemoteWorkers.size();
+		job.State->SkipUpToDate = b.SkipUpToDate;
+	});
+	if (progress) ProgressQueued();
+	scheduler = remote ? GetRemoteScheduler() : GetScheduler();
+	if (after.empty()) {
+		scheduler->Submit(job.State, limit);
+		return job;
+	}
+
+	// Queued once the last of `after` finishes, unless one of them failed.
+	state = job.State;
+	waiting = std::make_shared<std::atomic<size_t>>(after.size());
+	for (const Job &dependency : after) {
+		dependency.OnFinish([scheduler, state, waiting, after, limit] {
+			string failed;
+
+			if (--*waiting) return;
+			for (const Job &other : after) {
+				if (other.State && (!other.State->Error.empty() || other.State->Result.ExitCode)) {
+					failed = other.State->Target ? other.State->Target->Output : other.State->Command;
+					break;
+				}
+			}
+			if (failed.empty()) {
+				scheduler->Submit(state, limit);
+				return;
+			}
+			if (state->Progress) ProgressFinished(ProgressStarted(state->Command), true, state->Command, string());
+			FinishJob(*state, "dependency failed: " + failed, 0);
+		});
+	}
+	return job;
+}
+
+Job Build::Builder::ExecRawAsync(string cmdExpr) {
+	return SubmitJob(cmdExpr, std::function<int(ExecResult &, unsigned)>(), false);
+}
+
+void Build::Builder::SetUpOutputCache(OutputCache &cache, bool cxx) {
+	// Family, version and target rather than the path, so that machines with the compiler
+	// installed elsewhere share entries.
+	ToolchainInfo toolchain = cxx ? ProbeCXX() : ProbeCC();
+	std::shared_ptr<Scheduler> uploads;
+	bool upload = false;
+
+	cache.Toolchain = toolchain.Family + " " + toolchain.Version + " " + toolchain.Target;
+	Configure([&cache, &upload](Builder &b) {
+		if (!b.CacheDir.empty()) cache.Dir = JoinPath(b.CacheDir, "artifacts");
+		cache.RemoteURL = b.RemoteCache;
+		upload = b.RemoteCacheUpload;
+	});
+	if (!upload || cache.RemoteURL.empty()) return;
+
+	uploads = GetUploadScheduler();
+	cache.Upload = [uploads](std::function<void()> fn) {
+		std::shared_ptr<JobState> job = std::make_shared<JobState>();
+
+		job->Run = [fn](ExecResult &, unsigned) {
+			fn();
+			return 0;
+		};
+		uploads->Submit(job, maxUploads);
+	};
+}
+
+// Command compiling `step` on its own with `commandLine`.
+static string CompileCommand(const string &commandLine, const Build::CompileStep &step) {
+	return commandLine + (step.Flags.empty() ? "" : " " + step.Flags) + " -c -o " + step.Object + " " + step.Source;
+}
+
+// Files of `step`, compiled by `command`.
+static Build::StepTarget CompileTarget(const Build::CompileStep &step, const string &command) {
+	Build::StepTarget target;
+	size_t dot = step.Object.rfind('.');
+
+	target.Output = step.Object;
+	target.Inputs.push_back(step.Source);
+	// Where `-MMD` puts it.
+	target.DepFile = (dot == string::npos || step.Object.find_first_of("/\\", dot) != string::npos ? step.Object : step.Object.substr(0, dot)) + ".d";
+	target.Command = command;
+
+	return target;
+}
+
+Job Build::Builder::CompileAsync(const CompileStep &step) {
+	CompileRequest request;
+	StepTarget target;
+	bool dryRun = true, deterministic = false;
+
+	request.CommandLine = step.CXX ? CXXCommandLine() : CCCommandLine();
+	request.Step = step;
+	Configure([&deterministic](Builder &b) { deterministic = b.Deterministic; });
+	// GCC otherwise names some symbols, e.g. the sections of LTO objects, at random.
+	if (deterministic && (step.CXX ? ProbeCXX() : ProbeCC()).Family == "gcc") {
+		request.Step.Flags += (step.Flags.empty() ? "" : " ") + string("-frandom-seed=") + step.Object;
+	}
+	request.LocalCommand = CompileCommand(request.CommandLine, request.Step);
+	target = CompileTarget(request.Step, request.LocalCommand);
+	target.Program = request.CommandLine;
+	request.DepFile = target.DepFile;
+	Configure([&request, &dryRun](Builder &b) {
+		request.Workers = b.RemoteWorkers;
+		request.PrintCommand = b.PrintCommandToStdout && !b.ShowProgress;
+		request.CacheOutputs = b.CacheOutputs;
+		dryRun = b.DryRun;
+	});
+	if (request.CacheOutputs && !dryRun) SetUpOutputCache(request.Cache, step.CXX);
+	if (request.Workers.empty() && !request.CacheOutputs) {
+		return SubmitJob(request.LocalCommand, std::function<int(ExecResult &, unsigned)>(), false, 1,
+			std::function<string(unsigned)>(), &target);
+	}
+
+	return SubmitJob(request.LocalCommand, [request](ExecResult &result, unsigned) { return RunCompile(request, result); },
+		!request.Workers.empty(), 1, std::function<string(unsigned)>(), &target);
+}
+
+ExecResult Build::Builder::Compile(const CompileStep &step) {
+	return CompileAsync(step).Wait();
+}
+
+// Whether `step` may share a compiler invocation run in the directory of its object: the compiler then names the
+// object after the source, and nothing in its flags names a single output.
+static bool CompileBatchable(const Build::CompileStep &step) {
+	string name = step.Source.substr(step.Source.find_last_of("/\\") + 1);
+	std::istringstream flags(step.Flags);
+	string flag;
+
+	if (name.rfind('.') != string::npos) name.resize(name.rfind('.'));
+	if (step.Object.substr(step.Object.find_last_of("/\\") + 1) != name + ".o") return false;
+	while (flags >> flag) {
+		if (flag == "-o" || !flag.compare(0, 3, "-MF") || !flag.compare(0, 3, "-MT") || !flag.compare(0, 3, "-MQ")) return false;
+	}
+
+	return true;
+}
+
+// `flags` with the relative paths of include options made absolute, for a compiler run in another directory.
+static string AbsoluteIncludeFlags(const string &flags) {
+	static const char *options[] = { "-iquote", "-isystem", "-idirafter", "-include", "-imacros", "-I" };
+	std::istringstream in(flags);
+	string flag, result;
+	bool pathNext = false;
+
+	while (in >> flag) {
+		if (pathNext && !Build::IsAbsolutePath(flag)) flag = Build::AbsolutePath(flag);
+		pathNext = false;
+		for (const char *option : options) {
+			size_t length = strlen(option);
+
+			if (flag.compare(0, length, option)) continue;
+			if (flag.size() == length) pathNext = true;
+			else if (!Build::IsAbsolutePath(flag.substr(length))) flag = option + Build::AbsolutePath(flag.substr(length));
+			break;
+		}
+		result += (result.empty() ? "" : " ") + flag;
+	}
+
+	return result;
+}
+
+vector<Job> Build::Builder::CompileBatchedAsync(const vector<CompileStep> &steps) {
+	bool batching = false, skipUpToDate = false;
+	unsigned jobs = 1, batchSize = 1;
+	string logPath = BuildLogPath(), commandLines[2];
+	vector<Job> queued(steps.size());
+	std::map<string, vector<size_t>> groups;
+	size_t stale = 0;
+
+	Configure([&](Builder &b) {
+		// Steps that are not run here, or not by the compiler alone, are queued one by one, as are those of
+		// deterministic builds, where GCC gets a `-frandom-seed` per object.
+		batching = !b.DryRun && !b.Plan && b.NinjaFile.empty() && b.RemoteWorkers.empty() && !b.CacheOutputs
+			&& !b.Deterministic && b.CompileBatchSize > 1;
+		skipUpToDate = b.SkipUpToDate;
+		jobs = b.Jobs < 1 ? 1 : b.Jobs;
+		batchSize = b.CompileBatchSize;
+	});
+	for (size_t i = 0; i < steps.size(); ++i) {
+		const CompileStep &step = steps[i];
+		string &commandLine = commandLines[step.CXX];
+		StepTarget target;
+
+		if (!batching || !CompileBatchable(step)) {
+			queued[i] = CompileAsync(step);
+			continue;
+		}
+		if (commandLine.empty()) commandLine = step.CXX ? CXXCommandLine() : CCCommandLine();
+		target = CompileTarget(step, CompileCommand(commandLine, step));
+		// Checked per object, so that only the stale sources of a batch are compiled.
+		if (skipUpToDate && OutOfDateReason(target, logPath, NULL).empty()) {
+			queued[i] = SkippedJob(target.Command);
+			++Counters.JobsSkipped;
+			continue;
+		}
+		groups[string(step.CXX ? "c++" : "c") + "\n" + DirName(step.Object) + "\n" + step.Flags].push_back(i);
+		++stale;
+	}
+	// Small enough batches for all job slots to get one.
+	batchSize = std::min<size_t>(batchSize, std::max<size_t>(1, (stale + jobs - 1) / jobs));
+
+	for (const auto &group : groups) {
+		// As many batches as needed, of even sizes.
+		size_t batches = (group.second.size() + batchSize - 1) / batchSize, size = (group.second.size() + batches - 1) / batches;
+
+		for (size_t first = 0; first < group.second.size(); first += size) {
+			vector<size_t> batch(group.second.begin() + first, group.second.begin() + std::min(first + size, group.second.size()));
+			vector<std::shared_ptr<JobState>> states;
+			const CompileStep &step = steps[batch[0]];
+			string dir = DirName(step.Object), command;
+
+			if (batch.size() == 1) {
+				queued[batch[0]] = CompileAsync(step);
+				continue;
+			}
+			if (dir.find(' ') != string::npos) dir = "\"" + dir + "\"";
+			command = (IsWindows() ? "cd /d " : "cd ") + dir + " && " + AbsoluteIncludeFlags(commandLines[step.CXX])
+				+ (step.Flags.empty() ? "" : " " + AbsoluteIncludeFlags(step.Flags)) + " -c";
+			for (size_t i : batch) {
+				Job job;
+
+				command += " " + AbsolutePath(steps[i].Source);
+				job.State = std::make_shared<JobState>();
+				job.State->Target = std::make_shared<StepTarget>(CompileTarget(steps[i], CompileCommand(commandLines[step.CXX], steps[i])));
+				job.State->Command = job.State->Result.Command = job.State->Target->Command;
+				states.push_back(job.State);
+				queued[i] = job;
+			}
+
+			// Each source gets the result of its own object: the compiler goes on with the other sources after
+			// one fails, and leaves no object for it, as the objects of the batch are removed first.
+			SubmitJob(command, [command, states, logPath](ExecResult &result, unsigned) {
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				int exitCode = 0;
+				long long duration = 0;
+				ResourceUsage usage;
+
+				try {
+					for (const std::shared_ptr<JobState> &state : states) remove(state->Target->Output.c_str());
+					exitCode = ExitCodeOfStatus(RunShell(command, &result.Usage));
+				} catch (std::exception &e) {
+					for (const std::shared_ptr<JobState> &state : states) FinishJob(*state, e.what(), 0);
+					throw;
+				}
+				duration = (long long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				// Each object gets the peak memory of the batch, which is at least what it took, and a share of the rest.
+				usage = result.Usage;
+				usage.UserSeconds /= states.size();
+				usage.SystemSeconds /= states.size();
+				usage.MinorFaults /= (long long) states.size();
+				usage.MajorFaults /= (long long) states.size();
+				usage.VoluntarySwitches /= (long long) states.size();
+				usage.InvoluntarySwitches /= (long long) states.size();
+				for (const std::shared_ptr<JobState> &state : states) {
+					FileStamp stamp;
+					bool built = StatFile(state->Target->Output, stamp);
+					string outputHash;
+
+					state->Result.Usage = usage;
+					// Recorded with its own command, and a share of the batch's time, as if compiled on its own. With
+					// the hash of the new content, so that the early cutoff of a later rebuild compares against it.
+					if (built && !logPath.empty()) {
+						try {
+							outputHash = Sha256Hex(ReadFile(state->Target->Output));
+						} catch (std::exception &e) {
+							// Recorded as unknown, so that the next rebuild is not cut off.
+							outputHash = "-";
+						}
+						RecordBuildLog(logPath, state->Target->Output, HashHex(state->Target->Command), duration / (long long) states.size(),
+							usage, outputHash);
+					}
+					FinishJob(*state, string(), built ? 0 : (exitCode ? exitCode : 1));
+				}
+				return exitCode;
+			}, false, 1, std::function<string(unsigned)>(), NULL, vector<Job>(), false);
+		}
+	}
+
+	return queued;
+}
+
+vector<ExecResult> Build::Builder::CompileBatched(const vector<CompileStep> &steps) {
+	return WaitAll(CompileBatchedAsync(steps));
+}
+
+Job Build::Builder::LinkAsync(const LinkStep &step) {
+	LinkRequest request;
+	StepTarget target;
+	bool dryRun = true, plan = false;
+	unsigned maxThreads = 1;
+	string cacheDir;
+
+	request.Step = step;
+	request.CommandLine = step.CXX ? CXXCommandLine() : CCCommandLine();
+	request.ResponseFileDir = ResponseFileDir();
+	Configure([&](Builder &b) {
+		request.CacheOutputs = b.CacheOutputs;
+		request.LTOCacheSize = b.LTOCacheSize;
+		cacheDir = b.CacheDir;
+		maxThreads = b.LTOJobs ? std::min(b.LTOJobs, b.Jobs) : b.Jobs;
+		dryRun = b.DryRun;
+		plan = b.Plan;
+	});
+	if (request.CacheOutputs && (!dryRun || plan)) SetUpOutputCache(request.Cache, step.CXX);
+	if (step.LTO) {
+		request.Toolchain = step.CXX ? ProbeCXX() : ProbeCC();
+		if (!cacheDir.empty()) request.LTOCacheDir = AbsolutePath(JoinPath(cacheDir, "lto"));
+	}
+	target.Output = LinkOutput(step);
+	target.Inputs = step.Inputs;
+	if (!step.VersionScript.empty()) target.Inputs.push_back(step.VersionScript);
+	if (step.SplitDebugInfo) target.OtherOutputs.push_back(target.Output + ".debug");
+	for (const string &link : LinkSymlinks(step)) target.OtherOutputs.push_back(link);
+	// Without the LTO thread count, which changes from one link to the next.
+	target.Command = LinkCommand(request, 0);
+	// The commands after the link cannot go into its response file.
+	if (LinkFinishCommands(step, false).empty()) target.Program = request.CommandLine;
+	if (request.CacheOutputs) target.InCache = [request] { return LinkOutputsCached(request); };
+	if (!step.LTO) {
+		return SubmitJob(LinkCommand(request, 1), [request](ExecResult &result, unsigned) { return RunLink(request, result, 1); }, false,
+			1, std::function<string(unsigned)>(), &target);
+	}
+
+	// The LTO threads take up job slots, so that the link neither oversubscribes the machine
+	// nor leaves it idle.
+	return SubmitJob(LinkCommand(request, maxThreads),
+		[request](ExecResult &result, unsigned slots) { return RunLink(request, result, slots); }, false,
+		maxThreads, [request](unsigned slots) { return LinkCommand(request, slots); }, &target);
+}
+
+ExecResult Build::Builder::Link(const LinkStep &step) {
+	return LinkAsync(step).Wait();
+}
+
+void Build::Builder::WaitForUploads() {
+	std::shared_ptr<Scheduler> uploads;
+
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		uploads = UploadScheduler;
+	}
+	if (uploads) uploads->WaitIdle();
+}
+
+Job Build::Builder::ExecCommandAsyncFV(string cmd, string fmt, va_list args) {
+	string params = FormatCommandFV(string(), fmt, args), dir;
+
+	if (cmd.empty()) return ExecRawAsync(params);
+	dir = ResponseFileDir();
+	return SubmitJob(cmd + " " + params,
+		[cmd, params, dir](ExecResult &result, unsigned) {
+			return ExitCodeOfStatus(RunShell(ResponseFileCommand(cmd, params, dir), &result.Usage));
+		}, false);
+}
+
+Job Build::Builder::CCAsync(string fmt, ...) {
+	va_list args;
+	Job job;
+
+	try {
+		va_start(args, fmt);
+		job = CCAsyncFV(fmt, args);
+		va_end(args);
+	} catch (std::exception &e) {
+		// Make sure to end var args.
+		va_end(args);
+		throw;
+	}
+
+	return job;
+}
+
+Job Build::Builder::CCAsyncFV(string fmt, va_list args) {
+	return ExecCommandAsyncFV(CCCommandLine(), fmt, args);
+}
+
+Job Build::Builder::CXXAsync(string fmt, ...) {
+	va_list args;
+	Job job;
+
+	try {
+		va_start(args, fmt);
+		job = CXXAsyncFV(fmt, args);
+		va_end(args);
+	} catch (std::exception &e) {
+		// Make sure to end var args.
+		va_end(args);
+		throw;
+	}
+
+	return job;
+}
+
+Job Build::Builder::CXXAsyncFV(string fmt, va_list args) {
+	return ExecCommandAsyncFV(CXXCommandLine(), fmt, args);
+}
+
+Job Build::Builder::ARAsync(string fmt, ...) {
+	va_list args;
+	Job job;
+
+	try {
+		va_start(args, fmt);
+		job = ARAsyncFV(fmt, args);
+		va_end(args);
+	} catch (std::exception &e) {
+		// Make sure to end var args.
+		va_end(args);
+		throw;
+	}
+
+	return job;
+}
+
+Job Build::Builder::ARAsyncFV(string fmt, va_list args) {
+	return ExecCommandAsyncFV(ConfigValue(ARCommand), fmt, args);
+}
+
+Job Build::Builder::LDAsync(string fmt, ...) {
+	va_list args;
+	Job job;
+
+	try {
+		va_start(args, fmt);
+		job = LDAsyncFV(fmt, args);
+		va_end(args);
+	} catch (std::exception &e) {
+		// Make sure to end var args.
+		va_end(args);
+		throw;
+	}
+
+	return job;
+}
+
+Job Build::Builder::LDAsyncFV(string fmt, va_list args) {
+	return ExecCommandAsyncFV(ConfigValue(LDCommand), fmt, args);
+}
+
+Job Build::Builder::ExecAsync(string fmt, ...) {
+	va_list args;
+	Job job;
+
+	try {
+		va_start(args, fmt);
+		job = ExecAsyncFV(fmt, args);
+		va_end(args);
+	} catch (std::exception &e) {
+		// Make sure to end var args.
+		va_end(args);
+		throw;
+	}
+
+	return job;
+}
+
+Job Build::Builder::ExecAsyncFV(string fmt, va_list args) {
+	return ExecCommandAsyncFV(string(), fmt, args);
+}
+
+Build::Builder Build::Builder::Variant(string name, std::function<void(Builder &)> configure) {
+	Builder variant;
+
+	// Created before copying, so that the variant shares them.
+	GetScheduler();
+	GetRemoteScheduler();
+	GetUploadScheduler();
+	GetOnceJobs();
+	GetPlanState();
+	Configure([&variant](Builder &b) { variant = b; });
+
+	variant.LastExecCommand.clear();
+	variant.VariantName = name;
+	variant.OutputDir = JoinPath(variant.OutputDir, name);
+	if (configure) configure(variant);
+
+	return variant;
+}
+
+Job Build::Builder::Once(string key, std::function<Job()> start) {
+	std::shared_ptr<OnceJobs> once = GetOnceJobs();
+	std::shared_ptr<JobState> placeholder;
+	Job job;
+
+	{
+		std::lock_guard<std::mutex> lock(once->Mutex);
+		std::map<string, Job>::iterator it = once->Jobs.find(key);
+
+		if (it != once->Jobs.end()) return it->second;
+		// Stands in for the job while `start` runs without the lock, which it may need for steps of its own,
+		// and finishes with it.
+		placeholder = std::make_shared<JobState>();
+		placeholder->Command = placeholder->Result.Command = key;
+		once->Jobs[key].State = placeholder;
+	}
+	try {
+		job = start();
+	} catch (std::exception &e) {
+		FinishJob(*placeholder, e.what(), 0);
+		throw;
+	}
+	{
+		std::lock_guard<std::mutex> lock(once->Mutex);
+		once->Jobs[key] = job;
+	}
+	job.OnFinish([placeholder, job] {
+		if (!job.State) {
+			FinishJob(*placeholder, string(), 0);
+			return;
+		}
+		placeholder->Command = job.State->Command;
+		placeholder->Result = job.State->Result;
+		FinishJob(*placeholder, job.State->Error, job.State->Result.ExitCode);
+	});
+
+	return job;
+}
+
+Job Build::Builder::ExecOnceAsync(string fmt, ...) {
+	va_list args;
+	Job job;
+
+	try {
+		va_start(args, fmt);
+		job = ExecOnceAsyncFV(fmt, args);
+		va_end(args);
+	} catch (std::exception &e) {
+		// Make sure to end var args.
+		va_end(args);
+		throw;
+	}
+
+	return job;
+}
+
+Job Build::Builder::ExecOnceAsyncFV(string fmt, va_list args) {
+	string cmdExpr = FormatCommandFV(string(), fmt, args);
+
+	return Once(cmdExpr, [this, &cmdExpr] { return ExecRawAsync(cmdExpr); });
+}
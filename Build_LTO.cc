@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using Build::ToolchainInfo;
+
+namespace {
+	struct CacheFile {
+		string Path;
+		long long Size;
+		// Latest of the access and modification times, so entries the linker reused are kept.
+		long long UsedAt;
+	};
+}
+
+static void ListCacheFiles(const string &dirPath, vector<CacheFile> &files) {
+	DIR *dir = opendir(dirPath.c_str());
+	struct dirent *d = NULL;
+
+	if (!dir) return;
+	while ((d = readdir(dir))) {
+		string name = d->d_name, path;
+		struct stat sb;
+
+		if (name == "." || name == "..") continue;
+		path = Build::JoinPath(dirPath, name);
+		if (stat(path.c_str(), &sb)) continue;
+		if (S_ISDIR(sb.st_mode)) {
+			ListCacheFiles(path, files);
+		} else if (S_ISREG(sb.st_mode)) {
+			files.push_back(CacheFile{ path, (long long) sb.st_size, (long long) std::max(sb.st_atime, sb.st_mtime) });
+		}
+	}
+	closedir(dir);
+}
+
+string Build::LTOLinkFlags(const ToolchainInfo &toolchain, const string &flags, unsigned threads, const string &cacheDir) {
+	string lto, n = std::to_string(threads);
+
+	if (toolchain.Family == "gcc") {
+		// Runs the LTRANS partitions on `threads` processes; the partitioning itself (balanced,
+		// 128 partitions) already leaves enough work to spread.
+		lto = " -flto=" + n;
+		if (!cacheDir.empty() && toolchain.Supports("lto-incremental")) lto += " -flto-incremental=" + cacheDir;
+	} else if (toolchain.Family == "clang") {
+		// ThinLTO unless the flags ask for something else: its backends run in parallel and are cached.
+		if (flags.find("-flto") == string::npos) lto = " -flto=thin";
+#if defined(MACOS)
+		lto += " -Wl,-mllvm,-threads=" + n;
+		if (!cacheDir.empty()) lto += " -Wl,-cache_path_lto," + cacheDir;
+#else
+		// Understood by both lld and the gold plugin.
+		lto += " -Wl,-plugin-opt,jobs=" + n;
+		if (!cacheDir.empty()) lto += " -Wl,-plugin-opt,cache-dir=" + cacheDir;
+#endif
+	} else if (flags.find("-flto") == string::npos) {
+		lto = " -flto";
+	}
+
+	return lto;
+}
+
+void Build::PruneCacheDir(const string &dirPath, unsigned long long maxSize) {
+	vector<CacheFile> files;
+	unsigned long long size = 0;
+
+	ListCacheFiles(dirPath, files);
+	for (const CacheFile &file : files) size += (unsigned long long) file.Size;
+	if (size <= maxSize) return;
+
+	// Least recently used first.
+	std::sort(files.begin(), files.end(), [](const CacheFile &a, const CacheFile &b) { return a.UsedAt < b.UsedAt; });
+	for (const CacheFile &file : files) {
+		if (size <= maxSize) break;
+		if (!remove(file.Path.c_str())) size -= (unsigned long long) file.Size;
+	}
+}
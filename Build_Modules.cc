@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::CompileStep;
+using Build::ExecResult;
+using Build::Job;
+using Build::StepTarget;
+
+namespace {
+	// What a translation unit declares about modules.
+	struct ModuleUnit {
+		// Module or partition (`m:part`) the unit is an interface or partition of, which it builds the BMI of;
+		// empty for other units.
+		string Provides;
+		// Modules and partitions it imports, including the module an implementation unit belongs to.
+		vector<string> Requires;
+	};
+}
+
+static bool IsIdentifierChar(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Skips spaces and tabs, and comments, within the line.
+static void SkipLineSpace(const string &source, size_t &i) {
+	while (i < source.size()) {
+		if (source[i] == ' ' || source[i] == '\t') {
+			++i;
+		} else if (!source.compare(i, 2, "/*")) {
+			size_t end = source.find("*/", i + 2);
+			i = end == string::npos ? source.size() : end + 2;
+		} else {
+			break;
+		}
+	}
+}
+
+static string ReadIdentifier(const string &source, size_t &i) {
+	size_t start = i;
+
+	while (i < source.size() && IsIdentifierChar(source[i])) ++i;
+	return source.substr(start, i - start);
+}
+
+// Reads a module name, e.g. `a.b`, or `a.b:part`, or `:part`, which gets `module` prepended.
+static string ReadModuleName(const string &source, size_t &i, const string &module) {
+	string name, part;
+
+	SkipLineSpace(source, i);
+	while (i < source.size() && IsIdentifierChar(source[i])) {
+		name += ReadIdentifier(source, i);
+		SkipLineSpace(source, i);
+		if (i >= source.size() || source[i] != '.') break;
+		name += source[i++];
+		SkipLineSpace(source, i);
+	}
+	if (i < source.size() && source[i] == ':' && source.compare(i, 2, "::")) {
+		++i;
+		SkipLineSpace(source, i);
+		part = ReadIdentifier(source, i);
+		if (part.empty()) return string();
+		if (name.empty()) name = module;
+		if (name.empty()) return string();
+		name += ":" + part;
+	}
+
+	return name;
+}
+
+// Finds the module and import declarations of `source`, which start lines, like preprocessor directives.
+// Declarations in conditional blocks count, so the result may list more imports than the compiler sees.
+static void ScanModuleDeclarations(const string &source, ModuleUnit &unit) {
+	string module;
+	size_t i = 0;
+	bool lineStart = true;
+
+	while (i < source.size()) {
+		char c = source[i];
+
+		if (c == '\n') {
+			lineStart = true;
+			++i;
+		} else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+			++i;
+		} else if (!source.compare(i, 2, "//")) {
+			i = source.find('\n', i);
+			if (i == string::npos) i = source.size();
+		} else if (!source.compare(i, 2, "/*")) {
+			size_t end = source.find("*/", i + 2);
+			i = end == string::npos ? source.size() : end + 2;
+		} else if (c == '#' && lineStart) {
+			// A directive, up to the end of the line and its continuations.
+			while (i < source.size() && source[i] != '\n') {
+				if (source[i] == '\\' && i + 1 < source.size() && source[i + 1] == '\n') ++i;
+				++i;
+			}
+		} else if (c == '"' || c == '\'') {
+			for (++i; i < source.size() && source[i] != c && source[i] != '\n'; ++i) {
+				if (source[i] == '\\') ++i;
+			}
+			++i;
+			lineStart = false;
+		} else if (IsIdentifierChar(c)) {
+			bool atLineStart = lineStart, exported = false;
+			string word = ReadIdentifier(source, i), name;
+
+			lineStart = false;
+			if (i < source.size() && source[i] == '"' && !word.empty() && word[word.size() - 1] == 'R') {
+				// A raw string literal: `R"delim(...)delim"`.
+				size_t paren = source.find('(', i);
+				size_t end = paren == string::npos ? paren : source.find(")" + source.substr(i + 1, paren - i - 1) + "\"", paren);
+				i = end == string::npos ? source.size() : end + (paren - i) + 1;
+				continue;
+			}
+			if (!atLineStart) continue;
+			if (word == "export") {
+				SkipLineSpace(source, i);
+				word = ReadIdentifier(source, i);
+				exported = true;
+			}
+			if (word == "module") {
+				name = ReadModuleName(source, i, module);
+				SkipLineSpace(source, i);
+				// `module;` starts the global module fragment, and `module :private;` has no name.
+				if (name.empty() || i >= source.size() || (source[i] != ';' && source[i] != '[')) continue;
+				module = name.substr(0, name.find(':'));
+				// Interface units and partitions build a BMI; implementation units import their module.
+				if (exported || name.find(':') != string::npos) unit.Provides = name;
+				else unit.Requires.push_back(name);
+			} else if (word == "import") {
+				SkipLineSpace(source, i);
+				// Header units (`import <a.h>;`) are not supported, and skipped.
+				if (i < source.size() && (source[i] == '<' || source[i] == '"')) continue;
+				name = ReadModuleName(source, i, module);
+				SkipLineSpace(source, i);
+				if (!name.empty() && i < source.size() && (source[i] == ';' || source[i] == '[')) unit.Requires.push_back(name);
+			}
+		} else {
+			lineStart = false;
+			++i;
+		}
+	}
+}
+
+// Reads the JSON string starting at the quote at `i`, and moves `i` past it. Escapes are kept as is, as module
+// names have none.
+static string ReadJSONString(const string &json, size_t &i) {
+	size_t start = ++i;
+
+	while (i < json.size() && json[i] != '"') i += json[i] == '\\' ? 2 : 1;
+	return json.substr(start, (i++ < json.size() ? i - 1 : json.size()) - start);
+}
+
+// Returns the value of the string member `key` of the JSON object `object`, or an empty string.
+// Only looks at the members of `object` itself, not those of nested objects.
+static string JSONStringMember(const string &object, const string &key) {
+	int depth = 0;
+
+	for (size_t i = 0; i < object.size(); ) {
+		if (object[i] == '"') {
+			string s = ReadJSONString(object, i);
+			size_t colon = object.find_first_not_of(" \t\r\n", i);
+
+			if (depth != 1 || s != key || colon == string::npos || object[colon] != ':') continue;
+			i = object.find_first_not_of(" \t\r\n", colon + 1);
+			return i != string::npos && object[i] == '"' ? ReadJSONString(object, i) : string();
+		}
+		if (object[i] == '{' || object[i] == '[') ++depth;
+		else if (object[i] == '}' || object[i] == ']') --depth;
+		++i;
+	}
+
+	return string();
+}
+
+// Returns the objects of the JSON array `key`, wherever it is in `json`, as text.
+static vector<string> JSONArrayObjects(const string &json, const string &key) {
+	vector<string> objects;
+	size_t i = json.find("\"" + key + "\"");
+	int depth = 0;
+	size_t start = 0;
+
+	if (i == string::npos || (i = json.find('[', i)) == string::npos) return objects;
+	for (++i; i < json.size(); ++i) {
+		if (json[i] == '"') {
+			ReadJSONString(json, i);
+			--i;
+		} else if (json[i] == '{' || json[i] == '[') {
+			if (depth++ == 0) start = i;
+		} else if (json[i] == '}' || json[i] == ']') {
+			if (depth == 0) break;
+			if (--depth == 0) objects.push_back(json.substr(start, i + 1 - start));
+		}
+	}
+
+	return objects;
+}
+
+// Reads the modules provided and required by the P1689 dependency file `ddiPath`.
+static void ReadP1689(const string &ddiPath, ModuleUnit &unit) {
+	string json = Build::ReadFile(ddiPath);
+
+	for (const string &object : JSONArrayObjects(json, "provides")) {
+		unit.Provides = JSONStringMember(object, "logical-name");
+	}
+	for (const string &object : JSONArrayObjects(json, "requires")) {
+		string method = JSONStringMember(object, "lookup-method");
+
+		// Header units are looked up by file name, and not supported.
+		if (!method.empty() && method != "by-name") continue;
+		unit.Requires.push_back(JSONStringMember(object, "logical-name"));
+	}
+}
+
+// Whether `path` has one of the extensions used for module interface units, which compilers do not
+// take for C++ sources on their own.
+static bool HasModuleInterfaceExtension(const string &path) {
+	static const char *extensions[] = { ".cppm", ".ixx", ".mpp", ".ccm", ".cxxm", ".c++m" };
+	size_t dot = path.rfind('.');
+	string extension = dot == string::npos ? string() : path.substr(dot);
+
+	for (const char *e : extensions) {
+		if (extension == e) return true;
+	}
+
+	return false;
+}
+
+// Visits `unit` and, before it, the units it imports, appending them to `order` after their dependencies.
+static void SortModuleUnits(size_t unit, const vector<vector<size_t>> &dependencies, const vector<ModuleUnit> &units,
+	vector<int> &visited, vector<size_t> &stack, vector<size_t> &order) {
+	if (visited[unit] == 2) return;
+	if (visited[unit] == 1) {
+		string cycle;
+
+		for (size_t i = std::find(stack.begin(), stack.end(), unit) - stack.begin(); i < stack.size(); ++i) {
+			cycle += units[stack[i]].Provides + " -> ";
+		}
+		throw runtime_error("module cycle: " + cycle + units[unit].Provides);
+	}
+	visited[unit] = 1;
+	stack.push_back(unit);
+	for (size_t dependency : dependencies[unit]) SortModuleUnits(dependency, dependencies, units, visited, stack, order);
+	stack.pop_back();
+	visited[unit] = 2;
+	order.push_back(unit);
+}
+
+vector<Job> Build::Builder::CompileModulesAsync(const vector<CompileStep> &steps) {
+	ToolchainInfo toolchain = ProbeCXX();
+	bool clang = toolchain.Family == "clang", dryRun = true, plan = false, ninja = false;
+	string commandLine = CXXCommandLine(), mapperPath, mapper, bmiDir;
+	vector<ModuleUnit> units(steps.size());
+	vector<vector<size_t>> dependencies(steps.size());
+	vector<int> visited(steps.size(), 0);
+	vector<size_t> stack, order;
+	vector<string> bmis(steps.size());
+	vector<Job> jobs(steps.size());
+	std::map<string, size_t> providers;
+
+	Configure([&dryRun, &plan, &ninja](Builder &b) {
+		dryRun = b.DryRun;
+		plan = b.Plan;
+		ninja = !b.NinjaFile.empty();
+	});
+
+	// Finds out what each unit provides and imports: with the compiler's P1689 scan when it has one,
+	// as it sees through macros and conditional blocks, else by reading the module declarations here.
+	// Ninja builds cannot scan first, as the steps are only recorded.
+	if (!dryRun && !plan && !ninja && toolchain.Supports("p1689")) {
+		vector<Job> scans;
+		vector<ExecResult> results;
+
+		for (const CompileStep &step : steps) {
+			StepTarget target;
+			string ddi = step.Object + ".ddi";
+
+			target.Output = ddi;
+			target.Inputs.push_back(step.Source);
+			target.DepFile = ddi + ".d";
+			target.Command = commandLine + (step.Flags.empty() ? "" : " " + step.Flags) + " -fmodules-ts -E -x c++ "
+				+ step.Source + " -fdeps-format=p1689r5 -fdeps-file=" + ddi + " -fdeps-target=" + step.Object
+				+ " -M -MF " + target.DepFile + " -MT " + ddi;
+			scans.push_back(SubmitJob(target.Command, std::function<int(ExecResult &, unsigned)>(), false, 1,
+				std::function<string(unsigned)>(), &target));
+		}
+		results = WaitAll(scans);
+		for (size_t i = 0; i < steps.size(); ++i) {
+			if (results[i].ExitCode) throw runtime_error("unable to scan modules: " + steps[i].Source);
+			try {
+				ReadP1689(steps[i].Object + ".ddi", units[i]);
+			} catch (std::exception &e) {
+				throw runtime_error("unable to scan modules: " + steps[i].Source + ": " + e.what());
+			}
+		}
+	} else {
+		for (size_t i = 0; i < steps.size(); ++i) {
+			try {
+				ScanModuleDeclarations(ReadFile(steps[i].Source), units[i]);
+			} catch (std::exception &e) {
+				throw runtime_error("unable to scan modules: " + steps[i].Source + ": " + e.what());
+			}
+		}
+	}
+
+	// Each module is built by one unit, whose BMI the importers wait for.
+	for (size_t i = 0; i < units.size(); ++i) {
+		string name = units[i].Provides;
+
+		if (name.empty()) continue;
+		if (providers.count(name)) {
+			throw runtime_error("duplicate module: " + name + " (" + steps[providers[name]].Source + " and " + steps[i].Source + ")");
+		}
+		providers[name] = i;
+		std::replace(name.begin(), name.end(), ':', '-');
+		bmis[i] = OutputPath("bmi/" + name + (clang ? ".pcm" : ".gcm"));
+		mapper += units[i].Provides + " " + bmis[i] + "\n";
+	}
+	for (size_t i = 0; i < units.size(); ++i) {
+		for (const string &name : units[i].Requires) {
+			auto it = providers.find(name);
+
+			if (it == providers.end()) throw runtime_error("missing module: " + name + " (imported by " + steps[i].Source + ")");
+			if (it->second != i) dependencies[i].push_back(it->second);
+		}
+	}
+	for (size_t i = 0; i < units.size(); ++i) SortModuleUnits(i, dependencies, units, visited, stack, order);
+
+	// GCC finds BMIs through a mapper file, rewritten only when the modules change, so as not to look newer
+	// than the objects. Clang finds them by name in the BMI directory.
+	if (clang) {
+		bmiDir = DirName(OutputPath("bmi/x"));
+	} else {
+		mapperPath = OutputPath("modules.map");
+		// Ninja builds read it too.
+		if (ninja || (!dryRun && !plan)) {
+			string current;
+
+			try {
+				current = ReadFile(mapperPath);
+			} catch (std::exception &e) {
+			}
+			if (current != mapper) {
+				MakeDirs(DirName(mapperPath));
+				WriteFileAtomic(mapperPath, mapper);
+			}
+		}
+	}
+
+	for (size_t i : order) {
+		const CompileStep &step = steps[i];
+		StepTarget target;
+		vector<Job> after;
+		size_t dot = step.Object.rfind('.');
+		string command = commandLine + (step.Flags.empty() ? "" : " " + step.Flags);
+
+		if (clang) {
+			command += " -fprebuilt-module-path=" + bmiDir;
+			if (!bmis[i].empty()) {
+				command += " -fmodule-output=" + bmis[i];
+				// Clang takes only `.cppm` files for interface units on its own.
+				if (step.Source.size() < 5 || step.Source.compare(step.Source.size() - 5, 5, ".cppm")) command += " -x c++-module";
+			}
+		} else {
+			command += " -fmodules-ts -fmodule-mapper=" + mapperPath;
+			if (HasModuleInterfaceExtension(step.Source)) command += " -x c++";
+		}
+		command += " -c -o " + step.Object + " " + step.Source;
+
+		target.Output = step.Object;
+		if (!bmis[i].empty()) target.OtherOutputs.push_back(bmis[i]);
+		target.Inputs.push_back(step.Source);
+		for (size_t dependency : dependencies[i]) {
+			target.Inputs.push_back(bmis[dependency]);
+			after.push_back(jobs[dependency]);
+		}
+		target.DepFile = (dot == string::npos || step.Object.find_first_of("/\\", dot) != string::npos ? step.Object : step.Object.substr(0, dot)) + ".d";
+		target.Command = command;
+		target.Program = commandLine;
+		jobs[i] = SubmitJob(command, std::function<int(ExecResult &, unsigned)>(), false, 1,
+			std::function<string(unsigned)>(), &target, after);
+	}
+
+	return jobs;
+}
+
+vector<ExecResult> Build::Builder::CompileModules(const vector<CompileStep> &steps) {
+	return WaitAll(CompileModulesAsync(steps));
+}
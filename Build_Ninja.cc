@@ -0,0 +1,146 @@
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using Build::StepTarget;
+
+struct Build::NinjaState {
+	std::mutex Mutex;
+	// `build` statements, in the order the steps were recorded.
+	string Statements;
+	// Outputs recorded so far; a step building one of them again is left out, as Ninja allows one step per output.
+	std::set<string> Outputs;
+	// Depths of the pools used, by name.
+	std::map<string, unsigned> Pools;
+	// Output of the last synchronous step, which the steps after it are ordered after.
+	string Barrier;
+	// Number of steps without declared outputs, which name their phony outputs.
+	unsigned Commands = 0;
+};
+
+// Escapes `path` for a list of paths of a `build` statement.
+static string NinjaPath(const string &path) {
+	string escaped;
+
+	for (char c : path) {
+		if (c == '$' || c == ' ' || c == ':') escaped += '$';
+		escaped += c;
+	}
+
+	return escaped;
+}
+
+// Escapes `value` for a variable of a `build` statement.
+static string NinjaValue(const string &value) {
+	string escaped;
+
+	for (char c : value) {
+		if (c == '$') escaped += '$';
+		escaped += c == '\n' || c == '\r' ? ' ' : c;
+	}
+
+	return escaped;
+}
+
+std::shared_ptr<Build::NinjaState> Build::Builder::GetNinjaState() {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	if (!SharedNinjaState) SharedNinjaState = std::make_shared<NinjaState>();
+	return SharedNinjaState;
+}
+
+string Build::Builder::NinjaStep(const string &cmdExpr, const StepTarget *target, const string &program, unsigned slots,
+	const vector<string> &after, bool sync) {
+	std::shared_ptr<NinjaState> ninja = GetNinjaState();
+	string output, statement, pool;
+	unsigned jobs = 1;
+
+	Configure([&jobs](Builder &b) { jobs = b.Jobs < 1 ? 1 : b.Jobs; });
+	std::lock_guard<std::mutex> lock(ninja->Mutex);
+
+	if (target) {
+		output = target->Output;
+		if (!ninja->Outputs.insert(output).second) return output;
+		statement = "build " + NinjaPath(output);
+		if (!target->OtherOutputs.empty()) {
+			statement += " |";
+			for (const string &path : target->OtherOutputs) {
+				statement += " " + NinjaPath(path);
+				ninja->Outputs.insert(path);
+			}
+		}
+		statement += ": step";
+		for (const string &path : target->Inputs) statement += " " + NinjaPath(path);
+	} else {
+		// Never written, so the command runs on every build, like in a build program.
+		output = "libBuild-command-" + std::to_string(++ninja->Commands);
+		statement = "build " + NinjaPath(output) + ": step";
+	}
+	if (!after.empty() || !ninja->Barrier.empty()) {
+		statement += " ||";
+		for (const string &path : after) statement += " " + NinjaPath(path);
+		if (!ninja->Barrier.empty()) statement += " " + NinjaPath(ninja->Barrier);
+	}
+	statement += "\n";
+
+	if (!program.empty() && CommandTooLong(cmdExpr) && !cmdExpr.compare(0, program.size() + 1, program + " ")) {
+		statement += "  command = " + NinjaValue(program) + " @$out.rsp\n";
+		statement += "  rspfile = $out.rsp\n";
+		statement += "  rspfile_content = " + NinjaValue(cmdExpr.substr(program.size() + 1)) + "\n";
+	} else {
+		statement += "  command = " + NinjaValue(cmdExpr) + "\n";
+	}
+	// Ninja then keeps the headers in its own log. Without these flags the file may not be written at all, and
+	// Ninja would take the step as dirty on every build.
+	if (target && !target->DepFile.empty() && (HasFlag(cmdExpr, "-MMD") || HasFlag(cmdExpr, "-MD"))) {
+		statement += "  depfile = " + NinjaValue(target->DepFile) + "\n";
+		statement += "  deps = gcc\n";
+	}
+	if (slots > 1) {
+		// Steps taking several job slots, e.g. LTO links with as many threads, share the `Jobs` slots.
+		pool = "slots" + std::to_string(slots);
+		ninja->Pools[pool] = jobs / slots < 1 ? 1 : jobs / slots;
+		statement += "  pool = " + pool + "\n";
+	}
+
+	ninja->Statements += statement;
+	if (sync) ninja->Barrier = output;
+
+	return output;
+}
+
+void Build::Builder::WriteNinjaFile() {
+	std::shared_ptr<NinjaState> ninja = GetNinjaState();
+	string path = ConfigValue(NinjaFile), content, current;
+
+	if (path.empty()) return;
+
+	content = "# Written by a libBuild build program; changes are lost when it runs again.\n"
+		"ninja_required_version = 1.3\n\n"
+		"rule step\n"
+		"  command = $command\n\n";
+	{
+		std::lock_guard<std::mutex> lock(ninja->Mutex);
+
+		for (const auto &kv : ninja->Pools) content += "pool " + kv.first + "\n  depth = " + std::to_string(kv.second) + "\n\n";
+		content += ninja->Statements;
+	}
+
+	// Left untouched when unchanged, so that its timestamp tells when the steps did.
+	try {
+		current = ReadFile(path);
+	} catch (std::exception &e) {
+	}
+	if (current == content) return;
+	MakeDirs(DirName(path));
+	WriteFileAtomic(path, content);
+}
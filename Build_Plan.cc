@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using Build::BuildLogEntry;
+using Build::FileStamp;
+using Build::StepTarget;
+
+// The build log is this header, then one line per finished step: its duration in ms, user and system
+// CPU time in ms, peak RSS in KiB, minor and major page faults, voluntary and involuntary context switches,
+// restat time in ns, command hash, output hash (`-` if unknown), command (`-` if the key names the output; with
+// `%`, spaces and line breaks as `%XX`) and key. Later lines override earlier ones; the log is rewritten when it
+// holds too many stale lines.
+static const char buildLogHeader[] = "libBuild-log 4";
+static const int buildLogNumbers = 9;
+// Longest command recorded for a step without declared outputs; longer ones are cut, and end with `...`.
+static const size_t maxLoggedCommand = 200;
+
+namespace {
+	struct BuildLog {
+		std::map<string, BuildLogEntry> Entries;
+		size_t Lines = 0;
+		// Whether the file must be rewritten, rather than appended to, on the next record.
+		bool Rewrite = false;
+	};
+}
+
+// `field` for a build log line, where it cannot contain spaces.
+static string EscapeLogField(const string &field) {
+	static const char hex[] = "0123456789ABCDEF";
+	string escaped;
+
+	if (field.empty()) return "-";
+	for (char c : field) {
+		if (c == '%' || c == ' ' || c == '\t' || c == '\n' || c == '\r' || (c == '-' && field.size() == 1)) {
+			escaped += '%';
+			escaped += hex[(unsigned char) c >> 4];
+			escaped += hex[(unsigned char) c & 15];
+		} else {
+			escaped += c;
+		}
+	}
+
+	return escaped;
+}
+
+static string UnescapeLogField(const string &field) {
+	string unescaped;
+
+	if (field == "-") return unescaped;
+	for (size_t i = 0; i < field.size(); ++i) {
+		if (field[i] == '%' && i + 2 < field.size() && isxdigit((unsigned char) field[i + 1]) && isxdigit((unsigned char) field[i + 2])) {
+			unescaped += (char) strtol(field.substr(i + 1, 2).c_str(), NULL, 16);
+			i += 2;
+		} else {
+			unescaped += field[i];
+		}
+	}
+
+	return unescaped;
+}
+
+// Build logs by path, read once per process.
+static std::mutex buildLogsMutex;
+static std::map<string, BuildLog> buildLogs;
+
+static bool ParseBuildLogLine(const string &line, string &key, BuildLogEntry &entry) {
+	long long numbers[buildLogNumbers];
+	size_t start = 0, space = 0;
+
+	for (int i = 0; i < buildLogNumbers; ++i) {
+		space = line.find(' ', start);
+		if (space == string::npos) return false;
+		numbers[i] = atoll(line.c_str() + start);
+		start = space + 1;
+	}
+	space = line.find(' ', start);
+	if (space == string::npos) return false;
+	entry.CommandHash = line.substr(start, space - start);
+	start = space + 1;
+	space = line.find(' ', start);
+	if (space == string::npos) return false;
+	entry.OutputHash = line.substr(start, space - start);
+	if (entry.OutputHash == "-") entry.OutputHash.clear();
+	start = space + 1;
+	space = line.find(' ', start);
+	if (space == string::npos) return false;
+	entry.Command = UnescapeLogField(line.substr(start, space - start));
+	key = line.substr(space + 1);
+	entry.DurationMsec = numbers[0];
+	entry.Usage.UserSeconds = (double) numbers[1] / 1000.0;
+	entry.Usage.SystemSeconds = (double) numbers[2] / 1000.0;
+	entry.Usage.MaxRSSKiB = numbers[3];
+	entry.Usage.MinorFaults = numbers[4];
+	entry.Usage.MajorFaults = numbers[5];
+	entry.Usage.VoluntarySwitches = numbers[6];
+	entry.Usage.InvoluntarySwitches = numbers[7];
+	entry.RestatMTimeNsec = numbers[8];
+
+	return true;
+}
+
+// Returns the build log `logPath`, reading it on first use. Must be called with `buildLogsMutex` held.
+static BuildLog & LoadBuildLog(const string &logPath) {
+	std::map<string, BuildLog>::iterator it = buildLogs.find(logPath);
+	BuildLog *log = NULL;
+	FileStamp stamp;
+	string content;
+	size_t start = 0;
+
+	if (it != buildLogs.end()) return it->second;
+	log = &buildLogs[logPath];
+	log->Rewrite = true;
+	try {
+		if (!Build::StatFile(logPath, stamp)) return *log;
+		content = Build::ReadFile(logPath);
+	} catch (std::exception &e) {
+		return *log;
+	}
+	if (content.compare(0, sizeof(buildLogHeader) - 1, buildLogHeader) || content[sizeof(buildLogHeader) - 1] != '\n') return *log;
+
+	log->Rewrite = false;
+	start = sizeof(buildLogHeader);
+	while (start < content.size()) {
+		size_t end = content.find('\n', start);
+		string line, key;
+		BuildLogEntry entry;
+
+		// A torn last line, from a process that was killed while appending.
+		if (end == string::npos) {
+			log->Rewrite = true;
+			break;
+		}
+		line = content.substr(start, end - start);
+		start = end + 1;
+		if (!ParseBuildLogLine(line, key, entry)) continue;
+		log->Entries[key] = entry;
+		++log->Lines;
+	}
+	if (log->Lines > 1000 && log->Lines > 3 * log->Entries.size()) log->Rewrite = true;
+
+	return *log;
+}
+
+static string BuildLogLine(const string &key, const BuildLogEntry &entry) {
+	const Build::ResourceUsage &usage = entry.Usage;
+	long long numbers[buildLogNumbers] = {
+		entry.DurationMsec, (long long) (usage.UserSeconds * 1000.0 + 0.5), (long long) (usage.SystemSeconds * 1000.0 + 0.5),
+		usage.MaxRSSKiB, usage.MinorFaults, usage.MajorFaults, usage.VoluntarySwitches, usage.InvoluntarySwitches,
+		entry.RestatMTimeNsec
+	};
+	string line;
+
+	for (long long number : numbers) line += std::to_string(number) + " ";
+
+	return line + entry.CommandHash + " " + (entry.OutputHash.empty() ? "-" : entry.OutputHash) + " " + EscapeLogField(entry.Command)
+		+ " " + key + "\n";
+}
+
+bool Build::LookUpBuildLog(const string &logPath, const string &key, BuildLogEntry &entry) {
+	std::lock_guard<std::mutex> lock(buildLogsMutex);
+	BuildLog &log = LoadBuildLog(logPath);
+	std::map<string, BuildLogEntry>::const_iterator it = log.Entries.find(key);
+
+	if (it == log.Entries.end()) return false;
+	entry = it->second;
+	return true;
+}
+
+void Build::RecordBuildLog(const string &logPath, const string &key, const string &commandHash, long long durationMsec,
+	const ResourceUsage &usage, const string &outputHash, long long restatMTimeNsec, const string &command) {
+	std::lock_guard<std::mutex> lock(buildLogsMutex);
+	BuildLog &log = LoadBuildLog(logPath);
+	BuildLogEntry &entry = log.Entries[key];
+	size_t slash = logPath.find_last_of("/\\");
+
+	if (entry.CommandHash == commandHash && durationMsec < 0 && (outputHash.empty() || entry.OutputHash == outputHash)
+		&& entry.RestatMTimeNsec == restatMTimeNsec) {
+		return;
+	}
+	entry.CommandHash = commandHash;
+	if (!outputHash.empty()) entry.OutputHash = outputHash;
+	entry.RestatMTimeNsec = restatMTimeNsec;
+	if (!command.empty()) {
+		entry.Command = command.size() > maxLoggedCommand ? command.substr(0, maxLoggedCommand - 3) + "..." : command;
+	}
+	if (durationMsec >= 0) {
+		entry.DurationMsec = durationMsec;
+		entry.Usage = usage;
+	}
+
+	if (log.Rewrite) {
+		string content = string(buildLogHeader) + "\n";
+
+		for (const auto &kv : log.Entries) content += BuildLogLine(kv.first, kv.second);
+		try {
+			if (slash != string::npos) MakeDirs(logPath.substr(0, slash));
+			WriteFileAtomic(logPath, content);
+		} catch (std::exception &e) {
+			// The build log is best-effort: steps it misses are rebuilt.
+			return;
+		}
+		log.Lines = log.Entries.size();
+		log.Rewrite = false;
+	} else {
+		FILE *out = fopen(logPath.c_str(), "ab");
+		string line = BuildLogLine(key, entry);
+
+		if (!out) return;
+		fwrite(line.data(), 1, line.size(), out);
+		fclose(out);
+		if (++log.Lines > 1000 && log.Lines > 3 * log.Entries.size()) log.Rewrite = true;
+	}
+}
+
+std::map<string, BuildLogEntry> Build::ReadBuildLog(const string &logPath) {
+	std::lock_guard<std::mutex> lock(buildLogsMutex);
+
+	return LoadBuildLog(logPath).Entries;
+}
+
+vector<string> Build::ReadDepFile(const string &path) {
+	vector<string> inputs;
+	string content, token;
+	FileStamp stamp;
+
+	if (!Build::StatFile(path, stamp)) return inputs;
+	content = Build::ReadFile(path);
+	for (size_t i = 0; i <= content.size(); ++i) {
+		char c = i < content.size() ? content[i] : '\n';
+
+		if (c == '\\' && i + 1 < content.size() && (content[i + 1] == '\n' || content[i + 1] == '\r')) {
+			// Line continuation.
+			c = ' ';
+			++i;
+			if (content[i] == '\r' && i + 1 < content.size() && content[i + 1] == '\n') ++i;
+		} else if (c == '\\' && i + 1 < content.size() && (content[i + 1] == ' ' || content[i + 1] == '#')) {
+			token += content[++i];
+			continue;
+		} else if (c == '$' && i + 1 < content.size() && content[i + 1] == '$') {
+			token += content[++i];
+			continue;
+		}
+		if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+			token += c;
+			continue;
+		}
+		// Targets end with a colon.
+		if (!token.empty() && token != ":" && token[token.size() - 1] != ':') inputs.push_back(token);
+		token.clear();
+	}
+
+	return inputs;
+}
+
+string Build::OutOfDateReason(const StepTarget &target, const string &logPath, const std::set<string> *rebuilt) {
+	FileStamp output, input;
+	BuildLogEntry entry;
+	vector<string> inputs = target.Inputs, depInputs;
+
+	if (!StatFile(target.Output, output)) return "output missing";
+	for (const string &path : target.OtherOutputs) {
+		if (!StatFile(path, input)) return "output missing: " + path;
+	}
+	if (!logPath.empty()) {
+		if (!LookUpBuildLog(logPath, target.Output, entry)) return "no recorded command";
+		if (entry.CommandHash != HashHex(target.Command)) return "command changed";
+		// Rebuilt unchanged last time, keeping its older modification time.
+		if (entry.RestatMTimeNsec > output.MTimeNsec) output.MTimeNsec = entry.RestatMTimeNsec;
+	}
+	if (!target.DepFile.empty()) {
+		depInputs = ReadDepFile(target.DepFile);
+		inputs.insert(inputs.end(), depInputs.begin(), depInputs.end());
+	}
+	for (const string &path : inputs) {
+		if (rebuilt && rebuilt->count(path)) return "input rebuilt: " + path;
+		if (!StatFile(path, input)) return "input missing: " + path;
+		if (input.MTimeNsec > output.MTimeNsec) return "newer input: " + path;
+	}
+
+	return string();
+}
+
+long long Build::NewestInputMTime(const StepTarget &target) {
+	FileStamp input;
+	vector<string> inputs = target.Inputs, depInputs;
+	long long newest = 0;
+
+	if (!target.DepFile.empty()) {
+		depInputs = ReadDepFile(target.DepFile);
+		inputs.insert(inputs.end(), depInputs.begin(), depInputs.end());
+	}
+	for (const string &path : inputs) {
+		if (StatFile(path, input) && input.MTimeNsec > newest) newest = input.MTimeNsec;
+	}
+
+	return newest;
+}
+
+struct Build::PlanState {
+	std::mutex Mutex;
+	// Outputs of the steps that would run, which make the steps using them run too.
+	std::set<string> Rebuilt;
+	// Recorded durations of the steps that would run, in milliseconds, or -1 if unknown.
+	vector<long long> Durations;
+	unsigned UpToDate = 0;
+};
+
+std::shared_ptr<Build::PlanState> Build::Builder::GetPlanState() {
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	if (!SharedPlanState) SharedPlanState = std::make_shared<PlanState>();
+	return SharedPlanState;
+}
+
+string Build::Builder::BuildLogPath() {
+	string cacheDir = ConfigValue(CacheDir);
+
+	return cacheDir.empty() ? string() : JoinPath(cacheDir, "log");
+}
+
+bool Build::Builder::PlanStep(const string &cmdExpr, const StepTarget *target) {
+	std::shared_ptr<PlanState> plan = GetPlanState();
+	string logPath = BuildLogPath(), reason;
+	bool skipUpToDate = false, printCommand = false, cached = false;
+	long long duration = -1;
+	BuildLogEntry entry;
+
+	Configure([&skipUpToDate, &printCommand](Builder &b) {
+		skipUpToDate = b.SkipUpToDate;
+		printCommand = b.PrintCommandToStdout;
+	});
+	if (target) {
+		{
+			std::lock_guard<std::mutex> lock(plan->Mutex);
+			reason = OutOfDateReason(*target, logPath, &plan->Rebuilt);
+			if (reason.empty() && (skipUpToDate || target->SkipsItself)) {
+				++plan->UpToDate;
+				return false;
+			}
+		}
+		if (reason.empty()) reason = "up to date, but SkipUpToDate is not set";
+		if (target->InCache) {
+			cached = target->InCache();
+			reason += cached ? ", restored from cache" : ", cache miss";
+		}
+	} else {
+		reason = "no declared outputs";
+	}
+
+	if (cached) {
+		duration = 0;
+	} else if (!logPath.empty() && LookUpBuildLog(logPath, target ? target->Output : "#" + HashHex(cmdExpr), entry)) {
+		duration = entry.DurationMsec;
+	}
+	{
+		std::lock_guard<std::mutex> lock(plan->Mutex);
+		if (target) {
+			plan->Rebuilt.insert(target->Output);
+			plan->Rebuilt.insert(target->OtherOutputs.begin(), target->OtherOutputs.end());
+		}
+		plan->Durations.push_back(duration);
+	}
+	if (printCommand) PrintCommand("PLAN", (target ? target->Output : cmdExpr) + ": " + reason);
+
+	return true;
+}
+
+Build::PlanEstimate Build::Builder::GetPlanEstimate() {
+	std::shared_ptr<PlanState> plan = GetPlanState();
+	PlanEstimate estimate;
+	long long known = 0, longest = 0, average = 0, serial = 0;
+	unsigned jobs = 1;
+
+	Configure([&jobs](Builder &b) { jobs = b.Jobs < 1 ? 1 : b.Jobs; });
+	{
+		std::lock_guard<std::mutex> lock(plan->Mutex);
+		for (long long duration : plan->Durations) {
+			if (duration < 0) {
+				++estimate.Unrecorded;
+				continue;
+			}
+			known += duration;
+			longest = std::max(longest, duration);
+		}
+		estimate.Steps = (unsigned) plan->Durations.size();
+		estimate.UpToDate = plan->UpToDate;
+	}
+
+	// Steps never run before are assumed to take as long as the others, on average.
+	if (estimate.Steps > estimate.Unrecorded) average = known / (long long) (estimate.Steps - estimate.Unrecorded);
+	serial = known + average * (long long) estimate.Unrecorded;
+	if (estimate.Unrecorded) longest = std::max(longest, average);
+	estimate.SerialSeconds = (double) serial / 1000.0;
+	// Without the dependencies between the steps, the longest one bounds the wall time from below.
+	estimate.Seconds = (double) std::max(serial / (long long) jobs, longest) / 1000.0;
+
+	return estimate;
+}
+
+vector<Build::StepUsage> Build::Builder::HeaviestSteps(unsigned n, bool byMemory) {
+	string logPath = BuildLogPath();
+	vector<StepUsage> steps;
+
+	if (logPath.empty()) return steps;
+	for (const auto &kv : ReadBuildLog(logPath)) {
+		StepUsage step;
+
+		// Steps only ever restored from the cache.
+		if (kv.second.DurationMsec < 0) continue;
+		step.Key = kv.first;
+		step.Command = kv.second.Command;
+		step.DurationMsec = kv.second.DurationMsec;
+		step.Usage = kv.second.Usage;
+		steps.push_back(step);
+	}
+	std::sort(steps.begin(), steps.end(), [byMemory](const StepUsage &a, const StepUsage &b) {
+		if (byMemory) return a.Usage.MaxRSSKiB > b.Usage.MaxRSSKiB;
+		return a.Usage.UserSeconds + a.Usage.SystemSeconds > b.Usage.UserSeconds + b.Usage.SystemSeconds;
+	});
+	if (steps.size() > n) steps.resize(n);
+
+	return steps;
+}
+
+void Build::Builder::PrintResourceReport(unsigned n) {
+	string report;
+
+	for (bool byMemory : { true, false }) {
+		vector<StepUsage> steps = HeaviestSteps(n, byMemory);
+
+		report += byMemory ? "Steps using the most memory" : "Steps using the most CPU time";
+		report += " (peak RSS, CPU time, wall time):\n";
+		for (const StepUsage &step : steps) {
+			char buf[128];
+
+			snprintf(buf, sizeof(buf), "%10.1f MiB %9.2f s CPU %9.2f s  ", (double) step.Usage.MaxRSSKiB / 1024.0,
+				step.Usage.UserSeconds + step.Usage.SystemSeconds, (double) step.DurationMsec / 1000.0);
+			report += buf + (step.Command.empty() ? step.Key : step.Command) + "\n";
+		}
+		if (steps.empty()) report += "(none recorded)\n";
+	}
+	PrintOutput(report);
+}
@@ -0,0 +1,192 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+
+// Minimum time between two redraws of the status line.
+static const long long progressRedrawMsec = 100;
+// Names of running jobs longer than this are shortened to their end, which names the file.
+static const size_t maxProgressNameSize = 32;
+
+namespace {
+	struct Progress {
+		std::mutex Mutex;
+		unsigned Queued = 0;
+		unsigned Done = 0;
+		unsigned NextId = 0;
+		// Names of the running jobs, by id, in the order they started.
+		std::map<unsigned, string> Running;
+		// Time spent with jobs queued, for the throughput: idle time between batches does not count.
+		long long BusyMsec = 0;
+		std::chrono::steady_clock::time_point BusySince;
+		std::chrono::steady_clock::time_point LastDraw;
+		// Whether the status line is on screen, and must be cleared before printing anything else.
+		bool Shown = false;
+		// Whether stdout is a terminal; -1 until checked.
+		int Terminal = -1;
+
+		~Progress() {
+			if (Shown) fputs("\n", stdout);
+		}
+	};
+}
+
+static Progress progressState;
+
+static bool IsTerminal() {
+	if (progressState.Terminal < 0) {
+#if defined(WINDOWS)
+		progressState.Terminal = 0;
+#else
+		const char *term = getenv("TERM");
+
+		progressState.Terminal = isatty(STDOUT_FILENO) && !(term && string(term) == "dumb");
+#endif
+	}
+
+	return progressState.Terminal > 0;
+}
+
+static size_t TerminalWidth() {
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+	struct winsize ws;
+
+	if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col > 0) return ws.ws_col;
+#endif
+
+	return 80;
+}
+
+static string FormatSeconds(long long seconds) {
+	if (seconds < 60) return std::to_string(seconds) + "s";
+	if (seconds < 3600) return std::to_string(seconds / 60) + "m" + std::to_string(seconds % 60) + "s";
+	return std::to_string(seconds / 3600) + "h" + std::to_string(seconds / 60 % 60) + "m";
+}
+
+// Returns `[done/queued]`, then, if `details` is set, the throughput, the ETA and the running jobs.
+// Must be called with the mutex held.
+static string ProgressLine(bool details) {
+	Progress &p = progressState;
+	string line = "[" + std::to_string(p.Done) + "/" + std::to_string(p.Queued) + "]";
+	long long busyMsec = p.BusyMsec;
+	size_t width = TerminalWidth(), names = 0;
+
+	if (!details) return line;
+	if (p.Done < p.Queued) {
+		busyMsec += (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - p.BusySince).count();
+	}
+	if (p.Done && busyMsec > 0) {
+		double rate = p.Done * 1000.0 / (double) busyMsec;
+		char buf[32];
+
+		snprintf(buf, sizeof(buf), " %.1f/s", rate);
+		line += buf;
+		if (p.Done < p.Queued) line += ", ETA " + FormatSeconds((long long) ((p.Queued - p.Done) / rate + 0.5));
+	}
+	for (const auto &kv : p.Running) {
+		string name = kv.second;
+
+		if (name.size() > maxProgressNameSize) name = "..." + name.substr(name.size() - (maxProgressNameSize - 3));
+		if (line.size() + name.size() + 2 >= width) {
+			line += " +" + std::to_string(p.Running.size() - names);
+			break;
+		}
+		line += (names++ ? ", " : ": ") + name;
+	}
+	if (line.size() >= width) line.resize(width - 1);
+
+	return line;
+}
+
+// Redraws the status line, unless it was drawn less than `progressRedrawMsec` ago and `force` is not set.
+// Must be called with the mutex held.
+static void DrawProgress(bool force) {
+	Progress &p = progressState;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	string line;
+
+	if (!force && p.Shown && now - p.LastDraw < std::chrono::milliseconds(progressRedrawMsec)) return;
+	p.LastDraw = now;
+	line = "\r" + ProgressLine(true) + "\033[K";
+	// The line is kept once all queued jobs are done, as output of the program may follow.
+	if (p.Done == p.Queued) line += "\n";
+	fwrite(line.data(), 1, line.size(), stdout);
+	fflush(stdout);
+	p.Shown = p.Done < p.Queued;
+}
+
+// Clears the status line, to print something else. Must be called with the mutex held.
+static void ClearProgress() {
+	if (!progressState.Shown) return;
+	fputs("\r\033[K", stdout);
+	fflush(stdout);
+	progressState.Shown = false;
+}
+
+void Build::PrintOutput(const string &text, FILE *stream) {
+	std::lock_guard<std::mutex> lock(progressState.Mutex);
+	bool redraw = progressState.Shown;
+
+	if (text.empty()) return;
+	ClearProgress();
+	fwrite(text.data(), 1, text.size(), stream);
+	if (text[text.size() - 1] != '\n') fputc('\n', stream);
+	fflush(stream);
+	if (redraw) DrawProgress(true);
+}
+
+void Build::ProgressQueued() {
+	std::lock_guard<std::mutex> lock(progressState.Mutex);
+
+	if (progressState.Done == progressState.Queued) progressState.BusySince = std::chrono::steady_clock::now();
+	++progressState.Queued;
+}
+
+unsigned Build::ProgressStarted(const string &name) {
+	std::lock_guard<std::mutex> lock(progressState.Mutex);
+	unsigned id = progressState.NextId++;
+
+	progressState.Running[id] = name;
+	if (IsTerminal()) DrawProgress(false);
+
+	return id;
+}
+
+void Build::ProgressFinished(unsigned id, bool failed, const string &command, const string &output) {
+	std::lock_guard<std::mutex> lock(progressState.Mutex);
+	Progress &p = progressState;
+	string name = p.Running[id], text;
+
+	p.Running.erase(id);
+	++p.Done;
+	if (p.Done == p.Queued) {
+		p.BusyMsec += (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - p.BusySince).count();
+	}
+
+	if (!IsTerminal()) text = ProgressLine(false) + " " + name + "\n";
+	if (failed) text += "[FAILED] " + command + "\n";
+	text += output;
+	if (!text.empty() && text[text.size() - 1] != '\n') text += "\n";
+	if (!text.empty()) {
+		ClearProgress();
+		fwrite(text.data(), 1, text.size(), stdout);
+		fflush(stdout);
+	}
+	// A queued job takes the slot of this one right away, and redraws the line then.
+	if (IsTerminal() && (!text.empty() || p.Done + p.Running.size() == p.Queued)) DrawProgress(!text.empty() || p.Done == p.Queued);
+}
@@ -0,0 +1,316 @@
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <unistd.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::ExecResult;
+
+// Requests and responses are this magic followed by length-prefixed fields:
+// request: language (`c` or `c++`), flags, source file name, preprocessed source;
+// response: exit code (decimal), diagnostics, object file.
+static const char workerMagic[4] = { 'L', 'B', 'W', '1' };
+static const unsigned long maxWorkerField = 1UL << 30;
+
+// Spreads compilations over the workers, process-wide.
+static std::atomic<unsigned> nextWorker(0);
+static std::atomic<unsigned> workerJobCounter(0);
+
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+void Build::SendAll(int fd, const char *data, size_t size) {
+#if defined(MSG_NOSIGNAL)
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+
+	while (size > 0) {
+		ssize_t n = send(fd, data, size, flags);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) throw runtime_error("connection lost");
+		data += n;
+		size -= (size_t) n;
+	}
+}
+
+static void RecvAll(int fd, char *data, size_t size) {
+	while (size > 0) {
+		ssize_t n = recv(fd, data, size, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) throw runtime_error("connection lost");
+		data += n;
+		size -= (size_t) n;
+	}
+}
+
+static void SendField(int fd, const string &field) {
+	unsigned char len[4];
+
+	for (int i = 0; i < 4; ++i) len[i] = (unsigned char) (field.size() >> (8 * (3 - i)));
+	Build::SendAll(fd, (const char *) len, 4);
+	Build::SendAll(fd, field.data(), field.size());
+}
+
+static string RecvField(int fd) {
+	unsigned char len[4];
+	unsigned long size = 0;
+	string field;
+
+	RecvAll(fd, (char *) len, 4);
+	for (int i = 0; i < 4; ++i) size = (size << 8) | len[i];
+	if (size > maxWorkerField) throw runtime_error("worker protocol error");
+	field.resize(size);
+	if (size) RecvAll(fd, &field[0], size);
+
+	return field;
+}
+
+static void RecvMagic(int fd) {
+	char magic[4];
+
+	RecvAll(fd, magic, 4);
+	if (memcmp(magic, workerMagic, 4)) throw runtime_error("worker protocol error");
+}
+
+int Build::OpenSocket(const string &address, bool listening) {
+	int fd = -1;
+
+	if (address.rfind("unix:", 0) == 0) {
+		struct sockaddr_un sa;
+		string path = address.substr(5);
+
+		if (path.size() >= sizeof(sa.sun_path)) throw runtime_error(string("invalid worker address: ") + address);
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		memcpy(sa.sun_path, path.c_str(), path.size());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) throw runtime_error(string("unable to connect to worker: ") + address);
+		if (listening) {
+			unlink(path.c_str());
+			if (!bind(fd, (struct sockaddr *) &sa, sizeof(sa)) && !listen(fd, 64)) return fd;
+		} else if (!connect(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+			return fd;
+		}
+		close(fd);
+	} else {
+		struct addrinfo hints, *addrs = NULL;
+		size_t colon = address.rfind(':');
+		string host = colon == string::npos ? string() : address.substr(0, colon);
+		string port = colon == string::npos ? address : address.substr(colon + 1);
+
+		if (host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']') host = host.substr(1, host.size() - 2);
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (listening) hints.ai_flags = AI_PASSIVE;
+		if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addrs)) {
+			throw runtime_error(string("invalid worker address: ") + address);
+		}
+		for (struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+			int yes = 1;
+
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0) continue;
+			if (listening) {
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+				if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 64)) break;
+			} else if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+				break;
+			}
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(addrs);
+		if (fd >= 0) return fd;
+	}
+
+	throw runtime_error(string(listening ? "unable to listen on: " : "unable to connect to worker: ") + address);
+}
+#endif
+
+string Build::CompileOnlyFlags(const string &flags) {
+	static const char *withArg[] = { "-include", "-imacros", "-I", "-isystem", "-iquote", "-idirafter", "-MF", "-MT", "-MQ", NULL };
+	static const char *alone[] = { "-M", "-MM", "-MD", "-MMD", "-MP", "-MG", NULL };
+	string remote;
+	size_t start = flags.find_first_not_of(" \t");
+
+	while (start != string::npos) {
+		size_t end = flags.find_first_of(" \t", start);
+		string flag = flags.substr(start, end == string::npos ? string::npos : end - start);
+		bool skip = false, skipNext = false;
+
+		for (int i = 0; withArg[i]; ++i) {
+			if (flag == withArg[i]) skip = skipNext = true;
+			else if (flag.rfind(withArg[i], 0) == 0 && (flag[1] == 'I' || flag[1] == 'M')) skip = true;
+		}
+		for (int i = 0; alone[i]; ++i) {
+			if (flag == alone[i]) skip = true;
+		}
+		if (flag.rfind("-Wp,", 0) == 0) skip = true;
+		if (!skip) remote += (remote.empty() ? "" : " ") + flag;
+
+		start = end == string::npos ? end : flags.find_first_not_of(" \t", end);
+		if (skipNext && start != string::npos) {
+			end = flags.find_first_of(" \t", start);
+			start = end == string::npos ? end : flags.find_first_not_of(" \t", end);
+		}
+	}
+
+	return remote;
+}
+
+int Build::ExitCodeOfStatus(int status) {
+	if (status == -1) throw runtime_error("invocation error");
+#if defined(WINDOWS)
+	return status;
+#else
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+bool Build::CompileOnWorker(const vector<string> &workers, const CompileStep &step, const string &flags,
+	const string &preprocessed, int &exitCode, string &diagnostics, string &object) {
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+	for (size_t attempt = 0; attempt < workers.size(); ++attempt) {
+		const string &worker = workers[nextWorker++ % workers.size()];
+		int fd = -1;
+
+		try {
+			fd = OpenSocket(worker, false);
+			SendAll(fd, workerMagic, 4);
+			SendField(fd, step.CXX ? "c++" : "c");
+			SendField(fd, flags);
+			SendField(fd, step.Source);
+			SendField(fd, preprocessed);
+			RecvMagic(fd);
+			exitCode = atoi(RecvField(fd).c_str());
+			diagnostics = RecvField(fd);
+			object = RecvField(fd);
+			close(fd);
+		} catch (std::exception &e) {
+			// Try the next worker.
+			if (fd >= 0) close(fd);
+			continue;
+		}
+
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+// Whether `flags`, as received from a client, can go on the worker's shell command line as they are: only
+// characters the shell gives no meaning to, so that a client can pass compiler flags but run nothing else.
+static bool ShellSafeFlags(const string &flags) {
+	for (char c : flags) {
+		if (!isalnum((unsigned char) c) && !strchr(" \t-_=+.,/:@%", c)) return false;
+	}
+
+	return true;
+}
+#endif
+
+void Build::Builder::ServeWorker(string address, std::function<bool()> keepRunning) {
+#if defined(MACOS) || defined(LINUX) || defined(UNIX)
+	int listener = OpenSocket(address, true);
+	std::mutex mutex;
+	std::condition_variable idle;
+	unsigned active = 0;
+	string workDir = JoinPath(ConfigValue(CacheDir).empty() ? string(".") : ConfigValue(CacheDir), "worker");
+
+	MakeDirs(workDir);
+	auto serve = [this, &workDir](int fd) {
+		string base = JoinPath(workDir, "job-" + std::to_string((long) getpid()) + "-" + std::to_string(workerJobCounter++));
+		string input, objectPath = base + ".o", errPath = base + ".err";
+
+		try {
+			string language, flags, source, preprocessed, diagnostics, object;
+			ExecResult result;
+
+			RecvMagic(fd);
+			language = RecvField(fd);
+			flags = RecvField(fd);
+			source = RecvField(fd);
+			preprocessed = RecvField(fd);
+			// Closing the connection makes the client compile locally.
+			if (!ShellSafeFlags(flags)) throw runtime_error("unsafe flags from client: " + flags);
+			input = base + (language == "c++" ? ".ii" : ".i");
+			WriteFileAtomic(input, preprocessed);
+
+			// Queued on this Builder's scheduler, so at most `Jobs` compilations run at once.
+			result = ExecRawAsync((language == "c++" ? CXXCommandLine() : CCCommandLine()) + (flags.empty() ? "" : " " + flags)
+				+ " -c -o " + objectPath + " " + input + " > " + errPath + " 2>&1").Wait();
+			diagnostics = ReadFile(errPath);
+			if (!result.ExitCode) object = ReadFile(objectPath);
+
+			SendAll(fd, workerMagic, 4);
+			SendField(fd, std::to_string(result.ExitCode));
+			SendField(fd, diagnostics);
+			SendField(fd, object);
+		} catch (std::exception &e) {
+			// The client compiles locally when a worker fails.
+		}
+		close(fd);
+		if (!input.empty()) remove(input.c_str());
+		remove(objectPath.c_str());
+		remove(errPath.c_str());
+	};
+
+	while (!keepRunning || keepRunning()) {
+		struct pollfd pfd;
+		int fd = -1;
+
+		pfd.fd = listener;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		// Wake up now and then to check `keepRunning`.
+		if (poll(&pfd, 1, 200) <= 0) continue;
+		fd = accept(listener, NULL, NULL);
+		if (fd < 0) continue;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++active;
+		}
+		std::thread([&, fd] {
+			serve(fd);
+			std::lock_guard<std::mutex> lock(mutex);
+			--active;
+			idle.notify_all();
+		}).detach();
+	}
+
+	close(listener);
+	if (address.rfind("unix:", 0) == 0) unlink(address.substr(5).c_str());
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [&active] { return active == 0; });
+#else
+	throw runtime_error(string("unable to listen on: ") + address);
+#endif
+}
@@ -0,0 +1,78 @@
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using Build::Statistics;
+
+Build::StatCounters Build::Counters;
+
+// Where the counters are written when the process exits, or empty.
+static std::mutex statsFileMutex;
+static string statsFilePath;
+
+static void WriteStatsAtExit() {
+	string path;
+
+	{
+		std::lock_guard<std::mutex> lock(statsFileMutex);
+		path = statsFilePath;
+	}
+	try {
+		Build::WriteFileAtomic(path, Build::StatsJSON(Build::Builder::Stats()));
+	} catch (std::exception &e) {
+		fprintf(stderr, "unable to write build statistics: %s\n", e.what());
+	}
+}
+
+void Build::SetStatsFile(const string &path) {
+	std::lock_guard<std::mutex> lock(statsFileMutex);
+
+	if (path.empty() || path == statsFilePath) return;
+	if (statsFilePath.empty()) atexit(WriteStatsAtExit);
+	statsFilePath = path;
+}
+
+Statistics Build::Builder::Stats() {
+	Statistics stats;
+
+	stats.ProcessesSpawned = Counters.ProcessesSpawned;
+	stats.SpawnSeconds = (double) Counters.SpawnNsec / 1e9;
+	stats.WaitSeconds = (double) Counters.WaitNsec / 1e9;
+	stats.StatCalls = Counters.StatCalls;
+	stats.StatCacheHits = Counters.StatCacheHits;
+	stats.CacheHits = Counters.CacheHits;
+	stats.CacheMisses = Counters.CacheMisses;
+	stats.BytesCopied = Counters.BytesCopied;
+	stats.JobsSkipped = Counters.JobsSkipped;
+	stats.JobsCutOff = Counters.JobsCutOff;
+
+	return stats;
+}
+
+string Build::StatsJSON(const Statistics &stats) {
+	char buf[512];
+
+	snprintf(buf, sizeof(buf),
+		"{\n"
+		"  \"processesSpawned\": %llu,\n"
+		"  \"spawnSeconds\": %.6f,\n"
+		"  \"waitSeconds\": %.6f,\n"
+		"  \"statCalls\": %llu,\n"
+		"  \"statCacheHits\": %llu,\n"
+		"  \"cacheHits\": %llu,\n"
+		"  \"cacheMisses\": %llu,\n"
+		"  \"bytesCopied\": %llu,\n"
+		"  \"jobsSkipped\": %llu,\n"
+		"  \"jobsCutOff\": %llu\n"
+		"}\n",
+		stats.ProcessesSpawned, stats.SpawnSeconds, stats.WaitSeconds, stats.StatCalls, stats.StatCacheHits,
+		stats.CacheHits, stats.CacheMisses, stats.BytesCopied, stats.JobsSkipped, stats.JobsCutOff);
+
+	return buf;
+}
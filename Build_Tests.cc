@@ -0,0 +1,115 @@
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using Build::ExecResult;
+using Build::Job;
+using Build::TestStep;
+
+// Part of the key of passed tests; bump to invalidate the recorded results.
+static const char *testKeyVersion = "libBuild-test 1";
+
+namespace {
+	struct TestRequest {
+		TestStep Step;
+		string Command;
+		// Where the output of the test is written.
+		string LogPath;
+		// Directory of the markers of passed tests, or empty if results are not cached.
+		string ResultsDir;
+	};
+}
+
+// Returns the key of a run of `request`: its command line, and the contents of the program and the data files.
+static string TestKey(const TestRequest &request) {
+	string key = string(testKeyVersion) + "\n" + request.Command + "\n";
+
+	// Programs found through `PATH` are not hashed.
+	if (Build::Builder::FileExists(request.Step.Program)) {
+		key += request.Step.Program + " " + Build::Sha256Hex(Build::ReadFile(request.Step.Program)) + "\n";
+	}
+	for (const string &path : request.Step.Data) key += path + " " + Build::Sha256Hex(Build::ReadFile(path)) + "\n";
+
+	return Build::Sha256Hex(key);
+}
+
+static int RunTest(const TestRequest &request, ExecResult &result) {
+	string marker, output;
+	bool timedOut = false;
+	int exitCode = 0;
+
+	if (!request.ResultsDir.empty()) {
+		marker = Build::JoinPath(request.ResultsDir, TestKey(request));
+		if (Build::Builder::FileExists(marker)) {
+			++Build::Counters.CacheHits;
+			result.Cached = true;
+			return 0;
+		}
+		++Build::Counters.CacheMisses;
+	}
+
+	exitCode = Build::ExitCodeOfStatus(Build::RunShellCapture(request.Command, output, &result.Usage, request.Step.TimeoutSeconds, &timedOut));
+	Build::WriteFileAtomic(request.LogPath, output);
+	if (timedOut) {
+		// Like timeout(1).
+		exitCode = 124;
+		Build::PrintOutput("[TIMEOUT] " + request.Step.Name + " after " + std::to_string(request.Step.TimeoutSeconds) + " s\n" + output);
+	} else if (exitCode) {
+		Build::PrintOutput("[FAILED] " + request.Step.Name + " (exit code " + std::to_string(exitCode) + ")\n" + output);
+	} else if (!marker.empty()) {
+		try {
+			Build::MakeDirs(request.ResultsDir);
+			Build::WriteFileAtomic(marker, string());
+		} catch (std::exception &e) {
+			// The test passed; it only runs again next time.
+		}
+	}
+
+	return exitCode;
+}
+
+// Returns whether the test `name` belongs to shard `index` of `count`. Tests are spread by the hash of their name,
+// so that each keeps its shard when others are added.
+static bool InTestShard(const string &name, unsigned index, unsigned count) {
+	if (count <= 1) return true;
+	return strtoull(Build::HashHex(name).c_str(), NULL, 16) % count == index;
+}
+
+Job Build::Builder::TestAsync(const TestStep &step) {
+	TestRequest request;
+	unsigned shardIndex = 0, shardCount = 0;
+	bool cacheResults = false;
+	string cacheDir, name;
+
+	request.Step = step;
+	if (request.Step.Name.empty()) request.Step.Name = step.Program;
+	request.Command = step.Program + (step.Args.empty() ? "" : " " + step.Args);
+	Configure([&](Builder &b) {
+		shardIndex = b.TestShardIndex;
+		shardCount = b.TestShardCount;
+		cacheResults = b.CacheTestResults;
+		cacheDir = b.CacheDir;
+	});
+	if (!InTestShard(request.Step.Name, shardIndex, shardCount)) {
+		// Another invocation runs it.
+		return SkippedJob(request.Command);
+	}
+	if (cacheResults && !cacheDir.empty()) request.ResultsDir = JoinPath(cacheDir, "tests");
+	name = NormalizePath(request.Step.Name);
+	for (char &c : name) {
+		if (c == '/' || c == '\\' || c == ':') c = '_';
+	}
+	request.LogPath = OutputPath("testlogs/" + name + ".log");
+
+	return SubmitJob(request.Command, [request](ExecResult &result, unsigned) { return RunTest(request, result); }, false);
+}
+
+ExecResult Build::Builder::Test(const TestStep &step) {
+	return TestAsync(step).Wait();
+}
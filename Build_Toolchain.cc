@@ -0,0 +1,336 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using Build::ToolchainInfo;
+
+static const char *toolchainCacheHeader = "libBuild-toolchain 3";
+
+#if defined(WINDOWS)
+static const char *nullDevice = "NUL";
+#else
+static const char *nullDevice = "/dev/null";
+#endif
+
+static const char *cStandards[] = { "c89", "c99", "c11", "c17", "c2x", "c23", NULL };
+static const char *cxxStandards[] = { "c++98", "c++11", "c++14", "c++17", "c++20", "c++2b", "c++23", "c++2c", "c++26", NULL };
+
+struct FeatureProbe {
+	const char *Name;
+	// Only probed for compilers of this family, if not empty.
+	const char *Family;
+	bool CXXOnly;
+	// `NULL_DEVICE` is replaced by the null device.
+	const char *Flags;
+};
+
+static const FeatureProbe featureProbes[] = {
+	{ "lto", "", false, "-flto -fsyntax-only" },
+	{ "lto-incremental", "gcc", false, "-flto -flto-incremental=NULL_DEVICE -fsyntax-only" },
+	{ "modules", "gcc", true, "-std=c++20 -fmodules-ts -fsyntax-only" },
+	{ "modules", "clang", true, "-std=c++20 -fsyntax-only" },
+	{ "p1689", "gcc", true, "-std=c++20 -fmodules-ts -fdeps-format=p1689r5 -fdeps-file=NULL_DEVICE -fdeps-target=probe.o -M -MF NULL_DEVICE -E" },
+	{ "thread-sanitizer", "", false, "-fsanitize=thread -fsyntax-only" },
+	{ "address-sanitizer", "", false, "-fsanitize=address -fsyntax-only" },
+	{ "split-dwarf", "", false, "-gsplit-dwarf -fsyntax-only" },
+	{ "color-diagnostics", "", false, "-fdiagnostics-color=always -fsyntax-only" },
+	{ "file-prefix-map", "", false, "-ffile-prefix-map=/=/ -fsyntax-only" },
+};
+
+// Probed toolchains, by cache key, so that later probes in the same process only stat the compiler.
+static std::mutex toolchainsMutex;
+static std::map<string, ToolchainInfo> toolchains;
+
+bool Build::ToolchainInfo::Supports(const string &name) const {
+	for (const string &standard : Standards) {
+		if (standard == name) return true;
+	}
+	for (const string &feature : Features) {
+		if (feature == name) return true;
+	}
+	return false;
+}
+
+static string FindExecutable(const string &name) {
+	const char *pathEnv = getenv("PATH");
+	string path, dirs = pathEnv ? pathEnv : "";
+#if defined(WINDOWS)
+	const char separator = ';';
+	string suffix = name.find('.') == string::npos ? ".exe" : "";
+#else
+	const char separator = ':';
+	string suffix;
+	char resolved[PATH_MAX];
+#endif
+	size_t start = 0;
+
+	if (name.find_first_of("/\\") != string::npos) {
+		path = name;
+	} else {
+		while (start <= dirs.size()) {
+			size_t end = dirs.find(separator, start);
+			string candidate;
+			struct stat sb;
+
+			if (end == string::npos) end = dirs.size();
+			candidate = Build::JoinPath(end > start ? dirs.substr(start, end - start) : string("."), name + suffix);
+			if (!stat(candidate.c_str(), &sb) && S_ISREG(sb.st_mode) && !access(candidate.c_str(), X_OK)) {
+				path = candidate;
+				break;
+			}
+			start = end + 1;
+		}
+		if (path.empty()) throw runtime_error(string("unable to probe toolchain: ") + name + " not found");
+	}
+
+#if !defined(WINDOWS)
+	if (realpath(path.c_str(), resolved)) path = resolved;
+#endif
+	return Build::AbsolutePath(path);
+}
+
+// Returns the path of the compiler run by `command`, skipping wrappers like `ccache`.
+static string ResolveCompiler(const string &command) {
+	size_t start = command.find_first_not_of(" \t");
+
+	while (start != string::npos) {
+		size_t end = command.find_first_of(" \t", start);
+		string word = command.substr(start, end == string::npos ? string::npos : end - start);
+		string base = word.substr(word.find_last_of("/\\") == string::npos ? 0 : word.find_last_of("/\\") + 1);
+
+		if (base.size() > 4 && base.compare(base.size() - 4, 4, ".exe") == 0) base.resize(base.size() - 4);
+		if (base != "ccache" && base != "sccache" && base != "distcc") return FindExecutable(word);
+		start = end == string::npos ? end : command.find_first_not_of(" \t", end);
+	}
+
+	throw runtime_error(string("unable to probe toolchain: ") + command);
+}
+
+static string MacroValue(const std::map<string, string> &macros, const string &name) {
+	auto it = macros.find(name);
+	return it == macros.end() ? string() : it->second;
+}
+
+// Parses the output of `<compiler> -dM -E -v`: the predefined macros, the target, and the search list.
+static void ParseCompilerInfo(const string &output, ToolchainInfo &info) {
+	std::map<string, string> macros;
+	bool inSearchList = false;
+	size_t start = 0;
+
+	while (start < output.size()) {
+		size_t end = output.find('\n', start);
+		string line = output.substr(start, end == string::npos ? string::npos : end - start);
+
+		if (end == string::npos) end = output.size();
+		start = end + 1;
+		if (!line.empty() && line[line.size() - 1] == '\r') line.resize(line.size() - 1);
+
+		if (line.rfind("#define ", 0) == 0) {
+			size_t space = line.find(' ', 8);
+			if (space == string::npos) {
+				macros[line.substr(8)] = "";
+			} else {
+				macros[line.substr(8, space - 8)] = line.substr(space + 1);
+			}
+		} else if (line == "#include <...> search starts here:") {
+			inSearchList = true;
+		} else if (line == "End of search list.") {
+			inSearchList = false;
+		} else if (inSearchList && !line.empty() && line[0] == ' ') {
+			const string framework = " (framework directory)";
+			line = line.substr(line.find_first_not_of(' '));
+			if (line.size() > framework.size() && line.compare(line.size() - framework.size(), framework.size(), framework) == 0) {
+				line.resize(line.size() - framework.size());
+			}
+			info.SystemIncludeDirs.push_back(Build::NormalizePath(line));
+		} else if (line.rfind("Target: ", 0) == 0) {
+			info.Target = line.substr(8);
+		}
+	}
+
+	if (macros.count("__clang__")) {
+		info.Family = "clang";
+		info.Version = MacroValue(macros, "__clang_major__") + "." + MacroValue(macros, "__clang_minor__") + "."
+			+ MacroValue(macros, "__clang_patchlevel__");
+	} else if (macros.count("__GNUC__")) {
+		info.Family = "gcc";
+		info.Version = MacroValue(macros, "__GNUC__") + "." + MacroValue(macros, "__GNUC_MINOR__") + "."
+			+ MacroValue(macros, "__GNUC_PATCHLEVEL__");
+	} else {
+		info.Family = "unknown";
+	}
+}
+
+static bool LoadToolchainCache(const string &path, const string &key, ToolchainInfo &info) {
+	FILE *in = fopen(path.c_str(), "rb");
+	char line[8192];
+	bool ok = false;
+
+	if (!in) return false;
+	ok = fgets(line, sizeof(line), in) && string(line) == string(toolchainCacheHeader) + "\n";
+	ok = ok && fgets(line, sizeof(line), in) && string(line) == "K " + key + "\n";
+	while (ok && fgets(line, sizeof(line), in)) {
+		size_t len = strlen(line);
+		string value;
+
+		if (len < 3 || line[len - 1] != '\n' || line[1] != ' ') {
+			ok = false;
+			break;
+		}
+		value = string(line + 2, len - 3);
+		switch (line[0]) {
+		case 'P': info.Path = value; break;
+		case 'F': info.Family = value; break;
+		case 'V': info.Version = value; break;
+		case 'T': info.Target = value; break;
+		case 'S': info.Standards.push_back(value); break;
+		case 'X': info.Features.push_back(value); break;
+		case 'I': info.SystemIncludeDirs.push_back(value); break;
+		default: ok = false; break;
+		}
+	}
+	fclose(in);
+
+	return ok;
+}
+
+static void SaveToolchainCache(const string &path, const string &key, const ToolchainInfo &info) {
+	string content = string(toolchainCacheHeader) + "\n" + "K " + key + "\n";
+
+	content += "P " + info.Path + "\n";
+	content += "F " + info.Family + "\n";
+	content += "V " + info.Version + "\n";
+	content += "T " + info.Target + "\n";
+	for (const string &standard : info.Standards) content += "S " + standard + "\n";
+	for (const string &feature : info.Features) content += "X " + feature + "\n";
+	for (const string &dir : info.SystemIncludeDirs) content += "I " + dir + "\n";
+
+	try {
+		Build::MakeDirs(path.substr(0, path.find_last_of('/')));
+		Build::WriteFileAtomic(path, content);
+	} catch (std::exception &e) {
+		// The cache is an optimization; probe again next time.
+	}
+}
+
+// Runs the probes for `command`, compiling `language`.
+static void RunToolchainProbes(const string &command, const string &language, bool printCommand, ToolchainInfo &info) {
+	string input = " -x " + language + " - < " + nullDevice, output;
+	vector<string> names, cmds;
+	vector<bool> isStandard;
+	vector<int> rets;
+	vector<std::thread> threads;
+	const char **standards = language == "c++" ? cxxStandards : cStandards;
+
+	if (printCommand) Build::PrintCommand("PROBE", command + " -dM -E -v" + input);
+	if (Build::RunShellCapture(command + " -dM -E -v" + input, output)) {
+		throw runtime_error(string("unable to probe toolchain: ") + command);
+	}
+	ParseCompilerInfo(output, info);
+
+	for (int i = 0; standards[i]; ++i) {
+		names.push_back(standards[i]);
+		isStandard.push_back(true);
+		cmds.push_back(command + " -std=" + standards[i] + " -fsyntax-only" + input);
+	}
+	for (const FeatureProbe &probe : featureProbes) {
+		string flags = probe.Flags;
+		size_t pos = 0;
+
+		if (probe.CXXOnly && language != "c++") continue;
+		if (probe.Family[0] && info.Family != probe.Family) continue;
+		while ((pos = flags.find("NULL_DEVICE")) != string::npos) flags.replace(pos, 11, nullDevice);
+		names.push_back(probe.Name);
+		isStandard.push_back(false);
+		cmds.push_back(command + " " + flags + input);
+	}
+
+	// The probes are independent, so run them at once.
+	rets.resize(cmds.size());
+	for (size_t i = 0; i < cmds.size(); ++i) {
+		if (printCommand) Build::PrintCommand("PROBE", cmds[i]);
+		threads.push_back(std::thread([&cmds, &rets, i] {
+			string ignored;
+			rets[i] = Build::RunShellCapture(cmds[i], ignored);
+		}));
+	}
+	for (std::thread &thread : threads) thread.join();
+
+	for (size_t i = 0; i < cmds.size(); ++i) {
+		if (rets[i]) continue;
+		if (isStandard[i]) {
+			info.Standards.push_back(names[i]);
+		} else {
+			info.Features.push_back(names[i]);
+		}
+	}
+}
+
+static ToolchainInfo ProbeToolchain(const string &command, const string &language, const string &cacheDir, bool printCommand) {
+	string path = ResolveCompiler(command), key, cachePath;
+	Build::FileStamp stamp;
+	ToolchainInfo info;
+
+	if (!Build::StatFile(path, stamp)) throw runtime_error(string("unable to probe toolchain: ") + command);
+	key = language + " " + std::to_string(stamp.Size) + " " + std::to_string(stamp.MTimeNsec) + " " + path + " " + command;
+
+	{
+		std::lock_guard<std::mutex> lock(toolchainsMutex);
+		auto it = toolchains.find(key);
+		if (it != toolchains.end()) return it->second;
+	}
+
+	if (!cacheDir.empty()) {
+		cachePath = Build::AbsolutePath(Build::JoinPath(Build::JoinPath(cacheDir, "toolchains"), Build::HashHex(language + " " + command)));
+	}
+	if (cachePath.empty() || !LoadToolchainCache(cachePath, key, info)) {
+		info = ToolchainInfo();
+		info.Path = path;
+		RunToolchainProbes(command, language, printCommand, info);
+		if (!cachePath.empty()) SaveToolchainCache(cachePath, key, info);
+	}
+
+	std::lock_guard<std::mutex> lock(toolchainsMutex);
+	toolchains[key] = info;
+	return info;
+}
+
+ToolchainInfo Build::Builder::ProbeCC() {
+	string command, cacheDir;
+	bool printCommand = true;
+
+	Configure([&](Builder &b) {
+		command = b.CCCommand;
+		cacheDir = b.CacheDir;
+		printCommand = b.PrintCommandToStdout;
+	});
+	return ProbeToolchain(command, "c", cacheDir, printCommand);
+}
+
+ToolchainInfo Build::Builder::ProbeCXX() {
+	string command, cacheDir;
+	bool printCommand = true;
+
+	Configure([&](Builder &b) {
+		command = b.CXXCommand;
+		cacheDir = b.CacheDir;
+		printCommand = b.PrintCommandToStdout;
+	});
+	return ProbeToolchain(command, "c++", cacheDir, printCommand);
+}
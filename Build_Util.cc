@@ -0,0 +1,353 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Build.h"
+#include "Build_Internal.h"
+#include "EnsureOSMacro.h"
+
+#if defined(WINDOWS)
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+// Commands longer than this have their arguments moved into a response file. Linux limits a single
+// argument, such as the command passed to `sh -c`, to 128 KiB; `cmd.exe` limits commands to 8191 characters.
+#if defined(WINDOWS)
+static const size_t maxCommandLength = 7000;
+#else
+static const size_t maxCommandLength = 32768;
+#endif
+
+// Splits `args` into arguments the way the shell would. Returns false if they use any shell feature
+// other than quoting, such as variables, globs or redirections, which a response file cannot express.
+static bool SplitShellArgs(const string &args, vector<string> &argv) {
+#if defined(WINDOWS)
+	static const char *special = "&|<>^%";
+#else
+	static const char *special = "|&;<>()$`*?[]~#{}!";
+#endif
+	string arg;
+	bool inArg = false;
+
+	for (size_t i = 0; i < args.size(); ++i) {
+		char c = args[i];
+
+		if (c == ' ' || c == '\t') {
+			if (inArg) argv.push_back(arg);
+			arg.clear();
+			inArg = false;
+			continue;
+		}
+		inArg = true;
+		if (c == '"') {
+			for (++i; i < args.size() && args[i] != '"'; ++i) {
+#if !defined(WINDOWS)
+				if (args[i] == '$' || args[i] == '`' || args[i] == '!') return false;
+				if (args[i] == '\\' && i + 1 < args.size() && strchr("\"\\$`", args[i + 1])) ++i;
+#endif
+				arg += args[i];
+			}
+			if (i == args.size()) return false;
+#if !defined(WINDOWS)
+		} else if (c == '\'') {
+			for (++i; i < args.size() && args[i] != '\''; ++i) arg += args[i];
+			if (i == args.size()) return false;
+		} else if (c == '\\') {
+			if (++i == args.size()) return false;
+			arg += args[i];
+#endif
+		} else if (strchr(special, c) || c == '\n' || c == '\r') {
+			return false;
+		} else {
+			arg += c;
+		}
+	}
+	if (inArg) argv.push_back(arg);
+
+	return true;
+}
+
+string Build::ResponseFileCommand(const string &program, const string &args, const string &dir) {
+	string command = program + (args.empty() ? "" : " " + args), content, path;
+	vector<string> argv;
+	FileStamp stamp;
+
+	if (program.empty()) return args;
+	if (command.size() <= maxCommandLength || !SplitShellArgs(args, argv)) return command;
+
+	// The quoting of GCC, Clang and binutils: backslashes escape the next character.
+	for (const string &arg : argv) {
+		for (char c : arg) {
+			if (strchr(" \t\n\r\\\"'", c)) content += '\\';
+			content += c;
+		}
+		content += '\n';
+	}
+
+	// Named by content, so an unchanged argument list reuses the file written by an earlier run.
+	path = JoinPath(dir, HashHex(content) + ".rsp");
+	if (!StatFile(path, stamp) || stamp.Size != (long long) content.size()) {
+		MakeDirs(dir);
+		WriteFileAtomic(path, content);
+	}
+
+	return program + " @" + path;
+}
+
+bool Build::CommandTooLong(const string &command) {
+	return command.size() > maxCommandLength;
+}
+
+string Build::JoinPath(const string &dir, const string &path) {
+	if (dir.empty() || dir == "." || IsAbsolutePath(path)) return path;
+	if (path.empty()) return dir;
+	if (dir[dir.size() - 1] == '/') return dir + path;
+	return dir + "/" + path;
+}
+
+bool Build::IsAbsolutePath(const string &path) {
+	if (!path.empty() && (path[0] == '/' || path[0] == '\\')) return true;
+#if defined(WINDOWS)
+	if (path.size() > 1 && path[1] == ':') return true;
+#endif
+	return false;
+}
+
+string Build::NormalizePath(const string &path) {
+	vector<string> segs;
+	string normalized;
+	bool absolute = IsAbsolutePath(path);
+	size_t start = 0;
+
+	while (start <= path.size()) {
+		size_t end = path.find_first_of("/\\", start);
+		if (end == string::npos) end = path.size();
+		string seg = path.substr(start, end - start);
+		if (seg == "..") {
+			if (!segs.empty() && segs.back() != "..") {
+				segs.pop_back();
+			} else if (!absolute) {
+				segs.push_back(seg);
+			}
+		} else if (!seg.empty() && seg != ".") {
+			segs.push_back(seg);
+		}
+		start = end + 1;
+	}
+
+	for (size_t i = 0; i < segs.size(); ++i) {
+		if (i) normalized += "/";
+		normalized += segs[i];
+	}
+#if defined(WINDOWS)
+	if (absolute && path.size() > 1 && path[1] == ':') return normalized;
+#endif
+	if (absolute) return "/" + normalized;
+	return normalized.empty() ? string(".") : normalized;
+}
+
+string Build::AbsolutePath(const string &path) {
+	if (IsAbsolutePath(path)) return NormalizePath(path);
+	return NormalizePath(Builder::GetCurrentWorkingDir() + "/" + path);
+}
+
+string Build::RelativePath(const string &path, const string &dir) {
+	string absPath = AbsolutePath(path), absDir = AbsolutePath(dir);
+	string relative;
+	size_t common = 0;
+
+	if (absDir == "/") absDir = "";
+	// Find the longest common directory prefix.
+	for (size_t i = 0; i <= absDir.size() && i <= absPath.size(); ++i) {
+		bool dirEnd = i == absDir.size() || absDir[i] == '/';
+		bool pathEnd = i == absPath.size() || absPath[i] == '/';
+		if (dirEnd && pathEnd) common = i;
+		if (i == absDir.size() || i == absPath.size() || absDir[i] != absPath[i]) break;
+	}
+	for (size_t i = common; i < absDir.size(); ++i) {
+		if (absDir[i] == '/') relative += "../";
+	}
+	if (common < absPath.size()) relative += absPath.substr(common + 1);
+	if (relative.empty()) return ".";
+	if (relative[relative.size() - 1] == '/') relative.resize(relative.size() - 1);
+	return relative;
+}
+
+void Build::MakeDirs(const string &dirPath) {
+	struct stat sb;
+	string parent;
+	size_t slash = 0;
+
+	if (dirPath.empty() || dirPath == "." || dirPath == "/") return;
+	if (!stat(dirPath.c_str(), &sb)) {
+		if (S_ISDIR(sb.st_mode)) return;
+		throw runtime_error(string("unable to create directory: ") + dirPath);
+	}
+
+	slash = dirPath.find_last_of("/\\");
+	if (slash != string::npos && slash > 0) MakeDirs(dirPath.substr(0, slash));
+#if defined(WINDOWS)
+	if (mkdir(dirPath.c_str()) && errno != EEXIST) {
+#else
+	if (mkdir(dirPath.c_str(), 0777) && errno != EEXIST) {
+#endif
+		throw runtime_error(string("unable to create directory: ") + dirPath);
+	}
+}
+
+bool Build::StatFile(const string &path, FileStamp &stamp) {
+	struct stat sb;
+
+	++Counters.StatCalls;
+	if (stat(path.c_str(), &sb)) {
+		if (errno == ENOENT || errno == ENOTDIR) return false;
+		throw runtime_error(string("unable to stat file: ") + path);
+	}
+	stamp.Size = (long long) sb.st_size;
+	stamp.MTimeNsec = (long long) sb.st_mtime * 1000000000LL;
+#if defined(LINUX)
+	stamp.MTimeNsec += sb.st_mtim.tv_nsec;
+#elif defined(MACOS)
+	stamp.MTimeNsec += sb.st_mtimespec.tv_nsec;
+#endif
+
+	return true;
+}
+
+bool Build::SetFileMTime(const string &path, long long mtimeNsec) {
+#if defined(WINDOWS)
+	struct _utimbuf times;
+
+	times.actime = times.modtime = (time_t) (mtimeNsec / 1000000000LL);
+	return !_utime(path.c_str(), &times);
+#else
+	struct timespec times[2];
+
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = (time_t) (mtimeNsec / 1000000000LL);
+	times[1].tv_nsec = (long) (mtimeNsec % 1000000000LL);
+	return !utimensat(AT_FDCWD, path.c_str(), times, 0);
+#endif
+}
+
+string Build::ReadFile(const string &path) {
+	string content;
+	char buf[65536];
+	size_t n = 0;
+	FILE *in = fopen(path.c_str(), "rb");
+
+	if (!in) throw runtime_error(string("unable to read file: ") + path);
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) content.append(buf, n);
+	if (ferror(in)) {
+		fclose(in);
+		throw runtime_error(string("unable to read file: ") + path);
+	}
+	fclose(in);
+
+	return content;
+}
+
+void Build::WriteFileAtomic(const string &path, const string &content) {
+	string tmpPath = path + ".tmp." + std::to_string((long) getpid());
+	FILE *out = NULL;
+	bool ok = false;
+
+	out = fopen(tmpPath.c_str(), "wb");
+	if (!out) throw runtime_error(string("unable to write file: ") + path);
+	ok = fwrite(content.data(), 1, content.size(), out) == content.size();
+	if (fclose(out)) ok = false;
+	if (ok) {
+#if defined(WINDOWS)
+		remove(path.c_str());
+#endif
+		ok = !rename(tmpPath.c_str(), path.c_str());
+	}
+	if (!ok) {
+		remove(tmpPath.c_str());
+		throw runtime_error(string("unable to write file: ") + path);
+	}
+}
+
+bool Build::HasFlag(const string &command, const string &flag) {
+	for (size_t pos = command.find(" " + flag); pos != string::npos; pos = command.find(" " + flag, pos + 1)) {
+		size_t end = pos + 1 + flag.size();
+
+		if (end == command.size() || command[end] == ' ' || command[end] == '\t') return true;
+	}
+
+	return false;
+}
+
+string Build::HashHex(const string &data) {
+	// 64-bit FNV-1a.
+	unsigned long long hash = 14695981039346656037ULL;
+	char hex[17];
+
+	for (unsigned char c : data) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	snprintf(hex, sizeof(hex), "%016llx", hash);
+
+	return hex;
+}
+
+string Build::Sha256Hex(const string &data) {
+	static const unsigned k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+	unsigned h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	unsigned long long bitLength = (unsigned long long) data.size() * 8;
+	string tail = data.substr(data.size() - data.size() % 64);
+	char hex[65];
+
+	tail += (char) 0x80;
+	while (tail.size() % 64 != 56) tail += '\0';
+	for (int i = 7; i >= 0; --i) tail += (char) (bitLength >> (8 * i));
+
+	for (size_t offset = 0; offset < data.size() - data.size() % 64 + tail.size(); offset += 64) {
+		const unsigned char *block = (const unsigned char *) (offset < data.size() - data.size() % 64
+			? data.data() + offset : tail.data() + offset - (data.size() - data.size() % 64));
+		unsigned w[64], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+
+		for (int i = 0; i < 16; ++i) {
+			w[i] = (unsigned) block[4 * i] << 24 | (unsigned) block[4 * i + 1] << 16 | (unsigned) block[4 * i + 2] << 8 | block[4 * i + 3];
+		}
+		for (int i = 16; i < 64; ++i) {
+			unsigned s0 = (w[i - 15] >> 7 | w[i - 15] << 25) ^ (w[i - 15] >> 18 | w[i - 15] << 14) ^ (w[i - 15] >> 3);
+			unsigned s1 = (w[i - 2] >> 17 | w[i - 2] << 15) ^ (w[i - 2] >> 19 | w[i - 2] << 13) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		for (int i = 0; i < 64; ++i) {
+			unsigned s1 = (e >> 6 | e << 26) ^ (e >> 11 | e << 21) ^ (e >> 25 | e << 7);
+			unsigned t1 = hh + s1 + ((e & f) ^ (~e & g)) + k[i] + w[i];
+			unsigned s0 = (a >> 2 | a << 30) ^ (a >> 13 | a << 19) ^ (a >> 22 | a << 10);
+			unsigned t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+			hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+	}
+
+	for (int i = 0; i < 8; ++i) snprintf(hex + 8 * i, 9, "%08x", h[i]);
+	return string(hex, 64);
+}
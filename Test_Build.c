@@ -33,13 +33,37 @@ static void TestAsprintfAndFriends() {
 }
 #endif
 
+// Build passed to `Build_VerifyReproducible()`, counting how many times it runs.
+static void CountBuild(BuildConfig *copy, void *arg) {
+	assert(Build_GetDeterministic(copy));
+	++*(int *) arg;
+}
+
 int main(int argc, char *argv[]) {
 	BuildConfig *b = NULL;
+	BuildConfig *variant = NULL;
+	char *path = NULL;
+	BuildPlanEstimate estimate;
+	BuildStats stats;
 	char *exeFileName = NULL;
 	char *exeDir = NULL;
 	char *cwdBeforeChDir = NULL;
 	char *cwd = NULL;
 	const char *cmd = NULL;
+	char **paths = NULL;
+	bool found = false;
+	BuildToolchainInfo *toolchain = NULL;
+	BuildJob *job = NULL;
+	BuildJob *jobs[3] = { NULL };
+	BuildJobStatus status;
+	BuildJobStatus statuses[3];
+	char *linkInputs[] = { "main.o", "libutil.a", NULL };
+	char *batchSources[] = { "a.c", "b.c", NULL };
+	char *batchObjects[] = { "a.o", "b.o", NULL };
+	char *moduleSources[] = { "Modules__missing.cc", NULL };
+	char *moduleObjects[] = { "Modules__missing.o", NULL };
+	int exitCodes = 0;
+	int builds = 0;
 
 	if (Build_SetConsoleCodePage("utf-8")) goto cleanUp;
 
@@ -79,6 +103,146 @@ int main(int argc, char *argv[]) {
 	// Test LD command.
 	assert(!Build_LD(b, "-o Test test.o"));
 	assert(!strcmp(Build_GetLastExecCommand(b), "ld -o Test test.o"));
+	// Test asynchronous commands in dry run mode.
+	assert((job = Build_CCAsync(b, "-c %s", "Builder.c")));
+	assert(!strcmp(Build_GetLastExecCommand(b), "gcc -std=c17 -c Builder.c"));
+	assert(!Build_Wait(job, &status));
+	assert(status.Code == B_OK && status.ExitCode == 0);
+	assert(Build_GetRemoteJobs(b) == 0);
+	assert(!Build_SetRemoteJobs(b, 16));
+	assert(Build_GetRemoteJobs(b) == 16);
+	assert(!Build_AddRemoteWorker(b, "localhost:7878"));
+	assert((job = Build_CompileAsync(b, "Builder.c", "Builder.o", "-O2", false)));
+	assert(!strcmp(Build_GetLastExecCommand(b), "gcc -std=c17 -O2 -c -o Builder.o Builder.c"));
+	assert(!Build_Wait(job, &status));
+	assert(!Build_ClearRemoteWorkers(b));
+	// Test output cache configuration, and linking in dry run mode.
+	assert(!Build_GetCacheOutputs(b));
+	assert(!Build_SetCacheOutputs(b, true));
+	assert(Build_GetCacheOutputs(b));
+	assert(!strcmp(Build_GetRemoteCache(b), ""));
+	assert(!Build_SetRemoteCache(b, "http://localhost:8080"));
+	assert(!strcmp(Build_GetRemoteCache(b), "http://localhost:8080"));
+	assert(Build_GetRemoteCacheUpload(b));
+	assert(!Build_SetRemoteCacheUpload(b, false));
+	assert(!Build_GetRemoteCacheUpload(b));
+	assert((job = Build_LinkAsync(b, "main", linkInputs, "-lm", false)));
+	assert(!strcmp(Build_GetLastExecCommand(b), "gcc -std=c17 -o main main.o libutil.a -lm"));
+	assert(!Build_Wait(job, &status));
+	assert(!status.Cached);
+	assert(!Build_WaitForUploads(b));
+	assert(!Build_SetCacheOutputs(b, false));
+	assert(!Build_SetRemoteCache(b, ""));
+	// Test linking a versioned shared library in dry run mode.
+	assert((job = Build_LinkSharedAsync(b, "libutil.so", linkInputs, NULL, "1.2.3", "util.map", true, false)));
+	assert(strstr(Build_GetLastExecCommand(b), "-o libutil.so.1.2.3 main.o libutil.a -shared -Wl,-soname,libutil.so.1 "));
+	assert(strstr(Build_GetLastExecCommand(b), " && ln -sf libutil.so.1 libutil.so"));
+	assert(!Build_Wait(job, &status));
+	// Test LTO link configuration.
+	assert(Build_GetLTOJobs(b) == 0);
+	assert(!Build_SetLTOJobs(b, 2));
+	assert(Build_GetLTOJobs(b) == 2);
+	assert(Build_GetLTOCacheSize(b) == 1ULL << 30);
+	assert(!Build_SetLTOCacheSize(b, 1ULL << 20));
+	assert(Build_GetLTOCacheSize(b) == 1ULL << 20);
+	assert((job = Build_LTOLinkAsync(b, "main", linkInputs, NULL, false)));
+	assert(!strncmp(Build_GetLastExecCommand(b), "gcc -std=c17 -o main main.o libutil.a -flto", 43));
+	assert(!Build_Wait(job, &status));
+	// Test planning.
+	assert(!Build_GetSkipUpToDate(b));
+	assert(!Build_SetSkipUpToDate(b, true));
+	assert(Build_GetSkipUpToDate(b));
+	assert(!Build_GetPlan(b));
+	assert(!Build_SetPlan(b, true));
+	assert(Build_GetPlan(b));
+	assert((job = Build_CompileAsync(b, "Plan__missing.c", "Plan__missing.o", NULL, false)));
+	assert(!Build_Wait(job, &status));
+	assert(!status.Skipped);
+	assert(!Build_GetPlanEstimate(b, &estimate));
+	assert(estimate.Steps == 1 && estimate.UpToDate == 0);
+	assert(!Build_SetPlan(b, false));
+	assert(!Build_SetSkipUpToDate(b, false));
+	// Test deterministic outputs; in dry runs, the build runs once and nothing is compared.
+	assert(!Build_GetDeterministic(b));
+	assert(!Build_SetDeterministic(b, true));
+	assert(Build_GetDeterministic(b));
+	assert(!Build_SetDeterministic(b, false));
+	assert((paths = Build_VerifyReproducible(b, CountBuild, &builds)));
+	assert(!paths[0] && builds == 1);
+	Build_FreeStringList(paths);
+	// Test the Ninja manifest configuration; without one, nothing is written.
+	assert(!strcmp(Build_GetNinjaFile(b), ""));
+	assert(!Build_SetNinjaFile(b, "build.ninja"));
+	assert(!strcmp(Build_GetNinjaFile(b), "build.ninja"));
+	assert(!Build_SetNinjaFile(b, ""));
+	assert(!Build_WriteNinjaFile(b));
+	// Test batched compilation; in dry runs, each source is compiled on its own.
+	assert(Build_GetCompileBatchSize(b) == 16);
+	assert(!Build_SetCompileBatchSize(b, 4));
+	assert(Build_GetCompileBatchSize(b) == 4);
+	assert(!Build_CompileBatchedAsync(b, batchSources, batchObjects, "-O2", false, jobs));
+	assert(!strcmp(Build_GetLastExecCommand(b), "gcc -std=c17 -O2 -c -o b.o b.c"));
+	assert(!Build_WaitAll(jobs, 2, statuses));
+	assert(!jobs[0] && !jobs[1]);
+	// Test module builds failing on sources that cannot be scanned.
+	assert(Build_CompileModulesAsync(b, moduleSources, moduleObjects, NULL, jobs) == -1);
+	assert(BStatusCode == B_ModuleScanFailed);
+	BStatusCode = B_OK;
+	// Test running tests in dry run mode, and their configuration.
+	assert(!Build_GetCacheTestResults(b));
+	assert(!Build_SetCacheTestResults(b, true));
+	assert(Build_GetCacheTestResults(b));
+	assert(!Build_SetCacheTestResults(b, false));
+	assert(!Build_SetTestShard(b, 1, 3));
+	assert(Build_GetTestShardIndex(b) == 1 && Build_GetTestShardCount(b) == 3);
+	assert(!Build_SetTestShard(b, 0, 0));
+	assert((job = Build_TestAsync(b, "./Test_Build_C", "--verbose", NULL, 60)));
+	assert(!strcmp(Build_GetLastExecCommand(b), "./Test_Build_C --verbose"));
+	assert(!Build_Wait(job, &status));
+	assert(!Build_GetShowProgress(b));
+	assert(!Build_SetShowProgress(b, true));
+	assert(Build_GetShowProgress(b));
+	assert(!Build_SetShowProgress(b, false));
+	// Test the statistics counters.
+	assert(!Build_GetStats(b, &stats));
+	assert(Build_GetStats(b, NULL) == -1);
+	assert(!strcmp(Build_GetStatsFile(b), ""));
+	assert(!Build_SetStatsFile(b, "stats.json"));
+	assert(!strcmp(Build_GetStatsFile(b), "stats.json"));
+	assert(!Build_SetStatsFile(b, ""));
+	assert(!Build_PrintResourceReport(b, 3));
+	// Test variants, and steps run once for all of them.
+	assert(!strcmp(Build_GetOutputDir(b), ""));
+	assert(!Build_SetOutputDir(b, "out"));
+	assert((variant = Build_InitVariant(b, "debug")));
+	assert(!strcmp(Build_GetVariantName(variant), "debug"));
+	assert(!strcmp(Build_GetOutputDir(variant), "out/debug"));
+	assert(!strcmp(Build_GetCLanguageStandard(variant), "c17"));
+	assert(!Build_SetCCCommand(variant, "gcc -O0 -g"));
+	assert(!strcmp(Build_GetCCCommand(b), "gcc"));
+	assert((job = Build_ExecOnceAsync(b, "echo %s", "gen")));
+	assert(!Build_Wait(job, &status));
+	assert((job = Build_ExecOnceAsync(variant, "echo gen")));
+	assert(!Build_Wait(job, &status));
+	assert(!strcmp(Build_GetLastExecCommand(variant), ""));
+	assert(!Build_SetSourceDir(variant, "src"));
+	assert(!strcmp(Build_GetSourceDir(variant), "src"));
+	assert((path = Build_ObjectPath(variant, "src/a/b.c")));
+	assert(!strcmp(path, "out/debug/a/b.o"));
+	free((void *) path);
+	assert(!Build_ObjectPath(variant, "src/a/b.cc"));
+	assert(BStatusCode == B_ObjectPathConflict);
+	assert((path = Build_ArchivePath(variant, "util")));
+	assert(!strcmp(path, "out/debug/libutil.a"));
+	free((void *) path);
+	assert((path = Build_SharedLibraryPath(variant, "util")));
+	assert(!strncmp(path, "out/debug/libutil.", 18));
+	free((void *) path);
+	assert((path = Build_ExecutablePath(b, "main")));
+	assert(!strncmp(path, "out/main", 8));
+	free((void *) path);
+	assert(!Build_DeinitBuildConfig(variant));
+	assert(!Build_SetOutputDir(b, ""));
 
 	// Test executable file name.
 	assert((exeFileName = Build_ExecutableFileName("Test_Build")));
@@ -125,6 +289,80 @@ int main(int argc, char *argv[]) {
 	assert(!Build_Exec(b, "echo \"%s\"", "Testing..."));
 	assert(!strcmp(Build_GetLastExecCommand(b), "echo \"Testing...\""));
 
+	// Test asynchronous jobs.
+	assert(Build_GetJobs(b) >= 1);
+	assert(!Build_SetJobs(b, 2));
+	assert(Build_GetJobs(b) == 2);
+	assert((jobs[0] = Build_ExecAsync(b, "exit 0")));
+	assert((jobs[1] = Build_ExecAsync(b, "exit %d", 2)));
+	assert((jobs[2] = Build_CCAsync(b, "--version")));
+	assert(Build_WaitAll(jobs, 3, statuses) == -1);
+	assert(BStatusCode == B_CommandFailed);
+	BStatusCode = B_OK;
+	assert(!jobs[0] && !jobs[1] && !jobs[2]);
+	assert(statuses[0].Code == B_OK && statuses[0].ExitCode == 0);
+	assert(statuses[1].Code == B_CommandFailed && statuses[1].ExitCode == 2);
+	assert(statuses[2].Code == B_OK && statuses[2].ExitCode == 0);
+	assert((jobs[0] = Build_ExecAsync(b, "exit 1")));
+	assert((jobs[1] = Build_ExecAsync(b, "exit 3")));
+	for (int i = 0; i < 2; ++i) {
+		assert(Build_WaitAny(jobs, 2, &status) != -1);
+		exitCodes += status.ExitCode;
+	}
+	BStatusCode = B_OK;
+	assert(exitCodes == 4);
+	assert(Build_WaitAny(jobs, 2, &status) == -1);
+	BStatusCode = B_OK;
+
+	// Test globbing.
+	assert(!strcmp(Build_GetCacheDir(b), ".libBuild"));
+	assert((paths = Build_Glob(b, "Build_*.c[c]")));
+	for (int i = 0; paths[i]; ++i) {
+		if (!strcmp(paths[i], "Build_Functions.cc")) found = true;
+	}
+	assert(found);
+	Build_FreeStringList(paths);
+	assert(!Build_AddGlobIgnorePattern(b, "Build_Functions.*"));
+	assert((paths = Build_Glob(b, "Build_*.cc")));
+	for (int i = 0; paths[i]; ++i) {
+		assert(strcmp(paths[i], "Build_Functions.cc"));
+	}
+	Build_FreeStringList(paths);
+	assert(!Build_ClearGlobIgnorePatterns(b));
+	assert(!Build_Glob(b, ""));
+	assert(BStatusCode == B_InvalidGlobPattern);
+	BStatusCode = B_OK;
+
+	// Test scanning includes.
+	assert((paths = Build_ScanIncludes(b, "Build_Glob.cc", NULL)));
+	assert(paths[0] && !strcmp(paths[0], "Build.h"));
+	Build_FreeStringList(paths);
+	assert(!Build_ScanIncludes(b, "Includes__missing.cc", NULL));
+	assert(BStatusCode == B_ReadFailed);
+	BStatusCode = B_OK;
+
+	// Test archiving.
+	assert(!Build_GetThinArchives(b));
+	assert(!Build_SetThinArchives(b, true));
+	assert(Build_GetThinArchives(b));
+	assert(!Build_SetThinArchives(b, false));
+	{
+		char *members[] = { "Archive__test/missing.o", NULL };
+		assert(Build_Archive(b, "Archive__test/libt.a", members) == -1);
+		assert(BStatusCode == B_StatFailed);
+		BStatusCode = B_OK;
+	}
+
+	// Test probing the toolchain.
+	assert((toolchain = Build_ProbeCC(b)));
+	assert(strlen(toolchain->Version) > 0);
+	found = false;
+	for (int i = 0; toolchain->Standards[i]; ++i) {
+		if (!strcmp(toolchain->Standards[i], "c99")) found = true;
+	}
+	assert(found);
+	Build_FreeToolchainInfo(toolchain);
+
 cleanUp:
 	if (cwdBeforeChDir) free((void *) cwdBeforeChDir);
 	if (cwd) free((void *) cwd);
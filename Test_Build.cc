@@ -1,15 +1,33 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <cassert>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
 #include <libgen.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#if !defined(WINDOWS)
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
 
 #include "Build.h"
 
 using std::cout;
 using std::string;
+using std::vector;
 using std::runtime_error;
 using Build::Builder;
+using Build::ExecResult;
+using Build::Job;
 
 static string OSNameUpper() {
 	if (Builder::IsWindows())
@@ -24,6 +42,216 @@ static string OSNameUpper() {
 		throw runtime_error("unknown OS");
 }
 
+static void MakeTestDir(string path) {
+#if defined(WINDOWS)
+	mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0777);
+#endif
+}
+
+static void WriteTestFile(string path) {
+	std::ofstream out(path.c_str());
+	out << "\n";
+}
+
+static string ReadTestFile(string path) {
+	std::ifstream in(path.c_str(), std::ios::binary);
+
+	return string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+#if !defined(WINDOWS)
+// Stand-in for a bazel-remote HTTP cache on a local port: stores the bodies of PUT requests
+// and serves them back to GET requests.
+struct StandInCache {
+	int Listener = -1;
+	int Port = 0;
+	std::atomic<bool> Serving;
+	std::mutex Mutex;
+	std::map<string, string> Blobs;
+	std::thread Server;
+
+	StandInCache() : Serving(true) {
+		struct sockaddr_in sa = {};
+		socklen_t len = sizeof(sa);
+
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		assert((Listener = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+		assert(!bind(Listener, (struct sockaddr *) &sa, sizeof(sa)) && !listen(Listener, 16));
+		assert(!getsockname(Listener, (struct sockaddr *) &sa, &len));
+		Port = ntohs(sa.sin_port);
+		Server = std::thread([this] { Serve(); });
+	}
+
+	~StandInCache() {
+		Stop();
+	}
+
+	string URL() const {
+		return "http://127.0.0.1:" + std::to_string(Port) + "/cache";
+	}
+
+	void Stop() {
+		if (!Serving.exchange(false)) return;
+		Server.join();
+		close(Listener);
+	}
+
+	void Serve() {
+		while (Serving) {
+			struct pollfd pfd = { Listener, POLLIN, 0 };
+			int fd = -1;
+
+			if (poll(&pfd, 1, 50) <= 0 || (fd = accept(Listener, NULL, NULL)) < 0) continue;
+			Handle(fd);
+			close(fd);
+		}
+	}
+
+	void Handle(int fd) {
+		string request, method, path, body, response;
+		size_t headerEnd = string::npos, length = 0, lengthAt = 0;
+		char buf[4096];
+		ssize_t n = 0;
+
+		while (headerEnd == string::npos && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+			request.append(buf, (size_t) n);
+			headerEnd = request.find("\r\n\r\n");
+		}
+		if (headerEnd == string::npos) return;
+		method = request.substr(0, request.find(' '));
+		path = request.substr(method.size() + 1, request.find(' ', method.size() + 1) - method.size() - 1);
+		if ((lengthAt = request.find("Content-Length: ")) < headerEnd) length = (size_t) atol(request.c_str() + lengthAt + 16);
+		body = request.substr(headerEnd + 4);
+		while (body.size() < length && (n = recv(fd, buf, sizeof(buf), 0)) > 0) body.append(buf, (size_t) n);
+
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			if (method == "PUT") {
+				Blobs[path] = body;
+				response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+			} else if (Blobs.count(path)) {
+				response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(Blobs[path].size()) + "\r\n\r\n" + Blobs[path];
+			} else {
+				response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+			}
+		}
+		send(fd, response.data(), response.size(), 0);
+	}
+
+	size_t Count(const string &prefix) {
+		std::lock_guard<std::mutex> lock(Mutex);
+		size_t count = 0;
+
+		for (auto &blob : Blobs) {
+			if (blob.first.rfind(prefix, 0) == 0) ++count;
+		}
+		return count;
+	}
+};
+#endif
+
+// Drives one Builder and one BuildConfig from many threads at once.
+// Build with `./build invoke build-tests-tsan` to run this under ThreadSanitizer.
+static void StressTestThreads() {
+	Builder shared, invoker;
+	BuildConfig *cfg = NULL;
+	vector<std::thread> threads;
+	std::atomic<int> failures(0);
+
+	assert((cfg = Build_InitBuildConfig()));
+	assert(!Build_SetPrintCommandToStdout(cfg, false));
+	shared.PrintCommandToStdout = false;
+	invoker.PrintCommandToStdout = false;
+	invoker.DryRun = false;
+
+	for (int t = 0; t < 8; ++t) {
+		threads.push_back(std::thread([&, t] {
+			for (int i = 0; i < 200; ++i) {
+				string src = "t" + std::to_string(t) + "_" + std::to_string(i) + ".c";
+				ExecResult result = shared.CC("-c %s", src.c_str());
+
+				if (result.Command.find(" -c " + src) == string::npos) ++failures;
+				if (shared.GetLastExecCommand() != result.Command) ++failures;
+				if (Build_CXX(cfg, "-c %s", src.c_str())) ++failures;
+				if (string(Build_GetLastExecCommand(cfg)).find(" -c " + src) == string::npos) ++failures;
+				if (string(Build_GetCXXCommand(cfg)).rfind("g++", 0) != 0) ++failures;
+			}
+		}));
+	}
+	for (int t = 0; t < 4; ++t) {
+		threads.push_back(std::thread([&, t] {
+			for (int i = 0; i < 5; ++i) {
+				if (invoker.Exec("exit %d", (t + i) % 3).ExitCode != (t + i) % 3) ++failures;
+				if (invoker.ExecAsync("exit %d", (t + i) % 3).Wait().ExitCode != (t + i) % 3) ++failures;
+			}
+		}));
+	}
+	threads.push_back(std::thread([&] {
+		for (int i = 0; i < 200; ++i) {
+			shared.Configure([i](Builder &b) { b.CLanguageStandard = i % 2 ? "c11" : "c17"; });
+			if (Build_SetCXXCommand(cfg, i % 2 ? "g++" : "g++ -Wall")) ++failures;
+		}
+	}));
+	for (std::thread &t : threads) t.join();
+
+	assert(failures == 0);
+	assert(!Build_DeinitBuildConfig(cfg));
+}
+
+#if defined(BUILD_HAS_COROUTINES)
+static Build::Task<int> ExitCodeTask(Builder &b, int code) {
+	ExecResult result = co_await b.ExecAsync("exit %d", code);
+
+	co_return result.ExitCode;
+}
+
+static Build::Task<void> RecipeTask(Builder &b, vector<int> &exitCodes) {
+	vector<Build::Task<int>> tasks;
+
+	for (int i = 0; i < 3; ++i) {
+		tasks.push_back(ExitCodeTask(b, i));
+	}
+	exitCodes = co_await Build::WhenAll(std::move(tasks));
+	exitCodes.push_back((co_await b.ExecAsync("exit 5")).ExitCode);
+}
+
+static Build::Task<void> FailingTask(Builder &b) {
+	co_await b.ExecAsync("exit 0");
+	throw runtime_error("task failed");
+}
+
+static void TestCoroutines(Builder &b) {
+	vector<int> exitCodes;
+	vector<Build::Task<void>> tasks;
+
+	Build::SyncWait(RecipeTask(b, exitCodes));
+	assert(exitCodes == vector<int>({ 0, 1, 2, 5 }));
+	assert(Build::SyncWait(ExitCodeTask(b, 4)) == 4);
+
+	tasks.push_back(FailingTask(b));
+	tasks.push_back(RecipeTask(b, exitCodes));
+	try {
+		Build::SyncWait(Build::WhenAll(std::move(tasks)));
+		assert(false); // should rethrow the failure.
+	} catch (std::exception &e) {
+		assert(string(e.what()) == "task failed");
+	}
+
+	// Failures on several scheduler threads at once keep one exception.
+	tasks.clear();
+	for (int i = 0; i < 8; ++i) tasks.push_back(FailingTask(b));
+	try {
+		Build::SyncWait(Build::WhenAll(std::move(tasks)));
+		assert(false); // should rethrow one of the failures.
+	} catch (std::exception &e) {
+		assert(string(e.what()) == "task failed");
+	}
+}
+#endif
+
 static const char *unknownCode = "unknown status code";
 
 int main(int argc, char *argv[]) {
@@ -103,6 +331,22 @@ int main(int argc, char *argv[]) {
 		// Test LD command.
 		b.LD("-o Test test.o");
 		assert(b.LastExecCommand == "ld -o Test test.o");
+		// Test per-call results.
+		assert(b.LD("-o %s test.o", "Test2").Command == "ld -o Test2 test.o");
+		assert(b.GetLastExecCommand() == "ld -o Test2 test.o");
+		{
+			// Copies keep their own last command, and other threads have none.
+			Builder copy = b;
+			string other = "unset";
+
+			assert(copy.GetLastExecCommand().empty());
+			std::thread([&b, &other]() { other = b.GetLastExecCommand(); }).join();
+			assert(other.empty());
+		}
+		assert(b.GetLastExecCommand() == "ld -o Test2 test.o");
+
+		// Test concurrent use of one Builder.
+		StressTestThreads();
 
 		// Test executable file name.
 		b.CXX("-o %s %s", b.ExecutableFileName("Test").c_str(), "Test.cc");
@@ -114,8 +358,30 @@ int main(int argc, char *argv[]) {
 
 		// Test actual invocation, compilation, move, copy and remove.
 		b.DryRun = false;
-		b.Exec("echo \"Testing...\"");
+		assert(b.Exec("echo \"Testing...\"").ExitCode == 0);
 		assert(b.LastExecCommand == "echo \"Testing...\"");
+		assert(b.Exec("exit 3").ExitCode == 3);
+
+		// Test asynchronous jobs.
+		vector<Job> jobs;
+		b.Jobs = 2;
+		for (int i = 0; i < 4; ++i) {
+			jobs.push_back(b.ExecAsync("exit %d", i));
+		}
+		assert(jobs[Builder::WaitAny(jobs)].Done());
+		vector<ExecResult> results = Builder::WaitAll(jobs);
+		for (int i = 0; i < 4; ++i) {
+			assert(jobs[i].Done());
+			assert(results[i].Command == "exit " + std::to_string(i));
+			assert(results[i].ExitCode == i);
+		}
+#if defined(BUILD_HAS_COROUTINES)
+		// Test coroutine tasks.
+		TestCoroutines(b);
+#endif
+		b.DryRun = true;
+		assert(b.CXXAsync("-c %s", "Test.cc").Wait().Command == "g++ -std=c++17 -c Test.cc");
+		b.DryRun = false;
 		string OSMacro = "-D" + OSNameUpper();
 		b.CXXCommand = b.CXXCommand + " " + OSMacro;
 		b.CXX("-o Builder__test.o -c Build_Builder.cc");
@@ -132,6 +398,1168 @@ int main(int argc, char *argv[]) {
 		assert(!b.FileExists("Builder__test1.o"));
 		assert(!b.FileExists("Builder__test2.o"));
 
+		// Test globbing, including ignore patterns.
+		MakeTestDir("Glob__test");
+		MakeTestDir("Glob__test/sub");
+		MakeTestDir("Glob__test/sub/deep");
+		WriteTestFile("Glob__test/a.cc");
+		WriteTestFile("Glob__test/a.h");
+		WriteTestFile("Glob__test/sub/b.cc");
+		WriteTestFile("Glob__test/sub/deep/c.cc");
+		assert(b.Glob("Glob__test/**/*.cc") == vector<string>({ "Glob__test/a.cc", "Glob__test/sub/b.cc", "Glob__test/sub/deep/c.cc" }));
+		assert(b.Glob("Glob__test/*.cc") == vector<string>({ "Glob__test/a.cc" }));
+		assert(b.Glob("Glob__test/s?b/[a-b].cc") == vector<string>({ "Glob__test/sub/b.cc" }));
+		assert(b.Glob("Glob__test/*/*/*") == vector<string>({ "Glob__test/sub/deep/c.cc" }));
+		assert(b.Glob("Glob__test/a.h") == vector<string>({ "Glob__test/a.h" }));
+		assert(b.Glob("Glob__test/missing.h").empty());
+		b.GlobIgnorePatterns.push_back("deep");
+		b.GlobIgnorePatterns.push_back("Glob__test/a.*");
+		assert(b.Glob("Glob__test/**") == vector<string>({ "Glob__test/sub/b.cc" }));
+		b.GlobIgnorePatterns.pop_back();
+		b.GlobIgnorePatterns.pop_back();
+		try {
+			b.Glob("");
+			assert(false); // should not accept an empty pattern.
+		} catch (std::exception &e) {
+			assert(Builder::ExceptionToStatusCode(e) == B_InvalidGlobPattern);
+		}
+		b.Remove("Glob__test/a.cc");
+		b.Remove("Glob__test/a.h");
+		b.Remove("Glob__test/sub/b.cc");
+		b.Remove("Glob__test/sub/deep/c.cc");
+		rmdir("Glob__test/sub/deep");
+		rmdir("Glob__test/sub");
+		rmdir("Glob__test");
+
+		// Test rebuilding a stale build program, which does nothing when it is up to date.
+		{
+			Builder self;
+			char programName[] = "prog", programPath[] = "Self__test/prog";
+			char *pathArgv[] = { programName, NULL }, *staleArgv[] = { programPath, NULL };
+
+			self.PrintCommandToStdout = false;
+			self.RebuildSelfIfStale(1, pathArgv, { "Self__test/missing.cc" }, "");
+			MakeTestDir("Self__test");
+			{
+				std::ofstream out("Self__test/prog.cc");
+				out << "int main() { return undeclared; }\n";
+			}
+			self.DryRun = false;
+			// Newer than its source: not rebuilt, which would fail.
+			self.Exec("touch -d '1 hour ago' Self__test/prog.cc");
+			WriteTestFile("Self__test/prog");
+			self.RebuildSelfIfStale(1, staleArgv, { "Self__test/prog.cc" }, "");
+			assert(!Builder::FileExists("Self__test/prog.d"));
+			self.Exec("touch -d '2 hours ago' Self__test/prog");
+			try {
+				self.RebuildSelfIfStale(1, staleArgv, { "Self__test/prog.cc" }, "");
+				assert(false);
+			} catch (std::exception &e) {
+				assert(Builder::ExceptionToStatusCode(e) == B_CommandFailed);
+			}
+			assert(ReadTestFile("Self__test/prog") == "\n");
+
+			self.Exec("rm -rf Self__test");
+		}
+
+		// Test scanning includes without the compiler, and reusing scans of unchanged files.
+		{
+			Builder scan;
+			std::map<string, vector<string>> headers;
+			unsigned long long hits = 0;
+
+			scan.DryRun = false;
+			scan.PrintCommandToStdout = false;
+			scan.CacheDir = "Includes__test/cache";
+			MakeTestDir("Includes__test");
+			MakeTestDir("Includes__test/inc");
+			MakeTestDir("Includes__test/inc/lib");
+			{
+				std::ofstream out("Includes__test/a.cc");
+				out << "#include \"a.h\"\n  #  include <lib/b.h>\n#include <vector>\n#include HEADER\nint x = 1; // #include \"d.h\"\n";
+			}
+			{
+				std::ofstream out("Includes__test/a.h");
+				out << "#pragma once\n#include \"a.h\"\n/*\n#include \"../Includes__test/c.h\"\n*/\n";
+			}
+			WriteTestFile("Includes__test/c.h");
+			WriteTestFile("Includes__test/d.h");
+			{
+				std::ofstream out("Includes__test/inc/lib/b.h");
+				out << "#include_next \"b2.h\"\n";
+			}
+			WriteTestFile("Includes__test/inc/lib/b2.h");
+			scan.Exec("touch -d '1 hour ago' Includes__test/*.* Includes__test/inc/lib/*");
+			headers = scan.ScanIncludes({ "Includes__test/a.cc" }, { "Includes__test/inc" });
+			assert(headers["Includes__test/a.cc"] == vector<string>({ "Includes__test/a.h", "Includes__test/c.h",
+				"Includes__test/inc/lib/b.h", "Includes__test/inc/lib/b2.h" }));
+			hits = Builder::Stats().StatCacheHits;
+			assert(scan.ScanIncludes({ "Includes__test/a.cc" }, { "Includes__test/inc" }) == headers);
+			assert(Builder::Stats().StatCacheHits == hits + 5);
+			try {
+				scan.ScanIncludes({ "Includes__test/missing.cc" }, vector<string>());
+				assert(false);
+			} catch (std::exception &e) {
+				assert(Builder::ExceptionToStatusCode(e) == B_ReadFailed);
+			}
+
+			scan.Exec("rm -rf Includes__test");
+		}
+
+		// Test archives are only written when a member changed.
+		MakeTestDir("Archive__test");
+		{
+			std::ofstream out("Archive__test/a.c");
+			out << "int ArchiveTestA(void) { return 1; }\n";
+		}
+		{
+			std::ofstream out("Archive__test/b.c");
+			out << "int ArchiveTestB(void) { return 2; }\n";
+		}
+		b.CC("-c -o Archive__test/a.o Archive__test/a.c");
+		b.CC("-c -o Archive__test/b.o Archive__test/b.c");
+		assert(b.Archive("Archive__test/libt.a", { "Archive__test/a.o", "Archive__test/b.o" }));
+		assert(!b.Archive("Archive__test/libt.a", { "Archive__test/a.o", "Archive__test/b.o" }));
+		assert(b.Exec("nm -s Archive__test/libt.a | grep -q 'ArchiveTestB in b.o'").ExitCode == 0);
+		{
+			// The symbol index keeps its size, so the archive is updated in place after `a.o`.
+			struct stat before, after;
+
+			assert(stat("Archive__test/libt.a", &before) == 0);
+			b.CC("-c -o Archive__test/b.o Archive__test/a.c");
+			assert(b.Archive("Archive__test/libt.a", { "Archive__test/a.o", "Archive__test/b.o" }));
+			assert(stat("Archive__test/libt.a", &after) == 0 && after.st_ino == before.st_ino);
+			assert(b.Exec("nm -s Archive__test/libt.a | grep -q 'ArchiveTestA in b.o'").ExitCode == 0);
+			assert(b.Exec("ar p Archive__test/libt.a b.o | cmp -s - Archive__test/b.o").ExitCode == 0);
+			// Fewer symbols, so written anew.
+			assert(b.Archive("Archive__test/libt.a", { "Archive__test/a.o" }));
+			assert(b.Exec("test \"$(ar t Archive__test/libt.a)\" = a.o").ExitCode == 0);
+		}
+		b.ThinArchives = true;
+		assert(b.Archive("Archive__test/libt.a", { "Archive__test/a.o" }));
+		{
+			std::ifstream in("Archive__test/libt.a");
+			string magic(8, '\0');
+			in.read(&magic[0], 8);
+			assert(magic == "!<thin>\n");
+		}
+		b.ThinArchives = false;
+		try {
+			b.Archive("Archive__test/libt.a", { "Archive__test/missing.o" });
+			assert(false); // should not archive missing members.
+		} catch (std::exception &e) {
+			assert(Builder::ExceptionToStatusCode(e) == B_StatFailed);
+		}
+		// Not ELF, so archived by `ARCommand`, whose failure fails the archive.
+		WriteTestFile("Archive__test/c.o");
+		b.ARCommand = "false";
+		try {
+			b.Archive("Archive__test/libt.a", { "Archive__test/a.o", "Archive__test/c.o" });
+			assert(false); // should fail with `ARCommand`.
+		} catch (std::exception &e) {
+			assert(Builder::ExceptionToStatusCode(e) == B_CommandFailed);
+		}
+		b.ARCommand = "ar";
+		assert(!Builder::FileExists("Archive__test/libt.a"));
+		b.Remove("Archive__test/c.o");
+		b.Remove("Archive__test/a.c");
+		b.Remove("Archive__test/b.c");
+		b.Remove("Archive__test/a.o");
+		b.Remove("Archive__test/b.o");
+		b.Remove("Archive__test/libt.a");
+		rmdir("Archive__test");
+
+		// Test probing the toolchain.
+		{
+			Build::ToolchainInfo cxx = b.ProbeCXX();
+			Build::ToolchainInfo cc = b.ProbeCC();
+			Builder missing;
+
+			assert(!cxx.Path.empty() && Builder::FileExists(cxx.Path));
+			assert(cxx.Family == "gcc" || cxx.Family == "clang");
+			assert(!cxx.Version.empty());
+			assert(cxx.Supports("c++11"));
+			assert(!cxx.Supports("c11"));
+			assert(!cxx.SystemIncludeDirs.empty());
+			assert(cc.Supports("c99"));
+			assert(b.ProbeCXX().Standards == cxx.Standards);
+			assert(!b.Glob(".libBuild/toolchains/*").empty());
+			missing.PrintCommandToStdout = false;
+			missing.CCCommand = "Toolchain__test-missing-cc";
+			try {
+				missing.ProbeCC();
+				assert(false); // should not find the compiler.
+			} catch (std::exception &e) {
+				assert(Builder::ExceptionToStatusCode(e) == B_ToolchainProbeFailed);
+			}
+		}
+
+	#if !defined(WINDOWS)
+		// Test compiling on a worker, and falling back to compiling here.
+		{
+			Builder worker;
+			std::atomic<bool> serving(true);
+			std::thread server;
+			Build::CompileStep step;
+			ExecResult result;
+			struct stat sb;
+
+			MakeTestDir("Remote__test");
+			{
+				std::ofstream out("Remote__test/r.h");
+				out << "#define REMOTE_TEST_VALUE 42\n";
+			}
+			{
+				std::ofstream out("Remote__test/r.cc");
+				out << "#include \"r.h\"\nint RemoteTest() { return REMOTE_TEST_VALUE; }\n";
+			}
+			{
+				std::ofstream out("Remote__test/bad.cc");
+				out << "int RemoteTestBad() { return undeclared; }\n";
+			}
+			worker.DryRun = false;
+			worker.PrintCommandToStdout = false;
+			server = std::thread([&] { worker.ServeWorker("unix:Remote__test/worker.sock", [&] { return serving.load(); }); });
+			while (stat("Remote__test/worker.sock", &sb)) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+			b.RemoteWorkers.push_back("unix:Remote__test/worker.sock");
+			step.Source = "Remote__test/r.cc";
+			step.Object = "Remote__test/r.o";
+			step.Flags = "-IRemote__test -MD -MF Remote__test/r.d";
+			step.CXX = true;
+			result = b.Compile(step);
+			assert(result.ExitCode == 0);
+			assert(result.Command == b.CXXCommand + " -std=" + b.CXXLanguageStandard + " " + step.Flags + " -c -o Remote__test/r.o Remote__test/r.cc");
+			assert(Builder::FileExists("Remote__test/r.o"));
+			assert(Builder::FileExists("Remote__test/r.d"));
+			assert(b.Exec("nm Remote__test/r.o | grep -q RemoteTest").ExitCode == 0);
+			worker.Configure([](Builder &w) { assert(w.LastExecCommand.find(" -c -o ") != string::npos); });
+			// The dependency file is written here, where `-MMD` puts it, so that a header edit rebuilds the object.
+			b.Remove("Remote__test/r.d");
+			step.Flags = "-IRemote__test -MMD";
+			b.SkipUpToDate = true;
+			assert(!b.Compile(step).Skipped);
+			assert(ReadTestFile("Remote__test/r.d").find("Remote__test/r.o: ") == 0);
+			assert(ReadTestFile("Remote__test/r.d").find("r.h") != string::npos);
+			assert(!Builder::FileExists("Remote__test/r.o.d"));
+			assert(b.Compile(step).Skipped);
+			b.Exec("touch -m -t 209001010000 Remote__test/r.h");
+			assert(!b.Compile(step).Skipped);
+			b.SkipUpToDate = false;
+			// Refused by the worker, as the shell would interpret it, and compiled here instead.
+			step.Flags = "-IRemote__test '-DREMOTE_TEST_QUOTED=1'";
+			assert(b.Compile(step).ExitCode == 0);
+			worker.Configure([](Builder &w) { assert(w.LastExecCommand.find("REMOTE_TEST_QUOTED") == string::npos); });
+			step.Source = "Remote__test/bad.cc";
+			step.Object = "Remote__test/bad.o";
+			step.Flags = "-w";
+			assert(b.Compile(step).ExitCode != 0);
+			assert(!Builder::FileExists("Remote__test/bad.o"));
+
+			serving = false;
+			server.join();
+			b.Remove("Remote__test/r.o");
+			step.Source = "Remote__test/r.cc";
+			step.Object = "Remote__test/r.o";
+			step.Flags = "-IRemote__test";
+			assert(b.Compile(step).ExitCode == 0);
+			assert(Builder::FileExists("Remote__test/r.o"));
+			b.RemoteWorkers.clear();
+
+			try {
+				worker.ServeWorker("unix:Remote__test/missing/worker.sock");
+				assert(false); // should not listen in a missing directory.
+			} catch (std::exception &e) {
+				assert(Builder::ExceptionToStatusCode(e) == B_WorkerFailed);
+			}
+			b.Remove("Remote__test/r.h");
+			b.Remove("Remote__test/r.cc");
+			b.Remove("Remote__test/r.d");
+			b.Remove("Remote__test/r.o");
+			b.Remove("Remote__test/bad.cc");
+			rmdir("Remote__test");
+		}
+
+		// Test reusing compile and link outputs from the local and the remote cache.
+		{
+			StandInCache remote;
+			Builder cached, fresh;
+			Build::CompileStep step;
+			Build::LinkStep link;
+			ExecResult result;
+			string object;
+
+			MakeTestDir("Cache__test");
+			{
+				std::ofstream out("Cache__test/c.cc");
+				out << "int main() { return 7; }\n";
+			}
+			cached.DryRun = false;
+			cached.PrintCommandToStdout = false;
+			cached.CacheOutputs = true;
+			cached.CacheDir = "Cache__test/local";
+			cached.RemoteCache = remote.URL();
+			step.Source = "Cache__test/c.cc";
+			step.Object = "Cache__test/c.o";
+			step.CXX = true;
+			result = cached.Compile(step);
+			assert(result.ExitCode == 0 && !result.Cached);
+			cached.WaitForUploads();
+			assert(remote.Count("/cache/ac/") == 1);
+			assert(remote.Count("/cache/cas/") == 1);
+			{
+				std::ifstream in("Cache__test/c.o", std::ios::binary);
+				object.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			assert(!object.empty());
+			assert(cached.Compile(step).Cached);
+
+			// A machine with an empty local cache downloads from the remote one.
+			fresh = cached;
+			fresh.CacheDir = "Cache__test/fresh";
+			fresh.RemoteCacheUpload = false;
+			cached.Remove("Cache__test/c.o");
+			result = fresh.Compile(step);
+			assert(result.ExitCode == 0 && result.Cached);
+			{
+				std::ifstream in("Cache__test/c.o", std::ios::binary);
+				assert(string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()) == object);
+			}
+			assert(!fresh.Glob("Cache__test/fresh/artifacts/cas/*").empty());
+
+			link.Inputs.push_back("Cache__test/c.o");
+			link.Output = Builder::ExecutableFileName("Cache__test/c");
+			link.CXX = true;
+			assert(!cached.Link(link).Cached);
+			cached.WaitForUploads();
+			assert(remote.Count("/cache/ac/") == 2);
+			cached.Remove(link.Output);
+			assert(fresh.Link(link).Cached);
+			assert(cached.Exec("./" + link.Output).ExitCode == 7);
+
+			cached.RemoteCache = "https://127.0.0.1/cache";
+			try {
+				cached.Compile(step);
+				assert(false); // should reject URLs other than http ones.
+			} catch (std::exception &e) {
+				assert(Builder::ExceptionToStatusCode(e) == B_RemoteCacheFailed);
+			}
+
+			// Builds go on when the remote cache cannot be reached.
+			remote.Stop();
+			cached.RemoteCache = remote.URL();
+			{
+				std::ofstream out("Cache__test/c.cc");
+				out << "int main() { return 8; }\n";
+			}
+			result = cached.Compile(step);
+			assert(result.ExitCode == 0 && !result.Cached);
+			cached.WaitForUploads();
+
+			cached.Exec("rm -rf Cache__test");
+		}
+
+		// Test that objects restored from the cache are rebuilt after a header edit.
+		{
+			Builder cached;
+			Build::CompileStep step;
+			ExecResult result;
+
+			MakeTestDir("CacheDeps__test");
+			{
+				std::ofstream out("CacheDeps__test/h.h");
+				out << "#define CACHE_DEPS_TEST 1\n";
+			}
+			{
+				std::ofstream out("CacheDeps__test/c.c");
+				out << "#include \"h.h\"\nint CacheDepsTest(void) { return CACHE_DEPS_TEST; }\n";
+			}
+			cached.DryRun = false;
+			cached.PrintCommandToStdout = false;
+			cached.CacheOutputs = true;
+			cached.SkipUpToDate = true;
+			cached.CacheDir = "CacheDeps__test/cache";
+			step.Source = "CacheDeps__test/c.c";
+			step.Object = "CacheDeps__test/c.o";
+			step.Flags = "-MMD";
+			assert(!cached.Compile(step).Cached);
+			cached.Remove("CacheDeps__test/c.o");
+			cached.Remove("CacheDeps__test/c.d");
+			result = cached.Compile(step);
+			assert(result.ExitCode == 0 && result.Cached);
+			assert(ReadTestFile("CacheDeps__test/c.d").find("h.h") != string::npos);
+			assert(!Builder::FileExists("CacheDeps__test/c.o.d"));
+			assert(cached.Compile(step).Skipped);
+			cached.Exec("touch -m -t 209001010000 CacheDeps__test/h.h");
+			assert(!cached.Compile(step).Skipped);
+
+			cached.Exec("rm -rf CacheDeps__test");
+		}
+
+		// Test LTO links taking the free job slots, and pruning the LTO cache.
+		{
+			Builder lto;
+			Build::CompileStep step;
+			Build::LinkStep link;
+			Job busy, linked;
+
+			MakeTestDir("LTO__test");
+			{
+				std::ofstream out("LTO__test/main.cc");
+				out << "int Answer();\nint main() { return Answer() == 42 ? 0 : 1; }\n";
+			}
+			{
+				std::ofstream out("LTO__test/answer.cc");
+				out << "int Answer() { return 42; }\n";
+			}
+			lto.DryRun = false;
+			lto.PrintCommandToStdout = false;
+			lto.Jobs = 4;
+			lto.CacheDir = "LTO__test/cache";
+			step.Flags = "-O2 -flto";
+			step.CXX = true;
+			for (const char *name : { "main", "answer" }) {
+				step.Source = string("LTO__test/") + name + ".cc";
+				step.Object = string("LTO__test/") + name + ".o";
+				assert(lto.Compile(step).ExitCode == 0);
+				link.Inputs.push_back(step.Object);
+			}
+			MakeTestDir("LTO__test/cache");
+			MakeTestDir("LTO__test/cache/lto");
+			{
+				std::ofstream out("LTO__test/cache/lto/stale");
+				out << string(4096, 'x');
+			}
+			lto.LTOCacheSize = 1024;
+			link.Output = Builder::ExecutableFileName("LTO__test/main");
+			link.Flags = "-O2";
+			link.CXX = true;
+			link.LTO = true;
+
+			// One slot is taken, so the link gets the other three.
+			busy = lto.ExecAsync("sleep 1");
+			linked = lto.LinkAsync(link);
+			assert(linked.Wait().ExitCode == 0);
+			if (lto.ProbeCXX().Family == "gcc") assert(linked.Wait().Command.find(" -flto=3") != string::npos);
+			busy.Wait();
+			assert(lto.Exec("./" + link.Output).ExitCode == 0);
+			assert(!Builder::FileExists("LTO__test/cache/lto/stale"));
+			lto.LTOJobs = 2;
+			if (lto.ProbeCXX().Family == "gcc") assert(lto.Link(link).Command.find(" -flto=2") != string::npos);
+
+			lto.Exec("rm -rf LTO__test");
+		}
+
+		// Test linking a versioned shared library, with a version script and its debug information split off.
+		if (Builder::IsLinux()) {
+			Builder shared;
+			Build::CompileStep step;
+			Build::LinkStep link;
+			ExecResult result;
+
+			MakeTestDir("Shared__test");
+			{
+				std::ofstream out("Shared__test/s.c");
+				out << "int SharedTestExported(void) { return 1; }\nint SharedTestHidden(void) { return 2; }\n";
+			}
+			{
+				std::ofstream out("Shared__test/s.map");
+				out << "{ global: SharedTestExported; local: *; };\n";
+			}
+			shared.DryRun = false;
+			shared.PrintCommandToStdout = false;
+			shared.SkipUpToDate = true;
+			step.Source = "Shared__test/s.c";
+			step.Object = "Shared__test/s.o";
+			step.Flags = "-fPIC -g";
+			assert(shared.Compile(step).ExitCode == 0);
+			link.Inputs = { step.Object };
+			link.Output = "Shared__test/libs.so";
+			link.Shared = true;
+			link.Version = "1.2.3";
+			link.VersionScript = "Shared__test/s.map";
+			link.SplitDebugInfo = true;
+
+			result = shared.Link(link);
+			assert(result.ExitCode == 0);
+			assert(result.Command.find(" -o Shared__test/libs.so.1.2.3 Shared__test/s.o -shared -Wl,-soname,libs.so.1"
+				" -Wl,--version-script=Shared__test/s.map") != string::npos);
+			assert(shared.Exec("test \"$(readlink Shared__test/libs.so)\" = libs.so.1").ExitCode == 0);
+			assert(shared.Exec("test \"$(readlink Shared__test/libs.so.1)\" = libs.so.1.2.3").ExitCode == 0);
+			assert(shared.Exec("readelf -d Shared__test/libs.so | grep -q 'SONAME.*libs.so.1]'").ExitCode == 0);
+			assert(shared.Exec("nm -D --defined-only Shared__test/libs.so | grep -q SharedTestExported").ExitCode == 0);
+			assert(shared.Exec("nm -D --defined-only Shared__test/libs.so | grep -q SharedTestHidden").ExitCode != 0);
+			assert(shared.Exec("readelf -S Shared__test/libs.so.1.2.3 | grep -q gnu_debuglink").ExitCode == 0);
+			assert(shared.Exec("readelf -S Shared__test/libs.so.1.2.3 | grep -q debug_info").ExitCode != 0);
+			assert(shared.Exec("readelf -S Shared__test/libs.so.1.2.3.debug | grep -q debug_info").ExitCode == 0);
+			// The links are outputs of the step too.
+			assert(shared.Link(link).Skipped);
+			shared.Remove("Shared__test/libs.so.1");
+			assert(!shared.Link(link).Skipped);
+			assert(Builder::FileExists("Shared__test/libs.so.1"));
+
+			shared.Exec("rm -rf Shared__test");
+		}
+
+		// Test building C++20 modules in the order of their imports, and rebuilding importers of changed ones.
+		if (Builder().ProbeCXX().Supports("modules")) {
+			Builder modules;
+			vector<Build::CompileStep> steps;
+			vector<ExecResult> results;
+			Build::LinkStep link;
+
+			MakeTestDir("Modules__test");
+			{
+				std::ofstream out("Modules__test/ops.cppm");
+				out << "export module math:ops;\nexport int Twice(int x) { return 2 * x; }\n";
+			}
+			{
+				std::ofstream out("Modules__test/math.cppm");
+				out << "module;\n#include <cstdlib>\nexport module math; // import nothing;\nexport import :ops;\nexport int Answer();\n";
+			}
+			{
+				std::ofstream out("Modules__test/answer.cc");
+				out << "module math;\nint Answer() { return Twice(21); }\n";
+			}
+			{
+				std::ofstream out("Modules__test/main.cc");
+				out << "/*\nimport missing;\n*/\nimport math;\nconst char *s = R\"(\nimport missing;\n)\";\n"
+					"int main() { return Answer() == 42 && Twice(1) == 2 ? 0 : 1; }\n";
+			}
+			modules.DryRun = false;
+			modules.PrintCommandToStdout = false;
+			modules.CXXLanguageStandard = "c++20";
+			modules.OutputDir = "Modules__test/out";
+			modules.CacheDir = "Modules__test/cache";
+			modules.SkipUpToDate = true;
+			modules.Jobs = 4;
+			// Importers first, so that only the import order gets them built.
+			for (const char *name : { "main.cc", "answer.cc", "math.cppm", "ops.cppm" }) {
+				Build::CompileStep step;
+
+				step.Source = string("Modules__test/") + name;
+				step.Object = modules.ObjectPath(step.Source);
+				step.CXX = true;
+				steps.push_back(step);
+				link.Inputs.push_back(step.Object);
+			}
+			results = modules.CompileModules(steps);
+			for (const ExecResult &result : results) assert(result.ExitCode == 0 && !result.Skipped);
+			link.Output = modules.ExecutablePath("main");
+			link.CXX = true;
+			assert(modules.Link(link).ExitCode == 0);
+			assert(modules.Exec("./" + link.Output).ExitCode == 0);
+			results = modules.CompileModules(steps);
+			for (const ExecResult &result : results) assert(result.Skipped);
+			// Without its BMI, the partition is rebuilt, and so is everything importing it.
+			assert(modules.Glob("Modules__test/out/bmi/*").size() == 2);
+			modules.Exec("rm Modules__test/out/bmi/math-ops.*");
+			results = modules.CompileModules(steps);
+			assert(!results[3].Skipped && !results[2].Skipped && !results[0].Skipped);
+			try {
+				steps[0].Source = "Modules__test/missing.cc";
+				{
+					std::ofstream out(steps[0].Source);
+					out << "import nowhere;\n";
+				}
+				modules.CompileModules(steps);
+				assert(false);
+			} catch (std::exception &e) {
+				assert(string(e.what()).find("missing module: nowhere") == 0);
+				assert(Builder::ExceptionToStatusCode(e) == B_ModuleScanFailed);
+			}
+
+			modules.Exec("rm -rf Modules__test");
+		}
+
+		// Test running tests with timeouts, captured output, sharding and cached results.
+		{
+			Builder tests;
+			Build::TestStep step;
+			ExecResult result;
+			unsigned inShard[2] = { 0, 0 };
+
+			MakeTestDir("Tests__test");
+			{
+				std::ofstream out("Tests__test/data.txt");
+				out << "first\n";
+			}
+			tests.DryRun = false;
+			tests.PrintCommandToStdout = false;
+			tests.CacheDir = "Tests__test/cache";
+			tests.OutputDir = "Tests__test/out";
+			tests.CacheTestResults = true;
+			tests.TestShardCount = 0;
+			step.Name = "cat";
+			step.Program = "cat";
+			step.Args = "Tests__test/data.txt";
+			step.Data.push_back("Tests__test/data.txt");
+			result = tests.Test(step);
+			assert(result.ExitCode == 0 && !result.Cached);
+			assert(ReadTestFile("Tests__test/out/testlogs/cat.log") == "first\n");
+			assert(tests.Test(step).Cached);
+			{
+				std::ofstream out("Tests__test/data.txt");
+				out << "second\n";
+			}
+			assert(!tests.Test(step).Cached);
+			assert(ReadTestFile("Tests__test/out/testlogs/cat.log") == "second\n");
+
+			// Failures are not cached.
+			step.Name = "fail";
+			step.Program = "sh";
+			step.Args = "-c 'echo expected failure; exit 3'";
+			assert(tests.Test(step).ExitCode == 3);
+			assert(tests.TestAsync(step).Wait().ExitCode == 3);
+			step.Name = "sleep";
+			step.Args = "-c 'sleep 10; echo done'";
+			step.TimeoutSeconds = 1;
+			result = tests.Test(step);
+			assert(result.ExitCode == 124 && result.Usage.UserSeconds < 1);
+			assert(ReadTestFile("Tests__test/out/testlogs/sleep.log").empty());
+
+			// Each test runs in exactly one of the shards.
+			tests.DryRun = true;
+			tests.TestShardCount = 2;
+			for (int i = 0; i < 8; ++i) {
+				step.Name = "shard" + std::to_string(i);
+				tests.TestShardIndex = 0;
+				inShard[0] += !tests.Test(step).Skipped;
+				tests.TestShardIndex = 1;
+				inShard[1] += !tests.Test(step).Skipped;
+			}
+			assert(inShard[0] + inShard[1] == 8 && inShard[0] && inShard[1]);
+
+			tests.DryRun = false;
+			tests.Exec("rm -rf Tests__test");
+		}
+
+		// Test spilling long command lines into response files.
+		{
+			Builder rsp;
+			ExecResult result;
+			string defines;
+
+			MakeTestDir("Rsp__test");
+			{
+				std::ofstream out("Rsp__test/r.cc");
+				out << "static_assert(sizeof(RSP_VALUE) == 4 && RSP_LAST == 2999, \"\");\n";
+			}
+			rsp.DryRun = false;
+			rsp.PrintCommandToStdout = false;
+			rsp.CacheDir = "Rsp__test/cache";
+			for (int i = 0; i < 3000; ++i) defines += " -DRSP_DEFINE_NUMBER_" + std::to_string(i) + "=" + std::to_string(i);
+			defines += " -DRSP_LAST=RSP_DEFINE_NUMBER_2999 '-DRSP_VALUE=\"a b\"'";
+			result = rsp.CXX("-c -o Rsp__test/r.o Rsp__test/r.cc%s", defines.c_str());
+			assert(result.ExitCode == 0);
+			assert(result.Command == rsp.CXXCommand + " -c -o Rsp__test/r.o Rsp__test/r.cc" + defines);
+			assert(rsp.GetLastExecCommand() == result.Command);
+			assert(rsp.Glob("Rsp__test/cache/rsp/*.rsp").size() == 1);
+			assert(rsp.CXXAsync("-c -o Rsp__test/r.o Rsp__test/r.cc%s", defines.c_str()).Wait().ExitCode == 0);
+			assert(rsp.Glob("Rsp__test/cache/rsp/*.rsp").size() == 1);
+			// Shell syntax stays on the command line.
+			assert(rsp.CXX("-c -o Rsp__test/r.o Rsp__test/r.cc%s > Rsp__test/out.txt", defines.c_str()).ExitCode == 0);
+			assert(Builder::FileExists("Rsp__test/out.txt"));
+
+			rsp.Exec("rm -rf Rsp__test");
+		}
+
+		// Test output paths mirroring the source tree in the output directory.
+		{
+			Builder out;
+
+			out.PrintCommandToStdout = false;
+			assert(out.ObjectPath("a/b.cc") == "a/b.o");
+			out.OutputDir = "Out__test/debug";
+			out.SourceDir = "src";
+			assert(out.ObjectPath("src/a/b.cc") == "Out__test/debug/a/b.o");
+			assert(out.ObjectPath("./gen/c.tab.c") == "Out__test/debug/gen/c.tab.o");
+			assert(out.ObjectPath("../lib/d.cc") == "Out__test/debug/__/lib/d.o");
+			try {
+				out.ObjectPath("src/a/b.c");
+				assert(false); // should not map two sources to one object.
+			} catch (std::exception &e) {
+				assert(Builder::ExceptionToStatusCode(e) == B_ObjectPathConflict);
+			}
+			assert(out.Glob("Out__test").empty());
+			out.DryRun = false;
+			assert(out.ObjectPath("src/a/b.cc") == "Out__test/debug/a/b.o");
+			{
+				std::ofstream object("Out__test/debug/a/b.o");
+				assert(object.good());
+			}
+			assert(out.ArchivePath("util") == "Out__test/debug/libutil.a");
+			assert(out.ExecutablePath("app") == "Out__test/debug/" + Builder::ExecutableFileName("app"));
+
+			out.Exec("rm -rf Out__test");
+		}
+
+		// Test skipping up-to-date steps, and planning.
+		{
+			Builder b1, planner, planner2;
+			Build::CompileStep step;
+			Build::LinkStep link;
+			Build::PlanEstimate estimate;
+			unsigned long long skipped = 0, cutOff = 0;
+			ExecResult compiled;
+			vector<Build::StepUsage> heaviest;
+
+			MakeTestDir("Plan__test");
+			{
+				std::ofstream out("Plan__test/p.h");
+				out << "#define P 3\n";
+			}
+			{
+				std::ofstream out("Plan__test/p.cc");
+				out << "#include \"p.h\"\nint main() { return P - 3; }\n";
+			}
+			for (Builder *pb : { &b1, &planner, &planner2 }) {
+				pb->DryRun = false;
+				pb->PrintCommandToStdout = false;
+				pb->CacheDir = "Plan__test/cache";
+				pb->SkipUpToDate = true;
+			}
+			planner.Plan = planner2.Plan = true;
+			step.Source = "Plan__test/p.cc";
+			step.Object = "Plan__test/p.o";
+			step.Flags = "-MMD";
+			step.CXX = true;
+			link.Inputs.push_back(step.Object);
+			link.Output = Builder::ExecutableFileName("Plan__test/p");
+			link.CXX = true;
+
+			compiled = b1.Compile(step);
+			assert(!compiled.Skipped && compiled.Usage.MaxRSSKiB > 0);
+			assert(compiled.Usage.UserSeconds + compiled.Usage.SystemSeconds > 0);
+			assert(!b1.Link(link).Skipped);
+			// Both steps, with what they used, are in the build log.
+			heaviest = b1.HeaviestSteps(1, true);
+			assert(heaviest.size() == 1 && heaviest[0].Usage.MaxRSSKiB > 0);
+			assert(b1.HeaviestSteps(10, false).size() == 2);
+			// Commands without declared outputs are named by their command, shortened.
+			assert(b1.Exec("true " + string(300, 'x')).ExitCode == 0);
+			heaviest = b1.HeaviestSteps(10, false);
+			assert(heaviest.size() == 3);
+			for (const Build::StepUsage &used : heaviest) {
+				assert(used.Key[0] == '#' ? used.Command == "true " + string(192, 'x') + "..." : used.Command.empty());
+			}
+			skipped = Builder::Stats().JobsSkipped;
+			assert(b1.Compile(step).Skipped);
+			assert(b1.Link(link).Skipped);
+			assert(Builder::Stats().JobsSkipped >= skipped + 2);
+			step.Flags = "-MMD -O1";
+			assert(!b1.Compile(step).Skipped);
+			step.Flags = "-MMD";
+			assert(!b1.Compile(step).Skipped);
+			assert(!b1.Link(link).Skipped);
+			// A comment makes no difference to the object, which keeps its modification time: the link stays up to date.
+			{
+				std::ofstream out("Plan__test/p.cc");
+				out << "#include \"p.h\"\n// Exits with 0.\nint main() { return P - 3; }\n";
+			}
+			b1.Exec("touch -m -t 209001010000 Plan__test/p.cc");
+			cutOff = Builder::Stats().JobsCutOff;
+			assert(!b1.Compile(step).Skipped);
+			assert(Builder::Stats().JobsCutOff == cutOff + 1);
+			assert(b1.Link(link).Skipped);
+			assert(b1.Compile(step).Skipped);
+
+			// Nothing changed.
+			assert(planner.Compile(step).Skipped);
+			assert(planner.Link(link).Skipped);
+			estimate = planner.GetPlanEstimate();
+			assert(estimate.Steps == 0 && estimate.UpToDate == 2 && estimate.Seconds == 0);
+
+			// A newer header, listed in the dependency file, rebuilds the object, and so the executable.
+			b1.Exec("touch -m -t 209901010000 Plan__test/p.h");
+			assert(!planner2.Compile(step).Skipped);
+			assert(!planner2.Link(link).Skipped);
+			assert(planner2.Exec("touch Plan__test/never").ExitCode == 0);
+			assert(!Builder::FileExists("Plan__test/never"));
+			estimate = planner2.GetPlanEstimate();
+			assert(estimate.Steps == 3 && estimate.UpToDate == 0 && estimate.Unrecorded == 1);
+			assert(estimate.Seconds > 0 && estimate.Seconds <= estimate.SerialSeconds);
+			assert(!b1.Compile(step).Skipped);
+
+			b1.Exec("rm -rf Plan__test");
+		}
+
+		// Test compiling stale sources in batches, tracking each object on its own.
+		{
+			Builder bb;
+			vector<Build::CompileStep> steps;
+			vector<ExecResult> results;
+
+			MakeTestDir("Batch__test");
+			MakeTestDir("Batch__test/inc");
+			MakeTestDir("Batch__test/obj");
+			{
+				std::ofstream out("Batch__test/inc/batch.h");
+				out << "#define BATCH_TEST_VALUE 1\n";
+			}
+			for (const char *name : { "a", "b", "c", "d", "e" }) {
+				Build::CompileStep step;
+
+				{
+					std::ofstream out(string("Batch__test/") + name + ".c");
+					out << "#include \"batch.h\"\nint BatchTest_" << name << "(void) { return BATCH_TEST_VALUE; }\n";
+				}
+				step.Source = string("Batch__test/") + name + ".c";
+				step.Object = string("Batch__test/obj/") + name + ".o";
+				step.Flags = "-IBatch__test/inc -MMD";
+				steps.push_back(step);
+			}
+			// Named after another source, so compiled on its own.
+			steps[4].Object = "Batch__test/obj/other.o";
+			bb.DryRun = false;
+			bb.PrintCommandToStdout = false;
+			bb.SkipUpToDate = true;
+			bb.Jobs = 2;
+			bb.CompileBatchSize = 4;
+
+			// Four stale sources for two slots: two batches of two.
+			results = bb.CompileBatched(steps);
+			for (size_t i = 0; i < steps.size(); ++i) {
+				assert(results[i].ExitCode == 0 && !results[i].Skipped);
+				assert(results[i].Command == bb.CCCommand + " " + steps[i].Flags + " -c -o " + steps[i].Object + " " + steps[i].Source);
+				assert(Builder::FileExists(steps[i].Object));
+			}
+			assert(Builder::FileExists("Batch__test/obj/a.d"));
+			assert(ReadTestFile("Batch__test/obj/a.d").find("batch.h") != string::npos);
+			bb.Configure([](Builder &b) {
+				assert(b.LastExecCommand.find("cd Batch__test/obj && " + b.CCCommand + " -I" + Builder::GetCurrentWorkingDir() + "/Batch__test/inc -MMD -c ") == 0);
+				assert(b.LastExecCommand.find("/Batch__test/c.c " + Builder::GetCurrentWorkingDir() + "/Batch__test/d.c") != string::npos);
+			});
+			for (const ExecResult &result : bb.CompileBatched(steps)) assert(result.Skipped);
+			// Compiled on its own, with the same command, as it is the only stale source.
+			bb.Exec("touch -m -t 200001010000 Batch__test/obj/b.o");
+			results = bb.CompileBatched(steps);
+			assert(!results[1].Skipped && results[0].Skipped && results[2].Skipped && results[3].Skipped);
+			bb.Configure([](Builder &b) { assert(b.LastExecCommand.find(" -c -o Batch__test/obj/b.o Batch__test/b.c") != string::npos); });
+			assert(bb.Compile(steps[1]).Skipped);
+			// A source failing to compile fails its own job only.
+			bb.Exec("touch -m -t 200001010000 Batch__test/obj/a.o Batch__test/obj/c.o Batch__test/obj/d.o");
+			{
+				std::ofstream out("Batch__test/c.c");
+				out << "int BatchTest_c(void) { return undeclared; }\n";
+			}
+			results = bb.CompileBatched(steps);
+			assert(results[0].ExitCode == 0 && results[2].ExitCode != 0 && results[3].ExitCode == 0);
+			assert(!Builder::FileExists("Batch__test/obj/c.o"));
+			assert(!bb.CompileBatched(steps)[2].Skipped);
+
+			bb.Exec("rm -rf Batch__test");
+		}
+
+		// Test that the early cutoff of an object compiled on its own compares against what its batch built.
+		{
+			Builder bb;
+			vector<Build::CompileStep> steps;
+			Build::LinkStep link;
+			vector<ExecResult> results;
+			size_t logged = 0;
+
+			MakeTestDir("BatchCutoff__test");
+			for (const char *name : { "a", "b" }) {
+				Build::CompileStep step;
+
+				step.Source = string("BatchCutoff__test/") + name + ".c";
+				step.Object = string("BatchCutoff__test/") + name + ".o";
+				steps.push_back(step);
+				link.Inputs.push_back(step.Object);
+			}
+			link.Output = Builder::ExecutableFileName("BatchCutoff__test/prog");
+			{
+				std::ofstream out("BatchCutoff__test/a.c");
+				out << "int B(void);\nint main(void) { return 1 + B(); }\n";
+			}
+			{
+				std::ofstream out("BatchCutoff__test/b.c");
+				out << "int B(void) { return 0; }\n";
+			}
+			bb.DryRun = false;
+			bb.PrintCommandToStdout = false;
+			bb.SkipUpToDate = true;
+			bb.Jobs = 1;
+			bb.CompileBatchSize = 4;
+			bb.CacheDir = "BatchCutoff__test/cache";
+
+			// Compiled one by one, which records the hashes of the objects.
+			for (const Build::CompileStep &step : steps) assert(bb.Compile(step).ExitCode == 0);
+			assert(bb.Link(link).ExitCode == 0);
+			assert(bb.Exec("./" + link.Output).ExitCode == 1);
+			// Both edited: compiled in one batch.
+			{
+				std::ofstream out("BatchCutoff__test/a.c");
+				out << "int B(void);\nint main(void) { return 2 + B(); }\n";
+			}
+			{
+				std::ofstream out("BatchCutoff__test/b.c");
+				out << "int B(void) { return 0 * 2; }\n";
+			}
+			bb.Exec("touch -m -t 200001010000 BatchCutoff__test/a.o BatchCutoff__test/b.o");
+			logged = bb.HeaviestSteps(1000, true).size();
+			results = bb.CompileBatched(steps);
+			assert(!results[0].Skipped && !results[1].Skipped);
+			// The objects are logged with what the batch used, and the batch itself is not.
+			assert(results[0].Usage.MaxRSSKiB > 0 && results[0].Usage.MaxRSSKiB == results[1].Usage.MaxRSSKiB);
+			assert(bb.HeaviestSteps(1000, true).size() == logged);
+			bb.Configure([](Builder &b) { assert(b.LastExecCommand.find("/BatchCutoff__test/a.c ") != string::npos); });
+			assert(!bb.Link(link).Skipped);
+			assert(bb.Exec("./" + link.Output).ExitCode == 2);
+			// Reverted: compiled on its own, back to its first content, which is not what was last built.
+			{
+				std::ofstream out("BatchCutoff__test/a.c");
+				out << "int B(void);\nint main(void) { return 1 + B(); }\n";
+			}
+			bb.Exec("touch -m -t 200001010000 BatchCutoff__test/a.o");
+			results = bb.CompileBatched(steps);
+			assert(!results[0].Skipped && results[1].Skipped);
+			assert(!bb.Link(link).Skipped);
+			assert(bb.Exec("./" + link.Output).ExitCode == 1);
+
+			bb.Exec("rm -rf BatchCutoff__test");
+		}
+
+		// Test deterministic outputs, built twice from an absolute source path.
+		{
+			Builder rb;
+			vector<string> differing;
+			string source = Builder::GetCurrentWorkingDir() + "/Repro__test/r.c", lastCommand;
+
+			MakeTestDir("Repro__test");
+			{
+				std::ofstream out("Repro__test/r.c");
+				out << "const char *where = __FILE__;\nconst char *when = __DATE__ \" \" __TIME__;\nint f(void) { return 0; }\n";
+			}
+			rb.DryRun = false;
+			rb.PrintCommandToStdout = false;
+			rb.OutputDir = "Repro__test/out";
+			differing = rb.VerifyReproducible([&source, &lastCommand](Builder &v) {
+				Build::CompileStep step;
+
+				step.Source = source;
+				step.Object = v.ObjectPath("r.c");
+				assert(!v.Compile(step).ExitCode);
+				lastCommand = v.GetLastExecCommand();
+				v.Archive(v.ArchivePath("r"), { step.Object });
+			});
+			assert(differing.empty());
+			assert(lastCommand.find(" -ffile-prefix-map=" + Builder::GetCurrentWorkingDir() + "=.") != string::npos);
+			assert(!rb.Deterministic);
+			// No trace of where the source was.
+			assert(ReadTestFile("Repro__test/out/r.o").find(Builder::GetCurrentWorkingDir()) == string::npos);
+			assert(ReadTestFile("Repro__test/out/r.o").find("./Repro__test/r.c") != string::npos);
+
+			rb.Exec("rm -rf Repro__test");
+		}
+
+		// Test that deterministic compiles in one checkout are cached for another one.
+		{
+			Builder rb;
+			Build::CompileStep step;
+			string cwd = Builder::GetCurrentWorkingDir();
+			ExecResult results[3];
+			int i = 0;
+
+			MakeTestDir("Checkouts__test");
+			for (const char *checkout : { "a", "b" }) {
+				MakeTestDir(string("Checkouts__test/") + checkout);
+				std::ofstream out(string("Checkouts__test/") + checkout + "/x.c");
+				out << "const char *where = __FILE__;\nint f(void) { return 0; }\n";
+			}
+			rb.DryRun = false;
+			rb.PrintCommandToStdout = false;
+			rb.Deterministic = true;
+			rb.CacheOutputs = true;
+			rb.CacheDir = cwd + "/Checkouts__test/cache";
+			step.Source = "x.c";
+			step.Object = "x.o";
+			// The compiler gets the path of each checkout, but the cache key does not.
+			for (const char *checkout : { "a", "b", "a" }) {
+				Builder::ChDir(cwd + "/Checkouts__test/" + checkout);
+				results[i++] = rb.Compile(step);
+				Builder::ChDir(cwd);
+			}
+			assert(results[0].ExitCode == 0 && !results[0].Cached);
+			assert(results[1].ExitCode == 0 && results[1].Cached);
+			assert(results[2].ExitCode == 0 && results[2].Cached);
+			assert(ReadTestFile("Checkouts__test/a/x.o") == ReadTestFile("Checkouts__test/b/x.o"));
+
+			rb.Exec("rm -rf Checkouts__test");
+		}
+
+		// Test writing the steps to a Ninja manifest instead of running them.
+		{
+			Builder nb, cleaner;
+			Build::CompileStep step, plain;
+			Build::LinkStep link;
+			string manifest;
+
+			MakeTestDir("Ninja__test");
+			nb.DryRun = false;
+			nb.PrintCommandToStdout = false;
+			nb.NinjaFile = "Ninja__test/build.ninja";
+			nb.Jobs = 4;
+			nb.LTOJobs = 2;
+			step.Source = "Ninja__test/n.cc";
+			step.Object = "Ninja__test/n.o";
+			step.Flags = "-MMD";
+			step.CXX = true;
+			plain.Source = "Ninja__test/plain.c";
+			plain.Object = "Ninja__test/plain.o";
+			link.Inputs.push_back(step.Object);
+			// Too long for the shell.
+			for (int i = 0; i < 400; ++i) link.Inputs.push_back("Ninja__test/" + string(100, 'x') + std::to_string(i) + ".o");
+			link.Output = "Ninja__test/n";
+			link.CXX = true;
+			link.LTO = true;
+
+			assert(nb.Exec("touch Ninja__test/generated.h").ExitCode == 0);
+			assert(!nb.Compile(step).Skipped);
+			assert(!nb.Compile(plain).Skipped);
+			assert(nb.Link(link).ExitCode == 0);
+			assert(nb.Archive("Ninja__test/libn.a", { step.Object }));
+			nb.WriteNinjaFile();
+			assert(!Builder::FileExists("Ninja__test/generated.h"));
+			assert(!Builder::FileExists(step.Object));
+
+			manifest = ReadTestFile("Ninja__test/build.ninja");
+			assert(manifest.find("build libBuild-command-1: step\n  command = touch Ninja__test/generated.h\n") != string::npos);
+			// Ordered after the synchronous command before it.
+			assert(manifest.find("build Ninja__test/n.o: step Ninja__test/n.cc || libBuild-command-1\n") != string::npos);
+			assert(manifest.find("  depfile = Ninja__test/n.d\n  deps = gcc\n") != string::npos);
+			// Without `-MMD`, no dependency file is written, which Ninja would take as out of date.
+			assert(manifest.find("  depfile = Ninja__test/plain.d\n") == string::npos);
+			assert(manifest.find("pool slots2\n  depth = 2\n") != string::npos);
+			assert(manifest.find("build Ninja__test/n: step Ninja__test/n.o Ninja__test/xxx") != string::npos);
+			assert(manifest.find("  rspfile = $out.rsp\n  rspfile_content = ") != string::npos);
+			assert(manifest.find("  pool = slots2\n") != string::npos);
+			assert(manifest.find("build Ninja__test/libn.a: step Ninja__test/n.o || libBuild-command-1\n  command = "
+				+ nb.RemoveCommand + " Ninja__test/libn.a && " + nb.ARCommand + " rcs Ninja__test/libn.a Ninja__test/n.o\n") != string::npos);
+			// A step is written once, even if submitted again.
+			assert(!nb.Compile(step).Skipped);
+			nb.WriteNinjaFile();
+			assert(ReadTestFile("Ninja__test/build.ninja") == manifest);
+
+			cleaner.DryRun = false;
+			cleaner.PrintCommandToStdout = false;
+			cleaner.Exec("rm -rf Ninja__test");
+		}
+
+		// Test the progress display, which prints only failed commands when stdout is not a terminal.
+		{
+			Builder progress;
+			vector<Job> jobs;
+			int savedStdout = dup(STDOUT_FILENO), fd = -1;
+			string printed;
+
+			progress.DryRun = false;
+			progress.ShowProgress = true;
+			MakeTestDir("Progress__test");
+			cout.flush();
+			fd = open("Progress__test/out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+			jobs.push_back(progress.ExecAsync("echo made"));
+			jobs.push_back(progress.ExecAsync("exit 3"));
+			assert(progress.WaitAll(jobs)[1].ExitCode == 3);
+			assert(progress.Exec("true").ExitCode == 0);
+			fflush(stdout);
+			dup2(savedStdout, STDOUT_FILENO);
+			close(savedStdout);
+			{
+				std::ifstream in("Progress__test/out.txt");
+				printed.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			assert(printed.find("[FAILED] exit 3\n") != string::npos);
+			assert(printed.find("made\n") != string::npos);
+			assert(printed.find("[3/3] true\n") != string::npos);
+			assert(printed.find("[INVOKE]") == string::npos);
+			progress.Exec("rm -rf Progress__test");
+		}
+
+		// Test the statistics counters, which are process-wide.
+		{
+			Builder counted;
+			Build::Statistics before = Builder::Stats(), after;
+			Job slow;
+
+			counted.DryRun = false;
+			counted.PrintCommandToStdout = false;
+			MakeTestDir("Stats__test");
+			{
+				std::ofstream out("Stats__test/src.txt");
+				out << "0123456789";
+			}
+			assert(counted.Copy("Stats__test/src.txt", "Stats__test/dest.txt").ExitCode == 0);
+			assert(Builder::FileExists("Stats__test/dest.txt"));
+			slow = counted.ExecAsync("sleep 0.2");
+			slow.Wait();
+			after = Builder::Stats();
+			assert(after.ProcessesSpawned >= before.ProcessesSpawned + 2);
+			assert(after.SpawnSeconds > before.SpawnSeconds);
+			assert(after.WaitSeconds >= before.WaitSeconds + 0.1);
+			assert(after.StatCalls >= before.StatCalls + 2);
+			assert(after.BytesCopied >= before.BytesCopied + 10);
+			counted.Exec("rm -rf Stats__test");
+		}
+
+		// Test variants sharing the job scheduler and the steps run once.
+		{
+			Builder base;
+			Job slow, fast, generated, nested, during;
+
+			base.PrintCommandToStdout = false;
+			base.OutputDir = "Variant__test";
+			base.CXXLanguageStandard = "c++17";
+			Builder debug = base.Variant("debug", [](Builder &v) {
+				v.CXXCommand = "g++ -O0 -g";
+				v.CXXLanguageStandard = "c++20";
+			});
+			Builder asan = base.Variant("asan", [](Builder &v) { v.CXXCommand = "g++ -fsanitize=address"; });
+			assert(debug.VariantName == "debug" && debug.OutputDir == "Variant__test/debug");
+			assert(asan.OutputDir == "Variant__test/asan");
+			assert(debug.CXX("-c a.cc").Command == "g++ -O0 -g -std=c++20 -c a.cc");
+			assert(asan.CXX("-c a.cc").Command == "g++ -fsanitize=address -std=c++17 -c a.cc");
+			assert(base.Variant("release").CXXCommand == "g++");
+
+			base.DryRun = debug.DryRun = asan.DryRun = false;
+			base.Jobs = debug.Jobs = asan.Jobs = 1;
+			MakeTestDir("Variant__test");
+			// With one slot between them, the second variant's job waits for the first one's.
+			slow = debug.ExecAsync("sleep 1");
+			fast = asan.ExecAsync("true");
+			fast.Wait();
+			assert(slow.Done());
+			generated = debug.ExecOnceAsync("echo gen >> %s", "Variant__test/gen.txt");
+			assert(asan.ExecOnceAsync("echo gen >> %s", "Variant__test/gen.txt").State == generated.State);
+			assert(base.ExecOnceAsync("echo gen >> Variant__test/gen.txt").Wait().ExitCode == 0);
+			{
+				std::ifstream in("Variant__test/gen.txt");
+				string line, lines;
+				while (std::getline(in, line)) lines += line + "\n";
+				assert(lines == "gen\n");
+			}
+			// A step started once may start its dependency once too; callers meanwhile get a job finishing with it.
+			nested = debug.Once("Variant__test/b.txt", [&] {
+				asan.Once("Variant__test/a.txt", [&] { return asan.ExecAsync("echo a > Variant__test/a.txt"); }).Wait();
+				during = base.Once("Variant__test/b.txt", [] {
+					assert(false); // should not start the step again.
+					return Job();
+				});
+				assert(!during.Done());
+				return debug.ExecAsync("cat Variant__test/a.txt > Variant__test/b.txt");
+			});
+			assert(nested.Wait().ExitCode == 0);
+			assert(during.Wait().Command == nested.Wait().Command);
+			assert(base.Once("Variant__test/b.txt", [] { return Job(); }).State == nested.State);
+			assert(ReadTestFile("Variant__test/b.txt") == "a\n");
+
+			base.Exec("rm -rf Variant__test");
+		}
+	#endif
+
 		// Test that we don't double free() the CBuilder's LastExecCommand property,
 		// if copy assignment is to be used.
 		b2 = b;
@@ -150,6 +1578,15 @@ int main(int argc, char *argv[]) {
 		assert(string(Build_StatusCodeMessage(B_ChDirFailed)) != unknownCode);
 		assert(string(Build_StatusCodeMessage(B_CurrentWorkingDirFailed)) != unknownCode);
 		assert(string(Build_StatusCodeMessage(B_MissingExecutableFilePath)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_InvalidGlobPattern)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_CommandFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_ReadFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_WriteFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_ToolchainProbeFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_WorkerFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_RemoteCacheFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_ModuleScanFailed)) != unknownCode);
+		assert(string(Build_StatusCodeMessage(B_ObjectPathConflict)) != unknownCode);
 
 
 		cout << "OK了: Test_Build_CXX\n";
@@ -1,2 +1,17 @@
+#include "Build_Archive.cc"
 #include "Build_Builder.cc"
+#include "Build_Cache.cc"
 #include "Build_Functions.cc"
+#include "Build_Glob.cc"
+#include "Build_Includes.cc"
+#include "Build_Jobs.cc"
+#include "Build_LTO.cc"
+#include "Build_Modules.cc"
+#include "Build_Ninja.cc"
+#include "Build_Plan.cc"
+#include "Build_Progress.cc"
+#include "Build_Remote.cc"
+#include "Build_Stats.cc"
+#include "Build_Tests.cc"
+#include "Build_Toolchain.cc"
+#include "Build_Util.cc"
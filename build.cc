@@ -1,20 +1,26 @@
 #include <iostream>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 #include <Build.h>
 
 using std::cout;
 using std::string;
+using std::vector;
 using std::runtime_error;
 using Build::Builder;
 
+static const char defaultOutputDir[] = "obj/default";
+
 static void PrintHelp(const char *exePath) {
 	const char *cmds[] = {
 		"help",
 		"build", "clean",
-		"build-tests", "clean-tests",
+		"build-tests", "build-tests-tsan", "run-tests", "clean-tests",
 		"build-examples", "clean-examples",
+		"build-worker", "clean-worker",
+		"report", "verify-reproducible",
 		NULL,
 	};
 
@@ -25,18 +31,70 @@ static void PrintHelp(const char *exePath) {
 	cout << "\n";
 	cout << "Commands are dry-run by default.\n";
 	cout << "To actually invoke, specify `invoke` before the first command.\n";
+	cout << "To see what would be rebuilt and why, and how long it would take, specify `plan` instead.\n";
+	cout << "To write the steps to a Ninja manifest instead of running them, specify `ninja=<file>` before the commands.\n";
+	cout << "To build outputs independent of the checkout path and the time, specify `deterministic` before the commands.\n";
+	cout << "To show a progress status line instead of each command, specify `progress` before the commands.\n";
+	cout << "To write build statistics as JSON at exit, specify `stats=<file>` before the commands.\n";
 	cout << "Example: " << exePath << " invoke build\n";
+	cout << "Objects go to `obj/<config>`; specify `config=<name>` before the commands to switch (default: `default`).\n";
+}
+
+// Path of the static library: `libBuild.a`, where `-L. -lBuild` finds it, for the default configuration, and in
+// the output directory for the others, so that they do not overwrite each other's.
+static string LibraryArchivePath(Builder &b) {
+	return b.OutputDir == defaultOutputDir ? "libBuild.a" : b.ArchivePath("Build");
+}
+
+// Builds the static library at `archivePath`, and the shared library in the output directory, from the same objects.
+static void BuildLibrary(Builder &b, const string &archivePath) {
+	vector<Build::CompileStep> steps;
+	vector<string> objects;
+	Build::LinkStep shared;
+	Build::Job sharedJob;
+
+	for (const string &source : b.Glob("Build_*.cc")) {
+		Build::CompileStep step;
+
+		step.Source = source;
+		step.Object = b.ObjectPath(source);
+		// The dependency file lists the headers, so that objects are only rebuilt when one changed.
+		step.Flags = "-fPIC -MMD";
+		objects.push_back(step.Object);
+		steps.push_back(step);
+	}
+	// Stale sources share compiler invocations, when there are more of them than job slots.
+	Builder::WaitAll(b.CompileBatchedAsync(steps));
+	// Linked while the archive is written. Left in the output directory, so that `-L. -lBuild` keeps
+	// picking the static library.
+	shared.Inputs = objects;
+	shared.Output = b.SharedLibraryPath("Build");
+	shared.Flags = "-pthread";
+	shared.CXX = true;
+	shared.Shared = true;
+	sharedJob = b.LinkAsync(shared);
+	b.Archive(archivePath, objects);
+	if (sharedJob.Wait().ExitCode) throw runtime_error("unable to link " + shared.Output);
 }
 
-static void BuildLibrary(Builder &b) {
-	b.CC("-fPIC -c Build_Builder.cc Build_Functions.cc");
-	b.AR("cr libBuild.a Build_Builder.o Build_Functions.o");
+// Builds the library twice, into its output directory, and fails if the objects or the archive differ.
+static void VerifyReproducible(Builder &b) {
+	vector<string> differing = b.VerifyReproducible([](Builder &copy) { BuildLibrary(copy, copy.ArchivePath("Build")); });
+
+	if (differing.empty()) return;
+	for (const string &path : differing) cout << "Differs between builds: " << path << "\n";
+	throw runtime_error("build is not reproducible");
 }
 
 static void CleanLibrary(Builder &b) {
-	b.Remove("libBuild.a");
-	b.Remove("Build_Builder.o");
-	b.Remove("Build_Functions.o");
+	b.Remove(LibraryArchivePath(b));
+	b.Remove(b.SharedLibraryPath("Build"));
+	for (const string &source : b.Glob("Build_*.cc")) {
+		string object = b.ObjectPath(source);
+
+		b.Remove(object);
+		b.Remove(object.substr(0, object.size() - 2) + ".d");
+	}
 }
 
 static void BuildTests(Builder &b) {
@@ -46,15 +104,51 @@ static void BuildTests(Builder &b) {
 	// On Windows, GCC likely will not work correctly,
 	// if `-l` switches are specified before source files,
 	// so we need to put it behind.
-	string compileParams = "-I. -L. -o \"%s\" \"%s\" -lBuild";
+	string compileParams = "-I. -L. -o \"%s\" \"%s\" -lBuild -pthread";
 
 	// Test_Build, C version.
 	exeFileName = b.ExecutableFileName("Test_Build_C");
 	b.CC(compileParams + " -lstdc++", exeFileName.c_str(), "Test_Build.c");
 
 	// Test_Build, C++ version.
+	// Built as C++20, to also test coroutine tasks.
 	exeFileName = b.ExecutableFileName("Test_Build_CXX");
-	b.CXX(compileParams, exeFileName.c_str(), "Test_Build.cc");
+	b.CXX(compileParams + " -std=c++20", exeFileName.c_str(), "Test_Build.cc");
+}
+
+// Runs the tests built by `build-tests`. Results are reused while the test programs and the files they read
+// are unchanged.
+static void RunTests(Builder &b) {
+	vector<Build::Job> jobs;
+	vector<string> data = b.Glob("*.h");
+	vector<string> sources = b.Glob("Build_*.cc");
+	bool failed = false;
+
+	data.insert(data.end(), sources.begin(), sources.end());
+	b.CacheTestResults = true;
+	for (const char *name : { "Test_Build_C", "Test_Build_CXX" }) {
+		Build::TestStep step;
+
+		step.Program = "./" + b.ExecutableFileName(name);
+		step.Data = data;
+		step.TimeoutSeconds = 600;
+		jobs.push_back(b.TestAsync(step));
+	}
+	for (const Build::ExecResult &result : Builder::WaitAll(jobs)) {
+		if (result.ExitCode) failed = true;
+	}
+	if (failed) throw runtime_error("tests failed");
+}
+
+// Builds the C++ tests together with the library sources under ThreadSanitizer.
+static void BuildTestsTSan(Builder &b) {
+	string exeFileName = b.ExecutableFileName("Test_Build_CXX_TSan");
+	string sources;
+
+	for (const string &source : b.Glob("Build_*.cc")) {
+		sources += " " + source;
+	}
+	b.CXX("-std=c++20 -fsanitize=thread -g -O1 -I. -o \"%s\" Test_Build.cc%s -pthread", exeFileName.c_str(), sources.c_str());
 }
 
 static void CleanTests(Builder &b) {
@@ -65,10 +159,13 @@ static void CleanTests(Builder &b) {
 
 	exeFileName = b.ExecutableFileName("Test_Build_CXX");
 	b.Remove(exeFileName);
+
+	exeFileName = b.ExecutableFileName("Test_Build_CXX_TSan");
+	b.Remove(exeFileName);
 }
 
 static void BuildExamples(Builder &b) {
-	string parameters = "-o %s %s -I. -L. -lBuild";
+	string parameters = "-o %s %s -I. -L. -lBuild -pthread";
 	string cExeFileName, cxxExeFileName;
 
 	cExeFileName = b.ExecutableFileName("example_c");
@@ -86,18 +183,25 @@ static void CleanExamples(Builder &b) {
 	b.Remove(cxxExeFileName);
 }
 
+static void BuildWorker(Builder &b) {
+	string exeFileName = b.ExecutableFileName("build_worker");
+
+	b.CXX("-o %s build_worker.cc -I. -L. -lBuild -pthread", exeFileName.c_str());
+}
+
+static void CleanWorker(Builder &b) {
+	b.Remove(b.ExecutableFileName("build_worker"));
+}
+
 int main(int argc, char *argv[]) {
 	Builder b;
 	string osMacro;
 	string cmd;
+	string sourceDir;
 	const char *exePath = argv[0];
 
 	try {
 		b.SetConsoleCodePage("utf-8");
-		b.ChDirToProgramDir(argc, argv);
-		b.DryRun = true;
-		b.PrintCommandToStdout = true;
-
 		if (b.IsWindows()) {
 			osMacro = "-DWINDOWS";
 		} else if (b.IsMacOS()) {
@@ -109,6 +213,17 @@ int main(int argc, char *argv[]) {
 		} else {
 			throw runtime_error("unknown OS");
 		}
+		// Before changing directory, as the path of the program may be relative. The dependency file lists the
+		// library sources `bootstrap.cc` includes.
+		sourceDir = Builder::DirName(exePath);
+		b.RebuildSelfIfStale(argc, argv, { sourceDir + "/build.cc", sourceDir + "/bootstrap.cc" },
+			"-I" + sourceDir + " " + osMacro + " -pthread");
+		b.ChDirToProgramDir(argc, argv);
+		b.DryRun = true;
+		b.PrintCommandToStdout = true;
+		b.OutputDir = defaultOutputDir;
+		b.SkipUpToDate = true;
+
 		if (osMacro != "") {
 			b.CCCommand = b.CCCommand + " " + osMacro;
 			b.CXXCommand = b.CXXCommand + " " + osMacro;
@@ -119,18 +234,42 @@ int main(int argc, char *argv[]) {
 				cmd = argv[i];
 				if (cmd == "invoke") {
 					b.DryRun = false;
+				} else if (cmd == "plan") {
+					b.Plan = true;
+				} else if (cmd == "deterministic") {
+					b.Deterministic = true;
+				} else if (cmd == "progress") {
+					b.ShowProgress = true;
+				} else if (cmd.rfind("ninja=", 0) == 0) {
+					b.NinjaFile = cmd.substr(6);
+				} else if (cmd.rfind("stats=", 0) == 0) {
+					b.StatsFile = cmd.substr(6);
+				} else if (cmd.rfind("config=", 0) == 0) {
+					b.OutputDir = "obj/" + cmd.substr(7);
 				} else if (cmd == "build") {
-					BuildLibrary(b);
+					BuildLibrary(b, LibraryArchivePath(b));
 				} else if (cmd == "clean") {
 					CleanLibrary(b);
 				} else if (cmd == "build-tests") {
 					BuildTests(b);
+				} else if (cmd == "build-tests-tsan") {
+					BuildTestsTSan(b);
+				} else if (cmd == "run-tests") {
+					RunTests(b);
 				} else if (cmd == "clean-tests") {
 					CleanTests(b);
 				} else if (cmd == "build-examples") {
 					BuildExamples(b);
 				} else if (cmd == "clean-examples") {
 					CleanExamples(b);
+				} else if (cmd == "build-worker") {
+					BuildWorker(b);
+				} else if (cmd == "clean-worker") {
+					CleanWorker(b);
+				} else if (cmd == "report") {
+					b.PrintResourceReport(10);
+				} else if (cmd == "verify-reproducible") {
+					VerifyReproducible(b);
 				} else if (cmd == "help") {
 					PrintHelp(exePath);
 				} else {
@@ -140,6 +279,18 @@ int main(int argc, char *argv[]) {
 		} else {
 			PrintHelp(exePath);
 		}
+		if (b.Plan) {
+			Build::PlanEstimate plan = b.GetPlanEstimate();
+
+			cout << "Plan: " << plan.Steps << " steps would run, " << plan.UpToDate << " are up to date; about "
+				<< plan.Seconds << " s with " << b.Jobs << " jobs";
+			if (plan.Unrecorded) cout << " (" << plan.Unrecorded << " steps without recorded durations)";
+			cout << "\n";
+		}
+		if (!b.NinjaFile.empty()) {
+			b.WriteNinjaFile();
+			cout << "Wrote " << b.NinjaFile << "; run `ninja -f " << b.NinjaFile << "` in this directory.\n";
+		}
 
 		return 0;
 	} catch (std::exception &e) {
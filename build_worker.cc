@@ -0,0 +1,54 @@
+// Reference worker for `Builder::RemoteWorkers`: compiles preprocessed sources sent by build programs.
+// Only run it on trusted networks; it runs the compiler with whatever flags it receives, though only those
+// without shell metacharacters.
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <Build.h>
+
+using std::cout;
+using std::string;
+using Build::Builder;
+
+static void PrintUsage(const char *exePath) {
+	cout << "Usage: " << exePath << " <host>:<port> | unix:<path> [-j <jobs>] [--cc <command>] [--cxx <command>]\n";
+	cout << "Example: " << exePath << " 127.0.0.1:7878 -j 32\n";
+}
+
+int main(int argc, char *argv[]) {
+	Builder b;
+	string arg;
+
+	if (argc < 2) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	try {
+		b.DryRun = false;
+		b.PrintCommandToStdout = true;
+		for (int i = 2; i < argc; ++i) {
+			arg = argv[i];
+			if (arg == "-j" && i + 1 < argc) {
+				b.Jobs = (unsigned) atoi(argv[++i]);
+				if (b.Jobs < 1) b.Jobs = 1;
+			} else if (arg == "--cc" && i + 1 < argc) {
+				b.CCCommand = argv[++i];
+			} else if (arg == "--cxx" && i + 1 < argc) {
+				b.CXXCommand = argv[++i];
+			} else {
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		}
+
+		cout << "Serving compilations on " << argv[1] << " with " << b.Jobs << " jobs\n";
+		b.ServeWorker(argv[1]);
+
+		return 0;
+	} catch (std::exception &e) {
+		cout << "Error: " << e.what() << "\n";
+		return 1;
+	}
+}